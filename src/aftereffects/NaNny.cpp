@@ -28,11 +28,12 @@
 
 #include "NaNny.h"
 
-#ifdef MAC_ENV
-#include <pthread.h>
-#endif
+#include "ProEXR_Kernels.h"
 
 #include <float.h>
+#include <string.h>
+
+#include <vector>
 
 static PF_Err 
 About (	
@@ -193,95 +194,16 @@ PreRender(
 
 #pragma mark-
 
-#ifdef MAC_ENV
-typedef pthread_mutex_t MutualExclusion;
-
-static void InitializeMutex(MutualExclusion *mutex)
-{
-	pthread_mutex_init(mutex, 0);
-}
-
-static void DeleteMutex(MutualExclusion *mutex)
-{
-	pthread_mutex_destroy(mutex);
-}
-
-static void LockMutex(MutualExclusion *mutex)
-{
-	pthread_mutex_lock(mutex);
-}
-
-static void UnlockMutex(MutualExclusion *mutex)
-{
-	pthread_mutex_unlock(mutex);
-}
-#else
-typedef CRITICAL_SECTION MutualExclusion;
-
-static void InitializeMutex(MutualExclusion *mutex)
-{
-	InitializeCriticalSection(mutex);
-}
-
-static void DeleteMutex(MutualExclusion *mutex)
-{
-	DeleteCriticalSection(mutex);
-}
-
-static void LockMutex(MutualExclusion *mutex)
-{
-	EnterCriticalSection(mutex);
-}
-
-static void UnlockMutex(MutualExclusion *mutex)
-{
-	LeaveCriticalSection(mutex);
-}
-#endif
-
-#pragma mark-
-
-inline bool
-IsNan(float f)
-{
-	u_int l = *(u_long*)&f;
-	
-	return ((l & 0x7f800000) == 0x7f800000) && ((l & 0x007fffff) != 0);	
-}
-
-inline bool
-IsInfinite(float f)
-{
-	u_int l = *(u_long*)&f;
-	
-	return ((l & 0xff800000) == 0x7f800000) && ((l & 0x007fffff) == 0);	
-}
-
-inline bool
-IsNegInfinite(float f)
-{
-	u_int l = *(u_long*)&f;
-	
-	return ((l & 0xff800000) == 0xff800000) && ((l & 0x007fffff) == 0);	
-}
-
-#pragma mark-
-
 typedef struct {
 	PF_InData			*in_data;
 	A_long				width;
     
-	int					Mode;
-	PF_FpShort			NaN_value;
-    PF_FpShort			inf_value;
-	PF_FpShort			nin_value;
+	ClassifyOptions		options;
 	
-	int					bad_pixels;
-	MutualExclusion		mutex;
+	ClassifyReport		*reports;	// one for each row
 } IterateData, *IteratePtr, **IterateHndl;
 
 
-
 static PF_Err
 ProcessRow(
 	IteratorRefcon refcon, 
@@ -294,133 +216,11 @@ ProcessRow(
 
 	IteratePtr i_ptr = (IteratePtr)refcon;
 	
-	if(i_ptr->Mode == MODE_DIAGNOSTIC)
-	{
-		int bad_pixels = 0;
-		
-		for(int i=0; i < i_ptr->width; i++)
-		{
-			if(	IsNan(in->red) ||
-				IsNan(in->green) ||
-				IsNan(in->blue) ||
-				IsInfinite(in->red) ||
-				IsInfinite(in->green) ||
-				IsInfinite(in->blue) ||
-				IsNegInfinite(in->red) ||
-				IsNegInfinite(in->green) ||
-				IsNegInfinite(in->blue) )
-			{
-				bad_pixels++;
-				
-				// white
-				out->red	= 1.0f;
-				out->green	= 1.0f;
-				out->blue	= 1.0f;
-				out->alpha	= 1.0f;
-			}
-			else
-			{
-				// black
-				out->red	= 0.0f;
-				out->green	= 0.0f;
-				out->blue	= 0.0f;
-				out->alpha	= 1.0f;
-			}
-			
-			in++;
-			out++;
-		}
-		
-		if(bad_pixels > 0)
-		{
-			LockMutex(&i_ptr->mutex);
-			i_ptr->bad_pixels += bad_pixels;
-			UnlockMutex(&i_ptr->mutex);
-		}
-	}
-	else
-	{
-		bool do_NaN = (i_ptr->Mode == MODE_NAN || i_ptr->Mode == MODE_ALL);
-		bool do_inf = (i_ptr->Mode == MODE_INF || i_ptr->Mode == MODE_ALL);
-		bool do_nin = (i_ptr->Mode == MODE_NIN || i_ptr->Mode == MODE_ALL);
-		
-		for(int i=0; i < i_ptr->width; i++)
-		{
-			*out = *in;
-			
-			if(false) //(i_ptr->Mode == MODE_MAKE_NAN)
-			{
-				// This lets you insert NaNs and infs and -infs if you want to make an image with these values.
-				// Oddly, AE doesn't show inf in the info palette unless the pixel is all by itself.
-				// A field of infs will appear as NaN.
-				
-				float NaN, inf, nin;
-				
-				u_int *NaNP = (u_int *)&NaN;
-				u_int *infP = (u_int *)&inf;
-				u_int *ninP = (u_int *)&nin;
-				
-				*NaNP = 0x7fC00000;
-				*infP = 0x7f800000;
-				*ninP = 0xff800000;
-
-				if(out->red == 1.0f && out->green == 0.0f && out->blue == 0.0f)
-				{
-					out->red = out->green = out->blue = NaN;
-				}
-				else if(out->red == 0.0f && out->green == 1.0f && out->blue == 0.0f)
-				{
-					out->red = out->green = out->blue = inf;
-				}
-				else if(out->red == 0.0f && out->green == 0.0f && out->blue == 1.0f)
-				{
-					out->red = out->green = out->blue = nin;
-				}
-			}
-			else
-			{
-				if(do_NaN)
-				{
-					if( IsNan(out->red) )
-						out->red = i_ptr->NaN_value;
-					
-					if( IsNan(out->green) )
-						out->green = i_ptr->NaN_value;
-						
-					if( IsNan(out->blue) )
-						out->blue = i_ptr->NaN_value;
-				}
-				
-				if(do_inf)
-				{
-					if( IsInfinite(out->red) )
-						out->red = i_ptr->inf_value;
-					
-					if( IsInfinite(out->green) )
-						out->green = i_ptr->inf_value;
-						
-					if( IsInfinite(out->blue) )
-						out->blue = i_ptr->inf_value;
-				}
-
-				if(do_nin)
-				{
-					if( IsNegInfinite(out->red) )
-						out->red = i_ptr->nin_value;
-					
-					if( IsNegInfinite(out->green) )
-						out->green = i_ptr->nin_value;
-						
-					if( IsNegInfinite(out->blue) )
-						out->blue = i_ptr->nin_value;
-				}
-			}
-			
-			in++;
-			out++;
-		}
-	}
-		
+	ClassifyReport &report = i_ptr->reports[y];
+	
+	ClearClassifyReport(report);
+	
+	ClassifyRow((const float *)in, (float *)out, i_ptr->width, i_ptr->options, report);
 	
 	return err;
 }
@@ -466,16 +266,24 @@ DoRender(
 			areaR.right = 1;
 			areaR.bottom = output->height;
 
-			IterateData i_data = {in_data, output->width,
-									NANNY_Mode->u.pd.value,
-									NANNY_NaN_value->u.fs_d.value,
-									NANNY_inf_value->u.fs_d.value,
-									NANNY_nin_value->u.fs_d.value,
-									0};
-									
-									
-			if(diagnostic_mode)
-				InitializeMutex(&i_data.mutex);
+			// every row reports separately, added up when they're all done
+			std::vector<ClassifyReport> reports( MAX(output->height, 1) );
+
+			const int mode = NANNY_Mode->u.pd.value;
+			
+			ClassifyOptions options;
+			
+			options.diagnostic = diagnostic_mode;
+			
+			options.replace[CLASS_NAN] = (mode == MODE_NAN || mode == MODE_ALL);
+			options.replace[CLASS_INF] = (mode == MODE_INF || mode == MODE_ALL);
+			options.replace[CLASS_NIN] = (mode == MODE_NIN || mode == MODE_ALL);
+			
+			options.value[CLASS_NAN] = NANNY_NaN_value->u.fs_d.value;
+			options.value[CLASS_INF] = NANNY_inf_value->u.fs_d.value;
+			options.value[CLASS_NIN] = NANNY_nin_value->u.fs_d.value;
+
+			IterateData i_data = {in_data, output->width, options, &reports[0]};
 			
 			
 			err2 = i32sP->iterate(in_data,
@@ -485,19 +293,49 @@ DoRender(
 									(IteratorRefcon)(&i_data),
 									ProcessRow,
 									output);
-									
-									
-			if(diagnostic_mode)
-				DeleteMutex(&i_data.mutex);
 			
 			
 			if(!err2 && diagnostic_mode)
 			{
-				char message[128];
+				int bad_pixels = 0;
+				int count[CLASS_NUM][4] = { {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0} };
+				PF_LRect bounds = {0, 0, 0, 0};
+				
+				for(int y=0; y < output->height; y++)
+				{
+					const ClassifyReport &report = reports[y];
+					
+					bad_pixels += report.bad_pixels;
+					
+					for(int c=0; c < CLASS_NUM; c++)
+						for(int i=0; i < 4; i++)
+							count[c][i] += report.count[c][i];
+					
+					if(report.bad_pixels > 0)
+					{
+						PF_LRect row_bounds = {report.left, y, report.right + 1, y + 1};
+						
+						UnionLRect(&row_bounds, &bounds);
+					}
+				}
+				
+				char message[128], details[128];
+				
+				if(bad_pixels > 0)
+				{
+					PF_SPRINTF(message, "NaNny found %d bad pixels in (%d, %d) - (%d, %d).", bad_pixels,
+								bounds.left, bounds.top, bounds.right - 1, bounds.bottom - 1);
+				}
+				else
+					PF_SPRINTF(message, "NaNny found %d bad pixels.", bad_pixels);
 				
-				PF_SPRINTF(message, "NaNny found %d bad pixels.", i_data.bad_pixels);
+				// ARGB order, so RGB is 1-3
+				PF_SPRINTF(details, "RGB NaN: %d/%d/%d  inf: %d/%d/%d  -inf: %d/%d/%d",
+							count[CLASS_NAN][1], count[CLASS_NAN][2], count[CLASS_NAN][3],
+							count[CLASS_INF][1], count[CLASS_INF][2], count[CLASS_INF][3],
+							count[CLASS_NIN][1], count[CLASS_NIN][2], count[CLASS_NIN][3]);
 				
-				advapP->PF_InfoDrawText(message, NULL);
+				advapP->PF_InfoDrawText(message, details);
 			}
 		}
 		else
@@ -24,114 +24,149 @@
 
 #include "Iex.h"
 
+#include <IlmThread.h>
+#include <IlmThreadSemaphore.h>
+
 #include "ProEXR_UTF.h"
+#include "ProEXR_FileCache.h"
 
 #include <time.h>
 #include <assert.h>
+#include <new>
+#include <string>
+
+#ifdef __APPLE__
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
 
 using namespace Imf;
 using namespace Iex;
+using namespace IlmThread;
+using namespace std;
+
+
+#ifndef MIN
+#define MIN(A,B)			( (A) < (B) ? (A) : (B))
+#endif
+
+// bytes to read at a time when we're not memory mapped
+#define READ_AHEAD_SIZE		(1024 * 1024)
+
+// size of each output buffer
+#define WRITE_BEHIND_SIZE	(4 * 1024 * 1024)
 
 
 extern AEGP_PluginID	S_mem_id;
 
-static AEGP_MemHandle	file_cacheH = NULL;
-static PathString		file_cache_path;
-static DateTime			file_cache_date_time;
-static Int64			file_cache_size = 0;
-static time_t			file_cache_last_access;
+// files we can't memory map get loaded into AE memory instead,
+// several can be kept at once and each one is shared by everyone reading that file
+#define FILE_CACHE_MAX_BYTES	((Int64)1024 * 1024 * 1024)
 
+static ProEXR_FileCache file_caches(FILE_CACHE_MAX_BYTES);
 
-static bool
-MatchCacheDateTime(DateTime date_time)
+
+class AEFileCacheMemory : public ProEXR_FileCacheMemory
 {
-#ifdef __APPLE__
-	return (date_time.fraction == file_cache_date_time.fraction &&
-			date_time.lowSeconds == file_cache_date_time.lowSeconds &&
-			date_time.highSeconds == file_cache_date_time.highSeconds);
-#else
-	return (date_time.dwHighDateTime == file_cache_date_time.dwHighDateTime &&
-			date_time.dwLowDateTime == file_cache_date_time.dwLowDateTime);
-#endif
+  public:
+	AEFileCacheMemory(const SPBasicSuite *pica_basicP);
+	virtual ~AEFileCacheMemory() {}
+	
+	virtual void *newHandle(Int64 size);
+	virtual void *lockHandle(void *handle);
+	virtual void unlockHandle(void *handle);
+	virtual void freeHandle(void *handle);
+	
+  private:
+	static const SPBasicSuite *checkPica(const SPBasicSuite *pica_basicP);
+	
+	AEGP_SuiteHandler _suites;
+};
+
+
+AEFileCacheMemory::AEFileCacheMemory(const SPBasicSuite *pica_basicP) :
+	_suites( checkPica(pica_basicP) )
+{
+
 }
 
 
-static void *
-LockFileCache(const SPBasicSuite *pica_basicP)
+const SPBasicSuite *
+AEFileCacheMemory::checkPica(const SPBasicSuite *pica_basicP)
 {
-	A_Err err = A_Err_NONE;
-	
 	if(pica_basicP == NULL)
 		throw LogicExc("pica_basicP is NULL");
 	
-	AEGP_SuiteHandler suites(pica_basicP);
+	return pica_basicP;
+}
+
 
-	void *cache = NULL;
+void *
+AEFileCacheMemory::newHandle(Int64 size)
+{
+	AEGP_MemHandle bufH = NULL;
 	
-	if(file_cacheH)
-	{
-		err = suites.MemorySuite()->AEGP_LockMemHandle(file_cacheH, (void**)&cache);
-		
-		file_cache_last_access = time(NULL);
-	}
+	_suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "File Cache", size,
+												AEGP_MemFlag_CLEAR, &bufH);
 	
-	return cache;
+	return bufH;
 }
 
 
-static void
-UnlockFileCache(const SPBasicSuite *pica_basicP)
+void *
+AEFileCacheMemory::lockHandle(void *handle)
 {
-	A_Err err = A_Err_NONE;
+	void *buf = NULL;
 	
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+	_suites.MemorySuite()->AEGP_LockMemHandle((AEGP_MemHandle)handle, &buf);
 	
-	AEGP_SuiteHandler suites(pica_basicP);
-
-	if(file_cacheH)
-		err = suites.MemorySuite()->AEGP_UnlockMemHandle(file_cacheH);
+	return buf;
 }
 
 
 void
-DeleteFileCache(const SPBasicSuite *pica_basicP, int timeout)
+AEFileCacheMemory::unlockHandle(void *handle)
 {
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
-	
-	if(file_cacheH && (timeout == 0 || (difftime(time(NULL), file_cache_last_access) > timeout)) )
-	{
-		AEGP_SuiteHandler suites(pica_basicP);
+	_suites.MemorySuite()->AEGP_UnlockMemHandle((AEGP_MemHandle)handle);
+}
 
-		A_Err err = suites.MemorySuite()->AEGP_FreeMemHandle(file_cacheH);
-		
-		file_cacheH = NULL;
-		file_cache_path = "";
-		file_cache_size = 0;
-	}
+
+void
+AEFileCacheMemory::freeHandle(void *handle)
+{
+	_suites.MemorySuite()->AEGP_FreeMemHandle((AEGP_MemHandle)handle);
 }
 
 
-static void *
-NewFileCache(const SPBasicSuite *pica_basicP, AEGP_MemSize size)
+// path and modification time, everything that has to match for a cache to be used
+static string
+FileCacheKey(const PathString &path, const DateTime &date_time)
 {
-	A_Err err = A_Err_NONE;
+	string key((const char *)path.string(), PathString::StrLen(path.string()) * sizeof(A_PathType));
 	
-	if(pica_basicP == NULL)
-		throw LogicExc("pica_basicP is NULL");
+#ifdef __APPLE__
+	key.append((const char *)&date_time.highSeconds, sizeof(date_time.highSeconds));
+	key.append((const char *)&date_time.lowSeconds, sizeof(date_time.lowSeconds));
+	key.append((const char *)&date_time.fraction, sizeof(date_time.fraction));
+#else
+	key.append((const char *)&date_time.dwHighDateTime, sizeof(date_time.dwHighDateTime));
+	key.append((const char *)&date_time.dwLowDateTime, sizeof(date_time.dwLowDateTime));
+#endif
 	
-	AEGP_SuiteHandler suites(pica_basicP);
+	return key;
+}
 
-	DeleteFileCache(pica_basicP);
+
+void
+DeleteFileCache(const SPBasicSuite *pica_basicP, int timeout)
+{
+	AEFileCacheMemory memory(pica_basicP);
 	
-	err = suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "File Cache", size,
-													AEGP_MemFlag_CLEAR, &file_cacheH);
-													
-	if(file_cacheH)
-		file_cache_size = size;
-																																					
-	return LockFileCache(pica_basicP);
+	file_caches.purge(memory, timeout);
 }
 
 #pragma mark-
@@ -141,6 +176,14 @@ IStreamPlatform::IStreamPlatform(const char fileName[], const SPBasicSuite *pica
 	IStream(fileName),
 	_pica_basicP(pica_basicP),
 	_vfile(NULL),
+	_cache(NULL),
+	_voffset(0),
+	_vsize(0),
+	_mapped(false),
+	_rbuf(NULL),
+	_rbuf_pos(0),
+	_rbuf_len(0),
+	_rpos(0),
 	_path(fileName)
 {
 	open_file(fileName);
@@ -153,6 +196,14 @@ IStreamPlatform::IStreamPlatform(const uint16_t fileName[], const SPBasicSuite *
 	IStream("Unicode Path"),
 	_pica_basicP(pica_basicP),
 	_vfile(NULL),
+	_cache(NULL),
+	_voffset(0),
+	_vsize(0),
+	_mapped(false),
+	_rbuf(NULL),
+	_rbuf_pos(0),
+	_rbuf_len(0),
+	_rpos(0),
 	_path(fileName)
 {
 	open_file(fileName);
@@ -167,7 +218,10 @@ IStreamPlatform::~IStreamPlatform()
 		close_file();
 	} catch(...) {}
 
-	release_cache();
+	unMemoryMap();
+	
+	if(_rbuf)
+		free(_rbuf);
 }
 
 
@@ -192,7 +246,7 @@ IStreamPlatform::read(char c[/*n*/], int n)
 		return success;
 	}
 	else
-		return read_file(c, n);
+		return read_ahead(c, n);
 }
 
 char *
@@ -220,7 +274,7 @@ IStreamPlatform::tellg()
 		return _voffset;
 	}
 	else
-		return tellg_file();
+		return _rpos;
 }
 
 
@@ -235,42 +289,56 @@ IStreamPlatform::seekg(Int64 pos)
 		_voffset = pos;
 	}
 	else
-		seekg_file(pos);
+		_rpos = pos; // actual file seek happens when we need more data
 }
 
 
 void
 IStreamPlatform::memoryMap()
 {
-	assert(_pica_basicP != NULL);
-
-	if(_pica_basicP && !isMemoryMapped() )
+	if( !isMemoryMapped() )
 	{
-		if(file_cacheH && MatchCacheDateTime(_modtime) && (_path == file_cache_path))
+		_voffset = _rpos;
+		
+		if( map_file() )
 		{
-			adopt_cache();
+			_mapped = true;
 		}
-		else
+		else if(_pica_basicP)
 		{
-			_vsize = file_size();
-			
-			_vfile = NewFileCache(_pica_basicP, _vsize);
+			// couldn't map, so fall back to the file cache
+			adopt_cache();
 			
-			if(_vfile)
+			if(_cache == NULL)
 			{
-				_voffset = tellg_file();
-				
-				seekg_file(0);
-				
-				read_file((char *)_vfile, _vsize);
+				_vsize = file_size();
 				
-				file_cache_path = _path;
+				AEFileCacheMemory memory(_pica_basicP);
 				
-				file_cache_date_time = _modtime;
+				_cache = file_caches.create(memory, FileCacheKey(_path, _modtime), _vsize, &_vfile);
 				
-				seekg_file(_voffset);
+				if(_cache)
+				{
+					seekg_file(0);
+					
+					if( read_file((char *)_vfile, _vsize) )
+					{
+						file_caches.share(_cache);
+					}
+					else
+						release_cache();
+				}
 			}
 		}
+		
+		if( isMemoryMapped() && _rbuf )
+		{
+			// won't be needing this
+			free(_rbuf);
+			
+			_rbuf = NULL;
+			_rbuf_len = 0;
+		}
 	}
 }
 
@@ -280,11 +348,15 @@ IStreamPlatform::unMemoryMap()
 {
 	if( isMemoryMapped() )
 	{
-		//seekg_file(_voffset); // use if you want to still access the file
-		
-		UnlockFileCache(_pica_basicP);
+		if(_mapped)
+			unmap_file();
+		else
+			release_cache();
 		
 		_vfile = NULL;
+		_mapped = false;
+		
+		_rpos = _voffset; // pick up where we left off
 	}
 }
 
@@ -292,21 +364,343 @@ IStreamPlatform::unMemoryMap()
 void
 IStreamPlatform::adopt_cache()
 {
-	if(file_cacheH == NULL)
-		throw LogicExc("Can't adopt a NULL cache.");
-
-	_vfile = LockFileCache(_pica_basicP);
+	AEFileCacheMemory memory(_pica_basicP);
 	
-	_voffset = tellg_file();
+	_cache = file_caches.acquire(memory, FileCacheKey(_path, _modtime), &_vfile);
 	
-	_vsize = file_cache_size;
+	if(_cache)
+		_vsize = _cache->size;
+	else
+		_vfile = NULL;
 }
 
 
 void
 IStreamPlatform::release_cache()
 {
-	unMemoryMap();
+	if(_cache)
+	{
+		AEFileCacheMemory memory(_pica_basicP);
+		
+		file_caches.release(memory, _cache);
+		
+		_cache = NULL;
+	}
+	
+	_vfile = NULL;
+}
+
+
+bool
+IStreamPlatform::read_ahead(char c[/*n*/], int n)
+{
+	while(n > 0)
+	{
+		if(_rbuf && _rpos >= _rbuf_pos && _rpos < _rbuf_pos + _rbuf_len)
+		{
+			// copy what we already have
+			const int offset = _rpos - _rbuf_pos;
+			const int count = MIN(n, _rbuf_len - offset);
+			
+			memcpy(c, _rbuf + offset, count);
+			
+			c += count;
+			n -= count;
+			_rpos += count;
+		}
+		else if(n >= READ_AHEAD_SIZE)
+		{
+			// big reads go straight into the caller's buffer
+			seekg_file(_rpos);
+			
+			if( !read_file(c, n) )
+				return false;
+			
+			_rpos += n;
+			
+			return true;
+		}
+		else
+		{
+			// fill the buffer
+			if(_rbuf == NULL)
+			{
+				_rbuf = (char *)malloc(READ_AHEAD_SIZE);
+				
+				if(_rbuf == NULL)
+					throw bad_alloc();
+			}
+			
+			const Int64 remaining = file_size() - _rpos;
+			
+			_rbuf_len = 0;
+			
+			if(remaining < n)
+				return false;
+			
+			const int count = MIN(remaining, READ_AHEAD_SIZE);
+			
+			seekg_file(_rpos);
+			
+			if( !read_file(_rbuf, count) )
+				return false;
+			
+			_rbuf_pos = _rpos;
+			_rbuf_len = count;
+		}
+	}
+	
+	return true;
+}
+
+
+#pragma mark-
+
+// writes full buffers to disk while OpenEXR keeps filling the other one
+class OStreamPlatform_Writer : public Thread
+{
+  public:
+	OStreamPlatform_Writer(OStreamPlatform &stream, char *spare);
+	virtual ~OStreamPlatform_Writer();
+	
+	// hand over a full buffer, get back an empty one
+	char *submit(char *buf, int n);
+	
+	// wait for the current write to finish
+	void wait();
+	
+	virtual void run();
+	
+  private:
+	OStreamPlatform &_stream;
+	char *_buf;
+	int _len;
+	bool _quit;
+	bool _failed;
+	string _error;
+	Semaphore _work;
+	Semaphore _idle;
+	Semaphore _finished;
+};
+
+
+OStreamPlatform_Writer::OStreamPlatform_Writer(OStreamPlatform &stream, char *spare) :
+	_stream(stream),
+	_buf(spare),
+	_len(0),
+	_quit(false),
+	_failed(false),
+	_work(0),
+	_idle(1),
+	_finished(0)
+{
+	start();
+}
+
+
+OStreamPlatform_Writer::~OStreamPlatform_Writer()
+{
+	_idle.wait();
+	
+	_quit = true;
+	
+	_work.post();
+	
+	// ~Thread joins too late, our semaphores are gone by then
+	_finished.wait();
+	
+	free(_buf);
+}
+
+
+char *
+OStreamPlatform_Writer::submit(char *buf, int n)
+{
+	_idle.wait();
+	
+	if(_failed)
+	{
+		_idle.post();
+		
+		throw IoExc(_error);
+	}
+	
+	char *spare = _buf;
+	
+	_buf = buf;
+	_len = n;
+	
+	_work.post();
+	
+	return spare;
+}
+
+
+void
+OStreamPlatform_Writer::wait()
+{
+	_idle.wait();
+	_idle.post();
+	
+	if(_failed)
+		throw IoExc(_error);
+}
+
+
+void
+OStreamPlatform_Writer::run()
+{
+	while(true)
+	{
+		_work.wait();
+		
+		if(_quit)
+			break;
+		
+		try{
+			_stream.write_file(_buf, _len);
+		}
+		catch(exception &e)
+		{
+			_error = e.what();
+			_failed = true;
+		}
+		catch(...)
+		{
+			_error = "Not able to write.";
+			_failed = true;
+		}
+		
+		_idle.post();
+	}
+	
+	_finished.post();
+}
+
+
+void
+OStreamPlatform::init_buffers(bool write_behind)
+{
+	_buf = (char *)malloc(WRITE_BEHIND_SIZE);
+	
+	if(_buf && write_behind && supportsThreads())
+	{
+		char *spare = (char *)malloc(WRITE_BEHIND_SIZE);
+		
+		if(spare)
+		{
+			try{
+				_writer = new OStreamPlatform_Writer(*this, spare);
+			}
+			catch(...)
+			{
+				free(spare);
+			}
+		}
+	}
+}
+
+
+void
+OStreamPlatform::free_buffers()
+{
+	try{
+		flush();
+	}catch(...) {} // call flush() yourself if you want to know
+	
+	if(_writer)
+		delete _writer;
+	
+	if(_buf)
+		free(_buf);
+	
+	_writer = NULL;
+	_buf = NULL;
+}
+
+
+void
+OStreamPlatform::write (const char c[/*n*/], int n)
+{
+	if(!_pos_known)
+	{
+		_buf_pos = tellp_file();
+		_pos_known = true;
+	}
+	
+	if(_buf == NULL)
+	{
+		write_file(c, n);
+		
+		_buf_pos += n;
+	}
+	else
+	{
+		while(n > 0)
+		{
+			const int count = MIN(n, WRITE_BEHIND_SIZE - _buf_len);
+			
+			memcpy(_buf + _buf_len, c, count);
+			
+			_buf_len += count;
+			c += count;
+			n -= count;
+			
+			if(_buf_len == WRITE_BEHIND_SIZE)
+				flush_buffer();
+		}
+	}
+}
+
+
+Int64
+OStreamPlatform::tellp ()
+{
+	if(!_pos_known)
+	{
+		_buf_pos = tellp_file();
+		_pos_known = true;
+	}
+	
+	return _buf_pos + _buf_len;
+}
+
+
+void
+OStreamPlatform::seekp (Int64 pos)
+{
+	flush();
+	
+	seekp_file(pos);
+	
+	_buf_pos = pos;
+	_pos_known = true;
+}
+
+
+void
+OStreamPlatform::flush()
+{
+	flush_buffer();
+	
+	if(_writer)
+		_writer->wait();
+}
+
+
+void
+OStreamPlatform::flush_buffer()
+{
+	if(_buf_len > 0)
+	{
+		if(_writer)
+			_buf = _writer->submit(_buf, _buf_len);
+		else
+			write_file(_buf, _buf_len);
+		
+		_buf_pos += _buf_len;
+		_buf_len = 0;
+	}
 }
 
 
@@ -423,6 +817,66 @@ IStreamPlatform::seekg_file(Int64 pos)
 }
 
 
+static bool
+IsLocalVolume(const char *path)
+{
+	// mapping a file on a network volume turns a dropped connection
+	// or a file that gets truncated under us into SIGBUS
+	struct statfs sfs;
+	
+	if(statfs(path, &sfs) != 0)
+		return false;
+	
+	return ((sfs.f_flags & MNT_LOCAL) != 0);
+}
+
+
+bool
+IStreamPlatform::map_file()
+{
+	UInt8 path[PATH_MAX + 1];
+	
+	OSStatus result = FSRefMakePath(&_fsRef, path, PATH_MAX);
+	
+	if(result != noErr)
+		return false;
+	
+	if( !IsLocalVolume((const char *)path) )
+		return false;
+	
+	const Int64 size = file_size();
+	
+	if(size <= 0 || size != (Int64)(size_t)size)
+		return false;
+	
+	int fd = open((const char *)path, O_RDONLY);
+	
+	if(fd < 0)
+		return false;
+	
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	
+	close(fd); // the mapping holds its own reference
+	
+	if(addr == MAP_FAILED)
+		return false;
+	
+	madvise(addr, size, MADV_SEQUENTIAL);
+	
+	_vfile = addr;
+	_vsize = size;
+	
+	return true;
+}
+
+
+void
+IStreamPlatform::unmap_file()
+{
+	munmap(_vfile, _vsize);
+}
+
+
 Int64
 IStreamPlatform::file_size()
 {
@@ -457,8 +911,13 @@ IStreamPlatform::file_modtime()
 }
 
 
-OStreamPlatform::OStreamPlatform(const char fileName[]):
-	OStream(fileName)
+OStreamPlatform::OStreamPlatform(const char fileName[], bool write_behind):
+	OStream(fileName),
+	_buf(NULL),
+	_buf_len(0),
+	_buf_pos(0),
+	_pos_known(false),
+	_writer(NULL)
 {
 	OSErr result = noErr;
 	
@@ -526,11 +985,18 @@ OStreamPlatform::OStreamPlatform(const char fileName[]):
 
 	if(result != noErr)
 		throw IoExc("Couldn't open file for writing.");
+	
+	init_buffers(write_behind);
 }
 
 
-OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
-	OStream("Unicode Path")
+OStreamPlatform::OStreamPlatform(const uint16_t fileName[], bool write_behind):
+	OStream("Unicode Path"),
+	_buf(NULL),
+	_buf_len(0),
+	_buf_pos(0),
+	_pos_known(false),
+	_writer(NULL)
 {
 	OSErr result = noErr;
 	
@@ -600,11 +1066,15 @@ OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
 
 	if(result != noErr)
 		throw IoExc("Couldn't open file for reading.");
+	
+	init_buffers(write_behind);
 }
 
 
 OStreamPlatform::~OStreamPlatform()
 {
+	free_buffers();
+	
 	OSErr result = FSCloseFork(_refNum);
 
 	assert(result == noErr);
@@ -612,7 +1082,7 @@ OStreamPlatform::~OStreamPlatform()
 
 
 void
-OStreamPlatform::write (const char c[/*n*/], int n)
+OStreamPlatform::write_file(const char c[/*n*/], int n)
 {
 	ByteCount count = n;
 
@@ -624,7 +1094,7 @@ OStreamPlatform::write (const char c[/*n*/], int n)
 
 
 Int64
-OStreamPlatform::tellp ()
+OStreamPlatform::tellp_file()
 {
 	Int64 pos;
 	SInt64 lpos;
@@ -641,7 +1111,7 @@ OStreamPlatform::tellp ()
 
 
 void
-OStreamPlatform::seekp (Int64 pos)
+OStreamPlatform::seekp_file(Int64 pos)
 {
 	OSErr result = FSSetForkPosition(_refNum, fsFromStart, pos);
 
@@ -724,10 +1194,101 @@ IStreamPlatform::seekg_file(Int64 pos)
 }
 
 
+static bool
+IsLocalVolume(HANDLE hFile)
+{
+	// mapping a file on a network share turns a dropped connection
+	// or a file that gets truncated under us into an access violation,
+	// so only map files on fixed drives
+	typedef DWORD (WINAPI *GetFinalPathNameByHandleProc)(HANDLE, LPWSTR, DWORD, DWORD);
+	
+	// Vista and later, XP just doesn't get mapping
+	GetFinalPathNameByHandleProc getFinalPathNameByHandle = (GetFinalPathNameByHandleProc)
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetFinalPathNameByHandleW");
+	
+	if(getFinalPathNameByHandle == NULL)
+		return false;
+	
+	// a long path just tells us how big a buffer it wants
+	const DWORD len = getFinalPathNameByHandle(hFile, NULL, 0, 0); // VOLUME_NAME_DOS
+	
+	if(len == 0)
+		return false;
+	
+	WCHAR *path = (WCHAR *)malloc((len + 1) * sizeof(WCHAR));
+	
+	if(path == NULL)
+		return false;
+	
+	UINT type = DRIVE_UNKNOWN;
+	
+	if( getFinalPathNameByHandle(hFile, path, len + 1, 0) != 0 )
+	{
+		// local files come back as \\?\C:\..., network files as \\?\UNC\...
+		const WCHAR *drive = (wcsncmp(path, L"\\\\?\\", 4) == 0 ? path + 4 : path);
+		
+		if(drive[0] != L'\0' && drive[1] == L':')
+		{
+			const WCHAR root[4] = { drive[0], L':', L'\\', L'\0' };
+			
+			type = GetDriveTypeW(root);
+		}
+	}
+	
+	free(path);
+	
+	return (type == DRIVE_FIXED || type == DRIVE_RAMDISK);
+}
+
+
+bool
+IStreamPlatform::map_file()
+{
+	if( !IsLocalVolume(_hFile) )
+		return false;
+	
+	const Int64 size = file_size();
+	
+	if(size <= 0 || size != (Int64)(SIZE_T)size)
+		return false;
+	
+	HANDLE hMapping = CreateFileMapping(_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	
+	if(hMapping == NULL)
+		return false;
+	
+	LPVOID addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	
+	CloseHandle(hMapping); // the view holds its own reference
+	
+	if(addr == NULL)
+		return false;
+	
+	_vfile = addr;
+	_vsize = size;
+	
+	return true;
+}
+
+
+void
+IStreamPlatform::unmap_file()
+{
+	UnmapViewOfFile(_vfile);
+}
+
+
 Int64
 IStreamPlatform::file_size()
 {
-	return GetFileSize(_hFile, NULL);
+	LARGE_INTEGER size;
+	
+	BOOL result = GetFileSizeEx(_hFile, &size);
+	
+	if(!result)
+		throw IoExc("Error calling GetFileSizeEx().");
+	
+	return size.QuadPart;
 }
 
 
@@ -742,28 +1303,44 @@ IStreamPlatform::file_modtime()
 }
 
 
-OStreamPlatform::OStreamPlatform(const char fileName[]):
-	OStream(fileName)
+OStreamPlatform::OStreamPlatform(const char fileName[], bool write_behind):
+	OStream(fileName),
+	_buf(NULL),
+	_buf_len(0),
+	_buf_pos(0),
+	_pos_known(false),
+	_writer(NULL)
 {
 	_hFile = CreateFile(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if(_hFile == INVALID_HANDLE_VALUE)
 		throw IoExc("Couldn't open file.");
+	
+	init_buffers(write_behind);
 }
 
 
-OStreamPlatform::OStreamPlatform(const uint16_t fileName[]):
-	OStream("Unicode Path")
+OStreamPlatform::OStreamPlatform(const uint16_t fileName[], bool write_behind):
+	OStream("Unicode Path"),
+	_buf(NULL),
+	_buf_len(0),
+	_buf_pos(0),
+	_pos_known(false),
+	_writer(NULL)
 {
 	_hFile = CreateFileW((LPCWSTR)fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if(_hFile == INVALID_HANDLE_VALUE)
 		throw IoExc("Couldn't open file.");
+	
+	init_buffers(write_behind);
 }
 
 
 OStreamPlatform::~OStreamPlatform()
 {
+	free_buffers();
+	
 	BOOL result = CloseHandle(_hFile);
 
 	assert(result == TRUE);
@@ -771,7 +1348,7 @@ OStreamPlatform::~OStreamPlatform()
 
 
 void
-OStreamPlatform::write (const char c[/*n*/], int n)
+OStreamPlatform::write_file(const char c[/*n*/], int n)
 {
 	DWORD count = n, out = 0;
 	
@@ -783,7 +1360,7 @@ OStreamPlatform::write (const char c[/*n*/], int n)
 
 
 Int64
-OStreamPlatform::tellp ()
+OStreamPlatform::tellp_file()
 {
 	Int64 pos;
 	LARGE_INTEGER lpos, zero;
@@ -802,7 +1379,7 @@ OStreamPlatform::tellp ()
 
 
 void
-OStreamPlatform::seekp (Int64 pos)
+OStreamPlatform::seekp_file(Int64 pos)
 {
 	LARGE_INTEGER lpos;
 
@@ -926,6 +1503,22 @@ PathString::operator == (const PathString &other) const
 }
 
 
+bool
+PathString::operator < (const PathString &other) const
+{
+	const A_PathType *s1 = _path;
+	const A_PathType *s2 = other.string();
+	
+	while(*s1 != '\0' && *s1 == *s2)
+	{
+		s1++;
+		s2++;
+	}
+	
+	return (*s1 < *s2);
+}
+
+
 template <typename T>
 int
 PathString::StrLen(const T *str)
@@ -60,6 +60,7 @@ class PathString
 	
 	bool operator == (const PathString &other) const;
 	bool operator != (const PathString &other) const { return !(*this == other); }
+	bool operator < (const PathString &other) const;
 	
 	const A_PathType *string() const { return _path; }
 
@@ -74,8 +75,11 @@ class PathString
 };
 
 
+// frees the file caches nobody is using, if they haven't been touched in timeout seconds
 void DeleteFileCache(const SPBasicSuite *pica_basicP, int timeout=0);
 
+struct ProEXR_FileCacheEntry;
+
 
 class IStreamPlatform : public Imf::IStream
 {
@@ -92,17 +96,23 @@ class IStreamPlatform : public Imf::IStream
 	virtual Imf::Int64 tellg();
 	virtual void seekg(Imf::Int64 pos);
 	
-	// function to load the file into a buffer and start memory mapping
+	// map the file into memory (or load it into the file cache if that fails)
 	void memoryMap();
 	void unMemoryMap();
 	
 	// access information relevant to caching
 	const PathString & getPath() const { return _path; }
 	DateTime getModTime() const { return _modtime; }
+	Imf::Int64 getSize() { return file_size(); }
 	
   private:
 	void adopt_cache();
 	void release_cache();
+	
+	bool read_ahead(char c[/*n*/], int n);
+	
+	bool map_file();
+	void unmap_file();
 
   private:
 	void open_file(const char fileName[]);
@@ -118,8 +128,16 @@ class IStreamPlatform : public Imf::IStream
   private:
 	const SPBasicSuite *_pica_basicP;
 	void *_vfile;
+	ProEXR_FileCacheEntry *_cache; // when we couldn't map
 	Imf::Int64 _voffset;
 	Imf::Int64 _vsize;
+	bool _mapped;
+	
+	// read-ahead buffer for when we're not memory mapped
+	char *_rbuf;
+	Imf::Int64 _rbuf_pos;
+	int _rbuf_len;
+	Imf::Int64 _rpos;
 
 	PathString _path;
 	DateTime _modtime;
@@ -135,20 +153,43 @@ class IStreamPlatform : public Imf::IStream
 };
 
 
+class OStreamPlatform_Writer;
+
 class OStreamPlatform : public Imf::OStream
 {
   public:
   
-	OStreamPlatform(const char fileName[]);
-	OStreamPlatform(const uint16_t fileName[]);
+	OStreamPlatform(const char fileName[], bool write_behind=true);
+	OStreamPlatform(const uint16_t fileName[], bool write_behind=true);
 	~OStreamPlatform();
 	
 	void write (const char c[/*n*/], int n);
 	Imf::Int64 tellp ();
 	void seekp (Imf::Int64 pos);
+	
+	// write out everything buffered, throws if there was a problem
+	void flush();
 
   private:
+	void init_buffers(bool write_behind);
+	void free_buffers();
+	void flush_buffer();
 	
+	void write_file(const char c[/*n*/], int n);
+	Imf::Int64 tellp_file();
+	void seekp_file(Imf::Int64 pos);
+	
+	friend class OStreamPlatform_Writer;
+
+  private:
+	char *_buf;
+	int _buf_len;
+	Imf::Int64 _buf_pos;
+	bool _pos_known;
+	
+	OStreamPlatform_Writer *_writer; // background thread, if we have one
+	
+
 #ifdef __APPLE__
 	FSRef _fsRef;
 	FSIORefNum _refNum;
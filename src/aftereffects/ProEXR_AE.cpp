@@ -27,6 +27,8 @@
 
 #include "ProEXRdoc_AE.h"
 #include "ProEXR_AE_Dialogs.h"
+#include "ProEXR_WriteQueue.h"
+#include "ProEXR_UTF.h"
 
 #include <ImfStandardAttributes.h>
 
@@ -35,6 +37,7 @@
 	
 
 #include <assert.h>
+#include <stdio.h>
 #include <time.h>
 #include <sys/timeb.h>
 
@@ -58,6 +61,21 @@ unsigned int gNumCPUs = 1;
 // our prefs
 A_Boolean gStorePersonal = FALSE;
 A_Boolean gStoreMachine = FALSE;
+A_Boolean gLayerParts = FALSE;
+A_Boolean gDemoteTypes = FALSE;
+A_Boolean gAutoCompression = FALSE;
+A_Boolean gWriteStats = FALSE;
+A_Boolean gWritePreview = FALSE;
+A_long gTiledLevels = 0; // 0 for scanlines, then one level, mipmap, ripmap
+A_long gTileSize = 64;
+A_long gSpeedWeightPercent = 25; // how much decode speed counts against size for auto compression
+A_long gWriteQueueMegabytes = 0; // 0 to write synchronously, otherwise AE is told a frame is done before it's on disk
+
+
+// frames get compressed and written here while AE renders the next one
+static ProEXR_WriteQueue *gWriteQueue = NULL;
+
+#define WRITE_QUEUE_THREADS	(2)
 
 
 A_Err
@@ -69,6 +87,15 @@ ProEXR_Init(struct SPBasicSuite *pica_basicP)
 #define PREFS_SECTION		"ProEXR"
 #define PREFS_PERSONAL_INFO	"Store Personal Info"
 #define PREFS_MACHINE_INFO	"Store Machine Info"
+#define PREFS_WRITE_QUEUE	"Write Queue Megabytes"
+#define PREFS_LAYER_PARTS	"Layer Parts"
+#define PREFS_DEMOTE_TYPES	"Demote Pixel Types"
+#define PREFS_AUTO_COMPRESSION	"Auto Compression"
+#define PREFS_SPEED_WEIGHT	"Auto Compression Speed Percent"
+#define PREFS_WRITE_STATS	"Channel Stats"
+#define PREFS_WRITE_PREVIEW	"Preview Image"
+#define PREFS_TILED_LEVELS	"Tiled Levels"
+#define PREFS_TILE_SIZE		"Tile Size"
 	
 	AEGP_SuiteHandler suites(pica_basicP);
 	
@@ -77,13 +104,43 @@ ProEXR_Init(struct SPBasicSuite *pica_basicP)
 	
 	A_long store_personal = 0;
 	A_long store_machine = 0;
+	A_long layer_parts = 0;
+	A_long demote_types = 0;
+	A_long auto_compression = 0;
+	A_long write_stats = 0;
+	A_long write_preview = 0;
 	A_long file_description = 1;
 	
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_PERSONAL_INFO, store_personal, &store_personal);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_MACHINE_INFO, store_machine, &store_machine);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_WRITE_QUEUE, gWriteQueueMegabytes, &gWriteQueueMegabytes);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_LAYER_PARTS, layer_parts, &layer_parts);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_DEMOTE_TYPES, demote_types, &demote_types);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_AUTO_COMPRESSION, auto_compression, &auto_compression);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_SPEED_WEIGHT, gSpeedWeightPercent, &gSpeedWeightPercent);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_WRITE_STATS, write_stats, &write_stats);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_WRITE_PREVIEW, write_preview, &write_preview);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_TILED_LEVELS, gTiledLevels, &gTiledLevels);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_TILE_SIZE, gTileSize, &gTileSize);
 	
 	gStorePersonal = (store_personal ? TRUE : FALSE);
 	gStoreMachine = (store_machine ? TRUE : FALSE);
+	gLayerParts = (layer_parts ? TRUE : FALSE);
+	gDemoteTypes = (demote_types ? TRUE : FALSE);
+	gAutoCompression = (auto_compression ? TRUE : FALSE);
+	gWriteStats = (write_stats ? TRUE : FALSE);
+	gWritePreview = (write_preview ? TRUE : FALSE);
+	
+	if(gTileSize < 8)
+		gTileSize = 8;
+	
+	// layer parts are always scanlines, so tiles lose if both are set
+	if(gLayerParts && gTiledLevels > 0)
+	{
+		gTiledLevels = 0;
+		
+		suites.UtilitySuite()->AEGP_WriteToDebugLog(S_mem_id, PLUGIN_NAME, "Prefs", "Tiled Levels is ignored because Layer Parts is on.");
+	}
 
 	if( IlmThread::supportsThreads() )
 	{
@@ -109,10 +166,43 @@ ProEXR_Init(struct SPBasicSuite *pica_basicP)
 }
 
 
+A_Err
+ProEXR_Idle(AEIO_BasicData *basic_dataP)
+{
+	// once the queue runs dry, report anything that went wrong since the last frame went in
+	if(gWriteQueue && gWriteQueue->idle())
+	{
+		try
+		{
+			gWriteQueue->finish();
+		}
+		catch(exception &e)
+		{
+			string msg = string("ProEXR write error: ") + e.what();
+			
+			if(msg.length() > 511)
+				msg.resize(511);
+			
+			basic_dataP->msg_func(0, msg.c_str() );
+		}
+		catch(...) {}
+	}
+	
+	return A_Err_NONE;
+}
+
+
 A_Err
 ProEXR_DeathHook(const SPBasicSuite *pica_basicP)
 {
 	try {
+		if(gWriteQueue)
+		{
+			delete gWriteQueue; // waits for the last frames to be written
+			
+			gWriteQueue = NULL;
+		}
+		
 		if( IlmThread::supportsThreads() )
 			setGlobalThreadCount(0);
 		
@@ -364,6 +454,165 @@ static bool possibleDropFrame(A_Time frame_duration)
 }
 
 
+#ifdef WIN32
+static bool
+MoveOverFile(const char *from, const char *to)
+{
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+}
+
+static bool
+MoveOverFile(const uint16_t *from, const uint16_t *to)
+{
+	return MoveFileExW((LPCWSTR)from, (LPCWSTR)to, MOVEFILE_REPLACE_EXISTING);
+}
+
+static void
+DeleteTempFile(const char *path)
+{
+	DeleteFileA(path);
+}
+
+static void
+DeleteTempFile(const uint16_t *path)
+{
+	DeleteFileW((LPCWSTR)path);
+}
+#else
+static bool
+MoveOverFile(const char *from, const char *to)
+{
+	return (rename(from, to) == 0);
+}
+
+static bool
+MoveOverFile(const uint16_t *from, const uint16_t *to)
+{
+	return MoveOverFile(UTF16toUTF8((const utf16_char *)from).c_str(), UTF16toUTF8((const utf16_char *)to).c_str());
+}
+
+static void
+DeleteTempFile(const char *path)
+{
+	remove(path);
+}
+
+static void
+DeleteTempFile(const uint16_t *path)
+{
+	remove(UTF16toUTF8((const utf16_char *)path).c_str());
+}
+#endif
+
+
+// everything needed to write a frame after AE has moved on,
+// written to a temp file that only gets the real name once it's all there
+class ProEXR_AEWriteJob : public ProEXR_WriteJob
+{
+  public:
+	ProEXR_AEWriteJob(const A_PathType *file_pathZ, const Header &header, AEIO_BasicData *basic_dataP, AEIO_OutSpecH outH,
+						Imf::PixelType pixelType, bool hidden_layers);
+	virtual ~ProEXR_AEWriteJob();
+	
+	ProEXRdoc_writeAE & doc() { return *_doc; }
+	
+	virtual void write();
+	virtual size_t size() const { return _doc->memorySize(); }
+	
+  private:
+	typedef vector<A_PathType> PathVec;
+	
+	PathVec _path;
+	PathVec _temp_path;
+	
+	Header _header; // the doc holds a reference to this
+	OStreamPlatform *_outstream;
+	ProEXRdoc_writeAE *_doc;
+};
+
+
+ProEXR_AEWriteJob::ProEXR_AEWriteJob(const A_PathType *file_pathZ, const Header &header, AEIO_BasicData *basic_dataP, AEIO_OutSpecH outH,
+										Imf::PixelType pixelType, bool hidden_layers) :
+	_header(header),
+	_outstream(NULL),
+	_doc(NULL)
+{
+	for(const A_PathType *c = file_pathZ; *c != '\0'; c++)
+		_path.push_back(*c);
+	
+	_temp_path = _path;
+	
+	static const char tmp_ext[] = ".tmp";
+	
+	for(const char *c = tmp_ext; *c != '\0'; c++)
+		_temp_path.push_back(*c);
+	
+	_path.push_back('\0');
+	_temp_path.push_back('\0');
+	
+	_outstream = new OStreamPlatform(&_temp_path[0]);
+	
+	try
+	{
+		_doc = new ProEXRdoc_writeAE(*_outstream, _header, basic_dataP, outH, pixelType, hidden_layers);
+	}
+	catch(...)
+	{
+		delete _outstream;
+		
+		DeleteTempFile(&_temp_path[0]);
+		
+		throw;
+	}
+}
+
+
+ProEXR_AEWriteJob::~ProEXR_AEWriteJob()
+{
+	// the queue deletes us on AE's thread, so the doc can let go of its suites
+	delete _doc;
+	
+	if(_outstream)
+	{
+		// never finished, so don't leave half a file behind
+		delete _outstream;
+		
+		DeleteTempFile(&_temp_path[0]);
+	}
+}
+
+
+void
+ProEXR_AEWriteJob::write()
+{
+	_doc->writeFile();
+	
+	_outstream->flush();
+	
+	// closed before it takes the real name, the doc is done with it
+	delete _outstream;
+	
+	_outstream = NULL;
+	
+	if( !MoveOverFile(&_temp_path[0], &_path[0]) )
+		throw IoExc("Couldn't rename the temp file.");
+}
+
+
+void
+ApplyWriterPrefs(ProEXRdoc_writeAE &outputFile)
+{
+	outputFile.setLayerParts(gLayerParts);
+	outputFile.setDemoteTypes(gDemoteTypes);
+	outputFile.setAutoCompression(gAutoCompression, (float)gSpeedWeightPercent / 100.f);
+	outputFile.setWriteStats(gWriteStats);
+	outputFile.setWritePreview(gWritePreview);
+	
+	if(gTiledLevels > 0)
+		outputFile.setTiles(true, gTiledLevels == 3 ? Imf::RIPMAP_LEVELS : gTiledLevels == 2 ? Imf::MIPMAP_LEVELS : Imf::ONE_LEVEL, gTileSize);
+}
+
+
 A_Err
 ProEXR_OutputFile(
 	AEIO_BasicData		*basic_dataP,
@@ -633,18 +882,55 @@ ProEXR_OutputFile(
 	
 	
 	// write file
-	OStreamPlatform outstream(file_pathZ);
+	ProEXR_AEWriteJob *job = new ProEXR_AEWriteJob(file_pathZ, header, basic_dataP, outH, pixel_type, options->hidden_layers);
 	
-	ProEXRdoc_writeAE outputFile(outstream, header, basic_dataP, outH, pixel_type, options->hidden_layers);
-	
-	if(options->layer_composite)
-		outputFile.addMainLayer((PF_PixelFloat *)wP->data, wP->rowbytes, pixel_type);
+	try
+	{
+		ProEXRdoc_writeAE &outputFile = job->doc();
+		
+		ApplyWriterPrefs(outputFile);
+		
+		if(options->layer_composite)
+			outputFile.addMainLayer((PF_PixelFloat *)wP->data, wP->rowbytes, pixel_type);
+		
+		// pixels get copied out of AE here, so the job doesn't need AE after this
+		outputFile.loadFromAE(&params);
+		
+		outputFile.restoreLayers();
+	}
+	catch(...)
+	{
+		delete job;
+		
+		throw;
+	}
 	
-	outputFile.loadFromAE(&params);
 	
-	outputFile.writeFile();
+	if(gWriteQueue == NULL && gWriteQueueMegabytes > 0 && IlmThread::supportsThreads())
+	{
+		gWriteQueue = new ProEXR_WriteQueue(WRITE_QUEUE_THREADS, (size_t)gWriteQueueMegabytes * 1024 * 1024);
+	}
 	
-	outputFile.restoreLayers();
+	if(gWriteQueue)
+	{
+		// takes the job, throws if an earlier frame failed but still writes this one
+		gWriteQueue->submit(job);
+	}
+	else
+	{
+		try
+		{
+			job->write();
+		}
+		catch(...)
+		{
+			delete job;
+			
+			throw;
+		}
+		
+		delete job;
+	}
 	
 	}catch(...) { err = AEIO_Err_DISK_FULL; }
 	
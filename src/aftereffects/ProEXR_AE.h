@@ -25,6 +25,8 @@
 
 #include "ProEXR_AE_FrameSeq.h"
 
+class ProEXRdoc_writeAE; // forward declaration
+
 
 #define PLUGIN_NAME		"ProEXR Layers"
 
@@ -93,6 +95,14 @@ ProEXR_InflateOutputOptions(
 	ProEXR_outData	*options);
 	
 	
+// sets the options from our prefs on a file about to be written
+void
+ApplyWriterPrefs(ProEXRdoc_writeAE &outputFile);
+
+
+A_Err
+ProEXR_Idle(AEIO_BasicData *basic_dataP);
+	
 A_Err
 ProEXR_DeathHook(const SPBasicSuite *pica_basicP);
 
@@ -318,7 +318,7 @@ AEIO_Idle(
 	AEIO_ModuleSignature	sig,
 	AEIO_IdleFlags			*idle_flags0)
 { 
-	return A_Err_NONE; 
+	return FrameSeq_Idle(basic_dataP); 
 };	
 
 
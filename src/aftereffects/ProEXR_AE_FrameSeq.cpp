@@ -874,6 +874,13 @@ FrameSeq_GetFlatOutputOptions(
 }
 
 
+A_Err
+FrameSeq_Idle(AEIO_BasicData *basic_dataP)
+{
+	return ProEXR_Idle(basic_dataP);
+}
+
+
 A_Err
 FrameSeq_DeathHook(const SPBasicSuite *pica_basicP)
 {
@@ -167,6 +167,9 @@ FrameSeq_GetFlatOutputOptions(
 	AEIO_OutSpecH	outH, 
 	AEIO_Handle		*flat_optionsPH);
 	
+A_Err
+FrameSeq_Idle(AEIO_BasicData *basic_dataP);
+	
 A_Err
 FrameSeq_DeathHook(const SPBasicSuite *pica_basicP);
 
@@ -21,6 +21,7 @@
 // -------------------------------------------------------------------*/
 
 #include "ProEXR_AE_GUI.h"
+#include "ProEXR_AE.h"
 
 #include "ProEXRdoc_AE.h"
 #include "ProEXR_AE_Dialogs.h"
@@ -598,6 +599,8 @@ ProEXR_GPCommandHook(
 						
 						ProEXRdoc_writeAE outputFile(outstream, header, sP, compH, pixelType, params.hidden_layers);
 						
+						ApplyWriterPrefs(outputFile);
+						
 						if(params.layer_composite)
 							outputFile.addMainLayer(pixelType);
 						
@@ -605,6 +608,8 @@ ProEXR_GPCommandHook(
 						
 						outputFile.writeFile();
 						
+						outstream.flush();
+						
 						outputFile.restoreLayers();
 					}
 					
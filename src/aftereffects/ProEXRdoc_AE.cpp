@@ -30,13 +30,17 @@
 #include <ImfStandardAttributes.h>
 #include <ImfArray.h>
 
+#include <IlmThreadPool.h>
+
 #include "ProEXR_UTF.h"
+#include "ProEXR_Kernels.h"
 
 #include "PITerminology.h"
 
 using namespace Imf;
 using namespace Imath;
 using namespace Iex;
+using namespace IlmThread;
 using namespace std;
 
 
@@ -374,49 +378,62 @@ ProEXRchannel_writeAE::~ProEXRchannel_writeAE()
 }
 
 
-void
-ProEXRchannel_writeAE::loadFromAE(float *world, size_t rowbytes)
+#pragma mark-
+
+
+// where one of AE's ARGB channels is going
+typedef struct DeinterleaveDest {
+	int ae_channel; // 0=A, 1=R, 2=G, 3=B
+	Imf::PixelType type; // FLOAT or HALF
+	char *buf;
+	size_t rowbytes;
+} DeinterleaveDest;
+
+
+// pulls all the channels out of an ARGB row in one go
+class DeinterleaveRowTask : public Task
 {
-	if( !loaded() )
+  public:
+	DeinterleaveRowTask(TaskGroup *group, const PF_PixelFloat *ae_row, int width, const DeinterleaveDest *dests, int num_dests, int y);
+	virtual ~DeinterleaveRowTask() {}
+	
+	virtual void execute();
+
+  private:
+	const float *_ae_row;
+	int _width;
+	
+	int _num_dests;
+	int _ae_channel[MAX_DEINTERLEAVE_DESTS];
+	Imf::PixelType _type[MAX_DEINTERLEAVE_DESTS];
+	void *_out_row[MAX_DEINTERLEAVE_DESTS];
+};
+
+
+DeinterleaveRowTask::DeinterleaveRowTask(TaskGroup *group, const PF_PixelFloat *ae_row, int width, const DeinterleaveDest *dests, int num_dests, int y) :
+	Task(group),
+	_ae_row((const float *)ae_row),
+	_width(width),
+	_num_dests(num_dests)
+{
+	assert(num_dests <= MAX_DEINTERLEAVE_DESTS);
+	
+	for(int i=0; i < _num_dests; i++)
 	{
-		if(doc() == NULL)
-			throw BaseExc("doc() is NULL.");
-		
-		ProEXRbuffer buffer = getBufferDesc(false);
-		
-		assert( buffer.width == doc()->width() );
-		assert( buffer.height == doc()->height() );
-		assert( buffer.type == Imf::FLOAT );
-		
-		if(buffer.buf == NULL)
-			throw BaseExc("buffer.buf is NULL.");
-		
-		
-		char *ae_row = (char *)world;
-		char *buf_row = (char *)buffer.buf;
-		
-		for(int y=0; y < buffer.height; y++)
-		{
-			float *ae_pix = (float *)ae_row;
-			float *buf_pix = (float *)buf_row;
-			
-			for(int x=0; x < buffer.width; x++)
-			{
-				*buf_pix = *ae_pix;
-				
-				ae_pix += 4;
-				buf_pix++;
-			}
-			
-			ae_row += rowbytes;
-			buf_row += buffer.rowbytes;
-		}
-		
-		setLoaded(true, true);
+		_ae_channel[i] = dests[i].ae_channel;
+		_type[i] = dests[i].type;
+		_out_row[i] = dests[i].buf + (y * dests[i].rowbytes);
 	}
 }
 
 
+void
+DeinterleaveRowTask::execute()
+{
+	DeinterleaveRow(_ae_row, _width, _num_dests, _ae_channel, _type, _out_row);
+}
+
+
 ProEXRlayer_writeAE::ProEXRlayer_writeAE(AEGP_SuiteHandler &sh, AEGP_LayerH layerH, string name, Imf::PixelType pixelType) :
 	ProEXRlayer(name),
 	suites(sh),
@@ -574,21 +591,7 @@ ProEXRlayer_writeAE::loadFromAE(RenderParams *params)
 	{
 		if( isCompositeLayer() )
 		{
-			for(int i=0; i < channels().size(); i++)
-			{
-				ProEXRchannel_writeAE &writeAE_channel = dynamic_cast<ProEXRchannel_writeAE &>( *channels().at(i) );
-				
-				// the channel naming converntion is RGBA, but AE is ARGB
-				int channel_index = (i == 3 ? 0 : i + 1);
-				
-				// we want to assure that an alpha channel is always coming from the alpha, such as layer.[U][V][A]
-				if( writeAE_channel.channelTag() == CHAN_A)
-					channel_index = 0;
-				
-				float *origin = (float *)_composite_buf + channel_index;
-				
-				writeAE_channel.loadFromAE(origin, _composite_rowbytes);
-			}
+			loadFromWorld(_composite_buf, _composite_rowbytes);
 		}
 		else
 		{
@@ -642,21 +645,7 @@ ProEXRlayer_writeAE::loadFromAE(RenderParams *params)
 						
 						assert(width == writeAE_doc.width() && height == writeAE_doc.height());
 						
-						for(int i=0; i < channels().size(); i++)
-						{
-							ProEXRchannel_writeAE &writeAE_channel = dynamic_cast<ProEXRchannel_writeAE &>( *channels().at(i) );
-							
-							// the channel naming converntion is RGBA, but AE is ARGB
-							int channel_index = (i == 3 ? 0 : i + 1);
-							
-							// we want to assure that an alpha channel is always coming from the alpha, such as layer.[U][V][A]
-							if( writeAE_channel.channelTag() == CHAN_A)
-								channel_index = 0;
-
-							float *origin = (float *)base_addr + channel_index;
-							
-							writeAE_channel.loadFromAE(origin, rowbytes);
-						}
+						loadFromWorld(base_addr, rowbytes);
 					}
 					
 					suites.RenderSuite()->AEGP_CheckinFrame(render_receiptH);
@@ -672,6 +661,78 @@ ProEXRlayer_writeAE::loadFromAE(RenderParams *params)
 }
 
 
+void
+ProEXRlayer_writeAE::loadFromWorld(const PF_PixelFloat *world, size_t rowbytes)
+{
+	// one sweep over the world fills every channel,
+	// going straight to half when that's what we're writing
+	if(doc() == NULL)
+		throw BaseExc("doc() is NULL.");
+	
+	const int width = doc()->width();
+	const int height = doc()->height();
+	
+	vector<ProEXRchannel *> loading;
+	
+	DeinterleaveDest dests[MAX_DEINTERLEAVE_DESTS];
+	int num_dests = 0;
+	
+	for(int i=0; i < channels().size() && num_dests < MAX_DEINTERLEAVE_DESTS; i++)
+	{
+		ProEXRchannel *chan = channels().at(i);
+		
+		if( !chan->loaded() )
+		{
+			// the channel naming converntion is RGBA, but AE is ARGB
+			int channel_index = (i == 3 ? 0 : i + 1);
+			
+			// we want to assure that an alpha channel is always coming from the alpha, such as layer.[U][V][A]
+			if( chan->channelTag() == CHAN_A)
+				channel_index = 0;
+			
+			ProEXRbuffer buffer = (chan->pixelType() == Imf::HALF ? chan->getHalfBufferDesc() : chan->getBufferDesc(false));
+			
+			assert( buffer.width == width );
+			assert( buffer.height == height );
+			assert( buffer.type == Imf::HALF || buffer.type == Imf::FLOAT );
+			
+			if(buffer.buf == NULL)
+				throw BaseExc("buffer.buf is NULL.");
+			
+			dests[num_dests].ae_channel = channel_index;
+			dests[num_dests].type = buffer.type;
+			dests[num_dests].buf = (char *)buffer.buf;
+			dests[num_dests].rowbytes = buffer.rowbytes;
+			
+			num_dests++;
+			
+			loading.push_back(chan);
+		}
+	}
+	
+	if(num_dests == 0)
+		return;
+	
+	
+	if(true) // making a scope for the TaskGroup
+	{
+		TaskGroup taskGroup;
+		
+		const char *ae_row = (const char *)world;
+		
+		for(int y=0; y < height; y++)
+		{
+			ThreadPool::addGlobalTask(new DeinterleaveRowTask(&taskGroup, (const PF_PixelFloat *)ae_row, width, dests, num_dests, y) );
+			
+			ae_row += rowbytes;
+		}
+	}
+	
+	for(vector<ProEXRchannel *>::iterator i = loading.begin(); i != loading.end(); ++i)
+		(*i)->setLoaded(true, true);
+}
+
+
 void
 ProEXRlayer_writeAE::setupLayer(Imf::PixelType pixelType)
 {
@@ -95,8 +95,6 @@ class ProEXRchannel_writeAE : public ProEXRchannel
   public:
 	ProEXRchannel_writeAE(std::string name, Imf::PixelType pixelType=Imf::HALF);
 	virtual ~ProEXRchannel_writeAE();
-	
-	void loadFromAE(float *world, size_t rowbytes);
 };
 
 
@@ -124,6 +122,7 @@ class ProEXRlayer_writeAE : public ProEXRlayer
 	size_t _composite_rowbytes;
   
 	void setupLayer(Imf::PixelType pixelType);
+	void loadFromWorld(const PF_PixelFloat *world, size_t rowbytes);
 	bool isCompositeLayer() { return (_composite_buf != NULL && _composite_rowbytes > 0); }
 
 	bool _visibility;
@@ -26,6 +26,7 @@
 #include "VRimgVersion.h"
 #include "VRimgInputFile.h"
 #include "VRimg_ChannelCache.h"
+#include "VRimgPrefetch.h"
 
 #include "ProEXR_AE_Dialogs.h"
 
@@ -35,15 +36,19 @@
 
 #include <IlmThread.h>
 #include <IlmThreadPool.h>
+#include <IlmThreadMutex.h>
 
 #include <string>
 #include <vector>
+#include <list>
 
 #include <assert.h>
 
 
 using namespace VRimg;
 using namespace std;
+using IMATH_NAMESPACE::Box2i;
+using IMATH_NAMESPACE::V2i;
 
 
 extern AEGP_PluginID S_mem_id;
@@ -52,12 +57,348 @@ extern unsigned int gNumCPUs;
 
 static A_long gChannelCaches = 3;
 static A_long gCacheTimeout = 30;
+static A_long gCacheMegabytes = 2048;
 static A_Boolean gMemoryMap = FALSE;
+static A_Boolean gCompactCache = FALSE;
+static A_long gPrefetchFrames = 3;
+static A_long gPrefetchMegabytes = 1024;
 
 
 static VRimg_CachePool gCachePool;
 
 
+// finds the other frames of a sequence by changing the number at the end of the file name
+class VRimg_SequenceSource : public FrameSource
+{
+  public:
+	VRimg_SequenceSource(const A_PathType *path);
+	virtual ~VRimg_SequenceSource() {}
+	
+	virtual Imf::IStream *openFrame(int frame, FrameStamp &stamp);
+	
+	// -1 if the path isn't part of our sequence
+	int frameNumber(const A_PathType *path) const;
+	
+  private:
+	typedef vector<A_PathType> PathVec;
+	
+	static bool parsePath(const A_PathType *path, PathVec &prefix, PathVec &suffix, int &digits, int &frame);
+	
+	PathVec _prefix;
+	PathVec _suffix;
+	int _digits;
+	int _frame;
+	bool _valid;
+};
+
+
+VRimg_SequenceSource::VRimg_SequenceSource(const A_PathType *path) :
+	_digits(0),
+	_frame(-1)
+{
+	_valid = parsePath(path, _prefix, _suffix, _digits, _frame);
+}
+
+
+static FrameStamp
+StreamStamp(IStreamPlatform &stream)
+{
+	const DateTime modtime = stream.getModTime();
+	
+#ifdef __APPLE__
+	const Imf::Int64 time = ((Imf::Int64)modtime.highSeconds << 48) | ((Imf::Int64)modtime.lowSeconds << 16) | modtime.fraction;
+#else
+	const Imf::Int64 time = ((Imf::Int64)modtime.dwHighDateTime << 32) | modtime.dwLowDateTime;
+#endif
+	
+	return FrameStamp(time, stream.getSize());
+}
+
+
+Imf::IStream *
+VRimg_SequenceSource::openFrame(int frame, FrameStamp &stamp)
+{
+	if(!_valid || frame < 0)
+		return NULL;
+	
+	char num[32];
+	
+	sprintf(num, "%0*d", _digits, frame);
+	
+	PathVec path(_prefix);
+	
+	for(const char *c = num; *c != '\0'; c++)
+		path.push_back(*c);
+	
+	path.insert(path.end(), _suffix.begin(), _suffix.end());
+	
+	path.push_back('\0');
+	
+	// no pica suite, we're not on AE's thread
+	IStreamPlatform *stream = new IStreamPlatform(&path[0]);
+	
+	stamp = StreamStamp(*stream);
+	
+	return stream;
+}
+
+
+int
+VRimg_SequenceSource::frameNumber(const A_PathType *path) const
+{
+	PathVec prefix, suffix;
+	int digits = 0;
+	int frame = -1;
+	
+	if(_valid && parsePath(path, prefix, suffix, digits, frame) &&
+		prefix == _prefix && suffix == _suffix)
+	{
+		return frame;
+	}
+	
+	return -1;
+}
+
+
+bool
+VRimg_SequenceSource::parsePath(const A_PathType *path, PathVec &prefix, PathVec &suffix, int &digits, int &frame)
+{
+	int len = 0;
+	
+	while(path[len] != '\0')
+		len++;
+	
+	// the last run of digits in the file name, not the directory
+	int name_start = 0;
+	
+	for(int i=0; i < len; i++)
+	{
+		if(path[i] == '/' || path[i] == '\\' || path[i] == ':')
+			name_start = i + 1;
+	}
+	
+	int num_end = -1;
+	
+	for(int i = len - 1; i >= name_start && num_end < 0; i--)
+	{
+		if(path[i] >= '0' && path[i] <= '9')
+			num_end = i + 1;
+	}
+	
+	if(num_end < 0)
+		return false;
+	
+	int num_start = num_end - 1;
+	
+	while(num_start > name_start && path[num_start - 1] >= '0' && path[num_start - 1] <= '9')
+		num_start--;
+	
+	digits = num_end - num_start;
+	
+	if(digits > 9)
+		return false;
+	
+	frame = 0;
+	
+	for(int i = num_start; i < num_end; i++)
+		frame = (frame * 10) + (path[i] - '0');
+	
+	prefix.assign(path, path + num_start);
+	suffix.assign(path + num_end, path + len);
+	
+	return true;
+}
+
+
+// one prefetcher for each sequence being read, most recent in front
+#define PREFETCH_SEQUENCES	4
+
+typedef struct SequencePrefetch {
+	VRimg_SequenceSource	*source; // owned by the prefetcher
+	Prefetcher				*prefetcher;
+	int						refs; // threads using it right now
+	bool					listed; // still in gPrefetchers
+} SequencePrefetch;
+
+typedef list<SequencePrefetch *> PrefetchList;
+
+// only guards the list and the refs, never held while a prefetcher is working
+static PrefetchList gPrefetchers;
+static IlmThread::Mutex gPrefetchMutex;
+
+
+static void
+TrimPrefetchers(PrefetchList &evicted)
+{
+	// with gPrefetchMutex held, takes the oldest ones nobody is using off the list
+	PrefetchList::iterator i = gPrefetchers.end();
+	
+	while(gPrefetchers.size() > PREFETCH_SEQUENCES && i != gPrefetchers.begin())
+	{
+		--i;
+		
+		if((*i)->refs == 0)
+		{
+			(*i)->listed = false;
+			
+			evicted.push_back(*i);
+			
+			i = gPrefetchers.erase(i);
+		}
+	}
+}
+
+
+static void
+FreePrefetchers(PrefetchList &evicted)
+{
+	// without the lock, deleting a prefetcher waits for its thread
+	for(PrefetchList::iterator i = evicted.begin(); i != evicted.end(); ++i)
+	{
+		delete (*i)->prefetcher;
+		delete *i;
+	}
+	
+	evicted.clear();
+}
+
+
+static void
+DeletePrefetchers()
+{
+	PrefetchList evicted;
+	
+	if(true) // making a scope for the Lock
+	{
+		IlmThread::Lock lock(gPrefetchMutex);
+		
+		PrefetchList::iterator i = gPrefetchers.begin();
+		
+		while(i != gPrefetchers.end())
+		{
+			(*i)->listed = false;
+			
+			// one that's in use gets deleted when it's handed back
+			if((*i)->refs == 0)
+				evicted.push_back(*i);
+			
+			i = gPrefetchers.erase(i);
+		}
+	}
+	
+	FreePrefetchers(evicted);
+}
+
+
+static void
+PrefetchLayers(const A_PathType *file_pathZ, IStreamPlatform &instream, InputFile &input, const vector<string> &layers)
+{
+	// tell the prefetcher for this sequence where we are and take anything it already has
+	if(gPrefetchFrames <= 0 || gPrefetchMegabytes <= 0)
+		return;
+	
+	SequencePrefetch *seq = NULL;
+	int frame = -1;
+	
+	PrefetchList evicted;
+	
+	try
+	{
+		IlmThread::Lock lock(gPrefetchMutex);
+		
+		PrefetchList::iterator i = gPrefetchers.begin();
+		
+		while(i != gPrefetchers.end() && frame < 0)
+		{
+			frame = (*i)->source->frameNumber(file_pathZ);
+			
+			if(frame < 0)
+				++i;
+		}
+		
+		if(frame >= 0)
+		{
+			gPrefetchers.splice(gPrefetchers.begin(), gPrefetchers, i);
+		}
+		else
+		{
+			VRimg_SequenceSource *source = new VRimg_SequenceSource(file_pathZ);
+			
+			frame = source->frameNumber(file_pathZ);
+			
+			if(frame < 0)
+			{
+				delete source; // not a sequence
+				
+				return;
+			}
+			
+			const size_t max_bytes = ((size_t)gPrefetchMegabytes * 1024 * 1024) / PREFETCH_SEQUENCES;
+			
+			SequencePrefetch *new_seq = new SequencePrefetch;
+			
+			new_seq->source = source;
+			new_seq->refs = 0;
+			new_seq->listed = true;
+			
+			try
+			{
+				new_seq->prefetcher = new Prefetcher(source, gPrefetchFrames, max_bytes);
+			}
+			catch(...)
+			{
+				delete source;
+				delete new_seq;
+				
+				throw;
+			}
+			
+			gPrefetchers.push_front(new_seq);
+		}
+		
+		seq = gPrefetchers.front();
+		
+		seq->refs++;
+		
+		TrimPrefetchers(evicted);
+	}
+	catch(...) {} // prefetching is just a bonus
+	
+	FreePrefetchers(evicted);
+	
+	if(seq == NULL)
+		return;
+	
+	
+	try
+	{
+		seq->prefetcher->adoptLayers(frame, input, StreamStamp(instream), layers);
+		
+		seq->prefetcher->frameRequested(frame, layers);
+	}
+	catch(...) {}
+	
+	
+	bool orphaned = false;
+	
+	if(true)
+	{
+		IlmThread::Lock lock(gPrefetchMutex);
+		
+		seq->refs--;
+		
+		orphaned = (seq->refs == 0 && !seq->listed);
+		
+		TrimPrefetchers(evicted);
+	}
+	
+	if(orphaned)
+		evicted.push_back(seq);
+	
+	FreePrefetchers(evicted);
+}
+
+
 A_Err
 VRimg_Init(struct SPBasicSuite *pica_basicP)
 {
@@ -71,22 +412,40 @@ VRimg_Init(struct SPBasicSuite *pica_basicP)
 #define PREFS_SECTION	"VRimg"
 #define PREFS_CHANNEL_CACHES "Channel Caches Number"
 #define PREFS_CACHE_EXPIRATION "Channel Cache Expiration"
+#define PREFS_CACHE_MEGABYTES "Channel Cache Megabytes"
 #define PREFS_MEMORY_MAP	"Memory Map"
+#define PREFS_COMPACT_CACHE	"Compact Channel Cache"
+#define PREFS_PREFETCH_FRAMES	"Prefetch Frames"
+#define PREFS_PREFETCH_MEGABYTES	"Prefetch Megabytes"
 
 
 	A_long channel_caches = gChannelCaches;
 	A_long cache_timeout = gCacheTimeout;
+	A_long cache_megabytes = gCacheMegabytes;
 	A_long memory_map = gMemoryMap;
+	A_long compact_cache = gCompactCache;
+	A_long prefetch_frames = gPrefetchFrames;
+	A_long prefetch_megabytes = gPrefetchMegabytes;
 	
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CHANNEL_CACHES, channel_caches, &channel_caches);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CACHE_EXPIRATION, cache_timeout, &cache_timeout);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_CACHE_MEGABYTES, cache_megabytes, &cache_megabytes);
 	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_MEMORY_MAP, memory_map, &memory_map);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_COMPACT_CACHE, compact_cache, &compact_cache);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_PREFETCH_FRAMES, prefetch_frames, &prefetch_frames);
+	suites.PersistentDataSuite()->AEGP_GetLong(blobH, PREFS_SECTION, PREFS_PREFETCH_MEGABYTES, prefetch_megabytes, &prefetch_megabytes);
 
 	gChannelCaches = channel_caches;
 	gCacheTimeout = cache_timeout;
+	gCacheMegabytes = cache_megabytes;
 	gMemoryMap = (memory_map ? TRUE : FALSE);
+	gCompactCache = (compact_cache ? TRUE : FALSE);
+	gPrefetchFrames = prefetch_frames;
+	gPrefetchMegabytes = prefetch_megabytes;
 	
 	gCachePool.configurePool(gChannelCaches, pica_basicP);
+	gCachePool.setMaxBytes((size_t)MAX(gCacheMegabytes, 0) * 1024 * 1024);
+	gCachePool.setCompact(gCompactCache);
 	
 	return err;
 }
@@ -97,6 +456,8 @@ VRimg_DeathHook(const SPBasicSuite *pica_basicP)
 {
 	try
 	{
+		DeletePrefetchers();
+		
 		gCachePool.configurePool(0);
 	}
 	catch(...) { return A_Err_PARAMETER; }
@@ -122,6 +483,8 @@ VRimg_IdleHook(const SPBasicSuite *pica_basicP)
 A_Err
 VRimg_PurgeHook(const SPBasicSuite *pica_basicP)
 {
+	DeletePrefetchers();
+	
 	gCachePool.configurePool(0);
 	gCachePool.configurePool(gChannelCaches);
 	
@@ -469,10 +832,6 @@ RefreshChannels(
 }
 
 
-typedef struct {
-	PF_FpShort red, green, blue;
-} RGBPixel;
-
 A_Err	
 VRimg_DrawSparseFrame(
 	AEIO_BasicData					*basic_dataP,
@@ -481,7 +840,9 @@ VRimg_DrawSparseFrame(
 	AEIO_DrawingFlags				*draw_flagsP,
 	const A_PathType				*file_pathZ,
 	FrameSeq_Info					*info,
-	VRimg_inData					*options)
+	VRimg_inData					*options,
+	const PF_LRect					*region0,
+	int								subsample)
 { 
 	// read pixels into the float buffer
 
@@ -501,6 +862,16 @@ VRimg_DrawSparseFrame(
 	InputFile input(instream);
 	
 	
+	string rgb_layer_name = "RGB color";
+	string alpha_layer_name = "Alpha";
+	
+	vector<string> frame_layers;
+	
+	frame_layers.push_back(rgb_layer_name);
+	frame_layers.push_back(alpha_layer_name);
+	
+	PrefetchLayers(file_pathZ, instream, input, frame_layers);
+	
 	
 #ifdef NDEBUG
 	#define CONT()	( (sparse_framePPB && sparse_framePPB->inter.abort0) ? !(err2 = sparse_framePPB->inter.abort0(sparse_framePPB->inter.refcon) ) : TRUE)
@@ -519,83 +890,77 @@ VRimg_DrawSparseFrame(
 		cache = gCachePool.addCache(input, instream, inter);
 	}
 	
+	VRimg_CacheRef cache_ref(gCachePool, cache);
 	
-	string rgb_layer_name = "RGB color";
 	
-	const Layer *rgb_layer = input.header().findLayer(rgb_layer_name);
+	// world pixel (x, y) comes from file pixel (x * subsample, y * subsample)
+	// and we only fill in the part of the world AE asked for
+	PF_LRect out_rect = {0, 0, wP->width, wP->height};
 	
-	if(rgb_layer && rgb_layer->type == VRimg::FLOAT && rgb_layer->dimensions == 3)
+	if(region0)
 	{
-		if(cache != NULL)
-			cache->copyLayerToBuffer(rgb_layer_name, wP->data, wP->rowbytes);
-		else
-			input.copyLayerToBuffer(rgb_layer_name, wP->data, wP->rowbytes);
-		
-		// that's going to be rows of RGBRGB, must fill gaps to make it ARGBARGB
-		for(int y = wP->height; y > 0; y--)
-		{
-			char *row = (char *)wP->data + ((y - 1) * wP->rowbytes);
-		
-			RGBPixel *src = (RGBPixel *)(row + (sizeof(RGBPixel) * (wP->width - 1)));
-			PF_Pixel32 *dest = (PF_Pixel32 *)(row + (sizeof(PF_Pixel32) * (wP->width - 1)));
-			
-			for(int x = wP->width; x > 0; x--)
-			{
-				dest->blue = src->blue;
-				dest->green = src->green;
-				dest->red = src->red;
-				dest->alpha = 1.f;
-				
-				src--;
-				dest--;
-			}
-		}
+		out_rect.left	= MAX(region0->left, 0);
+		out_rect.top	= MAX(region0->top, 0);
+		out_rect.right	= MIN(region0->right, wP->width);
+		out_rect.bottom	= MIN(region0->bottom, wP->height);
 	}
 	
+	if(subsample < 1)
+		subsample = 1;
 	
-	string alpha_layer_name = "Alpha";
+	const int out_width = out_rect.right - out_rect.left;
+	const int out_height = out_rect.bottom - out_rect.top;
 	
+	if(out_width <= 0 || out_height <= 0)
+		return err;
+	
+	const Box2i file_region(V2i(out_rect.left * subsample, out_rect.top * subsample),
+							V2i((out_rect.right - 1) * subsample, (out_rect.bottom - 1) * subsample));
+	
+	char *out_origin = (char *)wP->data + (out_rect.top * wP->rowbytes) + (out_rect.left * sizeof(PF_Pixel32));
+	
+	
+	// RGB and Alpha go straight into their places in the ARGB world
+	const Layer *rgb_layer = input.header().findLayer(rgb_layer_name);
 	const Layer *alpha_layer = input.header().findLayer(alpha_layer_name);
 	
-	if(alpha_layer && alpha_layer->type == VRimg::FLOAT)
+	const bool have_rgb = (rgb_layer && rgb_layer->type == VRimg::FLOAT && rgb_layer->dimensions == 3);
+	const bool have_alpha = (alpha_layer && alpha_layer->type == VRimg::FLOAT);
+	
+	PF_Pixel32 *out_pix = (PF_Pixel32 *)out_origin;
+	
+	InputFile::LayerSliceList slices;
+	
+	if(have_rgb)
+		slices.push_back( InputFile::LayerSlice(rgb_layer_name, &out_pix->red, sizeof(PF_Pixel32), wP->rowbytes, 3) );
+	
+	// for some reason getting 3 dimensional alphas?
+	if(have_alpha)
+		slices.push_back( InputFile::LayerSlice(alpha_layer_name, &out_pix->alpha, sizeof(PF_Pixel32), wP->rowbytes, 1) );
+	
+	if(cache != NULL)
 	{
-		// have to make a buffer
-		// for some reason getting 3 dimensional alphas?
-		AEIO_Handle alphaH = NULL;
-		
-		size_t rowbytes = sizeof(float) * alpha_layer->dimensions * wP->width;
-		
-		AEGP_MemSize mem_size = rowbytes * wP->height;
-		
-		suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "Alpha Buffer", mem_size, AEGP_MemFlag_CLEAR, &alphaH);
-		
-		if(alphaH)
+		for(InputFile::LayerSliceList::const_iterator i = slices.begin(); i != slices.end(); ++i)
 		{
-			void *alpha_buf = NULL;
-			
-			suites.MemorySuite()->AEGP_LockMemHandle(alphaH, &alpha_buf);
-			
-			if(cache != NULL)
-				cache->copyLayerToBuffer(alpha_layer_name, alpha_buf, rowbytes);
-			else
-				input.copyLayerToBuffer(alpha_layer_name, alpha_buf, rowbytes);
-			
+			cache->copyLayerToBuffer(input, i->name, i->buf, i->colbytes, i->rowbytes, file_region, subsample, i->channels);
+		}
+	}
+	else
+		input.copyLayersToBuffer(slices, file_region, subsample);
+	
+	
+	if(have_rgb && !have_alpha)
+	{
+		for(int y=0; y < out_height; y++)
+		{
+			PF_Pixel32 *pix = (PF_Pixel32 *)(out_origin + (y * wP->rowbytes));
 			
-			for(int y=0; y < wP->height; y++)
+			for(int x=0; x < out_width; x++)
 			{
-				PF_FpShort *src = (PF_FpShort *)((char *)alpha_buf + (y * rowbytes));
-				PF_Pixel32 *dest = (PF_Pixel32 *)((char *)wP->data + (y * wP->rowbytes));
-			
-				for(int x=0; x < wP->width; x++)
-				{
-					dest->alpha = *src;
-					
-					src += alpha_layer->dimensions;
-					dest++;
-				}
+				pix->alpha = 1.f;
+				
+				pix++;
 			}
-			
-			suites.MemorySuite()->AEGP_FreeMemHandle(alphaH);
 		}
 	}
 	
@@ -939,6 +1304,8 @@ VRimg_DrawAuxChannel(
 		
 	InputFile input(instream);
 	
+	PrefetchLayers(file_pathZ, instream, input, vector<string>(1, layer_name));
+	
 	
 	#ifdef NDEBUG
 		#define CONT2()	( (pbP && pbP->inter.abort0) ? !(err2 = pbP->inter.abort0(pbP->inter.refcon) ) : TRUE)
@@ -957,6 +1324,8 @@ VRimg_DrawAuxChannel(
 		cache = gCachePool.addCache(input, instream, interP);
 	}
 	
+	VRimg_CacheRef cache_ref(gCachePool, cache);
+	
 	
 	const Layer *layer = input.header().findLayer(layer_name);
 	
@@ -1005,7 +1374,7 @@ VRimg_DrawAuxChannel(
 		
 		
 		if(cache != NULL)
-			cache->copyLayerToBuffer(layer_name, vrimg_buffer, rowbytes);
+			cache->copyLayerToBuffer(input, layer_name, vrimg_buffer, rowbytes);
 		else
 			input.copyLayerToBuffer(layer_name, vrimg_buffer, rowbytes);
 		
@@ -85,7 +85,9 @@ VRimg_DrawSparseFrame(
 	AEIO_DrawingFlags				*draw_flagsP,
 	const A_PathType				*file_pathZ,
 	FrameSeq_Info					*info,
-	VRimg_inData					*options);
+	VRimg_inData					*options,
+	const PF_LRect					*region0,
+	int								subsample);
 	
 
 A_Err	
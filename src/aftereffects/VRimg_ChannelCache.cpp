@@ -25,6 +25,8 @@
 #include <IexBaseExc.h>
 #include <IlmThreadPool.h>
 
+#include <half.h>
+
 #include <assert.h>
 
 #include <vector>
@@ -34,108 +36,289 @@ using namespace VRimg;
 using namespace std;
 using namespace Iex;
 using namespace IlmThread;
+using IMATH_NAMESPACE::Box2i;
+using IMATH_NAMESPACE::V2i;
 
 extern AEGP_PluginID S_mem_id;
 
 
 
 VRimg_ChannelCache::VRimg_ChannelCache(const SPBasicSuite *pica_basicP, const AEIO_InterruptFuncs *inter,
-											InputFile &in, const IStreamPlatform &stream) :
+											InputFile &in, const IStreamPlatform &stream, bool compact,
+											VRimg_CachePool *pool) :
 	suites(pica_basicP),
+	_compact(compact),
+	_pool(pool),
+	_size(0),
 	_path(stream.getPath()),
-	_modtime(stream.getModTime())
+	_modtime(stream.getModTime()),
+	_refs(0),
+	_idle(false)
 {
+	suites.MemorySuite(); // load it now so threads don't race to later
+	
     const Header &head = in.header();
 	
 	_width = head.width();
 	_height = head.height();
 	
 	
-	try
+	// just make a list of the layers, we'll fill them in when they're asked for
+	const Header::LayerMap &layer_map = head.layers();
+	
+	for(Header::LayerMap::const_iterator i = layer_map.begin(); i != layer_map.end(); ++i)
 	{
-		InputFile::BufferMap BufMap;
-		
-		const Header::LayerMap &layer_map = head.layers();
+		const Layer &layer = i->second;
 		
-		for(Header::LayerMap::const_iterator i = layer_map.begin(); i != layer_map.end(); ++i)
+		_cache[ i->first ] = ChannelCache(layer.type, layer.dimensions, NULL);
+	}
+	
+	
+	updateCacheTime();
+}
+
+
+VRimg_ChannelCache::~VRimg_ChannelCache()
+{
+	for(ChannelMap::iterator i = _cache.begin(); i != _cache.end(); ++i)
+	{
+		if(i->second.bufH != NULL)
 		{
-			const string &name = i->first;
-			const Layer &layer = i->second;
-			
-			const size_t colbytes = sizeof(float) * layer.dimensions;
-			const size_t rowbytes = colbytes * _width;
-			const size_t data_size = rowbytes * _height;
-			
-			
-			AEIO_Handle bufH = NULL;
-			
-			suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "Channel Cache",
-													data_size,
-													AEGP_MemFlag_CLEAR, &bufH);
-			
-			if(bufH == NULL)
-				throw NullExc("Can't allocate a channel cache handle like I need to.");
-			
-			
-			_cache[ name ] = ChannelCache(layer.type, layer.dimensions, bufH);
-			
-			
-			char *buf = NULL;
-			
-			suites.MemorySuite()->AEGP_LockMemHandle(bufH, (void**)&buf);
-			
-			if(buf == NULL)
-				throw NullExc("Why is the locked handle NULL?");
-			
+			suites.MemorySuite()->AEGP_FreeMemHandle(i->second.bufH);
 			
-			BufMap[ name ] = buf;
+			i->second.bufH = NULL;
 		}
+	}
+}
+
+
+void
+VRimg_ChannelCache::fillLayer(InputFile &in, const string &name, ChannelCache &cache)
+{
+	const size_t colbytes = sizeof(float) * cache.dimensions;
+	const size_t rowbytes = colbytes * _width;
+	const size_t data_size = rowbytes * _height;
+	
+	
+	AEIO_Handle bufH = NULL;
+	
+	suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "Channel Cache",
+											data_size,
+											AEGP_MemFlag_CLEAR, &bufH);
+	
+	if(bufH == NULL)
+		throw NullExc("Can't allocate a channel cache handle like I need to.");
+	
+	
+	try
+	{
+		char *buf = NULL;
+		
+		suites.MemorySuite()->AEGP_LockMemHandle(bufH, (void**)&buf);
 		
+		if(buf == NULL)
+			throw NullExc("Why is the locked handle NULL?");
 		
-		in.loadFromFile( &BufMap );
+		try
+		{
+			in.copyLayerToBuffer(name, buf, rowbytes);
+		}
+		catch(IoExc) {} // we catch these so that partial files are read partially without error
+		catch(InputExc) {}
+		
+		suites.MemorySuite()->AEGP_UnlockMemHandle(bufH);
 	}
-	catch(IoExc) {} // we catch these so that partial files are read partially without error
-	catch(InputExc) {}
 	catch(...)
 	{
-		// out of memory or worse; kill anything that got allocated
-		for(ChannelMap::iterator i = _cache.begin(); i != _cache.end(); ++i)
+		suites.MemorySuite()->AEGP_FreeMemHandle(bufH);
+		
+		throw;
+	}
+	
+	
+	cache.storage = STORE_FULL;
+	cache.bufH = bufH;
+	cache.size = data_size;
+	
+	if(_compact)
+		compactLayer(cache);
+	
+	_size += cache.size;
+}
+
+
+// sparse rows are a series of runs, each starting with a header word
+// high bit set: that many zero words, otherwise: that many literal words follow
+#define SPARSE_ZERO_RUN		0x80000000
+
+static size_t
+EncodeSparseRow(const unsigned int *in, int words, unsigned int *out)
+{
+	// pass out=NULL to just count
+	size_t n = 0;
+	
+	int i = 0;
+	
+	while(i < words)
+	{
+		const int start = i;
+		
+		if(in[i] == 0)
+		{
+			while(i < words && in[i] == 0)
+				i++;
+			
+			if(out)
+				out[n] = (SPARSE_ZERO_RUN | (i - start));
+			
+			n++;
+		}
+		else
 		{
-			if(i->second.bufH != NULL)
+			while(i < words && in[i] != 0)
+				i++;
+			
+			const int run = i - start;
+			
+			if(out)
 			{
-				suites.MemorySuite()->AEGP_FreeMemHandle(i->second.bufH);
+				out[n] = run;
 				
-				i->second.bufH = NULL;
+				memcpy(&out[n + 1], &in[start], run * sizeof(unsigned int));
 			}
+			
+			n += 1 + run;
 		}
-		
-		throw; // re-throw the exception
 	}
 	
+	return n;
+}
+
 
+static void
+DecodeSparseRow(const unsigned int *in, int words, unsigned int *out)
+{
+	int i = 0;
 	
-	for(ChannelMap::const_iterator i = _cache.begin(); i != _cache.end(); ++i)
+	while(i < words)
 	{
-		if(i->second.bufH != NULL)
-			suites.MemorySuite()->AEGP_UnlockMemHandle(i->second.bufH);
+		const unsigned int head = *in++;
+		
+		if(head & SPARSE_ZERO_RUN)
+		{
+			int run = (head & ~SPARSE_ZERO_RUN);
+			
+			if(run > (words - i))
+				run = words - i;
+			
+			memset(&out[i], 0, run * sizeof(unsigned int));
+			
+			i += run;
+		}
+		else
+		{
+			int run = head;
+			
+			if(run > (words - i))
+				run = words - i;
+			
+			memcpy(&out[i], in, run * sizeof(unsigned int));
+			
+			in += head;
+			i += run;
+		}
 	}
-	
-	
-	updateCacheTime();
 }
 
 
-VRimg_ChannelCache::~VRimg_ChannelCache()
+void
+VRimg_ChannelCache::compactLayer(ChannelCache &cache)
 {
-	for(ChannelMap::iterator i = _cache.begin(); i != _cache.end(); ++i)
+	// masks and IDs are mostly zeros, so they get squeezed losslessly;
+	// other float layers become half
+	const int row_words = _width * cache.dimensions;
+	const size_t full_size = sizeof(unsigned int) * row_words * _height;
+	
+	const unsigned int *buf = NULL;
+	
+	suites.MemorySuite()->AEGP_LockMemHandle(cache.bufH, (void**)&buf);
+	
+	if(buf == NULL)
+		throw NullExc("Why is the locked handle NULL?");
+	
+	
+	// sparse layout is a table of row offsets followed by the rows
+	const size_t table_size = sizeof(size_t) * _height;
+	
+	size_t sparse_size = table_size;
+	
+	for(int y=0; y < _height; y++)
+		sparse_size += sizeof(unsigned int) * EncodeSparseRow(buf + (y * row_words), row_words, NULL);
+	
+	
+	const Storage storage = (sparse_size < (full_size / 2) ? STORE_SPARSE :
+								cache.pix_type == VRimg::FLOAT ? STORE_HALF :
+								STORE_FULL);
+	
+	const size_t new_size = (storage == STORE_SPARSE ? sparse_size : sizeof(half) * row_words * _height);
+	
+	AEIO_Handle newH = NULL;
+	
+	if(storage != STORE_FULL)
 	{
-		if(i->second.bufH != NULL)
+		suites.MemorySuite()->AEGP_NewMemHandle(S_mem_id, "Compact Channel Cache",
+												new_size,
+												AEGP_MemFlag_CLEAR, &newH);
+	}
+	
+	if(newH != NULL)
+	{
+		char *new_buf = NULL;
+		
+		suites.MemorySuite()->AEGP_LockMemHandle(newH, (void**)&new_buf);
+		
+		if(new_buf != NULL)
 		{
-			suites.MemorySuite()->AEGP_FreeMemHandle(i->second.bufH);
+			if(storage == STORE_SPARSE)
+			{
+				size_t *row_table = (size_t *)new_buf;
+				
+				size_t offset = table_size;
+				
+				for(int y=0; y < _height; y++)
+				{
+					row_table[y] = offset;
+					
+					offset += sizeof(unsigned int) * EncodeSparseRow(buf + (y * row_words), row_words,
+																		(unsigned int *)(new_buf + offset));
+				}
+			}
+			else
+			{
+				const float *in = (const float *)buf;
+				half *out = (half *)new_buf;
+				
+				for(size_t i=0; i < (size_t)row_words * _height; i++)
+					*out++ = *in++;
+			}
 			
-			i->second.bufH = NULL;
+			suites.MemorySuite()->AEGP_UnlockMemHandle(newH);
+			suites.MemorySuite()->AEGP_UnlockMemHandle(cache.bufH);
+			
+			suites.MemorySuite()->AEGP_FreeMemHandle(cache.bufH);
+			
+			cache.bufH = newH;
+			cache.storage = storage;
+			cache.size = new_size;
+			
+			return;
 		}
+		
+		suites.MemorySuite()->AEGP_FreeMemHandle(newH);
 	}
+	
+	// didn't get compacted, that's OK
+	suites.MemorySuite()->AEGP_UnlockMemHandle(cache.bufH);
 }
 
 
@@ -143,35 +326,48 @@ class CopyCacheTask : public Task
 {
   public:
 	CopyCacheTask(TaskGroup *group,
-					const char *buf, int width, VRimg::PixelType pix_type,
-					char *out_buf, size_t rowbytes, int row);
+					VRimg_ChannelCache::Storage storage, const char *in_row, int row_width, int x_start,
+					int width, int dimensions, int subsample, VRimg::PixelType pix_type,
+					char *out_row, size_t out_colbytes, int channels);
 	virtual ~CopyCacheTask() {}
 	
 	virtual void execute();
 	
-	template <typename PIXTYPE>
-	static void CopyRow(const char *in, char *out, int width);
+	template <typename INTYPE, typename OUTTYPE>
+	static void CopyRow(const char *in, char *out, int width, int dimensions, int subsample,
+						size_t out_colbytes, int channels);
 	
   private:
-	const char *_buf;
+	VRimg_ChannelCache::Storage _storage;
+	const char *_in_row;
+	int _row_width;
+	int _x_start;
 	int _width;
+	int _dimensions;
+	int _subsample;
 	VRimg::PixelType _pix_type;
-	char *_out_buf;
-	size_t _rowbytes;
-	int _row;
+	char *_out_row;
+	size_t _out_colbytes;
+	int _channels;
 };
 
 
 CopyCacheTask::CopyCacheTask(TaskGroup *group,
-								const char *buf, int width, VRimg::PixelType pix_type,
-								char *out_buf, size_t rowbytes, int row) :
+								VRimg_ChannelCache::Storage storage, const char *in_row, int row_width, int x_start,
+								int width, int dimensions, int subsample, VRimg::PixelType pix_type,
+								char *out_row, size_t out_colbytes, int channels) :
 	Task(group),
-	_buf(buf),
+	_storage(storage),
+	_in_row(in_row),
+	_row_width(row_width),
+	_x_start(x_start),
 	_width(width),
+	_dimensions(dimensions),
+	_subsample(subsample),
 	_pix_type(pix_type),
-	_out_buf(out_buf),
-	_rowbytes(rowbytes),
-	_row(row)
+	_out_row(out_row),
+	_out_colbytes(out_colbytes),
+	_channels(channels)
 {
 
 }
@@ -180,54 +376,149 @@ CopyCacheTask::CopyCacheTask(TaskGroup *group,
 void
 CopyCacheTask::execute()
 {
-	const size_t pix_size =	_pix_type == VRimg::FLOAT ? sizeof(float) :
-							_pix_type == VRimg::INT ? sizeof(int) :
-							sizeof(float);
-							
-	const size_t rowbytes = pix_size * _width;
-	
-	const char *in_row = _buf + (rowbytes * _row);
-				
-	char *out_row = _out_buf + (_rowbytes * _row);
-	
-	if(_pix_type == VRimg::FLOAT)
+	if(_storage == VRimg_ChannelCache::STORE_HALF)
 	{
-		CopyRow<float>(in_row, out_row, _width);
+		const char *in = _in_row + (sizeof(half) * _dimensions * _x_start);
+		
+		CopyRow<half, float>(in, _out_row, _width, _dimensions, _subsample, _out_colbytes, _channels);
 	}
-	else if(_pix_type == VRimg::INT)
+	else if(_storage == VRimg_ChannelCache::STORE_SPARSE)
 	{
-		CopyRow<int>(in_row, out_row, _width);
+		// bits are bits, doesn't matter if it's float or int
+		vector<unsigned int> row(_row_width * _dimensions);
+		
+		DecodeSparseRow((const unsigned int *)_in_row, row.size(), &row[0]);
+		
+		const char *in = (const char *)&row[_dimensions * _x_start];
+		
+		CopyRow<unsigned int, unsigned int>(in, _out_row, _width, _dimensions, _subsample, _out_colbytes, _channels);
+	}
+	else
+	{
+		const char *in = _in_row + (sizeof(float) * _dimensions * _x_start);
+		
+		if(_pix_type == VRimg::FLOAT)
+		{
+			CopyRow<float, float>(in, _out_row, _width, _dimensions, _subsample, _out_colbytes, _channels);
+		}
+		else if(_pix_type == VRimg::INT)
+		{
+			CopyRow<int, int>(in, _out_row, _width, _dimensions, _subsample, _out_colbytes, _channels);
+		}
 	}
 }
 
 
-template <typename PIXTYPE>
+template <typename INTYPE, typename OUTTYPE>
 void
-CopyCacheTask::CopyRow(const char *in, char *out, int width)
+CopyCacheTask::CopyRow(const char *in, char *out, int width, int dimensions, int subsample,
+						size_t out_colbytes, int channels)
 {
-	PIXTYPE *i = (PIXTYPE *)in;
-	PIXTYPE *o = (PIXTYPE *)out;
+	INTYPE *i = (INTYPE *)in;
+	OUTTYPE *o = (OUTTYPE *)out;
 	
-	while(width--)
+	if(channels != dimensions || out_colbytes != sizeof(OUTTYPE) * dimensions)
+	{
+		// interleaving into someone else's pixels
+		const int step = subsample * dimensions;
+		
+		while(width--)
+		{
+			for(int c=0; c < channels; c++)
+				o[c] = i[c];
+			
+			i += step;
+			o = (OUTTYPE *)((char *)o + out_colbytes);
+		}
+	}
+	else if(subsample == 1)
+	{
+		int samples = width * dimensions;
+		
+		while(samples--)
+		{
+			*o++ = *i++;
+		}
+	}
+	else
 	{
-		*o++ = *i++;
+		const int skip = (subsample - 1) * dimensions;
+		
+		while(width--)
+		{
+			for(int c=0; c < dimensions; c++)
+				*o++ = *i++;
+			
+			i += skip;
+		}
 	}
 }
 
 
 void
-VRimg_ChannelCache::copyLayerToBuffer(const string &name, void *buf, size_t rowbytes)
+VRimg_ChannelCache::copyLayerToBuffer(InputFile &in, const string &name, void *buf, size_t rowbytes)
 {
-	if(_cache.find(name) == _cache.end())
+	const Box2i region(V2i(0, 0), V2i(_width - 1, _height - 1));
+	
+	copyLayerToBuffer(in, name, buf, rowbytes, region, 1);
+}
+
+
+void
+VRimg_ChannelCache::copyLayerToBuffer(InputFile &in, const string &name, void *buf, size_t rowbytes,
+										const Box2i &region, int subsample)
+{
+	ChannelMap::const_iterator found = _cache.find(name);
+	
+	if(found == _cache.end())
 		return; // don't have this layer in my cache
+	
+	const int dimensions = found->second.dimensions;
+	
+	copyLayerToBuffer(in, name, buf, sizeof(float) * dimensions, rowbytes, region, subsample, dimensions);
+}
+
+
+void
+VRimg_ChannelCache::copyLayerToBuffer(InputFile &in, const string &name, void *buf, size_t colbytes, size_t rowbytes,
+										const Box2i &region, int subsample, int channels)
+{
+	if(subsample < 1 || region.min.x < 0 || region.min.y < 0)
+		throw ArgExc("Bad region or subsample.");
+	
+	ChannelMap::iterator found = _cache.find(name);
+	
+	if(found == _cache.end())
+		return; // don't have this layer in my cache
+	
+	// map entries never move, and once a layer is filled it stays put until we're deleted
+	ChannelCache &cache = found->second;
+	
+	if(channels < 1 || channels > cache.dimensions)
+		channels = cache.dimensions;
+	
+	size_t old_size = 0, new_size = 0;
+	
+	if(true) // making a scope for the Lock
+	{
+		Lock lock(_mutex);
+		
+		old_size = _size;
 		
+		if(cache.bufH == NULL)
+			fillLayer(in, name, cache);
+		
+		new_size = _size;
+	}
+	
+	if(_pool && new_size != old_size)
+		_pool->cacheResized(this, old_size, new_size);
+	
 	
 	vector<AEIO_Handle> locked_handles;
 
 	if(true) // making a scope for TaskGroup
 	{
-		const ChannelCache &cache = _cache[ name ];
-		
 		if(cache.bufH == NULL)
 			throw NullExc("Why is the handle NULL?");
 		
@@ -244,13 +535,26 @@ VRimg_ChannelCache::copyLayerToBuffer(const string &name, void *buf, size_t rowb
 		locked_handles.push_back(cache.bufH);
 		
 		
+		const size_t cache_rowbytes = (cache.storage == STORE_HALF ? sizeof(half) : sizeof(float)) * cache.dimensions * _width;
+		
+		const size_t *row_table = (const size_t *)cache_buf; // for STORE_SPARSE
+		
+		const int right = (region.max.x < _width ? region.max.x : _width - 1);
+		const int bottom = (region.max.y < _height ? region.max.y : _height - 1);
+		
+		const int out_width = (right >= region.min.x ? ((right - region.min.x) / subsample) + 1 : 0);
+		
 		TaskGroup group;
 		
-		for(int y=0; y < _height; y++)
+		for(int y = region.min.y, out_y = 0; y <= bottom && out_width > 0; y += subsample, out_y++)
 		{
+			const char *in_row = (cache.storage == STORE_SPARSE ? cache_buf + row_table[y] :
+									cache_buf + (cache_rowbytes * y));
+			
 			ThreadPool::addGlobalTask(new CopyCacheTask(&group,
-													cache_buf, _width * cache.dimensions, cache.pix_type,
-													(char *)buf, rowbytes, y) );
+													cache.storage, in_row, _width, region.min.x,
+													out_width, cache.dimensions, subsample, cache.pix_type,
+													(char *)buf + (rowbytes * out_y), colbytes, channels) );
 		}
 	}
 	
@@ -259,9 +563,15 @@ VRimg_ChannelCache::copyLayerToBuffer(const string &name, void *buf, size_t rowb
 	{
 		suites.MemorySuite()->AEGP_UnlockMemHandle(*i);
 	}
+}
+
+
+size_t
+VRimg_ChannelCache::cacheSize() const
+{
+	Lock lock(_mutex);
 	
-	
-	updateCacheTime();
+	return _size;
 }
 
 
@@ -289,7 +599,14 @@ VRimg_ChannelCache::cacheIsStale(int timeout) const
 
 VRimg_CachePool::VRimg_CachePool() :
 	_max_caches(0),
-	_pica_basicP(NULL)
+	_max_bytes(0),
+	_compact(false),
+	_pica_basicP(NULL),
+	_caches(0),
+	_bytes(0),
+	_hits(0),
+	_misses(0),
+	_evictions(0)
 {
 
 }
@@ -301,106 +618,360 @@ VRimg_CachePool::~VRimg_CachePool()
 }
 
 
-static bool
-compare_age(const VRimg_ChannelCache *first, const VRimg_ChannelCache *second)
+bool
+VRimg_CachePool::CacheKey::operator < (const CacheKey &other) const
 {
-	return first->cacheAge() > second->cacheAge();
+	if(path != other.path)
+		return (path < other.path);
+	
+#ifdef __APPLE__
+	if(modtime.highSeconds != other.modtime.highSeconds)
+		return (modtime.highSeconds < other.modtime.highSeconds);
+	
+	if(modtime.lowSeconds != other.modtime.lowSeconds)
+		return (modtime.lowSeconds < other.modtime.lowSeconds);
+	
+	return (modtime.fraction < other.modtime.fraction);
+#else
+	if(modtime.dwHighDateTime != other.modtime.dwHighDateTime)
+		return (modtime.dwHighDateTime < other.modtime.dwHighDateTime);
+	
+	return (modtime.dwLowDateTime < other.modtime.dwLowDateTime);
+#endif
 }
 
 
-void
-VRimg_CachePool::configurePool(int max_caches, const SPBasicSuite *pica_basicP)
+VRimg_CachePool::Shard &
+VRimg_CachePool::shardFor(const PathString &path)
 {
-	_max_caches = max_caches;
+	unsigned int hash = 0;
 	
-	if(pica_basicP)
-		_pica_basicP = pica_basicP;
+	for(const A_PathType *c = path.string(); *c != '\0'; c++)
+		hash = (hash * 31) + *c;
 	
-	_pool.sort(compare_age);
+	return _shards[hash % CACHE_POOL_SHARDS];
+}
 
-	while(_pool.size() > _max_caches)
+
+void
+VRimg_CachePool::configurePool(int max_caches, const SPBasicSuite *pica_basicP)
+{
+	if(true) // making a scope for the Lock
 	{
-		delete _pool.front();
+		Lock lock(_mutex);
+		
+		_max_caches = max_caches;
 		
-		_pool.pop_front();
+		if(pica_basicP)
+			_pica_basicP = pica_basicP;
 	}
+	
+	trimPool(NULL);
 }
 
 
-static bool
-MatchDateTime(const DateTime &d1, const DateTime &d2)
+void
+VRimg_CachePool::setMaxBytes(size_t max_bytes)
 {
-#ifdef __APPLE__
-	return (d1.fraction == d2.fraction &&
-			d1.lowSeconds == d2.lowSeconds &&
-			d1.highSeconds == d2.highSeconds);
-#else
-	return (d1.dwHighDateTime == d2.dwHighDateTime &&
-			d1.dwLowDateTime == d2.dwLowDateTime);
-#endif
+	if(true)
+	{
+		Lock lock(_mutex);
+		
+		_max_bytes = max_bytes;
+	}
+	
+	trimPool(NULL);
 }
 
 
 VRimg_ChannelCache *
-VRimg_CachePool::findCache(const IStreamPlatform &stream) const
+VRimg_CachePool::findCache(const IStreamPlatform &stream)
 {
-	for(list<VRimg_ChannelCache *>::const_iterator i = _pool.begin(); i != _pool.end(); ++i)
+	VRimg_ChannelCache *cache = NULL;
+	
+	if(true)
 	{
-		if( MatchDateTime(stream.getModTime(), (*i)->getModTime()) &&
-			stream.getPath() == (*i)->getPath() )
+		Shard &shard = shardFor(stream.getPath());
+		
+		Lock lock(shard.mutex);
+		
+		CacheMap::iterator found = shard.map.find( CacheKey(stream.getPath(), stream.getModTime()) );
+		
+		if(found != shard.map.end())
 		{
-			return *i;
+			cache = found->second;
+			
+			cache->_refs++;
+			
+			touchCache(cache);
 		}
 	}
 	
-	return NULL;
+	Lock lock(_mutex);
+	
+	if(cache)
+		_hits++;
+	else
+		_misses++;
+	
+	return cache;
 }
 
 
 VRimg_ChannelCache *
 VRimg_CachePool::addCache(InputFile &in, const IStreamPlatform &stream, const AEIO_InterruptFuncs *inter)
 {
-	_pool.sort(compare_age);
+	int max_caches = 0;
+	bool compact = false;
+	const SPBasicSuite *pica_basicP = NULL;
 	
-	while(_pool.size() && _pool.size() >= _max_caches)
+	if(true)
 	{
-		delete _pool.front();
+		Lock lock(_mutex);
 		
-		_pool.pop_front();
+		max_caches = _max_caches;
+		compact = _compact;
+		pica_basicP = _pica_basicP;
 	}
 	
-	if(_max_caches > 0)
+	if(max_caches <= 0)
+		return NULL;
+	
+	
+	VRimg_ChannelCache *new_cache = NULL;
+	
+	try
 	{
-		try
+		new_cache = new VRimg_ChannelCache(pica_basicP, inter, in, stream, compact, this);
+	}
+	catch(CancelExc) { throw; }
+	catch(...) { return NULL; }
+	
+	
+	VRimg_ChannelCache *cache = NULL;
+	
+	if(true)
+	{
+		Shard &shard = shardFor(new_cache->getPath());
+		
+		Lock lock(shard.mutex);
+		
+		const CacheKey key(new_cache->getPath(), new_cache->getModTime());
+		
+		CacheMap::iterator found = shard.map.find(key);
+		
+		if(found != shard.map.end())
 		{
-			VRimg_ChannelCache *new_cache = new VRimg_ChannelCache(_pica_basicP, inter, in, stream);
+			// another thread got here first
+			cache = found->second;
+		}
+		else
+		{
+			cache = new_cache;
 			
-			_pool.push_back(new_cache);
+			shard.map[key] = cache;
 			
-			return new_cache;
+			new_cache = NULL;
 		}
-		catch(CancelExc) { throw; }
-		catch(...) {}
+		
+		cache->_refs++;
+		
+		touchCache(cache);
+	}
+	
+	if(new_cache)
+	{
+		delete new_cache;
+	}
+	else
+	{
+		Lock lock(_mutex);
+		
+		_caches++;
+	}
+	
+	trimPool(cache);
+	
+	return cache;
+}
+
+
+void
+VRimg_CachePool::releaseCache(VRimg_ChannelCache *cache)
+{
+	if(cache == NULL)
+		return;
+	
+	if(true)
+	{
+		Shard &shard = shardFor(cache->getPath());
+		
+		Lock lock(shard.mutex);
+		
+		assert(cache->_refs > 0);
+		
+		cache->_refs--;
+		
+		touchCache(cache);
 	}
 	
-	return NULL;
+	// might have been kept over the limit while it was in use
+	trimPool(NULL);
 }
 
 
 void
 VRimg_CachePool::deleteStaleCaches(int timeout)
 {
-	if(_pool.size() > 0)
+	// just going to delete one cache per cycle, the oldest one
+	evictOldest(NULL, timeout);
+}
+
+
+void
+VRimg_CachePool::cacheResized(const VRimg_ChannelCache *cache, size_t old_size, size_t new_size)
+{
+	if(true)
 	{
-		_pool.sort(compare_age);
+		Lock lock(_mutex);
 		
-		if( _pool.front()->cacheIsStale(timeout) )
-		{
-			delete _pool.front(); // just going to delete one cache per cycle, the oldest one
-			
-			_pool.pop_front();
-		}
+		_bytes -= old_size;
+		_bytes += new_size;
 	}
+	
+	trimPool(cache);
 }
 
 
+VRimg_CachePool::Stats
+VRimg_CachePool::getStats() const
+{
+	Lock lock(_mutex);
+	
+	Stats stats;
+	
+	stats.hits = _hits;
+	stats.misses = _misses;
+	stats.evictions = _evictions;
+	stats.bytes = _bytes;
+	stats.caches = _caches;
+	
+	return stats;
+}
+
+
+void
+VRimg_CachePool::touchCache(VRimg_ChannelCache *cache)
+{
+	Lock lock(_mutex);
+	
+	if(cache->_idle)
+	{
+		_lru.erase(cache->_lru_pos);
+		
+		cache->_idle = false;
+	}
+	
+	if(cache->_refs == 0)
+	{
+		_lru.push_front(cache);
+		
+		cache->_lru_pos = _lru.begin();
+		cache->_idle = true;
+	}
+	
+	cache->updateCacheTime();
+}
+
+
+bool
+VRimg_CachePool::overLimits() const
+{
+	Lock lock(_mutex);
+	
+	const bool over_count = (_caches > _max_caches);
+	const bool over_bytes = (_max_bytes > 0 && _bytes > _max_bytes);
+	
+	return (over_count || over_bytes);
+}
+
+
+bool
+VRimg_CachePool::evictOldest(const VRimg_ChannelCache *keep, int timeout)
+{
+	// least recently used cache nobody is holding is at the back of the list
+	VRimg_ChannelCache *oldest = NULL;
+	CacheKey oldest_key = CacheKey(PathString(), DateTime());
+	
+	if(true)
+	{
+		Lock lock(_mutex);
+		
+		CacheList::reverse_iterator i = _lru.rbegin();
+		
+		if(i != _lru.rend() && *i == keep)
+			++i;
+		
+		if(i == _lru.rend())
+			return false;
+		
+		oldest = *i;
+		
+		if(timeout >= 0 && !oldest->cacheIsStale(timeout))
+			return false;
+		
+		// can't be deleted while it's in the list, so safe to look at
+		oldest_key = CacheKey(oldest->getPath(), oldest->getModTime());
+	}
+	
+	
+	if(true)
+	{
+		Shard &shard = shardFor(oldest_key.path);
+		
+		Lock shard_lock(shard.mutex);
+		
+		CacheMap::iterator found = shard.map.find(oldest_key);
+		
+		// somebody might have grabbed or deleted it while we weren't looking
+		if(found == shard.map.end() || found->second != oldest)
+			return true;
+		
+		Lock lock(_mutex);
+		
+		if(!oldest->_idle || oldest->_refs != 0)
+			return true;
+		
+		_lru.erase(oldest->_lru_pos);
+		
+		oldest->_idle = false;
+		
+		shard.map.erase(found);
+	}
+	
+	
+	const size_t size = oldest->cacheSize();
+	
+	delete oldest;
+	
+	Lock lock(_mutex);
+	
+	_caches--;
+	_bytes -= size;
+	_evictions++;
+	
+	return true;
+}
+
+
+void
+VRimg_CachePool::trimPool(const VRimg_ChannelCache *keep)
+{
+	// drop least recently used caches until we're under both limits,
+	// but never one that's being used right now
+	while( overLimits() )
+	{
+		if( !evictOldest(keep) )
+			break;
+	}
+}
@@ -29,7 +29,10 @@
 
 #include "fnord_SuiteHandler.h"
 
+#include <IlmThreadMutex.h>
+
 #include <list>
+
 #include <time.h>
 
 
@@ -47,14 +50,25 @@ class CancelExc : public std::exception
 };
 
 
+class VRimg_CachePool;
+
 class VRimg_ChannelCache
 {
   public:
 	VRimg_ChannelCache(const SPBasicSuite *pica_basicP, const AEIO_InterruptFuncs *inter,
-							VRimg::InputFile &in, const IStreamPlatform &stream);
+							VRimg::InputFile &in, const IStreamPlatform &stream, bool compact = false,
+							VRimg_CachePool *pool = NULL);
 	~VRimg_ChannelCache();
 	
-	void copyLayerToBuffer(const std::string &name, void *buf, size_t rowbytes);
+	// layers are read from the file the first time they're asked for,
+	// more than one thread can be copying out of the same cache
+	void copyLayerToBuffer(VRimg::InputFile &in, const std::string &name, void *buf, size_t rowbytes);
+	void copyLayerToBuffer(VRimg::InputFile &in, const std::string &name, void *buf, size_t rowbytes,
+							const IMATH_NAMESPACE::Box2i &region, int subsample);
+	
+	// only the first channels of each pixel, colbytes apart in buf, for interleaving layers
+	void copyLayerToBuffer(VRimg::InputFile &in, const std::string &name, void *buf, size_t colbytes, size_t rowbytes,
+							const IMATH_NAMESPACE::Box2i &region, int subsample, int channels);
 	
 	const PathString & getPath() const { return _path; }
 	DateTime getModTime() const { return _modtime; }
@@ -62,26 +76,53 @@ class VRimg_ChannelCache
 	double cacheAge() const;
 	bool cacheIsStale(int timeout) const;
 	
+	size_t cacheSize() const; // bytes
+	
+	typedef enum {
+		STORE_FULL = 0,	// float or int, just like the file
+		STORE_HALF,		// float layers as half
+		STORE_SPARSE	// runs of zeros squeezed out, row by row
+	} Storage;
+	
   private:
 	AEGP_SuiteHandler suites;
 	
 	int _width;
 	int _height;
 	
+	bool _compact;
+	
+	VRimg_CachePool *_pool;
+	size_t _size;
+	
+	// guards the layers while they're being filled
+	mutable IlmThread::Mutex _mutex;
+	
 	typedef struct ChannelCache {
 		VRimg::PixelType	pix_type;
 		int					dimensions;
+		Storage				storage;
 		AEIO_Handle			bufH;
+		size_t				size;
 		
-		ChannelCache(VRimg::PixelType t=VRimg::FLOAT, int d=1, AEIO_Handle b=NULL) : pix_type(t), dimensions(d), bufH(b) {}
+		ChannelCache(VRimg::PixelType t=VRimg::FLOAT, int d=1, AEIO_Handle b=NULL) : pix_type(t), dimensions(d), storage(STORE_FULL), bufH(b), size(0) {}
 	} ChannelCache;
 	
 	typedef std::map<std::string, ChannelCache> ChannelMap;
 	ChannelMap _cache;
 	
+	void fillLayer(VRimg::InputFile &in, const std::string &name, ChannelCache &cache);
+	void compactLayer(ChannelCache &cache);
+	
 	PathString _path;
 	DateTime _modtime;
-
+	
+	// the pool looks after these, under its shard lock
+	friend class VRimg_CachePool;
+	
+	int _refs;
+	bool _idle; // in the pool's LRU list, only while nobody holds it
+	std::list<VRimg_ChannelCache *>::iterator _lru_pos;
 	time_t _last_access;
 	void updateCacheTime();
 };
@@ -95,16 +136,95 @@ class VRimg_CachePool
 	
 	void configurePool(int max_caches, const SPBasicSuite *pica_basicP=NULL);
 	
-	VRimg_ChannelCache *findCache(const IStreamPlatform &stream) const;
+	// total memory all the caches can use
+	void setMaxBytes(size_t max_bytes);
+	
+	// new caches store layers as half or squeezed
+	void setCompact(bool compact) { _compact = compact; }
+	
+	// the cache you get back is yours until you hand it to releaseCache()
+	VRimg_ChannelCache *findCache(const IStreamPlatform &stream);
 	
 	VRimg_ChannelCache *addCache(VRimg::InputFile &in, const IStreamPlatform &stream, const AEIO_InterruptFuncs *inter);
 	
+	void releaseCache(VRimg_ChannelCache *cache);
+	
 	void deleteStaleCaches(int timeout);
 	
+	// caches call this when they fill or compact a layer
+	void cacheResized(const VRimg_ChannelCache *cache, size_t old_size, size_t new_size);
+	
+	typedef struct Stats {
+		unsigned long	hits;
+		unsigned long	misses;
+		unsigned long	evictions;
+		size_t			bytes;
+		int				caches;
+	} Stats;
+	
+	Stats getStats() const;
+	
   private:
+	typedef struct CacheKey {
+		PathString	path;
+		DateTime	modtime;
+		
+		CacheKey(const PathString &p, const DateTime &m) : path(p), modtime(m) {}
+		bool operator < (const CacheKey &other) const;
+	} CacheKey;
+	
+	typedef std::map<CacheKey, VRimg_ChannelCache *> CacheMap;
+	
+	// caches are spread over a few maps by file name so
+	// threads reading different files don't wait on each other
+	#define CACHE_POOL_SHARDS	8
+	
+	typedef struct Shard {
+		IlmThread::Mutex	mutex;
+		CacheMap			map;
+	} Shard;
+	
+	Shard _shards[CACHE_POOL_SHARDS];
+	
+	Shard & shardFor(const PathString &path);
+	
+	// guards everything below, never held while taking a shard lock
+	mutable IlmThread::Mutex _mutex;
+	
 	int _max_caches;
+	size_t _max_bytes;
+	bool _compact;
 	const SPBasicSuite *_pica_basicP;
-	std::list<VRimg_ChannelCache *> _pool;
+	
+	int _caches;
+	size_t _bytes;
+	
+	// caches nobody is holding, most recently used at the front,
+	// so the one to evict is always at the back
+	typedef std::list<VRimg_ChannelCache *> CacheList;
+	CacheList _lru;
+	
+	unsigned long _hits;
+	unsigned long _misses;
+	unsigned long _evictions;
+	
+	void touchCache(VRimg_ChannelCache *cache); // with the shard locked
+	bool overLimits() const;
+	bool evictOldest(const VRimg_ChannelCache *keep, int timeout = -1);
+	void trimPool(const VRimg_ChannelCache *keep);
+};
+
+
+// hands the cache back to the pool when it goes out of scope
+class VRimg_CacheRef
+{
+  public:
+	VRimg_CacheRef(VRimg_CachePool &pool, VRimg_ChannelCache *cache) : _pool(pool), _cache(cache) {}
+	~VRimg_CacheRef() { if(_cache) _pool.releaseCache(_cache); }
+	
+  private:
+	VRimg_CachePool &_pool;
+	VRimg_ChannelCache *_cache;
 };
 
 
@@ -578,8 +578,8 @@ VRimg_FrameSeq_DrawSparseFrame(
 	PF_EffectWorld					*wP,
 	AEIO_DrawingFlags				*draw_flagsP)
 { 
-	// we'll give a file-size buffer for filling and then fit it
-	// to what AE wants
+	// we'll give a buffer for filling at AE's resolution when we can,
+	// otherwise file-size, and then fit it to what AE wants
 	
 	A_Err err						=	A_Err_NONE;
 
@@ -671,8 +671,37 @@ VRimg_FrameSeq_DrawSparseFrame(
 								(pixel_format == PF_PixelFormat_ARGB64) ? 16 : 8;
 		
 
+		// at partial resolution, let the reader skip pixels instead of
+		// decoding the whole frame only to have AE scale it down
+		int subsample = 1;
+		
+		if(sparse_framePPB &&
+			sparse_framePPB->rs.x.num == 1 && sparse_framePPB->rs.y.num == 1 &&
+			sparse_framePPB->rs.x.den == sparse_framePPB->rs.y.den &&
+			sparse_framePPB->rs.x.den > 1)
+		{
+			subsample = sparse_framePPB->rs.x.den;
+		}
+		
+		A_long	draw_width = (info.width + subsample - 1) / subsample,
+				draw_height = (info.height + subsample - 1) / subsample;
+		
+		if(draw_width != wP->width || draw_height != wP->height)
+		{
+			// not what we expected, so draw full size and let AE scale
+			subsample = 1;
+			
+			draw_width = info.width;
+			draw_height = info.height;
+		}
+		
+		// required region is in the coordinates of the world AE gave us
+		const PF_LRect *region0 = ( (sparse_framePPB && draw_width == wP->width && draw_height == wP->height) ?
+										sparse_framePPB->required_region0 : NULL);
+		
+
 		// here's the only time we won't need to make our own buffer
-		if(	(info.width == wP->width) && (info.height == wP->height) && (wP_depth == 32) )
+		if(	(draw_width == wP->width) && (draw_height == wP->height) && (wP_depth == 32) )
 		{
 			active_World = wP; // just use the PF_EffectWorld AE gave us
 			
@@ -681,16 +710,17 @@ VRimg_FrameSeq_DrawSparseFrame(
 		else
 		{
 			// make our own PF_EffectWorld
-			suites.PFWorldSuite()->PF_NewWorld(NULL, info.width, info.height, FALSE,
+			suites.PFWorldSuite()->PF_NewWorld(NULL, draw_width, draw_height, (region0 != NULL),
 													PF_PixelFormat_ARGB128, temp_World);
 			
 			active_World = temp_World;
 		}
 
 
-		// should always pass a full-sized float world to write into (using options we pass)
+		// pass a float world to write into (using options we pass)
 		err = VRimg_DrawSparseFrame(basic_dataP, sparse_framePPB, active_World,
-										draw_flagsP, file_nameZ, &info, options);
+										draw_flagsP, file_nameZ, &info, options,
+										region0, subsample);
 
 		
 
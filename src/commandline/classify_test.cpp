@@ -0,0 +1,259 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// classify_test - ClassifyRow, which finds and replaces NaN and inf for
+// NaNny, against ClassifyPixel going one pixel at a time
+//
+// Every special bit pattern goes through in every channel, so -inf has to
+// stay apart from inf and a NaN with the sign bit set is still a NaN, then
+// rows of random widths full of random bits with random options, both
+// into a separate row and in place.
+
+
+#include "ProEXR_Kernels.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+using namespace std;
+
+
+#define MAX_WIDTH	41
+#define ROUNDS		2000
+
+static int gFailures = 0;
+
+static void
+Failed(const char *msg, const char *file, int line)
+{
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg, file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+static unsigned int gSeed = 1;
+
+static unsigned int
+Random(unsigned int n)
+{
+	gSeed = (gSeed * 1103515245) + 12345;
+	
+	return ((gSeed >> 16) % n);
+}
+
+
+typedef struct {
+	unsigned int	bits;
+	int				pixel_class; // CLASS_NUM for an ordinary number
+} Special;
+
+static const Special gSpecials[] = {
+	{ 0x00000000, CLASS_NUM }, // 0
+	{ 0x80000000, CLASS_NUM }, // -0
+	{ 0x3f800000, CLASS_NUM }, // 1
+	{ 0xbf800000, CLASS_NUM }, // -1
+	{ 0x00000001, CLASS_NUM }, // smallest denormal
+	{ 0x80000001, CLASS_NUM },
+	{ 0x7f7fffff, CLASS_NUM }, // FLT_MAX
+	{ 0xff7fffff, CLASS_NUM }, // -FLT_MAX
+	{ 0x7f800000, CLASS_INF },
+	{ 0xff800000, CLASS_NIN },
+	{ 0x7fc00000, CLASS_NAN }, // quiet NaN
+	{ 0x7f800001, CLASS_NAN }, // signaling NaN
+	{ 0x7fffffff, CLASS_NAN },
+	{ 0xffc00000, CLASS_NAN }, // what 0/0 gives on x86
+	{ 0xff800001, CLASS_NAN },
+	{ 0xffffffff, CLASS_NAN }
+};
+
+#define NUM_SPECIALS	(sizeof(gSpecials) / sizeof(gSpecials[0]))
+
+
+static float
+FromBits(unsigned int bits)
+{
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	
+	return f;
+}
+
+static unsigned int
+RandomBits()
+{
+	// a special pattern or any bits at all
+	if(Random(3) == 0)
+		return gSpecials[ Random(NUM_SPECIALS) ].bits;
+	else
+		return (Random(0x10000) << 16) | Random(0x10000);
+}
+
+static ClassifyOptions
+RandomOptions()
+{
+	ClassifyOptions options;
+	
+	options.diagnostic = (Random(4) == 0);
+	
+	for(int n=0; n < CLASS_NUM; n++)
+	{
+		options.replace[n] = (Random(2) == 0);
+		options.value[n] = FromBits( RandomBits() );
+	}
+	
+	return options;
+}
+
+
+// ClassifyPixel for every pixel, what ClassifyRow does without SSE
+static void
+PlainClassifyRow(const float *in, float *out, int width, const ClassifyOptions &options, ClassifyReport &report)
+{
+	for(int x=0; x < width; x++)
+		ClassifyPixel(in + (x * 4), out + (x * 4), x, options, report);
+}
+
+static bool
+SameReport(const ClassifyReport &a, const ClassifyReport &b)
+{
+	return !memcmp(&a, &b, sizeof(ClassifyReport));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	// each special pattern alone in each channel, the others ordinary
+	for(int s=0; s < (int)NUM_SPECIALS; s++)
+	{
+		for(int c=0; c < 4; c++)
+		{
+			ClassifyOptions options;
+			
+			options.diagnostic = false;
+			
+			for(int n=0; n < CLASS_NUM; n++)
+			{
+				options.replace[n] = true;
+				options.value[n] = (float)(n + 2);
+			}
+			
+			float in[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+			
+			in[c] = FromBits(gSpecials[s].bits);
+			
+			float got[4], expected[4];
+			
+			ClassifyReport got_report, expected_report;
+			
+			ClearClassifyReport(got_report);
+			ClearClassifyReport(expected_report);
+			
+			ClassifyRow(in, got, 1, options, got_report);
+			PlainClassifyRow(in, expected, 1, options, expected_report);
+			
+			CHECK(!memcmp(got, expected, sizeof(got)), "special pixel matches ClassifyPixel");
+			CHECK(SameReport(got_report, expected_report), "special report matches ClassifyPixel");
+			
+			const int pixel_class = gSpecials[s].pixel_class;
+			
+			// alpha is never looked at
+			const bool bad = (c > 0 && pixel_class != CLASS_NUM);
+			
+			CHECK(got_report.bad_pixels == (bad ? 1 : 0), "bad pixel counted");
+			
+			for(int n=0; n < CLASS_NUM; n++)
+			{
+				for(int i=0; i < 4; i++)
+				{
+					CHECK(got_report.count[n][i] == (bad && n == pixel_class && i == c ? 1 : 0), "counted in the right class and channel");
+				}
+			}
+			
+			float expected_out[4] = { in[0], in[1], in[2], in[3] };
+			
+			if(bad)
+				expected_out[c] = options.value[pixel_class];
+			
+			CHECK(!memcmp(got, expected_out, sizeof(got)), "replaced with its class's value");
+		}
+	}
+	
+	
+	// random rows, random options
+	for(int r=0; r < ROUNDS; r++)
+	{
+		const int width = Random(MAX_WIDTH + 1);
+		
+		const ClassifyOptions options = RandomOptions();
+		
+		vector<float> in(width * 4 + 1);
+		
+		for(size_t i=0; i < in.size(); i++)
+			in[i] = FromBits( RandomBits() );
+		
+		vector<float> got(in.size(), 0.f);
+		vector<float> expected(in.size(), 0.f);
+		
+		ClassifyReport got_report, expected_report;
+		
+		ClearClassifyReport(got_report);
+		ClearClassifyReport(expected_report);
+		
+		ClassifyRow(&in[0], &got[0], width, options, got_report);
+		PlainClassifyRow(&in[0], &expected[0], width, options, expected_report);
+		
+		// compared as bits, NaNs don't equal themselves
+		CHECK(!memcmp(&got[0], &expected[0], got.size() * sizeof(float)), "row matches ClassifyPixel, and nothing past it was touched");
+		CHECK(SameReport(got_report, expected_report), "row report matches ClassifyPixel");
+		
+		// in place, the way AE can hand it to us
+		vector<float> in_place(in);
+		
+		ClassifyReport in_place_report;
+		
+		ClearClassifyReport(in_place_report);
+		
+		ClassifyRow(&in_place[0], &in_place[0], width, options, in_place_report);
+		
+		CHECK(!memcmp(&in_place[0], &expected[0], width * 4 * sizeof(float)), "in place row matches");
+		CHECK(SameReport(in_place_report, expected_report), "in place report matches");
+	}
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("classify_test passed\n");
+	
+	return 0;
+}
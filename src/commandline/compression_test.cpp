@@ -0,0 +1,245 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// compression_test - ProEXRcompressionTrial, which auto compression uses
+// to pick a codec for each part, against files OpenEXR writes itself
+//
+// The packed strip has to be the scanlines an uncompressed file holds,
+// every trial has to come to the size the blocks take in a real file,
+// decoding always has to cost something, raw blocks included, and on
+// an image that compresses well zip has to score better than none.
+
+
+#include "ProEXRdoc.h"
+
+#include <ImfStdIO.h>
+#include <ImfInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfCompression.h>
+#include <ImfCompressor.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+
+using namespace Imf;
+using namespace Imath;
+using namespace std;
+
+
+#define WIDTH		1000
+#define HEIGHT		64
+#define TOP			10 // data window doesn't start at 0, like a strip out of a frame
+#define DECODE_RUNS	3
+
+static int gFailures = 0;
+
+static void
+Failed(const string &msg, const char *file, int line)
+{
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg.c_str(), file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+// smooth ramps with a little noise, so it compresses some but not all the way
+class TestImage
+{
+  public:
+	TestImage();
+	~TestImage() {}
+	
+	const Header & header() const { return _header; }
+	const FrameBuffer & frameBuffer() const { return _frameBuffer; }
+	
+  private:
+	Header _header;
+	FrameBuffer _frameBuffer;
+	
+	vector<half> _a;
+	vector<float> _b;
+	vector<unsigned int> _z;
+};
+
+
+TestImage::TestImage() :
+	_header(WIDTH, HEIGHT),
+	_a(WIDTH * HEIGHT),
+	_b(WIDTH * HEIGHT),
+	_z(WIDTH * HEIGHT)
+{
+	_header.dataWindow() = Box2i(V2i(0, TOP), V2i(WIDTH - 1, TOP + HEIGHT - 1));
+	
+	_header.channels().insert("A", Channel(HALF));
+	_header.channels().insert("B", Channel(FLOAT));
+	_header.channels().insert("Z", Channel(UINT));
+	
+	unsigned int seed = 1;
+	
+	for(int y=0; y < HEIGHT; y++)
+	{
+		for(int x=0; x < WIDTH; x++)
+		{
+			seed = (seed * 1103515245) + 12345;
+			
+			const int i = (y * WIDTH) + x;
+			
+			_a[i] = (float)x / (float)WIDTH;
+			_b[i] = sin((float)x / 50.f) * cos((float)y / 20.f) + ((float)((seed >> 16) & 0xff) / 100000.f);
+			_z[i] = (x / 8) + y;
+		}
+	}
+	
+	// origin so that base + y * yStride lands on our first row at TOP
+	_frameBuffer.insert("A", Slice(HALF, (char *)&_a[0] - (TOP * WIDTH * sizeof(half)), sizeof(half), WIDTH * sizeof(half)) );
+	_frameBuffer.insert("B", Slice(FLOAT, (char *)&_b[0] - (TOP * WIDTH * sizeof(float)), sizeof(float), WIDTH * sizeof(float)) );
+	_frameBuffer.insert("Z", Slice(UINT, (char *)&_z[0] - (TOP * WIDTH * sizeof(unsigned int)), sizeof(unsigned int), WIDTH * sizeof(unsigned int)) );
+}
+
+
+static string
+WriteFile(const TestImage &image, Compression compression)
+{
+	Header head = image.header();
+	
+	head.compression() = compression;
+	
+	StdOSStream stream;
+	
+	if(true) // making a scope for the file
+	{
+		OutputFile file(stream, head);
+		
+		file.setFrameBuffer( image.frameBuffer() );
+		file.writePixels(HEIGHT);
+	}
+	
+	return stream.str();
+}
+
+
+// the blocks as OpenEXR stored them, one after another
+static vector<char>
+FileBlocks(const string &file_data)
+{
+	StdISStream stream;
+	stream.str(file_data);
+	
+	InputFile file(stream);
+	
+	const Header &head = file.header();
+	const Box2i &dw = head.dataWindow();
+	
+	size_t line_size = 0;
+	
+	for(ChannelList::ConstIterator i = head.channels().begin(); i != head.channels().end(); ++i)
+		line_size += WIDTH * pixelTypeSize(i.channel().type);
+	
+	Compressor *compressor = newCompressor(head.compression(), line_size, head);
+	
+	const int block_lines = (compressor ? compressor->numScanLines() : 1);
+	
+	delete compressor;
+	
+	vector<char> blocks;
+	
+	for(int y = dw.min.y; y <= dw.max.y; y += block_lines)
+	{
+		const char *data = NULL;
+		int size = 0;
+		
+		file.rawPixelData(y, data, size);
+		
+		blocks.insert(blocks.end(), data, data + size);
+	}
+	
+	return blocks;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	TestImage image;
+	
+	vector<char> strip;
+	size_t line_size = 0;
+	
+	ProEXRcompressionTrial::packStrip(image.header(), image.frameBuffer(), strip, line_size);
+	
+	CHECK(line_size == WIDTH * (sizeof(half) + sizeof(float) + sizeof(unsigned int)), "line size counts every channel");
+	CHECK(FileBlocks( WriteFile(image, NO_COMPRESSION) ) == strip, "packed strip is what an uncompressed file holds");
+	
+	
+	static const Compression compressions[] = { NO_COMPRESSION, RLE_COMPRESSION, ZIPS_COMPRESSION, ZIP_COMPRESSION, PIZ_COMPRESSION,
+												PXR24_COMPRESSION, B44_COMPRESSION, B44A_COMPRESSION, DWAA_COMPRESSION, DWAB_COMPRESSION };
+	
+	static const char * names[] = { "none", "rle", "zips", "zip", "piz", "pxr24", "b44", "b44a", "dwaa", "dwab" };
+	
+	const int num_compressions = sizeof(compressions) / sizeof(compressions[0]);
+	
+	double none_score = 0.0;
+	double zip_score = 0.0;
+	
+	for(int c=0; c < num_compressions; c++)
+	{
+		const string name = names[c];
+		
+		ProEXRcompressionTrial trial(image.header(), strip, line_size, compressions[c]);
+		
+		trial.compress();
+		trial.timeDecode(DECODE_RUNS);
+		
+		CHECK(trial.ok(), name + " trial worked");
+		CHECK(trial.size() == FileBlocks( WriteFile(image, compressions[c]) ).size(), name + " trial size is what the file's blocks take");
+		CHECK(trial.seconds() > 0.0, name + " decoding takes some time");
+		
+		if(compressions[c] == NO_COMPRESSION)
+			none_score = trial.score(0.25f);
+		else if(compressions[c] == ZIP_COMPRESSION)
+			zip_score = trial.score(0.25f);
+		
+		printf("%-6s %8lu bytes  %8.1f us\n", names[c], (unsigned long)trial.size(), trial.seconds() * 1000000.0);
+	}
+	
+	CHECK(zip_score < none_score, "zip beats none on an image that compresses");
+	
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("compression_test passed\n");
+	
+	return 0;
+}
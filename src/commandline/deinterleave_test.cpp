@@ -0,0 +1,165 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// deinterleave_test - DeinterleaveRow, which splits AE's ARGB float rows
+// into EXR channels, against a plain pixel-by-pixel copy
+//
+// Rows of every width up to a few SSE blocks past the end, full of
+// random bit patterns so NaNs, infinities and denormals go through too,
+// and nothing may be written past the end of a channel's row.
+
+
+#include "ProEXR_Kernels.h"
+
+#include <half.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+using namespace std;
+
+
+#define MAX_WIDTH	41
+#define ROUNDS		2000
+#define GUARD		0xa5
+
+static int gFailures = 0;
+
+static void
+Failed(const char *msg, const char *file, int line)
+{
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg, file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+static unsigned int gSeed = 1;
+
+static unsigned int
+Random(unsigned int n)
+{
+	gSeed = (gSeed * 1103515245) + 12345;
+	
+	return ((gSeed >> 16) % n);
+}
+
+static float
+RandomFloat()
+{
+	// mostly ordinary pixel values, sometimes any bits at all
+	if(Random(4) == 0)
+	{
+		const unsigned int bits = (Random(0x10000) << 16) | Random(0x10000);
+		
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		
+		return f;
+	}
+	else
+		return ((float)Random(100000) / 25000.f) - 1.f;
+}
+
+
+// what DeinterleaveRow should do, one pixel at a time
+static void
+PlainDeinterleaveRow(const float *in, int width, int num_dests, const int *channel, const Imf::PixelType *type, void * const *out_row)
+{
+	for(int x=0; x < width; x++)
+	{
+		for(int i=0; i < num_dests; i++)
+		{
+			const float val = in[(x * 4) + channel[i]];
+			
+			if(type[i] == Imf::HALF)
+				((half *)out_row[i])[x] = val;
+			else
+				((float *)out_row[i])[x] = val;
+		}
+	}
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	for(int r=0; r < ROUNDS; r++)
+	{
+		const int width = Random(MAX_WIDTH + 1);
+		const int num_dests = 1 + Random(MAX_DEINTERLEAVE_DESTS);
+		
+		vector<float> in(width * 4 + 1);
+		
+		for(size_t i=0; i < in.size(); i++)
+			in[i] = RandomFloat();
+		
+		int channel[MAX_DEINTERLEAVE_DESTS];
+		Imf::PixelType type[MAX_DEINTERLEAVE_DESTS];
+		
+		vector<char> got[MAX_DEINTERLEAVE_DESTS];
+		vector<char> expected[MAX_DEINTERLEAVE_DESTS];
+		
+		void *got_row[MAX_DEINTERLEAVE_DESTS];
+		void *expected_row[MAX_DEINTERLEAVE_DESTS];
+		
+		for(int i=0; i < num_dests; i++)
+		{
+			channel[i] = Random(4);
+			type[i] = (Random(2) ? Imf::HALF : Imf::FLOAT);
+			
+			const size_t rowbytes = width * (type[i] == Imf::HALF ? sizeof(half) : sizeof(float));
+			
+			// a few extra bytes on the end to catch writing too far
+			got[i].assign(rowbytes + 16, (char)GUARD);
+			expected[i].assign(rowbytes + 16, (char)GUARD);
+			
+			got_row[i] = &got[i][0];
+			expected_row[i] = &expected[i][0];
+		}
+		
+		DeinterleaveRow(&in[0], width, num_dests, channel, type, got_row);
+		PlainDeinterleaveRow(&in[0], width, num_dests, channel, type, expected_row);
+		
+		for(int i=0; i < num_dests; i++)
+		{
+			CHECK(got[i] == expected[i], "row matches the plain copy, and nothing past it was touched");
+		}
+	}
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("deinterleave_test passed\n");
+	
+	return 0;
+}
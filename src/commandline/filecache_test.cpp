@@ -0,0 +1,487 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// filecache_test - ProEXR_FileCache, the shared whole-file cache the AE
+// plug-in falls back on when it can't memory map a file
+//
+// Made-up host memory that knows which handles are locked, so an entry
+// freed while somebody is reading it, a lock that's never undone or a
+// failed load left behind all show up.  Some checks one step at a time,
+// then lots of threads opening, sharing and letting go of files with a
+// small byte bound, checking what they read and that the cache stays
+// near its bound the whole time.
+
+
+#include "ProEXR_FileCache.h"
+
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+#define KEYS			64
+#define SIZE_STEP		(4 * 1024)
+#define MAX_SIZE		(8 * SIZE_STEP)
+#define MAX_BYTES		(128 * 1024)
+
+#define THREADS			8
+#define ITERATIONS		5000
+
+// everything unused gets trimmed to MAX_BYTES, but each thread can hold one more
+#define HARD_BOUND		(MAX_BYTES + (THREADS * MAX_SIZE))
+
+static int gFailures = 0;
+static IlmThread::Mutex gFailuresMutex;
+
+static void
+Failed(const char *msg, const char *file, int line)
+{
+	IlmThread::Lock lock(gFailuresMutex);
+	
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg, file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+typedef struct TestHandle {
+	char *buf;
+	Imf::Int64 size;
+	int locks;
+} TestHandle;
+
+
+// malloc pretending to be the host, keeping track of everything
+class TestMemory : public ProEXR_FileCacheMemory
+{
+  public:
+	TestMemory() : _handles(0), _locked(0), _bytes(0), _peak_bytes(0) {}
+	virtual ~TestMemory() {}
+	
+	virtual void *newHandle(Imf::Int64 size);
+	virtual void *lockHandle(void *handle);
+	virtual void unlockHandle(void *handle);
+	virtual void freeHandle(void *handle);
+	
+	int handles() const { IlmThread::Lock lock(_mutex); return _handles; }
+	int locked() const { IlmThread::Lock lock(_mutex); return _locked; }
+	Imf::Int64 bytes() const { IlmThread::Lock lock(_mutex); return _bytes; }
+	Imf::Int64 peakBytes() const { IlmThread::Lock lock(_mutex); return _peak_bytes; }
+	
+  private:
+	mutable IlmThread::Mutex _mutex;
+	
+	int _handles;
+	int _locked; // handles locked at least once
+	Imf::Int64 _bytes;
+	Imf::Int64 _peak_bytes;
+};
+
+
+void *
+TestMemory::newHandle(Imf::Int64 size)
+{
+	TestHandle *handle = new TestHandle;
+	
+	handle->buf = (char *)calloc(size, 1);
+	handle->size = size;
+	handle->locks = 0;
+	
+	IlmThread::Lock lock(_mutex);
+	
+	_handles++;
+	_bytes += size;
+	
+	if(_bytes > _peak_bytes)
+		_peak_bytes = _bytes;
+	
+	return handle;
+}
+
+
+void *
+TestMemory::lockHandle(void *handle)
+{
+	TestHandle *h = (TestHandle *)handle;
+	
+	IlmThread::Lock lock(_mutex);
+	
+	if(h->locks++ == 0)
+		_locked++;
+	
+	return h->buf;
+}
+
+
+void
+TestMemory::unlockHandle(void *handle)
+{
+	TestHandle *h = (TestHandle *)handle;
+	
+	IlmThread::Lock lock(_mutex);
+	
+	CHECK(h->locks > 0, "unlocked a handle that wasn't locked");
+	
+	if(--h->locks == 0)
+		_locked--;
+}
+
+
+void
+TestMemory::freeHandle(void *handle)
+{
+	TestHandle *h = (TestHandle *)handle;
+	
+	IlmThread::Lock lock(_mutex);
+	
+	CHECK(h->locks == 0, "freed a handle somebody still had locked");
+	
+	_handles--;
+	_bytes -= h->size;
+	
+	free(h->buf);
+	delete h;
+}
+
+
+static string
+Key(int k)
+{
+	char key[32];
+	
+	sprintf(key, "file%02d", k);
+	
+	return key;
+}
+
+
+static Imf::Int64
+Size(int k)
+{
+	return ((k % 8) + 1) * SIZE_STEP;
+}
+
+
+// what the file would have in it
+static void
+Fill(void *buf, int k)
+{
+	unsigned char *p = (unsigned char *)buf;
+	
+	for(Imf::Int64 i=0; i < Size(k); i++)
+		p[i] = (unsigned char)((k * 31) + i);
+}
+
+
+static bool
+Matches(const void *buf, int k)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	
+	for(Imf::Int64 i=0; i < Size(k); i++)
+	{
+		if(p[i] != (unsigned char)((k * 31) + i))
+			return false;
+	}
+	
+	return true;
+}
+
+
+// load k the way IStreamPlatform does, NULL if the load "failed"
+static ProEXR_FileCacheEntry *
+OpenFile(ProEXR_FileCache &cache, TestMemory &memory, int k, void **buf, bool fail = false)
+{
+	ProEXR_FileCacheEntry *entry = cache.acquire(memory, Key(k), buf);
+	
+	if(entry == NULL)
+	{
+		entry = cache.create(memory, Key(k), Size(k), buf);
+		
+		if(entry)
+		{
+			if(fail)
+			{
+				cache.release(memory, entry);
+				
+				return NULL;
+			}
+			
+			Fill(*buf, k);
+			
+			cache.share(entry);
+		}
+	}
+	
+	return entry;
+}
+
+
+// one of AE's render threads, reading files that sometimes are
+// already cached and sometimes aren't
+class CacheThread : public IlmThread::Thread
+{
+  public:
+	CacheThread(ProEXR_FileCache &cache, TestMemory &memory, unsigned int seed);
+	virtual ~CacheThread();
+	
+	virtual void run();
+	
+  private:
+	ProEXR_FileCache &_cache;
+	TestMemory &_memory;
+	unsigned int _seed;
+	IlmThread::Semaphore _finished;
+	
+	int random(int n) { _seed = (_seed * 1103515245) + 12345; return ((_seed >> 16) % n); }
+};
+
+
+CacheThread::CacheThread(ProEXR_FileCache &cache, TestMemory &memory, unsigned int seed) :
+	_cache(cache),
+	_memory(memory),
+	_seed(seed),
+	_finished(0)
+{
+	start();
+}
+
+
+CacheThread::~CacheThread()
+{
+	// ~Thread joins too late, our members are gone by then
+	_finished.wait();
+}
+
+
+void
+CacheThread::run()
+{
+	for(int i=0; i < ITERATIONS; i++)
+	{
+		// a few files get most of the reads, like a comp would
+		const int k = (random(4) == 0 ? random(KEYS) : random(8));
+		
+		void *buf = NULL;
+		
+		ProEXR_FileCacheEntry *entry = OpenFile(_cache, _memory, k, &buf, random(10) == 0);
+		
+		if(entry)
+		{
+			CHECK(entry->key == Key(k) && entry->size == Size(k), "got the entry for the file asked for");
+			CHECK(Matches(buf, k), "file reads right");
+			
+			sched_yield();
+			
+			CHECK(Matches(buf, k), "file still reads right before letting go");
+			
+			_cache.release(_memory, entry);
+		}
+		
+		CHECK(_memory.bytes() <= HARD_BOUND, "cache stays near its bound");
+	}
+	
+	_finished.post();
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	if(true) // a load that failed leaves nothing behind
+	{
+		TestMemory memory;
+		ProEXR_FileCache cache(MAX_BYTES);
+		
+		void *buf = NULL;
+		
+		CHECK(OpenFile(cache, memory, 0, &buf, true) == NULL, "failed load gives nothing");
+		CHECK(memory.handles() == 0 && cache.entries() == 0 && cache.bytes() == 0, "failed load was freed");
+	}
+	
+	
+	if(true) // shared, found again, and gone after purge
+	{
+		TestMemory memory;
+		ProEXR_FileCache cache(MAX_BYTES);
+		
+		void *buf = NULL;
+		
+		ProEXR_FileCacheEntry *entry = OpenFile(cache, memory, 3, &buf);
+		
+		CHECK(entry != NULL, "loaded a file");
+		
+		cache.release(memory, entry);
+		
+		CHECK(cache.entries() == 1 && cache.bytes() == Size(3), "file stays cached");
+		CHECK(memory.locked() == 0, "nothing left locked");
+		
+		void *buf2 = NULL;
+		
+		ProEXR_FileCacheEntry *entry2 = cache.acquire(memory, Key(3), &buf2);
+		
+		CHECK(entry2 == entry && Matches(buf2, 3), "cached file found again");
+		
+		if(entry2)
+			cache.release(memory, entry2);
+		
+		CHECK(cache.acquire(memory, Key(4), &buf2) == NULL, "other file isn't there");
+		
+		cache.purge(memory, 3600);
+		
+		CHECK(cache.entries() == 1, "purge with a timeout keeps a file just used");
+		
+		cache.purge(memory);
+		
+		CHECK(memory.handles() == 0 && cache.entries() == 0 && cache.bytes() == 0, "purge freed everything");
+	}
+	
+	
+	if(true) // oldest unused files go first, files in use never do
+	{
+		TestMemory memory;
+		ProEXR_FileCache cache(MAX_BYTES);
+		
+		void *held_buf = NULL;
+		
+		ProEXR_FileCacheEntry *held = OpenFile(cache, memory, 7, &held_buf);
+		
+		for(int k=8; k < KEYS; k++)
+		{
+			void *buf = NULL;
+			
+			ProEXR_FileCacheEntry *entry = OpenFile(cache, memory, k, &buf);
+			
+			if(entry)
+				cache.release(memory, entry);
+			
+			CHECK(cache.bytes() <= MAX_BYTES + Size(7), "bound kept while loading");
+		}
+		
+		CHECK(held != NULL && Matches(held_buf, 7), "file in use wasn't freed");
+		
+		void *buf = NULL;
+		
+		CHECK(cache.acquire(memory, Key(8), &buf) == NULL, "oldest file was dropped");
+		
+		ProEXR_FileCacheEntry *newest = cache.acquire(memory, Key(KEYS - 1), &buf);
+		
+		CHECK(newest != NULL, "newest file was kept");
+		
+		if(newest)
+			cache.release(memory, newest);
+		
+		cache.purge(memory);
+		
+		CHECK(cache.entries() == 1, "purge left the file in use");
+		
+		if(held)
+			cache.release(memory, held);
+		
+		CHECK(cache.bytes() <= MAX_BYTES, "under the bound once everything is let go");
+		
+		cache.purge(memory);
+		
+		CHECK(memory.handles() == 0, "purge freed everything");
+	}
+	
+	
+	if(true) // the most recent file stays even if it's over the bound by itself
+	{
+		TestMemory memory;
+		ProEXR_FileCache cache(SIZE_STEP);
+		
+		void *buf = NULL;
+		
+		ProEXR_FileCacheEntry *entry = OpenFile(cache, memory, 5, &buf);
+		
+		if(entry)
+			cache.release(memory, entry);
+		
+		CHECK(cache.entries() == 1 && cache.bytes() == Size(5), "big file kept");
+		
+		entry = OpenFile(cache, memory, 6, &buf);
+		
+		if(entry)
+			cache.release(memory, entry);
+		
+		CHECK(cache.entries() == 1 && cache.bytes() == Size(6), "only the newest big file kept");
+		
+		cache.purge(memory);
+		
+		CHECK(memory.handles() == 0, "purge freed everything");
+	}
+	
+	
+	if( IlmThread::supportsThreads() ) // lots of threads sharing one cache
+	{
+		TestMemory memory;
+		ProEXR_FileCache cache(MAX_BYTES);
+		
+		vector<CacheThread *> threads;
+		
+		for(int t=0; t < THREADS; t++)
+			threads.push_back( new CacheThread(cache, memory, t + 1) );
+		
+		for(size_t t=0; t < threads.size(); t++)
+			delete threads[t];
+		
+		CHECK(memory.locked() == 0, "every reference was given back");
+		CHECK(cache.bytes() <= MAX_BYTES, "under the bound after the threads are done");
+		CHECK(memory.bytes() == cache.bytes(), "nothing allocated outside the cache");
+		
+		printf("%d threads, peak %ld KB, bound %ld KB\n", THREADS,
+				(long)(memory.peakBytes() / 1024), (long)(MAX_BYTES / 1024));
+		
+		cache.purge(memory);
+		
+		CHECK(memory.handles() == 0 && cache.entries() == 0 && cache.bytes() == 0, "purge freed everything");
+	}
+	else
+		printf("no threads, skipping the threaded part\n");
+	
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("filecache_test passed\n");
+	
+	return 0;
+}
@@ -0,0 +1,176 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// halfexact_test - HalfExact and HalfExactRow against a real trip through half,
+// for every one of the 2^32 float bit patterns
+//
+// HalfExactRow gets each pattern four ways: alone, so it takes the plain
+// loop, and in a row of four, once filling all the lanes and once in
+// one lane next to values that are exact, so the SSE test has to
+// decide about it.
+
+
+#include "ProEXR_Kernels.h"
+
+#include <half.h>
+
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+
+#define SLICES			16
+#define MAX_REPORTS		8
+
+static int gFailures = 0;
+static IlmThread::Mutex gFailuresMutex;
+
+static void
+Failed(unsigned int bits, const char *what, bool expected)
+{
+	IlmThread::Lock lock(gFailuresMutex);
+	
+	if(gFailures < MAX_REPORTS)
+		fprintf(stderr, "FAILED: %s said %s for 0x%08x\n", what, (expected ? "no" : "yes"), bits);
+	
+	gFailures++;
+}
+
+
+// the slow and sure way: make a half and see what comes back
+static bool
+ReferenceExact(unsigned int bits)
+{
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	
+	if(f != f)
+		return false; // NaN, HalfExact never lets these through
+	
+	const float back = half(f);
+	
+	unsigned int back_bits;
+	memcpy(&back_bits, &back, sizeof(back_bits));
+	
+	return (back_bits == bits);
+}
+
+
+class SliceThread : public IlmThread::Thread
+{
+  public:
+	SliceThread(unsigned int first, unsigned int count);
+	virtual ~SliceThread();
+	
+	virtual void run();
+	
+  private:
+	const unsigned int _first;
+	const unsigned int _count;
+	IlmThread::Semaphore _finished;
+};
+
+
+SliceThread::SliceThread(unsigned int first, unsigned int count) :
+	_first(first),
+	_count(count),
+	_finished(0)
+{
+	start();
+}
+
+
+SliceThread::~SliceThread()
+{
+	// ~Thread joins too late, our members are gone by then
+	_finished.wait();
+}
+
+
+void
+SliceThread::run()
+{
+	const unsigned int exact_bits = 0x3f800000; // 1.0
+	
+	unsigned int row[4];
+	
+	for(unsigned int i=0; i < _count; i++)
+	{
+		const unsigned int bits = _first + i;
+		
+		const bool expected = ReferenceExact(bits);
+		
+		if(HalfExact(bits) != expected)
+			Failed(bits, "HalfExact", expected);
+		
+		if(HalfExactRow(&bits, 1) != expected)
+			Failed(bits, "HalfExactRow alone", expected);
+		
+		row[0] = row[1] = row[2] = row[3] = bits;
+		
+		if(HalfExactRow(row, 4) != expected)
+			Failed(bits, "HalfExactRow in every lane", expected);
+		
+		row[0] = row[1] = row[2] = row[3] = exact_bits;
+		row[bits & 3] = bits;
+		
+		if(HalfExactRow(row, 4) != expected)
+			Failed(bits, "HalfExactRow in one lane", expected);
+	}
+	
+	_finished.post();
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	const unsigned int slice_size = (0xffffffffu / SLICES) + 1;
+	
+	if(true) // making a scope for the threads
+	{
+		SliceThread *threads[SLICES];
+		
+		for(int s=0; s < SLICES; s++)
+			threads[s] = new SliceThread(s * slice_size, slice_size);
+		
+		for(int s=0; s < SLICES; s++)
+			delete threads[s];
+	}
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("halfexact_test passed\n");
+	
+	return 0;
+}
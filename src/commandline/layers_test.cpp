@@ -0,0 +1,557 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// layers_test - ProEXRdoc_read::buildLayers, seperateAlphas and overflowChannels
+// on headers with 100, 1,000 and 10,000 channels
+//
+// Every doc is built twice, once by ProEXRdoc and once by the way it used
+// to be done (start over after every change, look layers up by name, sort
+// channels from the top after each swap), and both have to come out with
+// the same layers in the same order.  The times for each are printed.
+
+
+#include "ProEXRdoc.h"
+
+#include <ImfStdIO.h>
+#include <ImfOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+using namespace Imf;
+using namespace Imath;
+using namespace std;
+
+
+static int gFailures = 0;
+
+static void
+Failed(const string &msg, const char *file, int line)
+{
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg.c_str(), file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+static double
+Seconds()
+{
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	
+	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+}
+
+
+// a 1x1 file with a render's worth of passes, cut off at num_channels
+static string
+MakeFile(int num_channels)
+{
+	Header head(1, 1);
+	
+	head.compression() = NO_COMPRESSION;
+	
+	ChannelList &chans = head.channels();
+	
+	int n = 0;
+	
+	static const char * reserved[] = { "R", "G", "B", "A", "Y" };
+	
+	for(int i=0; i < 5 && n < num_channels; i++, n++)
+		chans.insert(reserved[i], Channel(HALF));
+	
+	for(int k=0; n < num_channels; k++)
+	{
+		char layer[32];
+		sprintf(layer, "pass%05d.", k);
+		
+		const string l(layer);
+		
+		vector<string> names;
+		
+		switch(k % 5)
+		{
+			case 0: // plain RGBA
+				names.push_back(l + "R");
+				names.push_back(l + "G");
+				names.push_back(l + "B");
+				names.push_back(l + "A");
+				break;
+			
+			case 1: // untagged with a tagged Y in it
+				names.push_back(l + "X");
+				names.push_back(l + "Y");
+				names.push_back(l + "Z");
+				break;
+			
+			case 2: // alpha and more than 3 others, overflows
+				names.push_back(l + "A");
+				names.push_back(l + "c0");
+				names.push_back(l + "c1");
+				names.push_back(l + "c2");
+				names.push_back(l + "c3");
+				names.push_back(l + "c4");
+				names.push_back(l + "c5");
+				break;
+			
+			case 3: // single channels, one of them UINT
+			{
+				char single[32];
+				sprintf(single, "aux%05d", k);
+				
+				names.push_back(single);
+				
+				sprintf(single, "obj%05d.id", k);
+				
+				chans.insert(single, Channel(UINT));
+				n++;
+				break;
+			}
+			
+			case 4: // tagged and untagged mixed, overflows
+				names.push_back(l + "R");
+				names.push_back(l + "G");
+				names.push_back(l + "B");
+				names.push_back(l + "alpha");
+				names.push_back(l + "u");
+				names.push_back(l + "v");
+				break;
+		}
+		
+		for(vector<string>::const_iterator i = names.begin(); i != names.end() && n < num_channels; ++i, n++)
+			chans.insert(i->c_str(), Channel(HALF));
+	}
+	
+	StdOSStream stream;
+	
+	if(true) // making a scope for the file
+	{
+		OutputFile file(stream, head);
+		
+		file.setFrameBuffer( FrameBuffer() ); // channels get zeros
+		file.writePixels(1);
+	}
+	
+	return stream.str();
+}
+
+
+class LayerDoc : public ProEXRdoc_read
+{
+  public:
+	LayerDoc(IStream &is) : ProEXRdoc_read(is, false, false, false) { initChannels<ProEXRchannel_read>(); }
+	
+	void build(bool split_alpha) { buildLayers<ProEXRlayer_read>(split_alpha); }
+	void split() { seperateAlphas<ProEXRlayer_read>(); }
+	void overflow() { overflowChannels<ProEXRlayer_read>(); }
+	
+	// the way they used to be done
+	void oldGroup();
+	void oldSplit();
+	void oldOverflow();
+	void oldBuild(bool split_alpha);
+	
+  private:
+	static void oldAddChannel(ProEXRlayer *layer, ProEXRchannel *chan);
+};
+
+
+void
+LayerDoc::oldAddChannel(ProEXRlayer *layer, ProEXRchannel *chan)
+{
+	if(chan == NULL)
+		return;
+	
+	layer->addChannel(chan, false);
+	
+	vector<ProEXRchannel *> &chans = layer->channels();
+
+	for(int i=0; i < (int)chans.size() - 1; i++)
+	{
+		if( (
+			(chans[i]->channelTag() == CHAN_GENERAL || chans[i+1]->channelTag() == CHAN_GENERAL) && // untagged case
+			(chans[i]->channelName() > chans[i+1]->channelName() )
+			)
+			||
+			(
+			(chans[i]->channelTag() != CHAN_GENERAL && chans[i+1]->channelTag() != CHAN_GENERAL) && // tagged case
+			(chans[i]->channelTag() > chans[i+1]->channelTag() )
+			)
+		)
+		{
+			ProEXRchannel *temp = chans[i];
+			
+			chans[i] = chans[i+1];
+			chans[i+1] = temp;
+			
+			i = -1; // start over
+		}
+	}
+}
+
+
+void
+LayerDoc::oldGroup()
+{
+	bool have_R = false;
+	bool have_G = false;
+	bool have_B = false;
+	bool have_A = false;
+	bool have_Y = false;
+	bool have_RY = false;
+	bool have_BY = false;
+	bool have_AR = false;
+	bool have_AG = false;
+	bool have_AB = false;
+	
+	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		ProEXRchannel *chan = *i;
+		
+		if(chan->channelType() == CHANNEL_RESERVED)
+		{
+			if( chan->name() == "R" ) have_R = true;
+			else if ( chan->name() == "G" ) have_G = true;
+			else if ( chan->name() == "B" ) have_B = true;
+			else if ( chan->name() == "A" ) have_A = true;
+			else if ( chan->name() == "Y" ) have_Y = true;
+			else if ( chan->name() == "RY" ) have_RY = true;
+			else if ( chan->name() == "BY" ) have_BY = true;
+			else if ( chan->name() == "AR" ) have_AR = true;
+			else if ( chan->name() == "AG" ) have_AG = true;
+			else if ( chan->name() == "AB" ) have_AB = true;
+		}
+		else
+		{
+			ProEXRlayer *layer = findLayer( chan->layerName() );
+			
+			if(layer && chan->pixelType() != Imf::UINT)
+			{
+				oldAddChannel(layer, chan);
+			}
+			else
+			{
+				ProEXRlayer_read *l = NULL;
+				
+				if(chan->pixelType() == Imf::UINT)
+					l = new ProEXRlayer_read(chan->name());
+				else
+					l = new ProEXRlayer_read;
+				
+				oldAddChannel(l, chan);
+				
+				l->assignDoc(this);
+				
+				layers().push_back(l);
+			}
+		}
+	}
+	
+	if(have_AR || have_AG || have_AB)
+	{
+		ProEXRlayer_read *l = new ProEXRlayer_read;
+		
+		oldAddChannel(l, findChannel("AR") );
+		oldAddChannel(l, findChannel("AG") );
+		oldAddChannel(l, findChannel("AB") );
+		
+		l->assignDoc(this);
+		
+		layers().push_back(l);
+	}
+	
+	if(have_Y || have_RY || have_BY)
+	{
+		ProEXRlayer_read *l = new ProEXRlayer_read;
+		
+		oldAddChannel(l, findChannel("Y") );
+		oldAddChannel(l, findChannel("RY") );
+		oldAddChannel(l, findChannel("BY") );
+		
+		if(have_A && !have_R && !have_G && !have_B)
+			oldAddChannel(l, findChannel("A") );
+		
+		l->assignDoc(this);
+		
+		if(have_Y && have_RY && have_BY)
+			l->setLoadAsLayer(true);
+		
+		layers().push_back(l);
+	}
+	
+	if(have_R || have_G || have_B || (have_A && !have_Y && !have_RY && !have_BY) )
+	{
+		ProEXRlayer_read *l = new ProEXRlayer_read;
+		
+		oldAddChannel(l, findChannel("R") );
+		oldAddChannel(l, findChannel("G") );
+		oldAddChannel(l, findChannel("B") );
+		oldAddChannel(l, findChannel("A") );
+		
+		l->assignDoc(this);
+		
+		layers().push_back(l);
+	}
+}
+
+
+void
+LayerDoc::oldSplit()
+{
+	bool start_over = true;
+	
+	while(start_over)
+	{
+		start_over = false;
+		
+		for(vector<ProEXRlayer *>::iterator i = layers().begin(); !start_over && i != layers().end(); ++i)
+		{
+			ProEXRlayer *layer = *i;
+		
+			if( layer->channels().size() > 1 )
+			{
+				for(vector<ProEXRchannel *>::iterator j = layer->channels().begin(); !start_over && j != layer->channels().end(); ++j)
+				{
+					ProEXRchannel *chan = *j;
+					
+					if(chan->channelTag() == CHAN_A)
+					{
+						layer->channels().erase(j);
+						
+						layer->assignAlpha(chan);
+						
+						ProEXRlayer_read *new_layer = new ProEXRlayer_read;
+						
+						new_layer->assignDoc(this);
+						
+						oldAddChannel(new_layer, chan);
+						
+						layers().insert(i, new_layer);
+						
+						start_over = true;
+						break;
+					}
+				}
+			}
+			
+			if(start_over)
+				break;
+		}
+	}
+}
+
+
+void
+LayerDoc::oldOverflow()
+{
+	bool start_over = true;
+	
+	while(start_over)
+	{
+		start_over = false;
+		
+		for(vector<ProEXRlayer *>::iterator i = layers().begin(); !start_over && i != layers().end(); ++i)
+		{
+			ProEXRlayer *layer = *i;
+		
+			if( layer->getNonAlphaChannels().size() > 3 )
+			{
+				for(vector<ProEXRchannel *>::iterator j = layer->channels().begin(); !start_over && j != layer->channels().end(); ++j)
+				{
+					ProEXRchannel *chan = *j;
+					
+					if(chan->channelTag() == CHAN_GENERAL)
+					{
+						layer->channels().erase(j);
+						
+						ProEXRlayer_read *new_layer = new ProEXRlayer_read;
+						
+						new_layer->assignDoc(this);
+						
+						oldAddChannel(new_layer, chan);
+						
+						layers().insert(i, new_layer);
+						
+						start_over = true;
+						break;
+					}
+				}
+			}
+			
+			if(start_over)
+				break;
+		}
+	}
+}
+
+
+void
+LayerDoc::oldBuild(bool split_alpha)
+{
+	oldGroup();
+	
+	oldOverflow();
+	
+	if(split_alpha)
+		oldSplit();
+}
+
+
+// layer names, their channels and alphas, one layer per line
+static string
+LayerOrder(const ProEXRdoc &doc)
+{
+	string order;
+	
+	for(vector<ProEXRlayer *>::const_iterator i = doc.layers().begin(); i != doc.layers().end(); ++i)
+	{
+		const ProEXRlayer *layer = *i;
+		
+		order += layer->name() + ":";
+		
+		for(vector<ProEXRchannel *>::const_iterator j = layer->channels().begin(); j != layer->channels().end(); ++j)
+			order += " " + (*j)->name();
+		
+		if( layer->alphaChannel() )
+			order += " alpha=" + layer->alphaChannel()->name();
+		
+		order += "\n";
+	}
+	
+	return order;
+}
+
+
+static int
+LayerChannels(const ProEXRdoc &doc)
+{
+	int count = 0;
+	
+	for(vector<ProEXRlayer *>::const_iterator i = doc.layers().begin(); i != doc.layers().end(); ++i)
+		count += (*i)->channels().size();
+	
+	return count;
+}
+
+
+static void
+TestChannels(int num_channels)
+{
+	char label[64];
+	sprintf(label, "%d channels", num_channels);
+	
+	const string file_data = MakeFile(num_channels);
+	
+	
+	// the whole thing, the way a reader sets up
+	for(int split_alpha = 0; split_alpha <= 1; split_alpha++)
+	{
+		StdISStream new_stream, old_stream;
+		new_stream.str(file_data);
+		old_stream.str(file_data);
+		
+		LayerDoc new_doc(new_stream), old_doc(old_stream);
+		
+		CHECK((int)new_doc.channels().size() == num_channels, string(label) + " made it into the doc");
+		
+		double t = Seconds();
+		new_doc.build(split_alpha);
+		const double build_time = Seconds() - t;
+		
+		t = Seconds();
+		old_doc.oldBuild(split_alpha);
+		const double old_build_time = Seconds() - t;
+		
+		CHECK(LayerOrder(new_doc) == LayerOrder(old_doc), string(label) + ", buildLayers order unchanged" + (split_alpha ? " with alphas split" : ""));
+		CHECK(LayerChannels(new_doc) == num_channels, string(label) + ", every channel in one layer");
+		
+		if(split_alpha)
+			printf("%6d channels  buildLayers      %9.3f ms  (was %9.3f ms)\n", num_channels, build_time * 1000.0, old_build_time * 1000.0);
+	}
+	
+	
+	// the two passes by themselves, on the same layers
+	StdISStream new_stream, old_stream;
+	new_stream.str(file_data);
+	old_stream.str(file_data);
+	
+	LayerDoc new_doc(new_stream), old_doc(old_stream);
+	
+	new_doc.oldGroup();
+	old_doc.oldGroup();
+	
+	double t = Seconds();
+	new_doc.overflow();
+	const double overflow_time = Seconds() - t;
+	
+	t = Seconds();
+	old_doc.oldOverflow();
+	const double old_overflow_time = Seconds() - t;
+	
+	CHECK(LayerOrder(new_doc) == LayerOrder(old_doc), string(label) + ", overflowChannels order unchanged");
+	
+	t = Seconds();
+	new_doc.split();
+	const double split_time = Seconds() - t;
+	
+	t = Seconds();
+	old_doc.oldSplit();
+	const double old_split_time = Seconds() - t;
+	
+	CHECK(LayerOrder(new_doc) == LayerOrder(old_doc), string(label) + ", seperateAlphas order unchanged");
+	CHECK(LayerChannels(new_doc) == num_channels, string(label) + ", every channel in one layer after the passes");
+	
+	printf("%6d channels  overflowChannels %9.3f ms  (was %9.3f ms)\n", num_channels, overflow_time * 1000.0, old_overflow_time * 1000.0);
+	printf("%6d channels  seperateAlphas   %9.3f ms  (was %9.3f ms)\n", num_channels, split_time * 1000.0, old_split_time * 1000.0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	TestChannels(100);
+	TestChannels(1000);
+	TestChannels(10000);
+	
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("layers_test passed\n");
+	
+	return 0;
+}
@@ -0,0 +1,585 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// prefetch_test - drives VRimg::Prefetcher over a little sequence of made-up
+// VRimg files, the way the AE plug-in does while playing or scrubbing
+//
+// Every frame read has to match what's on disk right now, whether it came
+// from the prefetcher or not, including a frame that gets rendered again
+// after it was prefetched, and with many threads reading and scrubbing
+// the same sequence at once.  A frame whose index table leaves out a
+// bucket has to read as if there were no table.
+
+
+#include "VRimgPrefetch.h"
+#include "VRimgVersion.h"
+
+#include <ImfStdIO.h>
+
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace VRimg;
+using namespace std;
+
+
+#define WIDTH		40
+#define HEIGHT		24
+#define BUCKET_SIZE	16
+#define FRAMES		12
+#define WINDOW		3
+
+#define HAMMER_THREADS	8
+#define HAMMER_READS	150
+
+// tag tables at the end of a frame
+#define NO_INDEX	0
+#define FULL_INDEX	1
+#define SHORT_INDEX	2 // leaves out a bucket, the way some V-Ray files do
+
+static int gFailures = 0;
+static IlmThread::Mutex gFailuresMutex;
+
+static void
+Failed(const char *msg, const char *file, int line)
+{
+	IlmThread::Lock lock(gFailuresMutex);
+	
+	fprintf(stderr, "FAILED: %s (%s:%d)\n", msg, file, line);
+	
+	gFailures++;
+}
+
+#define CHECK(COND, MSG) \
+	do{ if(!(COND)) Failed(MSG, __FILE__, __LINE__); }while(0)
+
+
+// what's in every pixel, version goes up when a frame is rendered again
+static float
+PixelValue(int frame, int version, int x, int y, int c)
+{
+	return (frame * 100.f) + (version * 10.f) + c + ((y * WIDTH) + x) / 1024.f;
+}
+
+
+static void
+Put(FILE *f, unsigned int val)
+{
+	// VRimg files are little endian
+	const unsigned char bytes[4] = { (unsigned char)val, (unsigned char)(val >> 8), (unsigned char)(val >> 16), (unsigned char)(val >> 24) };
+	
+	fwrite(bytes, 1, 4, f);
+}
+
+
+static void
+PutFloat(FILE *f, float val)
+{
+	union { float f; unsigned int i; } bits;
+	
+	bits.f = val;
+	
+	Put(f, bits.i);
+}
+
+
+typedef struct IndexEntry
+{
+	unsigned int vals[10];
+	long offset;
+} IndexEntry;
+
+
+static void
+PutTag(FILE *f, unsigned int tag, unsigned int size, unsigned int p0=0, unsigned int p1=0,
+		unsigned int p2=0, unsigned int p3=0, unsigned int p4=0, unsigned int p7=0,
+		vector<IndexEntry> *index=NULL)
+{
+	const unsigned int vals[10] = { tag, size, p0, p1, p2, p3, p4, 0, 0, p7 };
+	
+	if(index)
+	{
+		IndexEntry entry;
+		
+		memcpy(entry.vals, vals, sizeof(vals));
+		entry.offset = ftell(f);
+		
+		index->push_back(entry);
+	}
+	
+	for(int i=0; i < 10; i++)
+		Put(f, vals[i]);
+}
+
+
+static string
+FramePath(const string &dir, int frame)
+{
+	char name[32];
+	
+	sprintf(name, "/frame.%04d.vrimg", frame);
+	
+	return dir + name;
+}
+
+
+// an uncompressed file with "RGB color" and "Alpha" layers in buckets
+static bool
+WriteFrame(const string &dir, int frame, int version, int index_type = NO_INDEX)
+{
+	FILE *f = fopen(FramePath(dir, frame).c_str(), "wb");
+	
+	if(f == NULL)
+		return false;
+	
+	const unsigned int header[8] = { MAGIC, 1, 0, 0, 0, 0, 0, 0 }; // no index, not compressed
+	
+	for(int i=0; i < 8; i++)
+		Put(f, header[i]);
+	
+	const unsigned int tag_size = 10 * sizeof(unsigned int);
+	
+	vector<IndexEntry> index;
+	
+	PutTag(f, RIT_RESOLUTION, tag_size, WIDTH, HEIGHT, 0, 0, 0, 0, &index);
+	
+	const unsigned int chan_size = (4 * sizeof(int)) + 64;
+	
+	PutTag(f, RIT_CHAN_INFO, tag_size + (2 * chan_size), 2, chan_size, 0, 0, 0, 0, &index);
+	
+	static const char * const names[2] = { "RGB color", "Alpha" };
+	static const int types[2] = { 2, 1 }; // 3 floats, 1 float
+	
+	for(int l=0; l < 2; l++)
+	{
+		char name[64];
+		
+		memset(name, 0, 64);
+		strcpy(name, names[l]);
+		
+		Put(f, l);
+		Put(f, types[l]);
+		Put(f, 0);
+		Put(f, 0);
+		
+		fwrite(name, 1, 64, f);
+	}
+	
+	for(int by=0; by < HEIGHT; by += BUCKET_SIZE)
+	{
+		for(int bx=0; bx < WIDTH; bx += BUCKET_SIZE)
+		{
+			const int w = (bx + BUCKET_SIZE > WIDTH ? WIDTH - bx : BUCKET_SIZE);
+			const int h = (by + BUCKET_SIZE > HEIGHT ? HEIGHT - by : BUCKET_SIZE);
+			
+			for(int l=0; l < 2; l++)
+			{
+				const int dimensions = (l == 0 ? 3 : 1);
+				
+				PutTag(f, (l == 0 ? RIT_CHAN3F : RIT_CHANF), tag_size + (sizeof(float) * dimensions * w * h),
+						l, bx, by, w, h, l, &index);
+				
+				for(int y = by; y < by + h; y++)
+					for(int x = bx; x < bx + w; x++)
+						for(int c=0; c < dimensions; c++)
+							PutFloat(f, PixelValue(frame, version, x, y, (l == 0 ? c : 3)));
+			}
+		}
+	}
+	
+	if(index_type != NO_INDEX)
+	{
+		if(index_type == SHORT_INDEX)
+			index.erase(index.end() - 2); // the last "RGB color" bucket
+		
+		const long index_pos = ftell(f);
+		
+		PutTag(f, RIT_INDEX, tag_size + (index.size() * (tag_size + 8)), index.size());
+		
+		for(vector<IndexEntry>::const_iterator i = index.begin(); i != index.end(); ++i)
+		{
+			for(int v=0; v < 10; v++)
+				Put(f, i->vals[v]);
+			
+			Put(f, i->offset);
+			Put(f, 0);
+		}
+		
+		fseek(f, 3 * sizeof(unsigned int), SEEK_SET);
+		
+		Put(f, index_pos);
+		Put(f, 0);
+	}
+	
+	return (fclose(f) == 0);
+}
+
+
+static bool
+StatFrame(const string &path, FrameStamp &stamp)
+{
+	struct stat st;
+	
+	if(stat(path.c_str(), &st) != 0)
+		return false;
+	
+	stamp = FrameStamp(((Imf::Int64)st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec, st.st_size);
+	
+	return true;
+}
+
+
+class TestSource : public FrameSource
+{
+  public:
+	TestSource(const string &dir) : _dir(dir) {}
+	virtual ~TestSource() {}
+	
+	virtual Imf::IStream *openFrame(int frame, FrameStamp &stamp);
+
+  private:
+	const string _dir;
+};
+
+
+Imf::IStream *
+TestSource::openFrame(int frame, FrameStamp &stamp)
+{
+	const string path = FramePath(_dir, frame);
+	
+	if( !StatFrame(path, stamp) )
+		return NULL;
+	
+	return new Imf::StdIFStream( path.c_str() );
+}
+
+
+static bool
+LayersMatch(InputFile &in, int frame, int version)
+{
+	float rgb[HEIGHT][WIDTH][3];
+	float alpha[HEIGHT][WIDTH];
+	
+	in.copyLayerToBuffer("RGB color", rgb, sizeof(float) * 3 * WIDTH);
+	in.copyLayerToBuffer("Alpha", alpha, sizeof(float) * WIDTH);
+	
+	bool match = true;
+	
+	for(int y=0; y < HEIGHT; y++)
+	{
+		for(int x=0; x < WIDTH; x++)
+		{
+			for(int c=0; c < 3; c++)
+				match = match && (rgb[y][x][c] == PixelValue(frame, version, x, y, c));
+			
+			match = match && (alpha[y][x] == PixelValue(frame, version, x, y, 3));
+		}
+	}
+	
+	return match;
+}
+
+
+// read a frame the way the plug-in does, returns how many layers the prefetcher had
+static int
+ReadFrame(Prefetcher &prefetcher, const string &dir, int frame, int version)
+{
+	const string path = FramePath(dir, frame);
+	
+	FrameStamp stamp;
+	
+	StatFrame(path, stamp);
+	
+	Imf::StdIFStream stream( path.c_str() );
+	
+	InputFile in(stream);
+	
+	vector<string> layers;
+	
+	layers.push_back("RGB color");
+	layers.push_back("Alpha");
+	
+	const int adopted = prefetcher.adoptLayers(frame, in, stamp, layers);
+	
+	prefetcher.frameRequested(frame, layers);
+	
+	char msg[64];
+	
+	sprintf(msg, "frame %d matches version %d", frame, version);
+	
+	CHECK(LayersMatch(in, frame, version), msg);
+	
+	return adopted;
+}
+
+
+static void
+Settle()
+{
+	// give the prefetch thread time to get ahead of us
+	usleep(100 * 1000);
+}
+
+
+// one of AE's render threads, reading frames around a playhead that wanders
+// and sometimes jumps, all of them sharing one prefetcher
+class HammerThread : public IlmThread::Thread
+{
+  public:
+	HammerThread(Prefetcher &prefetcher, const string &dir, unsigned int seed);
+	virtual ~HammerThread();
+	
+	virtual void run();
+	
+  private:
+	Prefetcher &_prefetcher;
+	const string _dir;
+	unsigned int _seed;
+	IlmThread::Semaphore _finished;
+	
+	int random(int n) { _seed = (_seed * 1103515245) + 12345; return ((_seed >> 16) % n); }
+};
+
+
+HammerThread::HammerThread(Prefetcher &prefetcher, const string &dir, unsigned int seed) :
+	_prefetcher(prefetcher),
+	_dir(dir),
+	_seed(seed),
+	_finished(0)
+{
+	start();
+}
+
+
+HammerThread::~HammerThread()
+{
+	// ~Thread joins too late, our members are gone by then
+	_finished.wait();
+}
+
+
+void
+HammerThread::run()
+{
+	int playhead = random(FRAMES);
+	
+	for(int i=0; i < HAMMER_READS; i++)
+	{
+		const int action = random(20);
+		
+		if(action == 0)
+			playhead = random(FRAMES); // jump
+		else if(action == 1)
+			_prefetcher.cancel();
+		else
+			playhead = (playhead + (action < 15 ? 1 : -1) + FRAMES) % FRAMES;
+		
+		try
+		{
+			ReadFrame(_prefetcher, _dir, playhead, 0);
+		}
+		catch(...)
+		{
+			Failed("reading a frame threw", __FILE__, __LINE__);
+		}
+	}
+	
+	_finished.post();
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	if( !IlmThread::supportsThreads() )
+	{
+		printf("no threads, nothing to test\n");
+		
+		return 0;
+	}
+	
+	char dir_template[] = "/tmp/prefetch_testXXXXXX";
+	
+	const char *dir_name = mkdtemp(dir_template);
+	
+	if(dir_name == NULL)
+	{
+		fprintf(stderr, "couldn't make a temp directory\n");
+		
+		return 1;
+	}
+	
+	const string dir = dir_name;
+	
+	for(int f=0; f < FRAMES; f++)
+	{
+		if( !WriteFrame(dir, f, 0) )
+		{
+			fprintf(stderr, "couldn't write %s\n", FramePath(dir, f).c_str());
+			
+			return 1;
+		}
+	}
+	
+	
+	if(true) // playing forward, the frames ahead should be waiting for us
+	{
+		Prefetcher prefetcher(new TestSource(dir), WINDOW, 64 * 1024 * 1024);
+		
+		int adopted = 0;
+		
+		for(int f=0; f < FRAMES; f++)
+		{
+			adopted += ReadFrame(prefetcher, dir, f, 0);
+			
+			Settle();
+		}
+		
+		CHECK(adopted > 0, "forward playback got layers from the prefetcher");
+		CHECK(prefetcher.bytes() == 0, "nothing left past the last frame");
+	}
+	
+	
+	if(true) // playing backward
+	{
+		Prefetcher prefetcher(new TestSource(dir), WINDOW, 64 * 1024 * 1024);
+		
+		int adopted = 0;
+		
+		for(int f = FRAMES - 1; f >= 0; f--)
+		{
+			adopted += ReadFrame(prefetcher, dir, f, 0);
+			
+			Settle();
+		}
+		
+		CHECK(adopted > 0, "backward playback got layers from the prefetcher");
+	}
+	
+	
+	if(true) // lots of threads on one prefetcher, which is how AE uses it with multi-frame rendering
+	{
+		Prefetcher prefetcher(new TestSource(dir), WINDOW, 64 * 1024 * 1024);
+		
+		vector<HammerThread *> threads;
+		
+		for(int t=0; t < HAMMER_THREADS; t++)
+			threads.push_back( new HammerThread(prefetcher, dir, t + 1) );
+		
+		for(size_t t=0; t < threads.size(); t++)
+			delete threads[t];
+		
+		prefetcher.cancel();
+		
+		CHECK(prefetcher.bytes() == 0, "nothing left after hammering");
+	}
+	
+	
+	if(true) // a frame rendered again after it was prefetched must not be served stale
+	{
+		Prefetcher prefetcher(new TestSource(dir), WINDOW, 64 * 1024 * 1024);
+		
+		ReadFrame(prefetcher, dir, 0, 0);
+		
+		Settle();
+		
+		CHECK(prefetcher.bytes() > 0, "frames after 0 were prefetched");
+		
+		WriteFrame(dir, 1, 1);
+		
+		// same size, so push the modification time well past the old one
+		struct timeval times[2];
+		gettimeofday(&times[0], NULL);
+		times[0].tv_sec += 100;
+		times[1] = times[0];
+		
+		utimes(FramePath(dir, 1).c_str(), times);
+		
+		const int adopted = ReadFrame(prefetcher, dir, 1, 1);
+		
+		CHECK(adopted == 0, "re-rendered frame wasn't taken from the prefetcher");
+		
+		Settle();
+		
+		CHECK(ReadFrame(prefetcher, dir, 2, 0) > 0, "the frame after it still was");
+	}
+	
+	
+	if(true) // jumping around and cancelling, just has to stay correct
+	{
+		Prefetcher prefetcher(new TestSource(dir), WINDOW, 64 * 1024 * 1024);
+		
+		ReadFrame(prefetcher, dir, 0, 0);
+		ReadFrame(prefetcher, dir, FRAMES - 2, 0);
+		ReadFrame(prefetcher, dir, 4, 0);
+		
+		prefetcher.cancel();
+		
+		CHECK(prefetcher.bytes() == 0, "cancel dropped everything");
+		
+		ReadFrame(prefetcher, dir, 5, 0);
+		ReadFrame(prefetcher, dir, 1, 1);
+	}
+	
+	
+	if(true) // index tables, past the end of the sequence so the prefetchers never saw them
+	{
+		WriteFrame(dir, FRAMES, 0, FULL_INDEX);
+		WriteFrame(dir, FRAMES + 1, 0, SHORT_INDEX);
+		
+		Imf::StdIFStream full_stream( FramePath(dir, FRAMES).c_str() );
+		Imf::StdIFStream short_stream( FramePath(dir, FRAMES + 1).c_str() );
+		
+		InputFile full_in(full_stream), short_in(short_stream);
+		
+		CHECK(LayersMatch(full_in, FRAMES, 0), "frame read with its index table");
+		CHECK(LayersMatch(short_in, FRAMES + 1, 0), "index table missing a bucket wasn't trusted");
+	}
+	
+	
+	for(int f=0; f < FRAMES + 2; f++)
+		remove( FramePath(dir, f).c_str() );
+	
+	rmdir( dir.c_str() );
+	
+	
+	if(gFailures > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", gFailures);
+		
+		return 1;
+	}
+	
+	printf("prefetch_test passed\n");
+	
+	return 0;
+}
@@ -0,0 +1,911 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+// vrimg2exr - convert V-Ray .vrimg files to multi-part OpenEXR
+//
+// usage: vrimg2exr [options] file.vrimg [file.vrimg ...]
+//
+//	-c <compression>	none, rle, zips, zip, piz, pxr24, b44, b44a, dwaa, dwab, auto (default: zip)
+//	-w <weight>			for auto, how much decode speed counts against file size (default: 0.25)
+//	-half				write float layers as half
+//	-demote				write float channels as half when no precision would be lost
+//	-stats				put min, max, mean, NaN/Inf counts, bounds and a histogram in the header
+//	-preview			embed an 8-bit preview image for thumbnails
+//	-t <threads>		total threads to use (default: number of CPUs)
+//	-j <frames>			frames to convert at once (default: a quarter of the threads)
+//	-m <megabytes>		memory the frames in flight can use (default: half of physical memory)
+//	-o <directory>		where to put the EXRs (default: next to each vrimg)
+//	-bench				write each frame with every compression and auto, report size and
+//						read speed, and keep none of them
+//
+// Each render element becomes its own part, with "RGB color" and "Alpha"
+// going in the first part as R, G, B, A. Hand it a whole sequence with a shell glob.
+
+
+#include "ProEXRdoc.h"
+
+#include "VRimgInputFile.h"
+
+#include <ImfStdIO.h>
+#include <ImfCompression.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfInputPart.h>
+
+#include <IlmThread.h>
+#include <IlmThreadPool.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <Iex.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+using namespace Imf;
+using namespace Imath;
+using namespace IlmThread;
+using namespace std;
+
+
+class ProEXRchannel_VRimg : public ProEXRchannel
+{
+  public:
+	ProEXRchannel_VRimg(std::string name, Imf::PixelType pixelType=Imf::FLOAT) : ProEXRchannel(name, pixelType) {}
+	virtual ~ProEXRchannel_VRimg() {}
+	
+	// buf is a whole VRimg layer, we take one component out of each pixel
+	void loadFromVRimg(const void *buf, int dimensions, int component);
+};
+
+
+void
+ProEXRchannel_VRimg::loadFromVRimg(const void *buf, int dimensions, int component)
+{
+	if( !loaded() )
+	{
+		if(doc() == NULL)
+			throw Iex::BaseExc("doc() is NULL.");
+		
+		ProEXRbuffer buffer = getBufferDesc(false);
+		
+		assert( buffer.width == doc()->width() );
+		assert( buffer.height == doc()->height() );
+		assert( buffer.colbytes == sizeof(unsigned int) );
+		
+		if(buffer.buf == NULL)
+			throw Iex::BaseExc("buffer.buf is NULL.");
+		
+		// VRimg floats and ints are both 4 bytes, so we just move the bits
+		const unsigned int *vr_pix = (const unsigned int *)buf + component;
+		char *buf_row = (char *)buffer.buf;
+		
+		for(int y=0; y < buffer.height; y++)
+		{
+			unsigned int *buf_pix = (unsigned int *)buf_row;
+			
+			for(int x=0; x < buffer.width; x++)
+			{
+				*buf_pix++ = *vr_pix;
+				
+				vr_pix += dimensions;
+			}
+			
+			buf_row += buffer.rowbytes;
+		}
+		
+		setLoaded(true, true);
+	}
+}
+
+
+// holds the layers VRimg::InputFile decodes for us
+class LayerBuffers
+{
+  public:
+	LayerBuffers(const VRimg::Header &head);
+	~LayerBuffers();
+	
+	VRimg::InputFile::BufferMap & map() { return _map; }
+	
+  private:
+	VRimg::InputFile::BufferMap _map;
+};
+
+
+LayerBuffers::LayerBuffers(const VRimg::Header &head)
+{
+	const VRimg::Header::LayerMap &layers = head.layers();
+	
+	for(VRimg::Header::LayerMap::const_iterator i = layers.begin(); i != layers.end(); ++i)
+	{
+		const size_t buf_size = sizeof(float) * i->second.dimensions * head.width() * head.height();
+		
+		void *buf = malloc(buf_size);
+		
+		if(buf == NULL)
+		{
+			for(VRimg::InputFile::BufferMap::iterator j = _map.begin(); j != _map.end(); ++j)
+				free(j->second);
+			
+			throw bad_alloc();
+		}
+		
+		// a file that ends early leaves the rest black, same as the plug-ins
+		memset(buf, 0, buf_size);
+		
+		_map[ i->first ] = buf;
+	}
+}
+
+
+LayerBuffers::~LayerBuffers()
+{
+	for(VRimg::InputFile::BufferMap::iterator i = _map.begin(); i != _map.end(); ++i)
+		free(i->second);
+}
+
+
+typedef struct Options
+{
+	Compression compression;
+	bool auto_compression;
+	float speed_weight;
+	bool half;
+	bool demote;
+	bool stats;
+	bool preview;
+	int threads;
+	int jobs;
+	int megabytes;
+	string out_dir;
+	bool bench;
+	
+	Options() : compression(ZIP_COMPRESSION), auto_compression(false), speed_weight(0.25f), half(false), demote(false), stats(false), preview(false), threads(0), jobs(0), megabytes(0), bench(false) {}
+} Options;
+
+
+// frames running side by side wait here until there's room for them,
+// one frame is always let through so a huge frame still gets done
+class MemoryBudget
+{
+  public:
+	MemoryBudget(size_t max_bytes) : _max_bytes(max_bytes), _used(0), _waiters(0), _freed(0) {}
+	~MemoryBudget() {}
+	
+	void acquire(size_t bytes);
+	void release(size_t bytes);
+	
+  private:
+	const size_t _max_bytes;
+	size_t _used;
+	int _waiters;
+	
+	Mutex _mutex;
+	Semaphore _freed;
+};
+
+
+void
+MemoryBudget::acquire(size_t bytes)
+{
+	Lock lock(_mutex);
+	
+	while(_used > 0 && _used + bytes > _max_bytes)
+	{
+		_waiters++;
+		
+		lock.release();
+		
+		_freed.wait();
+		
+		lock.acquire();
+	}
+	
+	_used += bytes;
+}
+
+
+void
+MemoryBudget::release(size_t bytes)
+{
+	Lock lock(_mutex);
+	
+	_used -= bytes;
+	
+	while(_waiters > 0)
+	{
+		_freed.post();
+		
+		_waiters--;
+	}
+}
+
+
+class MemoryReservation
+{
+  public:
+	MemoryReservation(MemoryBudget &budget, size_t bytes) : _budget(budget), _bytes(bytes) { _budget.acquire(_bytes); }
+	~MemoryReservation() { _budget.release(_bytes); }
+	
+  private:
+	MemoryBudget &_budget;
+	const size_t _bytes;
+};
+
+
+static size_t
+FrameBytes(const VRimg::Header &head)
+{
+	// every layer as VRimg floats, then again as EXR channels
+	size_t bytes = 0;
+	
+	const VRimg::Header::LayerMap &layers = head.layers();
+	
+	for(VRimg::Header::LayerMap::const_iterator i = layers.begin(); i != layers.end(); ++i)
+		bytes += sizeof(float) * i->second.dimensions * head.width() * head.height();
+	
+	return (2 * bytes);
+}
+
+
+static string
+OutputPath(const string &in_path, const Options &options)
+{
+	string path = in_path;
+	
+	const string::size_type slash_pos = path.find_last_of("/\\");
+	const string::size_type dot_pos = path.find_last_of('.');
+	
+	if(dot_pos != string::npos && (slash_pos == string::npos || dot_pos > slash_pos))
+		path.erase(dot_pos);
+	
+	path += ".exr";
+	
+	if( !options.out_dir.empty() )
+	{
+		const string file_name = (slash_pos == string::npos ? path : path.substr(slash_pos + 1));
+		
+		const char last = options.out_dir[options.out_dir.size() - 1];
+		
+		path = options.out_dir + ((last == '/' || last == '\\') ? "" : "/") + file_name;
+	}
+	
+	return path;
+}
+
+
+static string
+TranscodeFrame(const string &in_path, const string &out_path, const Options &options, MemoryBudget &budget)
+{
+	StdIFStream in_stream( in_path.c_str() );
+	
+	VRimg::InputFile in_file(in_stream);
+	
+	const VRimg::Header &vr_head = in_file.header();
+	
+	MemoryReservation reservation(budget, FrameBytes(vr_head));
+	
+	// every layer in one trip through the file
+	LayerBuffers buffers(vr_head);
+	
+	in_file.loadFromFile( &buffers.map() );
+	
+	
+	Header head(vr_head.width(), vr_head.height(), vr_head.pixelAspectRatio());
+	
+	head.compression() = options.compression;
+	
+	
+	// write to a temp file so a killed job never leaves a finished-looking EXR
+	const string temp_path = out_path + ".tmp";
+	
+	string notes;
+	
+	try{
+		if(true) // making a scope for the output file
+		{
+			StdOFStream out_stream( temp_path.c_str() );
+			
+			ProEXRdoc_writeMultiPart doc(out_stream, head);
+			
+			doc.setDemoteTypes(options.demote);
+			doc.setAutoCompression(options.auto_compression, options.speed_weight);
+			doc.setWriteStats(options.stats);
+			doc.setWritePreview(options.preview);
+			
+			const VRimg::Header::LayerMap &layers = vr_head.layers();
+			
+			for(VRimg::Header::LayerMap::const_iterator i = layers.begin(); i != layers.end(); ++i)
+			{
+				const string &layer_name = i->first;
+				const VRimg::Layer &layer = i->second;
+				
+				const Imf::PixelType pixel_type = (layer.type == VRimg::INT ? Imf::UINT :
+													options.half ? Imf::HALF : Imf::FLOAT);
+				
+				static const char * chan_names[4] = { "R", "G", "B", "A" };
+				
+				vector<string> names;
+				
+				if(layer_name == "RGB color")
+				{
+					for(int n=0; n < layer.dimensions && n < 3; n++)
+						names.push_back( chan_names[n] );
+				}
+				else if(layer_name == "Alpha")
+				{
+					names.push_back("A");
+				}
+				else if(layer.dimensions == 1)
+				{
+					names.push_back(layer_name + ".Y");
+				}
+				else
+				{
+					for(int n=0; n < layer.dimensions && n < 4; n++)
+						names.push_back(layer_name + "." + chan_names[n]);
+				}
+				
+				const void *buf = buffers.map()[layer_name];
+				
+				for(size_t n=0; n < names.size(); n++)
+				{
+					ProEXRchannel_VRimg *chan = new ProEXRchannel_VRimg(names[n], pixel_type);
+					
+					doc.addChannel(chan);
+					
+					chan->loadFromVRimg(buf, layer.dimensions, n);
+				}
+			}
+			
+			doc.writeFile();
+			
+			string demoted;
+			
+			for(size_t i=0; i < doc.demotedChannels().size(); i++)
+				demoted += (i == 0 ? " (half: " : ", ") + doc.demotedChannels()[i];
+			
+			if( !demoted.empty() )
+				demoted += ")";
+			
+			string chosen;
+			
+			for(size_t i=0; i < doc.chosenCompressions().size(); i++)
+				chosen += (i == 0 ? " (" : ", ") + doc.chosenCompressions()[i];
+			
+			if( !chosen.empty() )
+				chosen += ")";
+			
+			notes = demoted + chosen;
+		}
+	}
+	catch(...)
+	{
+		// the stream is closed by now, don't leave half a file behind
+		remove( temp_path.c_str() );
+		
+		throw;
+	}
+	
+	remove( out_path.c_str() );
+	
+	if( rename(temp_path.c_str(), out_path.c_str()) != 0 )
+		throw Iex::IoExc("Could not rename " + temp_path + " to " + out_path);
+	
+	return notes;
+}
+
+
+// frames get handed out one at a time to a fixed set of threads
+class FrameQueue
+{
+  public:
+	FrameQueue(const vector<string> &files, const Options &options, MemoryBudget &budget) :
+		_files(files), _options(options), _budget(budget), _next(0), _failures(0) {}
+	~FrameQueue() {}
+	
+	void run();
+	
+	int failures() const { return _failures; }
+	
+  private:
+	const vector<string> &_files;
+	const Options &_options;
+	MemoryBudget &_budget;
+	
+	Mutex _mutex;
+	size_t _next;
+	int _failures;
+	
+	void report(const string &message, bool failed);
+};
+
+
+void
+FrameQueue::run()
+{
+	while(true)
+	{
+		size_t frame = 0;
+		
+		if(true) // making a scope for the lock
+		{
+			Lock lock(_mutex);
+			
+			if(_next >= _files.size())
+				return;
+			
+			frame = _next++;
+		}
+		
+		const string &in_path = _files[frame];
+		const string out_path = OutputPath(in_path, _options);
+		
+		try
+		{
+			const string notes = TranscodeFrame(in_path, out_path, _options, _budget);
+			
+			report(in_path + " -> " + out_path + notes, false);
+		}
+		catch(bad_alloc &e)
+		{
+			report(in_path + ": out of memory", true);
+		}
+		catch(exception &e)
+		{
+			report(in_path + ": " + e.what(), true);
+		}
+		catch(...)
+		{
+			report(in_path + ": unknown error", true);
+		}
+	}
+}
+
+
+void
+FrameQueue::report(const string &message, bool failed)
+{
+	Lock lock(_mutex);
+	
+	if(failed)
+		_failures++;
+	
+	fprintf((failed ? stderr : stdout), "%s\n", message.c_str());
+	fflush(failed ? stderr : stdout);
+}
+
+
+class FrameThread : public Thread
+{
+  public:
+	FrameThread(FrameQueue &queue) : _queue(queue), _finished(0) { start(); }
+	virtual ~FrameThread() { _finished.wait(); } // ~Thread joins too late, our members are gone by then
+	
+	virtual void run() { _queue.run(); _finished.post(); }
+	
+  private:
+	FrameQueue &_queue;
+	Semaphore _finished;
+};
+
+
+static int
+NumCPUs()
+{
+#ifdef WIN32
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+
+	return systemInfo.dwNumberOfProcessors;
+#else
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return (cpus > 0 ? cpus : 1);
+#endif
+}
+
+
+static int
+PhysicalMegabytes()
+{
+#ifdef WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	
+	if( !GlobalMemoryStatusEx(&status) )
+		return 0;
+	
+	return (int)(status.ullTotalPhys / (1024 * 1024));
+#else
+	const long pages = sysconf(_SC_PHYS_PAGES);
+	const long page_size = sysconf(_SC_PAGE_SIZE);
+	
+	if(pages <= 0 || page_size <= 0)
+		return 0;
+	
+	return (int)((double)pages * (double)page_size / (1024.0 * 1024.0));
+#endif
+}
+
+
+static const char * gCompressionNames[] = { "none", "rle", "zips", "zip", "piz", "pxr24", "b44", "b44a", "dwaa", "dwab" };
+
+static const Compression gCompressions[] = { NO_COMPRESSION, RLE_COMPRESSION, ZIPS_COMPRESSION, ZIP_COMPRESSION,
+												PIZ_COMPRESSION, PXR24_COMPRESSION, B44_COMPRESSION, B44A_COMPRESSION,
+												DWAA_COMPRESSION, DWAB_COMPRESSION };
+
+#define NUM_COMPRESSIONS	(sizeof(gCompressions) / sizeof(gCompressions[0]))
+
+
+static bool
+ParseCompression(const char *name, Compression &compression)
+{
+	for(size_t i=0; i < NUM_COMPRESSIONS; i++)
+	{
+		if( !strcmp(name, gCompressionNames[i]) )
+		{
+			compression = gCompressions[i];
+			
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+
+#define BENCH_READS	(3)
+
+static double
+Seconds()
+{
+#ifdef WIN32
+	LARGE_INTEGER count, frequency;
+	
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	
+	return ((double)count.QuadPart / (double)frequency.QuadPart);
+#else
+	struct timeval tv;
+	
+	gettimeofday(&tv, NULL);
+	
+	return ((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+#endif
+}
+
+
+static size_t
+FileSize(const string &path)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	
+	if(f == NULL)
+		throw Iex::IoExc("Could not open " + path);
+	
+	fseek(f, 0, SEEK_END);
+	
+	const long size = ftell(f);
+	
+	fclose(f);
+	
+	return (size > 0 ? size : 0);
+}
+
+
+// reads every channel of every part, the way a compositor opens a frame,
+// and keeps the fastest of a few tries
+static double
+ReadSeconds(const string &path, size_t &pixel_bytes)
+{
+	double best = -1.0;
+	
+	for(int r=0; r < BENCH_READS; r++)
+	{
+		double seconds = 0.0;
+		
+		pixel_bytes = 0;
+		
+		double start = Seconds();
+		
+		MultiPartInputFile in_file( path.c_str() );
+		
+		seconds += Seconds() - start;
+		
+		for(int p=0; p < in_file.parts(); p++)
+		{
+			InputPart part(in_file, p);
+			
+			const Header &head = part.header();
+			const Box2i &dw = head.dataWindow();
+			const size_t width = (dw.max.x - dw.min.x) + 1;
+			const size_t height = (dw.max.y - dw.min.y) + 1;
+			
+			size_t part_bytes = 0;
+			
+			for(ChannelList::ConstIterator i = head.channels().begin(); i != head.channels().end(); ++i)
+				part_bytes += pixelTypeSize(i.channel().type) * width * height;
+			
+			// one block carved into a plane per channel
+			vector<char> buf(part_bytes);
+			
+			FrameBuffer frameBuffer;
+			
+			char *plane = &buf[0];
+			
+			for(ChannelList::ConstIterator i = head.channels().begin(); i != head.channels().end(); ++i)
+			{
+				const size_t pix_size = pixelTypeSize(i.channel().type);
+				
+				char *origin = plane - (dw.min.x * pix_size) - (dw.min.y * width * pix_size);
+				
+				frameBuffer.insert(i.name(), Slice(i.channel().type, origin, pix_size, width * pix_size) );
+				
+				plane += pix_size * width * height;
+			}
+			
+			start = Seconds();
+			
+			part.setFrameBuffer(frameBuffer);
+			part.readPixels(dw.min.y, dw.max.y);
+			
+			seconds += Seconds() - start;
+			
+			pixel_bytes += part_bytes;
+		}
+		
+		if(r == 0 || seconds < best)
+			best = seconds;
+	}
+	
+	return best;
+}
+
+
+static void
+BenchReport(const char *name, size_t size, size_t none_size, double seconds, size_t pixel_bytes, const string &notes)
+{
+	const double mb_per_sec = (seconds > 0.0 ? ((double)pixel_bytes / (1024.0 * 1024.0)) / seconds : 0.0);
+	
+	printf("  %-6s %12lu bytes %6.1f%% %9.1f ms %8.1f MB/s%s\n", name, (unsigned long)size,
+			(none_size > 0 ? (100.0 * (double)size / (double)none_size) : 100.0),
+			seconds * 1000.0, mb_per_sec, notes.c_str());
+}
+
+
+// writes the frame with each fixed compression, then with auto, and reads each
+// one back, so the size and read speed auto buys can be seen next to the rest
+static void
+BenchmarkFrame(const string &in_path, const Options &options, MemoryBudget &budget)
+{
+	const string bench_path = OutputPath(in_path, options) + ".bench";
+	
+	printf("%s\n", in_path.c_str());
+	
+	size_t none_size = 0;
+	
+	try
+	{
+		for(size_t c=0; c < NUM_COMPRESSIONS; c++)
+		{
+			Options fixed = options;
+			
+			fixed.compression = gCompressions[c];
+			fixed.auto_compression = false;
+			
+			TranscodeFrame(in_path, bench_path, fixed, budget);
+			
+			const size_t size = FileSize(bench_path);
+			
+			if(gCompressions[c] == NO_COMPRESSION)
+				none_size = size;
+			
+			size_t pixel_bytes = 0;
+			
+			const double seconds = ReadSeconds(bench_path, pixel_bytes);
+			
+			BenchReport(gCompressionNames[c], size, none_size, seconds, pixel_bytes, "");
+		}
+		
+		// auto also tries whatever -c asked for
+		Options automatic = options;
+		
+		automatic.auto_compression = true;
+		
+		const string notes = TranscodeFrame(in_path, bench_path, automatic, budget);
+		
+		size_t pixel_bytes = 0;
+		
+		const double seconds = ReadSeconds(bench_path, pixel_bytes);
+		
+		BenchReport("auto", FileSize(bench_path), none_size, seconds, pixel_bytes, notes);
+		
+		fflush(stdout);
+	}
+	catch(...)
+	{
+		remove( bench_path.c_str() );
+		
+		throw;
+	}
+	
+	remove( bench_path.c_str() );
+}
+
+
+static void
+Usage()
+{
+	fprintf(stderr, "usage: vrimg2exr [-c compression] [-w weight] [-half] [-demote] [-stats] [-preview] [-t threads] [-j frames] [-m megabytes] [-o directory] [-bench] file.vrimg ...\n");
+	fprintf(stderr, "  compression: none, rle, zips, zip, piz, pxr24, b44, b44a, dwaa, dwab, auto\n");
+	fprintf(stderr, "  weight: for auto, how much decode speed counts against size (default: 0.25)\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	Options options;
+	
+	vector<string> files;
+	
+	for(int i=1; i < argc; i++)
+	{
+		const string arg = argv[i];
+		
+		const bool have_value = (i + 1 < argc);
+		
+		if(arg == "-c" && have_value)
+		{
+			i++;
+			
+			if( !strcmp(argv[i], "auto") )
+				options.auto_compression = true;
+			else if( !ParseCompression(argv[i], options.compression) )
+			{
+				Usage();
+				return 1;
+			}
+		}
+		else if(arg == "-w" && have_value)
+			options.speed_weight = atof(argv[++i]);
+		else if(arg == "-half")
+			options.half = true;
+		else if(arg == "-demote")
+			options.demote = true;
+		else if(arg == "-stats")
+			options.stats = true;
+		else if(arg == "-preview")
+			options.preview = true;
+		else if(arg == "-t" && have_value)
+			options.threads = atoi(argv[++i]);
+		else if(arg == "-j" && have_value)
+			options.jobs = atoi(argv[++i]);
+		else if(arg == "-m" && have_value)
+			options.megabytes = atoi(argv[++i]);
+		else if(arg == "-o" && have_value)
+			options.out_dir = argv[++i];
+		else if(arg == "-bench")
+			options.bench = true;
+		else if(arg.size() > 0 && arg[0] == '-')
+		{
+			Usage();
+			return 1;
+		}
+		else
+			files.push_back(arg);
+	}
+	
+	if(files.empty())
+	{
+		Usage();
+		return 1;
+	}
+	
+	
+	// the thread budget is split between frames running side by side and
+	// the global pool that does VRimg decompression and EXR compression,
+	// frame threads are not pool threads so waiting on the pool can't deadlock
+	const int threads = (options.threads > 0 && supportsThreads() ? options.threads :
+							supportsThreads() ? NumCPUs() : 1);
+	
+	// a whole multi-layer frame is in memory per job, so by default most
+	// of the threads go to the pool and only a few frames are open at once
+	int jobs = (options.jobs > 0 ? options.jobs : (threads + 3) / 4);
+	
+	if(options.bench)
+		jobs = 1; // benchmarked frames go one at a time
+	
+	jobs = MIN(jobs, threads);
+	jobs = MIN(jobs, (int)files.size());
+	jobs = MAX(jobs, 1);
+	
+	setGlobalThreadCount(threads - jobs);
+	
+	
+	const int physical_megabytes = PhysicalMegabytes();
+	
+	const int megabytes = (options.megabytes > 0 ? options.megabytes :
+							physical_megabytes > 0 ? (physical_megabytes / 2) : 2048);
+	
+	MemoryBudget budget((size_t)megabytes * 1024 * 1024);
+	
+	
+	if(options.bench)
+	{
+		// no FrameQueue, each frame gets the machine to itself while it is timed
+		int failures = 0;
+		
+		for(size_t i=0; i < files.size(); i++)
+		{
+			try
+			{
+				BenchmarkFrame(files[i], options, budget);
+			}
+			catch(exception &e)
+			{
+				fprintf(stderr, "%s: %s\n", files[i].c_str(), e.what());
+				
+				failures++;
+			}
+		}
+		
+		return (failures > 0 ? 1 : 0);
+	}
+	
+	
+	FrameQueue queue(files, options, budget);
+	
+	if(jobs > 1)
+	{
+		vector<FrameThread *> frame_threads;
+		
+		for(int i=0; i < jobs; i++)
+			frame_threads.push_back( new FrameThread(queue) );
+		
+		for(size_t i=0; i < frame_threads.size(); i++)
+			delete frame_threads[i];
+	}
+	else
+		queue.run();
+	
+	
+	if(queue.failures() > 0)
+	{
+		fprintf(stderr, "%d of %d files failed\n", queue.failures(), (int)files.size());
+		
+		return 1;
+	}
+	
+	return 0;
+}
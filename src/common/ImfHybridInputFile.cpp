@@ -24,8 +24,11 @@
 #include "ImfHybridInputFile.h"
 
 #include "ImfInputPart.h"
+#include "ImfTiledInputPart.h"
 #include "ImfPartType.h"
 
+#include <string.h>
+
 #include "Iex.h"
 
 
@@ -65,34 +68,43 @@ HybridInputFile::isComplete() const
 }
 
 
-void
-HybridInputFile::readPixels(int scanLine1, int scanLine2)
+FrameBuffer
+HybridInputFile::partFrameBuffer(int n) const
 {
-	for(int n=0; n < _multiPart.parts(); n++)
+	FrameBuffer part_fb;
+
+	for(FrameBuffer::ConstIterator i = _frameBuffer.begin(); i != _frameBuffer.end(); i++)
 	{
-		FrameBuffer part_fb;
-	
-		for(FrameBuffer::ConstIterator i = _frameBuffer.begin(); i != _frameBuffer.end(); i++)
+		HybridChannelMap::const_iterator hyChan = _map.find( i.name() );
+		
+		if(hyChan != _map.end())
 		{
-			if( _map.find( i.name() ) != _map.end() )
-			{
-				const HybridChannel &hyChan = _map[ i.name() ];
-				
-				if(hyChan.part == n)
-				{
-					part_fb.insert( hyChan.name, i.slice() );
-				}
-			}
-			else if(n == 0)
+			if(hyChan->second.part == n)
 			{
-				// for channels that will be simply be filled
-				const bool rename = (_multiPart.parts() > 1);
-				
-				const string name_never_loaded = (rename ? string("zzNOLOADzz") + i.name() : i.name());
-				
-				part_fb.insert( name_never_loaded, i.slice() );
+				part_fb.insert( hyChan->second.name, i.slice() );
 			}
 		}
+		else if(n == 0)
+		{
+			// for channels that will be simply be filled
+			const bool rename = (_multiPart.parts() > 1);
+			
+			const string name_never_loaded = (rename ? string("zzNOLOADzz") + i.name() : i.name());
+			
+			part_fb.insert( name_never_loaded, i.slice() );
+		}
+	}
+	
+	return part_fb;
+}
+
+
+void
+HybridInputFile::readPixels(int scanLine1, int scanLine2)
+{
+	for(int n=0; n < _multiPart.parts(); n++)
+	{
+		FrameBuffer part_fb = partFrameBuffer(n);
 		
 		if(part_fb.begin() != part_fb.end()) // i.e. it's not empty
 		{
@@ -114,6 +126,221 @@ HybridInputFile::readPixels(int scanLine1, int scanLine2)
 }
 
 
+Box2i
+HybridInputFile::levelDataWindow(int level) const
+{
+	const int width = (_dataWindow.max.x - _dataWindow.min.x) + 1;
+	const int height = (_dataWindow.max.y - _dataWindow.min.y) + 1;
+	
+	const int level_width = max(1, width >> level);
+	const int level_height = max(1, height >> level);
+	
+	return Box2i(_dataWindow.min, _dataWindow.min + IMATH_NAMESPACE::V2i(level_width - 1, level_height - 1));
+}
+
+
+bool
+HybridInputFile::partHasLevel(int n, int level) const
+{
+	const Header &head = _multiPart.header(n);
+	
+	if(level == 0)
+		return true;
+	
+	if( !head.hasTileDescription() || (head.hasType() && head.type() != TILEDIMAGE) )
+		return false;
+	
+	const TileDescription &td = head.tileDescription();
+	
+	// the level has to line up with levelDataWindow()
+	if(td.mode == ONE_LEVEL || td.roundingMode != ROUND_DOWN || head.dataWindow() != _dataWindow)
+		return false;
+	
+	const int width = (_dataWindow.max.x - _dataWindow.min.x) + 1;
+	const int height = (_dataWindow.max.y - _dataWindow.min.y) + 1;
+	
+	if(td.mode == MIPMAP_LEVELS)
+		return ((max(width, height) >> level) > 0);
+	else
+		return ((width >> level) > 0 && (height >> level) > 0); // RIPMAP_LEVELS, we use (level, level)
+}
+
+
+void
+HybridInputFile::readPixels(int scanLine1, int scanLine2, int level)
+{
+	if(level == 0)
+	{
+		readPixels(scanLine1, scanLine2);
+		
+		return;
+	}
+	
+	for(int n=0; n < _multiPart.parts(); n++)
+	{
+		FrameBuffer part_fb = partFrameBuffer(n);
+		
+		if(part_fb.begin() != part_fb.end())
+		{
+			if( partHasLevel(n, level) )
+				readLevelPixels(n, part_fb, scanLine1, scanLine2, level);
+			else
+				readStridedPixels(n, part_fb, scanLine1, scanLine2, level);
+		}
+	}
+}
+
+
+static void
+CopyPixels(const FrameBuffer &source, const FrameBuffer &dest, int source_y, int dest_y, int source_x, int dest_x, int x_step, int count)
+{
+	// same names in both
+	for(FrameBuffer::ConstIterator i = dest.begin(); i != dest.end(); i++)
+	{
+		const Slice &out = i.slice();
+		const Slice &in = source[ i.name() ];
+		
+		const size_t pix_size = pixelTypeSize(out.type);
+		
+		const char *in_pix = in.base + (source_y * in.yStride) + (source_x * in.xStride);
+		char *out_pix = out.base + (dest_y * out.yStride) + (dest_x * out.xStride);
+		
+		for(int x=0; x < count; x++)
+		{
+			memcpy(out_pix, in_pix, pix_size);
+			
+			in_pix += in.xStride * x_step;
+			out_pix += out.xStride;
+		}
+	}
+}
+
+
+void
+HybridInputFile::readLevelPixels(int n, const FrameBuffer &part_fb, int scanLine1, int scanLine2, int level)
+{
+	const Box2i level_dw = levelDataWindow(level);
+	
+	const int startScanline = max(scanLine1, level_dw.min.y);
+	const int endScanline = min(scanLine2, level_dw.max.y);
+	
+	if(endScanline < startScanline)
+		return;
+	
+	TiledInputPart inPart(_multiPart, n);
+	
+	const TileDescription &td = inPart.header().tileDescription();
+	
+	// whole tiles get read, so they go to a temporary buffer and we copy out what was asked for
+	const int tile_y1 = (startScanline - level_dw.min.y) / td.ySize;
+	const int tile_y2 = (endScanline - level_dw.min.y) / td.ySize;
+	
+	const int band_top = level_dw.min.y + (tile_y1 * td.ySize);
+	const int band_bottom = min<int>(level_dw.max.y, level_dw.min.y + ((tile_y2 + 1) * td.ySize) - 1);
+	
+	const int width = (level_dw.max.x - level_dw.min.x) + 1;
+	const int height = (band_bottom - band_top) + 1;
+	
+	// one block carved up by channel, a vector of vectors could move
+	// the earlier buffers out from under their Slices as it grows
+	size_t band_bytes = 0;
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+		band_bytes += pixelTypeSize(i.slice().type) * width * height;
+	
+	vector<char> band_buf(band_bytes);
+	FrameBuffer band_fb;
+	
+	char *plane = (band_buf.empty() ? NULL : &band_buf[0]);
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+	{
+		const Slice &slice = i.slice();
+		
+		const size_t pix_size = pixelTypeSize(slice.type);
+		const size_t rowbytes = pix_size * width;
+		
+		char *origin = plane - (band_top * rowbytes) - (level_dw.min.x * pix_size);
+		
+		band_fb.insert(i.name(), Slice(slice.type, origin, pix_size, rowbytes, 1, 1, slice.fillValue) );
+		
+		plane += rowbytes * height;
+	}
+	
+	inPart.setFrameBuffer(band_fb);
+	
+	inPart.readTiles(0, inPart.numXTiles(level) - 1, tile_y1, tile_y2, level, level);
+	
+	for(int y = startScanline; y <= endScanline; y++)
+	{
+		CopyPixels(band_fb, part_fb, y, y, level_dw.min.x, level_dw.min.x, 1, width);
+	}
+}
+
+
+void
+HybridInputFile::readStridedPixels(int n, const FrameBuffer &part_fb, int scanLine1, int scanLine2, int level)
+{
+	const Box2i level_dw = levelDataWindow(level);
+	const Box2i &dataW = _multiPart.header(n).dataWindow();
+	
+	const int step = (1 << level);
+	
+	// the reduced pixels that land in this part
+	const int first_x = max(level_dw.min.x, level_dw.min.x + ((dataW.min.x - _dataWindow.min.x + step - 1) / step));
+	const int last_x = min(level_dw.max.x, level_dw.min.x + ((dataW.max.x - _dataWindow.min.x) / step));
+	
+	if(last_x < first_x)
+		return;
+	
+	// one full scanline at a time goes here, yStride of 0 so any y lands in it
+	const int width = (dataW.max.x - dataW.min.x) + 1;
+	
+	// one block carved up by channel, same as the tiled band above
+	size_t row_bytes = 0;
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+		row_bytes += pixelTypeSize(i.slice().type) * width;
+	
+	vector<char> row_buf(row_bytes);
+	FrameBuffer row_fb;
+	
+	char *row = (row_buf.empty() ? NULL : &row_buf[0]);
+	
+	for(FrameBuffer::ConstIterator i = part_fb.begin(); i != part_fb.end(); i++)
+	{
+		const Slice &slice = i.slice();
+		
+		const size_t pix_size = pixelTypeSize(slice.type);
+		
+		char *origin = row - (dataW.min.x * pix_size);
+		
+		row_fb.insert(i.name(), Slice(slice.type, origin, pix_size, 0, 1, 1, slice.fillValue) );
+		
+		row += pix_size * width;
+	}
+	
+	InputPart inPart(_multiPart, n);
+	
+	inPart.setFrameBuffer(row_fb);
+	
+	// skipping scanlines means skipping whole chunks once the step is bigger than the chunk
+	for(int y = max(scanLine1, level_dw.min.y); y <= min(scanLine2, level_dw.max.y); y++)
+	{
+		const int full_y = _dataWindow.min.y + ((y - level_dw.min.y) * step);
+		
+		if(full_y >= dataW.min.y && full_y <= dataW.max.y)
+		{
+			inPart.readPixels(full_y);
+			
+			const int full_x = _dataWindow.min.x + ((first_x - level_dw.min.x) * step);
+			
+			CopyPixels(row_fb, part_fb, 0, y, full_x, first_x, step, (last_x - first_x) + 1);
+		}
+	}
+}
+
+
 void
 HybridInputFile::setup()
 {
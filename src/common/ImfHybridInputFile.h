@@ -70,8 +70,21 @@ class IMF_EXPORT HybridInputFile : public GenericInputFile
     void		readPixels (int scanLine1, int scanLine2);
     void		readPixels (int scanLine) { readPixels(scanLine, scanLine); }
 	
+	// reduced reads for thumbnails and proxies: level n is 1/2^n the size, rounding down
+	// like a mipmap, with the frame buffer and scanlines in levelDataWindow(n) coordinates
+	IMATH_NAMESPACE::Box2i	levelDataWindow (int level) const;
+	
+	bool		partHasLevel (int part, int level) const; // or we'll be reading every 2^n-th pixel
+	
+    void		readPixels (int scanLine1, int scanLine2, int level);
+	
   private:
 	void setup();
+	
+	FrameBuffer partFrameBuffer (int part) const;
+	
+	void readLevelPixels (int part, const FrameBuffer &part_fb, int scanLine1, int scanLine2, int level);
+	void readStridedPixels (int part, const FrameBuffer &part_fb, int scanLine1, int scanLine2, int level);
 
   private:
 	MultiPartInputFile _multiPart;
@@ -0,0 +1,215 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "ProEXR_FileCache.h"
+
+using namespace IlmThread;
+using namespace std;
+
+
+ProEXR_FileCache::ProEXR_FileCache(Imf::Int64 max_bytes) :
+	_max_bytes(max_bytes),
+	_bytes(0)
+{
+
+}
+
+
+ProEXR_FileCache::~ProEXR_FileCache()
+{
+	// entries left over belong to a host that's gone now, so they're left alone
+}
+
+
+ProEXR_FileCacheEntry *
+ProEXR_FileCache::acquire(ProEXR_FileCacheMemory &memory, const string &key, void **buf)
+{
+	Lock lock(_mutex);
+	
+	for(EntryList::iterator i = _entries.begin(); i != _entries.end(); ++i)
+	{
+		ProEXR_FileCacheEntry *entry = *i;
+		
+		if(entry->key == key)
+		{
+			*buf = memory.lockHandle(entry->handle);
+			
+			if(*buf == NULL)
+				return NULL;
+			
+			entry->refs++;
+			entry->last_access = time(NULL);
+			
+			_entries.splice(_entries.begin(), _entries, i);
+			
+			return entry;
+		}
+	}
+	
+	return NULL;
+}
+
+
+ProEXR_FileCacheEntry *
+ProEXR_FileCache::create(ProEXR_FileCacheMemory &memory, const string &key, Imf::Int64 size, void **buf)
+{
+	Lock lock(_mutex);
+	
+	trim(memory, size);
+	
+	void *handle = memory.newHandle(size);
+	
+	if(handle == NULL)
+		return NULL;
+	
+	*buf = memory.lockHandle(handle);
+	
+	if(*buf == NULL)
+	{
+		memory.freeHandle(handle);
+		
+		return NULL;
+	}
+	
+	ProEXR_FileCacheEntry *entry = new ProEXR_FileCacheEntry;
+	
+	entry->handle = handle;
+	entry->key = key;
+	entry->size = size;
+	entry->last_access = time(NULL);
+	entry->refs = 1;
+	entry->shared = false;
+	
+	return entry;
+}
+
+
+void
+ProEXR_FileCache::share(ProEXR_FileCacheEntry *entry)
+{
+	Lock lock(_mutex);
+	
+	_entries.push_front(entry);
+	
+	_bytes += entry->size;
+	
+	entry->shared = true;
+}
+
+
+void
+ProEXR_FileCache::release(ProEXR_FileCacheMemory &memory, ProEXR_FileCacheEntry *entry)
+{
+	Lock lock(_mutex);
+	
+	memory.unlockHandle(entry->handle);
+	
+	entry->refs--;
+	entry->last_access = time(NULL);
+	
+	if(!entry->shared)
+	{
+		if(entry->refs == 0)
+			freeEntry(memory, entry);
+	}
+	else
+		trim(memory, 0);
+}
+
+
+void
+ProEXR_FileCache::purge(ProEXR_FileCacheMemory &memory, int timeout)
+{
+	Lock lock(_mutex);
+	
+	EntryList::iterator i = _entries.begin();
+	
+	while(i != _entries.end())
+	{
+		ProEXR_FileCacheEntry *entry = *i;
+		
+		if(entry->refs == 0 && (timeout == 0 || (difftime(time(NULL), entry->last_access) > timeout)) )
+		{
+			freeEntry(memory, entry);
+			
+			i = _entries.erase(i);
+		}
+		else
+			++i;
+	}
+}
+
+
+Imf::Int64
+ProEXR_FileCache::bytes() const
+{
+	Lock lock(_mutex);
+	
+	return _bytes;
+}
+
+
+int
+ProEXR_FileCache::entries() const
+{
+	Lock lock(_mutex);
+	
+	return _entries.size();
+}
+
+
+void
+ProEXR_FileCache::freeEntry(ProEXR_FileCacheMemory &memory, ProEXR_FileCacheEntry *entry)
+{
+	memory.freeHandle(entry->handle);
+	
+	if(entry->shared)
+		_bytes -= entry->size;
+	
+	delete entry;
+}
+
+
+void
+ProEXR_FileCache::trim(ProEXR_FileCacheMemory &memory, Imf::Int64 room_for)
+{
+	// unless we're making room, the most recent one stays no matter how big it is
+	EntryList::iterator i = _entries.end();
+	
+	while(i != _entries.begin() && (_bytes + room_for) > _max_bytes)
+	{
+		--i;
+		
+		if(room_for == 0 && i == _entries.begin())
+			break;
+		
+		ProEXR_FileCacheEntry *entry = *i;
+		
+		if(entry->refs == 0)
+		{
+			freeEntry(memory, entry);
+			
+			i = _entries.erase(i);
+		}
+	}
+}
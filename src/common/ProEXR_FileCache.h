@@ -0,0 +1,101 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef __ProEXR_FileCache_H__
+#define __ProEXR_FileCache_H__
+
+#include <IlmThreadMutex.h>
+#include <ImfInt64.h>
+
+#include <time.h>
+
+#include <list>
+#include <string>
+
+
+// where the file cache gets its memory, the host's in a plug-in
+// a handle is only locked while somebody is reading from it
+class ProEXR_FileCacheMemory
+{
+  public:
+	virtual ~ProEXR_FileCacheMemory() {}
+	
+	virtual void *newHandle(Imf::Int64 size) = 0; // zeroed, NULL if there's no room
+	virtual void *lockHandle(void *handle) = 0; // NULL if it can't be locked
+	virtual void unlockHandle(void *handle) = 0;
+	virtual void freeHandle(void *handle) = 0;
+};
+
+
+// one whole file in memory
+typedef struct ProEXR_FileCacheEntry {
+	void			*handle;
+	std::string		key;
+	Imf::Int64		size;
+	time_t			last_access;
+	int				refs;
+	bool			shared;	// in the list where others can find it
+} ProEXR_FileCacheEntry;
+
+
+// files that were loaded whole, each one shared by everyone reading it
+// entries nobody is using go oldest first to stay under max_bytes,
+// but the most recent one stays no matter how big it is
+class ProEXR_FileCache
+{
+  public:
+	ProEXR_FileCache(Imf::Int64 max_bytes);
+	~ProEXR_FileCache(); // the host owns the memory, so purge() while it's still around
+	
+	// the entry for key with its buffer locked in *buf, or NULL
+	ProEXR_FileCacheEntry *acquire(ProEXR_FileCacheMemory &memory, const std::string &key, void **buf);
+	
+	// a new entry for the caller to fill, nobody else sees it until share()
+	ProEXR_FileCacheEntry *create(ProEXR_FileCacheMemory &memory, const std::string &key, Imf::Int64 size, void **buf);
+	void share(ProEXR_FileCacheEntry *entry);
+	
+	// unlocks the buffer, an entry that was never shared is freed right away
+	void release(ProEXR_FileCacheMemory &memory, ProEXR_FileCacheEntry *entry);
+	
+	// frees the entries nobody is using, if they haven't been touched in timeout seconds
+	void purge(ProEXR_FileCacheMemory &memory, int timeout=0);
+	
+	Imf::Int64 bytes() const; // in shared entries
+	int entries() const;
+	
+  private:
+	void freeEntry(ProEXR_FileCacheMemory &memory, ProEXR_FileCacheEntry *entry); // call with the lock held
+	void trim(ProEXR_FileCacheMemory &memory, Imf::Int64 room_for); // call with the lock held
+	
+	typedef std::list<ProEXR_FileCacheEntry *> EntryList; // most recently used in front
+	
+	const Imf::Int64 _max_bytes;
+	
+	mutable IlmThread::Mutex _mutex;
+	
+	EntryList _entries;
+	Imf::Int64 _bytes;
+};
+
+
+#endif // __ProEXR_FileCache_H__
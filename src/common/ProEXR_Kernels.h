@@ -0,0 +1,357 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef __ProEXR_Kernels_H__
+#define __ProEXR_Kernels_H__
+
+//
+// The pixel loops that have an SSE path, kept out here so the checks
+// next to vrimg2exr can hold them up against the plain versions.
+//
+
+#include <half.h>
+#include <ImfPixelType.h>
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define PROEXR_SSE2
+	#include <emmintrin.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define PROEXR_SSE
+	#include <xmmintrin.h>
+#endif
+
+
+// would this float come back from half exactly the same?
+static inline bool
+HalfExact(unsigned int bits)
+{
+	const unsigned int abs_bits = (bits & 0x7fffffff);
+	
+	if(abs_bits == 0 || abs_bits == 0x7f800000) // zero or infinity
+		return true;
+	
+	const int e = (int)(abs_bits >> 23) - 127;
+	
+	if(e < -24 || e > 15) // too small, too big, or NaN
+		return false;
+	
+	// half has 10 bits of mantissa, fewer once it goes denormal
+	const int dropped_bits = (e < -14 ? -1 - e : 13);
+	
+	return !( abs_bits & ((1u << dropped_bits) - 1) );
+}
+
+
+static inline bool
+HalfExactRow(const unsigned int *row, int width)
+{
+	int x = 0;
+	
+#ifdef PROEXR_SSE2
+	// normal half range with the low 13 bits clear covers most pixels,
+	// anything else gets the careful check
+	const __m128i abs_mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i low_mask = _mm_set1_epi32(0x00001fff);
+	const __m128i inf_bits = _mm_set1_epi32(0x7f800000);
+	const __m128i min_exp = _mm_set1_epi32(112); // 127 - 15
+	const __m128i max_exp = _mm_set1_epi32(143); // 127 + 16
+	const __m128i zero = _mm_setzero_si128();
+	
+	while(x + 4 <= width)
+	{
+		const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(row + x)), abs_mask);
+		const __m128i e = _mm_srli_epi32(v, 23);
+		
+		const __m128i normal = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(e, min_exp), _mm_cmplt_epi32(e, max_exp)),
+												_mm_cmpeq_epi32(_mm_and_si128(v, low_mask), zero) );
+		
+		const __m128i ok = _mm_or_si128(normal, _mm_or_si128(_mm_cmpeq_epi32(v, zero), _mm_cmpeq_epi32(v, inf_bits)) );
+		
+		if(_mm_movemask_epi8(ok) != 0xffff)
+		{
+			for(int i=0; i < 4; i++)
+			{
+				if( !HalfExact(row[x + i]) )
+					return false;
+			}
+		}
+		
+		x += 4;
+	}
+#endif
+	
+	while(x < width)
+	{
+		if( !HalfExact(row[x]) )
+			return false;
+		
+		x++;
+	}
+	
+	return true;
+}
+
+
+#define MAX_DEINTERLEAVE_DESTS	(4)
+
+// pulls channels out of an interleaved 4-channel float row (AE's ARGB),
+// channel[i] is which of the four goes to out_row[i] as type[i]
+static inline void
+DeinterleaveRow(const float *in, int width, int num_dests, const int *channel, const Imf::PixelType *type, void * const *out_row)
+{
+	assert(num_dests <= MAX_DEINTERLEAVE_DESTS);
+	
+	int x = 0;
+	
+#ifdef PROEXR_SSE
+	// four pixels at a time, transposed so each register holds one channel
+	while(x + 4 <= width)
+	{
+		__m128 plane[4];
+		
+		plane[0] = _mm_loadu_ps(in + 0);
+		plane[1] = _mm_loadu_ps(in + 4);
+		plane[2] = _mm_loadu_ps(in + 8);
+		plane[3] = _mm_loadu_ps(in + 12);
+		
+		_MM_TRANSPOSE4_PS(plane[0], plane[1], plane[2], plane[3]);
+		
+		for(int i=0; i < num_dests; i++)
+		{
+			if(type[i] == Imf::HALF)
+			{
+				float f[4];
+				
+				_mm_storeu_ps(f, plane[ channel[i] ]);
+				
+				half *out = (half *)out_row[i] + x;
+				
+				out[0] = f[0];
+				out[1] = f[1];
+				out[2] = f[2];
+				out[3] = f[3];
+			}
+			else
+				_mm_storeu_ps((float *)out_row[i] + x, plane[ channel[i] ]);
+		}
+		
+		in += 16;
+		x += 4;
+	}
+#endif
+	
+	while(x < width)
+	{
+		for(int i=0; i < num_dests; i++)
+		{
+			if(type[i] == Imf::HALF)
+				((half *)out_row[i])[x] = in[ channel[i] ];
+			else
+				((float *)out_row[i])[x] = in[ channel[i] ];
+		}
+		
+		in += 4;
+		x++;
+	}
+}
+
+
+enum {
+	CLASS_NAN = 0,
+	CLASS_INF,
+	CLASS_NIN,
+	CLASS_NUM
+};
+
+// what ClassifyRow should do with the bad values it finds
+typedef struct {
+	bool	diagnostic;				// white where a pixel is bad, black elsewhere
+	bool	replace[CLASS_NUM];		// otherwise swap in value[] for these classes
+	float	value[CLASS_NUM];
+} ClassifyOptions;
+
+// what one row found, each row gets its own so nobody has to lock anything
+typedef struct {
+	int		count[CLASS_NUM][4];	// by class and ARGB channel (alpha never counts)
+	int		bad_pixels;
+	int		left;					// of the bad pixels, -1 if there aren't any
+	int		right;
+} ClassifyReport;
+
+
+static inline void
+ClearClassifyReport(ClassifyReport &report)
+{
+	memset(&report, 0, sizeof(ClassifyReport));
+	
+	report.left = report.right = -1;
+}
+
+
+// NaN has all the exponent bits and some mantissa, inf and -inf are exact patterns,
+// the sign bit doesn't matter for NaN
+static inline void
+ClassifyPixel(const float *in, float *out, int x, const ClassifyOptions &options, ClassifyReport &report)
+{
+	unsigned int bits[4];
+	
+	memcpy(bits, in, sizeof(bits));
+	
+	float result[4] = { in[0], in[1], in[2], in[3] };
+	
+	bool bad = false;
+	
+	for(int c=1; c < 4; c++)
+	{
+		const unsigned int abs_bits = (bits[c] & 0x7fffffff);
+		
+		const int pixel_class = (abs_bits > 0x7f800000 ? CLASS_NAN :
+									bits[c] == 0x7f800000 ? CLASS_INF :
+									bits[c] == 0xff800000 ? CLASS_NIN :
+									CLASS_NUM);
+		
+		if(pixel_class != CLASS_NUM)
+		{
+			report.count[pixel_class][c]++;
+			
+			if(options.replace[pixel_class])
+				result[c] = options.value[pixel_class];
+			
+			bad = true;
+		}
+	}
+	
+	if(bad)
+	{
+		report.bad_pixels++;
+		
+		if(report.left < 0)
+			report.left = x;
+		
+		report.right = x;
+	}
+	
+	if(options.diagnostic)
+	{
+		result[0] = 1.0f;
+		result[1] = result[2] = result[3] = (bad ? 1.0f : 0.0f);
+	}
+	
+	memcpy(out, result, sizeof(result));
+}
+
+
+// a row of AE's ARGB float pixels, in and out can be the same
+static inline void
+ClassifyRow(const float *in, float *out, int width, const ClassifyOptions &options, ClassifyReport &report)
+{
+	int x = 0;
+	
+#ifdef PROEXR_SSE2
+	// a whole pixel per register, the masks are per channel
+	// so counting them also gives the per-channel counts
+	const __m128i rgb_lanes = _mm_set_epi32(-1, -1, -1, 0); // alpha in the low lane
+	const __m128i abs_mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i inf_bits = _mm_set1_epi32(0x7f800000);
+	const __m128i nin_bits = _mm_set1_epi32((int)0xff800000);
+	
+	const __m128 white = _mm_set1_ps(1.0f);
+	const __m128 black = _mm_set_ps(0.0f, 0.0f, 0.0f, 1.0f);
+	
+	const __m128i NaN_value = _mm_castps_si128( _mm_set1_ps(options.value[CLASS_NAN]) );
+	const __m128i inf_value = _mm_castps_si128( _mm_set1_ps(options.value[CLASS_INF]) );
+	const __m128i nin_value = _mm_castps_si128( _mm_set1_ps(options.value[CLASS_NIN]) );
+	
+	__m128i nan_count = _mm_setzero_si128();
+	__m128i inf_count = _mm_setzero_si128();
+	__m128i nin_count = _mm_setzero_si128();
+	
+	for(; x < width; x++)
+	{
+		const __m128i bits = _mm_loadu_si128((const __m128i *)(in + (x * 4)));
+		
+		// abs > inf is only true for NaN, compares are signed but abs is never negative
+		const __m128i is_nan = _mm_and_si128(_mm_cmpgt_epi32(_mm_and_si128(bits, abs_mask), inf_bits), rgb_lanes);
+		const __m128i is_inf = _mm_and_si128(_mm_cmpeq_epi32(bits, inf_bits), rgb_lanes);
+		const __m128i is_nin = _mm_and_si128(_mm_cmpeq_epi32(bits, nin_bits), rgb_lanes);
+		
+		// a mask lane is -1, so subtracting counts it
+		nan_count = _mm_sub_epi32(nan_count, is_nan);
+		inf_count = _mm_sub_epi32(inf_count, is_inf);
+		nin_count = _mm_sub_epi32(nin_count, is_nin);
+		
+		const bool bad = _mm_movemask_ps( _mm_castsi128_ps( _mm_or_si128(is_nan, _mm_or_si128(is_inf, is_nin)) ) ) != 0;
+		
+		if(bad)
+		{
+			report.bad_pixels++;
+			
+			if(report.left < 0)
+				report.left = x;
+			
+			report.right = x;
+		}
+		
+		if(options.diagnostic)
+		{
+			_mm_storeu_ps(out + (x * 4), (bad ? white : black));
+		}
+		else
+		{
+			__m128i result = bits;
+			
+			if(options.replace[CLASS_NAN])
+				result = _mm_or_si128(_mm_andnot_si128(is_nan, result), _mm_and_si128(is_nan, NaN_value));
+			
+			if(options.replace[CLASS_INF])
+				result = _mm_or_si128(_mm_andnot_si128(is_inf, result), _mm_and_si128(is_inf, inf_value));
+			
+			if(options.replace[CLASS_NIN])
+				result = _mm_or_si128(_mm_andnot_si128(is_nin, result), _mm_and_si128(is_nin, nin_value));
+			
+			_mm_storeu_si128((__m128i *)(out + (x * 4)), result);
+		}
+	}
+	
+	int counts[CLASS_NUM][4];
+	
+	_mm_storeu_si128((__m128i *)counts[CLASS_NAN], nan_count);
+	_mm_storeu_si128((__m128i *)counts[CLASS_INF], inf_count);
+	_mm_storeu_si128((__m128i *)counts[CLASS_NIN], nin_count);
+	
+	for(int n=0; n < CLASS_NUM; n++)
+		for(int c=0; c < 4; c++)
+			report.count[n][c] += counts[n][c];
+#endif
+	
+	for(; x < width; x++)
+		ClassifyPixel(in + (x * 4), out + (x * 4), x, options, report);
+}
+
+
+#endif // __ProEXR_Kernels_H__
@@ -0,0 +1,312 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#include "ProEXR_WriteQueue.h"
+
+#include <IlmThread.h>
+#include <Iex.h>
+
+#include <exception>
+#include <new>
+
+using namespace IlmThread;
+using namespace std;
+
+
+class ProEXR_WriteThread : public Thread
+{
+  public:
+	ProEXR_WriteThread(ProEXR_WriteQueue &queue) : _queue(queue), _finished(0) { start(); }
+	virtual ~ProEXR_WriteThread() { _finished.wait(); } // ~Thread joins too late, our members are gone by then
+	
+	virtual void run() { _queue.run(); _finished.post(); }
+	
+  private:
+	ProEXR_WriteQueue &_queue;
+	Semaphore _finished;
+};
+
+
+ProEXR_WriteQueue::ProEXR_WriteQueue(int threads, size_t max_bytes) :
+	_max_bytes(max_bytes),
+	_bytes(0),
+	_pending(0),
+	_failed(false),
+	_quit(false),
+	_waiters(0),
+	_work(0),
+	_done(0)
+{
+	if( supportsThreads() )
+	{
+		for(int i=0; i < threads; i++)
+			_threads.push_back( new ProEXR_WriteThread(*this) );
+	}
+}
+
+
+ProEXR_WriteQueue::~ProEXR_WriteQueue()
+{
+	try
+	{
+		finish();
+	}
+	catch(...) {}
+	
+	if(true) // making a scope for the Lock
+	{
+		Lock lock(_mutex);
+		
+		_quit = true;
+	}
+	
+	for(size_t i=0; i < _threads.size(); i++)
+		_work.post();
+	
+	for(size_t i=0; i < _threads.size(); i++)
+		delete _threads[i];
+}
+
+
+void
+ProEXR_WriteQueue::submit(ProEXR_WriteJob *job)
+{
+	if(job == NULL)
+		throw Iex::NullExc("job is NULL");
+	
+	if( _threads.empty() )
+	{
+		// no threads, so just do it
+		try
+		{
+			job->write();
+		}
+		catch(...)
+		{
+			delete job;
+			
+			throw;
+		}
+		
+		delete job;
+		
+		return;
+	}
+	
+	
+	const size_t job_size = job->size();
+	
+	reap();
+	
+	Lock lock(_mutex);
+	
+	// always let one through, even if it's bigger than the limit
+	while(_pending > 0 && (_bytes + job_size) > _max_bytes)
+	{
+		wait(lock);
+	}
+	
+	_queue.push_back(job);
+	
+	_bytes += job_size;
+	_pending++;
+	
+	_work.post();
+	
+	// this frame is fine, but the host has to hear about the one that wasn't
+	if(_failed)
+		throwError();
+}
+
+
+void
+ProEXR_WriteQueue::finish()
+{
+	Lock lock(_mutex);
+	
+	while(_pending > 0)
+	{
+		wait(lock);
+	}
+	
+	// nothing is running now, so this gets the last of them
+	lock.release();
+	
+	reap();
+	
+	lock.acquire();
+	
+	if(_failed)
+		throwError();
+}
+
+
+bool
+ProEXR_WriteQueue::idle() const
+{
+	Lock lock(_mutex);
+	
+	return (_pending == 0);
+}
+
+
+size_t
+ProEXR_WriteQueue::bytes() const
+{
+	Lock lock(_mutex);
+	
+	return _bytes;
+}
+
+
+void
+ProEXR_WriteQueue::reap()
+{
+	list<ProEXR_WriteJob *> finished;
+	
+	if(true) // making a scope for the Lock
+	{
+		Lock lock(_mutex);
+		
+		finished.swap(_finished);
+	}
+	
+	size_t freed = 0;
+	
+	for(list<ProEXR_WriteJob *>::iterator i = finished.begin(); i != finished.end(); ++i)
+	{
+		ProEXR_WriteJob *job = *i;
+		
+		freed += job->size();
+		
+		delete job;
+	}
+	
+	if(freed)
+	{
+		Lock lock(_mutex);
+		
+		_bytes -= freed;
+	}
+}
+
+
+void
+ProEXR_WriteQueue::wait(Lock &lock)
+{
+	// wait for a job to finish, then clean up after it
+	_waiters++;
+	
+	lock.release();
+	
+	_done.wait();
+	
+	reap();
+	
+	lock.acquire();
+}
+
+
+void
+ProEXR_WriteQueue::throwError()
+{
+	// report it once, the next frame gets a fresh start
+	const string error = _error;
+	
+	_failed = false;
+	_error = "";
+	
+	throw Iex::BaseExc(error);
+}
+
+
+void
+ProEXR_WriteQueue::run()
+{
+	while(true)
+	{
+		_work.wait();
+		
+		ProEXR_WriteJob *job = NULL;
+		
+		if(true) // making a scope for the Lock
+		{
+			Lock lock(_mutex);
+			
+			if(_quit)
+				return;
+			
+			if(_queue.empty())
+				continue;
+			
+			job = _queue.front();
+			
+			_queue.pop_front();
+		}
+		
+		
+		bool failed = false;
+		string error;
+		
+		try
+		{
+			job->write();
+		}
+		catch(bad_alloc &e)
+		{
+			failed = true;
+			error = "Out of memory writing EXR";
+		}
+		catch(exception &e)
+		{
+			failed = true;
+			error = e.what();
+		}
+		catch(...)
+		{
+			failed = true;
+			error = "Error writing EXR";
+		}
+		
+		
+		Lock lock(_mutex);
+		
+		_finished.push_back(job); // deleted by reap()
+		
+		if(failed && !_failed)
+		{
+			_failed = true;
+			_error = error;
+		}
+		
+		_pending--;
+		
+		// wake everyone up, they'll check for themselves
+		while(_waiters > 0)
+		{
+			_waiters--;
+			
+			_done.post();
+		}
+	}
+}
@@ -0,0 +1,109 @@
+
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+#ifndef __ProEXR_WriteQueue_H__
+#define __ProEXR_WriteQueue_H__
+
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <list>
+#include <vector>
+#include <string>
+
+
+// a frame that's ready to be compressed and written,
+// holding on to everything it needs to do that
+class ProEXR_WriteJob
+{
+  public:
+	virtual ~ProEXR_WriteJob() {}
+	
+	// called on a queue thread, throw if something goes wrong
+	virtual void write() = 0;
+	
+	// memory held until the job is deleted
+	virtual size_t size() const = 0;
+};
+
+
+class ProEXR_WriteThread;
+
+// compresses and writes frames on background threads so the host can get
+// on with rendering the next one
+// jobs are deleted on the thread calling submit() or finish(), so they
+// can hang on to host objects that shouldn't be touched from anywhere else
+class ProEXR_WriteQueue
+{
+  public:
+	ProEXR_WriteQueue(int threads, size_t max_bytes);
+	~ProEXR_WriteQueue(); // waits for everything to be written
+	
+	// we own the job from now on, waits while the queue is holding more than
+	// max_bytes, throws if an earlier job failed (that job's error, not this one's,
+	// which is queued all the same)
+	void submit(ProEXR_WriteJob *job);
+	
+	// waits until everything has been written, throws if anything failed
+	void finish();
+	
+	// true if everything has been written
+	bool idle() const;
+	
+	size_t bytes() const; // held by jobs that haven't been deleted yet
+	
+  private:
+	friend class ProEXR_WriteThread;
+	
+	void run(); // queue threads live here
+	
+	void reap(); // delete finished jobs, call without the lock
+	void wait(IlmThread::Lock &lock);
+	
+	void throwError(); // call with the lock held
+	
+	std::vector<ProEXR_WriteThread *> _threads;
+	
+	const size_t _max_bytes;
+	
+	mutable IlmThread::Mutex _mutex;
+	
+	std::list<ProEXR_WriteJob *> _queue;
+	std::list<ProEXR_WriteJob *> _finished;
+	
+	size_t _bytes;
+	int _pending; // queued plus running
+	
+	bool _failed;
+	std::string _error;
+	
+	bool _quit;
+	
+	int _waiters;
+	
+	IlmThread::Semaphore _work;
+	IlmThread::Semaphore _done;
+};
+
+
+#endif // __ProEXR_WriteQueue_H__
@@ -23,7 +23,13 @@
 
 #include "ProEXRdoc.h"
 
+#include "ProEXR_Kernels.h"
+
 #include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
 
 #include <Iex.h>
 
@@ -33,6 +39,27 @@
 #include <ImfStandardAttributes.h>
 #include <ImfTileDescriptionAttribute.h>
 #include <ImfArray.h>
+#include <ImfOutputPart.h>
+#include <ImfPartType.h>
+#include <ImfCompressor.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfFloatAttribute.h>
+#include <ImfVecAttribute.h>
+#include <ImfBoxAttribute.h>
+#include <ImfFloatVectorAttribute.h>
+#include <ImfStringAttribute.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
 
 
 using namespace Imf;
@@ -230,1522 +257,3087 @@ ConvertFloatRowTask::execute()
 	}
 }
 
-static int
-ScanlineBlockSize(const HybridInputFile &in)
+class HalfExactTask : public Task
 {
-	int block_size = 128;
+  public:
+	HalfExactTask(TaskGroup *group, ProEXRchannel *channel, char &exact) : Task(group), _channel(channel), _exact(exact) {}
+	virtual ~HalfExactTask() {}
 	
-	if(in.parts() > 1)
+	virtual void execute() { _exact = _channel->halfExact(); }
+
+  private:
+	ProEXRchannel *_channel;
+	char &_exact;
+};
+
+// finds the part of a channel that isn't zero, empty if it's all zero
+class ChannelBoundsTask : public Task
+{
+  public:
+	ChannelBoundsTask(TaskGroup *group, const ProEXRbuffer &buffer, Box2i &bounds);
+	virtual ~ChannelBoundsTask() {}
+	
+	virtual void execute();
+
+  private:
+	template <typename T>
+	void findBounds(T mask);
+	
+	const ProEXRbuffer _buffer;
+	Box2i &_bounds;
+};
+
+ChannelBoundsTask::ChannelBoundsTask(TaskGroup *group, const ProEXRbuffer &buffer, Box2i &bounds) :
+	Task(group),
+	_buffer(buffer),
+	_bounds(bounds)
+{
+
+}
+
+void
+ChannelBoundsTask::execute()
+{
+	// looking at the bits so -0 counts as zero
+	if(_buffer.type == Imf::HALF)
+		findBounds<unsigned short>(0x7fff);
+	else if(_buffer.type == Imf::FLOAT)
+		findBounds<unsigned int>(0x7fffffff);
+	else
+		findBounds<unsigned int>(0xffffffff);
+}
+
+template <typename T>
+void
+ChannelBoundsTask::findBounds(T mask)
+{
+	assert(_buffer.colbytes == sizeof(T));
+	
+	Box2i bounds; // starts empty
+	
+	const char *row = (const char *)_buffer.buf;
+	
+	for(int y=0; y < _buffer.height; y++)
 	{
-		// read the whole thing to minimize bouncing around
-		const Box2i &dw = in.dataWindow();
+		const T *pix = (const T *)row;
 		
-		block_size = dw.max.y - dw.min.y + 1;
-	}
-	else if( isTiled( in.version() ) )
-	{
-		const TileDescriptionAttribute *tiles = in.header(0).findTypedAttribute<TileDescriptionAttribute>("tiles");
+		int left = 0;
 		
-		if(tiles)
+		while(left < _buffer.width && !(pix[left] & mask))
+			left++;
+		
+		if(left < _buffer.width)
 		{
-			block_size = tiles->value().ySize;
+			int right = _buffer.width - 1;
 			
-			const Box2i &dataW = in.dataWindow();
-			const Box2i &dispW = in.displayWindow();
+			while(right > left && !(pix[right] & mask))
+				right--;
 			
-			if(dataW != dispW)
-				block_size *= 2; // might not be on tile boundries
+			bounds.extendBy( V2i(left, y) );
+			bounds.extendBy( V2i(right, y) );
 		}
+		
+		row += _buffer.rowbytes;
 	}
 	
-	return block_size;
+	_bounds = bounds;
 }
 
-#pragma mark-
+#define STATS_BAND_ROWS	(64)
 
-ProEXRchannel::ProEXRchannel(string name, Imf::PixelType pixelType) :
-	_name(name),
-	_pixelType(pixelType),
-	_doc(NULL),
-	_loaded(false),
-	_premultiplied(true),
-	_width(0),
-	_height(0),
-	_data(NULL),
-	_half_data(NULL),
-	_rowbytes(0),
-	_half_rowbytes(0)
+// a band of rows' worth of ChannelStats, put together afterwards
+typedef struct StatsBand {
+	float min;
+	float max;
+	double sum;
+	int finite;
+	int nan_count;
+	int inf_count;
+	Box2i bounds;
+	vector<unsigned int> histogram;
+} StatsBand;
+
+static inline float PixelFloat(const half &v) { return v; }
+static inline float PixelFloat(const float &v) { return v; }
+static inline float PixelFloat(const unsigned int &v) { return v; }
+
+// min, max, sum, NaN/Inf counts and non-zero bounds for a band
+class ChannelStatsTask : public Task
+{
+  public:
+	ChannelStatsTask(TaskGroup *group, const ProEXRbuffer &buffer, int start_row, int end_row, StatsBand &band);
+	virtual ~ChannelStatsTask() {}
+	
+	virtual void execute();
+
+  private:
+	template <typename T>
+	void gather();
+	
+	const ProEXRbuffer _buffer;
+	int _start_row;
+	int _end_row;
+	StatsBand &_band;
+};
+
+ChannelStatsTask::ChannelStatsTask(TaskGroup *group, const ProEXRbuffer &buffer, int start_row, int end_row, StatsBand &band) :
+	Task(group),
+	_buffer(buffer),
+	_start_row(start_row),
+	_end_row(end_row),
+	_band(band)
 {
 
 }
 
-ProEXRchannel::~ProEXRchannel()
+void
+ChannelStatsTask::execute()
 {
-	freeBuffers();
+	if(_buffer.type == Imf::HALF)
+		gather<half>();
+	else if(_buffer.type == Imf::FLOAT)
+		gather<float>();
+	else
+		gather<unsigned int>();
 }
 
-string
-ProEXRchannel::layerName() const
+template <typename T>
+void
+ChannelStatsTask::gather()
 {
-	assert( channelType() != CHANNEL_RESERVED);
+	assert(_buffer.colbytes == sizeof(T));
 	
-	if( channelType() == CHANNEL_LAYER )
+	float min_val = 0.f;
+	float max_val = 0.f;
+	double sum = 0.0;
+	int finite = 0;
+	int nan_count = 0;
+	int inf_count = 0;
+	Box2i bounds;
+	
+	for(int y=_start_row; y < _end_row; y++)
 	{
-		string layerName, channelName;
+		const T *pix = (const T *)((const char *)_buffer.buf + (y * _buffer.rowbytes));
 		
-		channelParts(layerName, channelName);
+		double row_sum = 0.0;
+		int left = -1;
+		int right = -1;
 		
-		return layerName;
-	}
-	else if( channelType() == CHANNEL_SINGLE )
-	{
-		return string("[") + _name + string("]");
+		for(int x=0; x < _buffer.width; x++)
+		{
+			const float val = PixelFloat(pix[x]);
+			
+			const unsigned int l = *(const unsigned int *)&val;
+			
+			if((l & 0x7f800000) == 0x7f800000)
+			{
+				if(l & 0x007fffff)
+					nan_count++;
+				else
+					inf_count++;
+				
+				// not zero, so it's in the bounds
+				if(left < 0)
+					left = x;
+				
+				right = x;
+			}
+			else
+			{
+				if(finite == 0)
+				{
+					min_val = max_val = val;
+				}
+				else if(val < min_val)
+					min_val = val;
+				else if(val > max_val)
+					max_val = val;
+				
+				row_sum += val;
+				finite++;
+				
+				if(val != 0.f)
+				{
+					if(left < 0)
+						left = x;
+					
+					right = x;
+				}
+			}
+		}
+		
+		sum += row_sum;
+		
+		if(left >= 0)
+		{
+			bounds.extendBy( V2i(left, y) );
+			bounds.extendBy( V2i(right, y) );
+		}
 	}
+	
+	_band.min = min_val;
+	_band.max = max_val;
+	_band.sum = sum;
+	_band.finite = finite;
+	_band.nan_count = nan_count;
+	_band.inf_count = inf_count;
+	_band.bounds = bounds;
+}
+
+// once we know the range, count the finite pixels going into each bin
+class ChannelHistogramTask : public Task
+{
+  public:
+	ChannelHistogramTask(TaskGroup *group, const ProEXRbuffer &buffer, int start_row, int end_row,
+							float min_val, float max_val, vector<unsigned int> &histogram);
+	virtual ~ChannelHistogramTask() {}
+	
+	virtual void execute();
+
+  private:
+	template <typename T>
+	void count();
+	
+	const ProEXRbuffer _buffer;
+	int _start_row;
+	int _end_row;
+	float _min;
+	float _max;
+	vector<unsigned int> &_histogram;
+};
+
+ChannelHistogramTask::ChannelHistogramTask(TaskGroup *group, const ProEXRbuffer &buffer, int start_row, int end_row,
+											float min_val, float max_val, vector<unsigned int> &histogram) :
+	Task(group),
+	_buffer(buffer),
+	_start_row(start_row),
+	_end_row(end_row),
+	_min(min_val),
+	_max(max_val),
+	_histogram(histogram)
+{
+
+}
+
+void
+ChannelHistogramTask::execute()
+{
+	if(_buffer.type == Imf::HALF)
+		count<half>();
+	else if(_buffer.type == Imf::FLOAT)
+		count<float>();
 	else
-		return _name;
+		count<unsigned int>();
 }
 
-string
-ProEXRchannel::channelName() const
+template <typename T>
+void
+ChannelHistogramTask::count()
 {
-	if( channelType() == CHANNEL_LAYER )
+	_histogram.assign(CHANNEL_STATS_BINS, 0);
+	
+	const double scale = (_max > _min ? (double)CHANNEL_STATS_BINS / ((double)_max - (double)_min) : 0.0);
+	
+	for(int y=_start_row; y < _end_row; y++)
 	{
-		string layerName, channelName;
-		
-		channelParts(layerName, channelName);
+		const T *pix = (const T *)((const char *)_buffer.buf + (y * _buffer.rowbytes));
 		
-		return channelName;
+		for(int x=0; x < _buffer.width; x++)
+		{
+			const float val = PixelFloat(pix[x]);
+			
+			const unsigned int l = *(const unsigned int *)&val;
+			
+			if((l & 0x7f800000) != 0x7f800000)
+			{
+				const int bin = ((double)val - (double)_min) * scale;
+				
+				_histogram[ MIN(bin, CHANNEL_STATS_BINS - 1) ]++;
+			}
+		}
 	}
+}
+
+#define PREVIEW_SIZE	(256)
+
+static inline float
+BufferFloat(const ProEXRbuffer &buffer, int x, int y)
+{
+	const char *pix = (const char *)buffer.buf + (y * buffer.rowbytes) + (x * buffer.colbytes);
+	
+	if(buffer.type == Imf::HALF)
+		return *(const half *)pix;
+	else if(buffer.type == Imf::FLOAT)
+		return *(const float *)pix;
 	else
-		return _name;
+		return *(const unsigned int *)pix;
+}
+
+// the curve from the OpenEXR preview image example
+static inline unsigned char
+PreviewGamma(float x)
+{
+	if( !(x > 0.f) ) // NaN too
+		return 0;
+	
+	x = pow(5.5555f * x, 0.4545f) * 84.66f;
+	
+	return (x < 255.f ? (unsigned char)x : 255);
+}
+
+static inline unsigned char
+PreviewAlpha(float x)
+{
+	if( !(x > 0.f) )
+		return 0;
+	
+	x = (x * 255.f) + 0.5f;
+	
+	return (x < 255.f ? (unsigned char)x : 255);
+}
+
+// box filters one row of the preview
+class PreviewRowTask : public Task
+{
+  public:
+	PreviewRowTask(TaskGroup *group, const ProEXRbuffer *rgba[4], PreviewImage &preview, int y);
+	virtual ~PreviewRowTask() {}
+	
+	virtual void execute();
+
+  private:
+	const ProEXRbuffer *_rgba[4]; // alpha can be NULL
+	PreviewImage &_preview;
+	int _y;
+};
+
+PreviewRowTask::PreviewRowTask(TaskGroup *group, const ProEXRbuffer *rgba[4], PreviewImage &preview, int y) :
+	Task(group),
+	_preview(preview),
+	_y(y)
+{
+	for(int c=0; c < 4; c++)
+		_rgba[c] = rgba[c];
 }
 
 void
-ProEXRchannel::incrementName()
+PreviewRowTask::execute()
 {
-	if( channelType() == CHANNEL_LAYER )
+	const int width = _rgba[0]->width;
+	const int height = _rgba[0]->height;
+	
+	const int preview_width = _preview.width();
+	const int preview_height = _preview.height();
+	
+	const int top = (_y * height) / preview_height;
+	const int bottom = MAX(top + 1, ((_y + 1) * height) / preview_height);
+	
+	PreviewRgba *out = &_preview.pixel(0, _y);
+	
+	for(int px=0; px < preview_width; px++)
 	{
-		string layerName, channelName;
+		const int left = (px * width) / preview_width;
+		const int right = MAX(left + 1, ((px + 1) * width) / preview_width);
 		
-		channelParts(layerName, channelName);
+		float sum[4] = { 0.f, 0.f, 0.f, 0.f };
 		
-		incrementText(layerName);
+		for(int y=top; y < bottom; y++)
+		{
+			for(int x=left; x < right; x++)
+			{
+				for(int c=0; c < 4; c++)
+				{
+					if(_rgba[c])
+						sum[c] += BufferFloat(*_rgba[c], x, y);
+				}
+			}
+		}
 		
-		_name = layerName + "." + channelName;
-	}
-	else if( channelType() == CHANNEL_SINGLE )
-	{
-		incrementText(_name);
-	}
-	else // reserved, I guess
-	{
-		_name = "layer1." + _name;
+		const float count = (bottom - top) * (right - left);
+		
+		out->r = PreviewGamma(sum[0] / count);
+		out->g = PreviewGamma(sum[1] / count);
+		out->b = PreviewGamma(sum[2] / count);
+		out->a = (_rgba[3] ? PreviewAlpha(sum[3] / count) : 255);
+		
+		out++;
 	}
 }
 
-ChanTag
-ProEXRchannel::channelTag() const
+#define DOWNSAMPLE_BAND_ROWS	(32)
+
+// makes a band of rows for the next level down, halving in x and/or y
+// with a box filter (UINT gets point sampled, averaging IDs makes no sense)
+class DownsampleTask : public Task
 {
-	string n = channelName();
+  public:
+	DownsampleTask(TaskGroup *group, const ProEXRbuffer &source, const ProEXRbuffer &dest, int start_row, int end_row);
+	virtual ~DownsampleTask() {}
 	
-	     if(n == "R" || n == "r" || n == "RED" || n == "Red" || n == "red") return CHAN_R;
-	else if(n == "G" || n == "g" || n == "GREEN" || n == "Green" || n == "green") return CHAN_G;
-	else if(n == "B" || n == "b" || n == "BLUE" || n == "Blue" || n == "blue") return CHAN_B;
-	else if(n == "A" || n == "a" || n == "ALPHA" || n == "Alpha" || n == "alpha") return CHAN_A;
-	else if(n == "Y") return CHAN_Y;
-	else if(n == "RY") return CHAN_RY;
-	else if(n == "BY") return CHAN_BY;
-	else if(n == "AR") return CHAN_AR;
-	else if(n == "AG") return CHAN_AG;
-	else if(n == "AB") return CHAN_AB;
-	else
-		return CHAN_GENERAL;
+	virtual void execute();
+
+  private:
+	template <typename T>
+	void average();
+	
+	void pointSample();
+	
+	const ProEXRbuffer _source;
+	const ProEXRbuffer _dest;
+	int _start_row;
+	int _end_row;
+};
+
+DownsampleTask::DownsampleTask(TaskGroup *group, const ProEXRbuffer &source, const ProEXRbuffer &dest, int start_row, int end_row) :
+	Task(group),
+	_source(source),
+	_dest(dest),
+	_start_row(start_row),
+	_end_row(end_row)
+{
+
 }
 
-ChannelType
-ProEXRchannel::channelType() const
+void
+DownsampleTask::execute()
 {
-	if(	_name == "R" ||	_name == "G" ||	_name == "B" ||	_name == "A" ||
-		_name == "Y" || _name == "RY"||	_name == "BY"||
-		_name == "AR"||	_name == "AG"||	_name == "AB"	)
-	{
-		return CHANNEL_RESERVED;
-	}
+	if(_source.type == Imf::HALF)
+		average<half>();
+	else if(_source.type == Imf::FLOAT)
+		average<float>();
 	else
+		pointSample();
+}
+
+template <typename T>
+void
+DownsampleTask::average()
+{
+	assert(_dest.type == Imf::FLOAT);
+	
+	const bool half_x = (_dest.width < _source.width);
+	const bool half_y = (_dest.height < _source.height);
+	
+	for(int y=_start_row; y < _end_row; y++)
 	{
-		string layerName, channelName;
+		const T *in_a = (const T *)((const char *)_source.buf + ((half_y ? y * 2 : y) * _source.rowbytes));
+		const T *in_b = (const T *)((const char *)in_a + (half_y ? _source.rowbytes : 0));
 		
-		channelParts(layerName, channelName);
+		float *out = (float *)((char *)_dest.buf + (y * _dest.rowbytes));
 		
-		if(layerName == "")
+		if(half_x)
 		{
-			// this channel not part of a layer
-			return CHANNEL_SINGLE;
+			for(int x=0; x < _dest.width; x++)
+			{
+				const float a = PixelFloat(in_a[x * 2]) + PixelFloat(in_a[(x * 2) + 1]);
+				const float b = PixelFloat(in_b[x * 2]) + PixelFloat(in_b[(x * 2) + 1]);
+				
+				out[x] = (a + b) * 0.25f;
+			}
 		}
 		else
-			return CHANNEL_LAYER;
+		{
+			for(int x=0; x < _dest.width; x++)
+				out[x] = (PixelFloat(in_a[x]) + PixelFloat(in_b[x])) * 0.5f;
+		}
 	}
 }
 
 void
-ProEXRchannel::assignDoc(ProEXRdoc *doc)
+DownsampleTask::pointSample()
 {
-	_doc = doc;
+	assert(_dest.type == Imf::UINT);
 	
-	_width = doc->width();
-	_height = doc->height();
+	const int step_x = (_dest.width < _source.width ? 2 : 1);
+	const int step_y = (_dest.height < _source.height ? 2 : 1);
+	
+	for(int y=_start_row; y < _end_row; y++)
+	{
+		const unsigned int *in = (const unsigned int *)((const char *)_source.buf + (y * step_y * _source.rowbytes));
+		
+		unsigned int *out = (unsigned int *)((char *)_dest.buf + (y * _dest.rowbytes));
+		
+		for(int x=0; x < _dest.width; x++)
+			out[x] = in[x * step_x];
+	}
 }
 
-void
-ProEXRchannel::allocateBuffers(bool allocate_half)
+// all the channels at one tile level
+class LevelBuffers
 {
-	assert(_width && _height);
-	
-	// we always allocate the full-size FLOAT/UINT buffer
-	// only allocate half if we have to (usually for writing half channels only)
+  public:
+	LevelBuffers(const vector<ProEXRbuffer> &buffers); // the full size channels, not ours to free
+	LevelBuffers(const LevelBuffers &source, int width, int height); // downsampled from the level above
+	~LevelBuffers();
 	
-	size_t colbytes, half_colbytes;
-	size_t buf_size, half_buf_size;
+	void write(TiledOutputFile &file, const vector<string> &names, const Box2i &dw, int lx, int ly) const;
+
+  private:
+	vector<ProEXRbuffer> _buffers;
+	bool _own_buffers;
 	
-	colbytes = 4;
-	_rowbytes = colbytes * _width;
-	buf_size = _rowbytes * _height;
-	
-	if(allocate_half)
+	LevelBuffers(const LevelBuffers &other); // no copying
+	LevelBuffers & operator = (const LevelBuffers &other);
+};
+
+LevelBuffers::LevelBuffers(const vector<ProEXRbuffer> &buffers) :
+	_buffers(buffers),
+	_own_buffers(false)
+{
+
+}
+
+LevelBuffers::LevelBuffers(const LevelBuffers &source, int width, int height) :
+	_own_buffers(true)
+{
+	for(int c=0; c < source._buffers.size(); c++)
 	{
-		assert(_pixelType == Imf::HALF);
+		ProEXRbuffer buffer;
 		
-		half_colbytes = 2;
-		_half_rowbytes = half_colbytes * _width;
-		half_buf_size = _half_rowbytes * _height;
-	}
-	else
-	{
-		half_colbytes = 0;
-		_half_rowbytes = 0;
-		half_buf_size = 0;
-	}
-	
-	queryAbort();
-	
-	if(_data == NULL)
-	{
-		_data = malloc(buf_size);
+		buffer.type = (source._buffers[c].type == Imf::UINT ? Imf::UINT : Imf::FLOAT);
+		buffer.width = width;
+		buffer.height = height;
+		buffer.colbytes = pixelTypeSize(buffer.type);
+		buffer.rowbytes = buffer.colbytes * width;
+		buffer.buf = malloc(buffer.rowbytes * height);
 		
-		if(_data == NULL)
-			throw bad_alloc();
+		if(buffer.buf == NULL)
+		{
+			for(int i=0; i < _buffers.size(); i++)
+				free(_buffers[i].buf);
 			
-		memset(_data, 0, buf_size);
+			throw BaseExc("Out of memory making tile levels.");
+		}
+		
+		_buffers.push_back(buffer);
 	}
 	
-	queryAbort();
+	TaskGroup taskGroup;
 	
-	if(half_buf_size && _half_data == NULL)
+	for(int c=0; c < _buffers.size(); c++)
 	{
-		_half_data = malloc(half_buf_size);
-		
-		if(_half_data == NULL)
-			throw bad_alloc();
-			
-		memset(_half_data, 0, half_buf_size);
+		for(int y=0; y < height; y += DOWNSAMPLE_BAND_ROWS)
+		{
+			ThreadPool::addGlobalTask(new DownsampleTask(&taskGroup, source._buffers[c], _buffers[c],
+															y, MIN(y + DOWNSAMPLE_BAND_ROWS, height)) );
+		}
 	}
-	
-	queryAbort();
 }
 
-void
-ProEXRchannel::freeBuffers()
+LevelBuffers::~LevelBuffers()
 {
-	if(_data)
+	if(_own_buffers)
 	{
-		free(_data);
-		_data = NULL;
-		_rowbytes = 0;
+		for(int c=0; c < _buffers.size(); c++)
+			free(_buffers[c].buf);
 	}
+}
+
+void
+LevelBuffers::write(TiledOutputFile &file, const vector<string> &names, const Box2i &dw, int lx, int ly) const
+{
+	FrameBuffer frameBuffer;
 	
-	if(_half_data)
+	for(int c=0; c < _buffers.size(); c++)
 	{
-		free(_half_data);
-		_half_data = NULL;
-		_half_rowbytes = 0;
+		const ProEXRbuffer &buffer = _buffers[c];
+		
+		char *exr_origin = (char *)buffer.buf - (dw.min.y * buffer.rowbytes) - (dw.min.x * buffer.colbytes);
+		
+		frameBuffer.insert(names[c].c_str(), Slice(buffer.type, exr_origin, buffer.colbytes, buffer.rowbytes) );
 	}
 	
-	_loaded = false;
+	file.setFrameBuffer(frameBuffer);
+	
+	file.writeTiles(0, file.numXTiles(lx) - 1, 0, file.numYTiles(ly) - 1, lx, ly);
 }
 
+#define TRIAL_SCANLINES		(64)
+#define TRIAL_DECODE_RUNS	(3)
 
-ProEXRbuffer
-ProEXRchannel::getBufferDesc(bool use_half)
+// decoding at this many bytes a second adds the speed weight to a score,
+// the same as the file growing by that fraction of the raw strip
+#define TRIAL_REFERENCE_RATE	(200.0 * 1024.0 * 1024.0)
+
+static double
+Seconds()
 {
-	// allocate half if we're getting a float buffer that will
-	// get converted to half for writing
-	assert(_width && _height);
-	 
-	if(_data == NULL || (use_half && _half_data == NULL) )
-		allocateBuffers(use_half && _pixelType == Imf::HALF);
+#ifdef WIN32
+	LARGE_INTEGER count, frequency;
 	
-	assert(_data);
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
 	
-	if(_pixelType == Imf::HALF && use_half)
-	{
-		assert(_half_data);
-		assert(_loaded);
-		
-		copyToHalf();
-		
-		ProEXRbuffer desc = { _pixelType, _half_data, _width, _height, sizeof(half), _half_rowbytes };
-		
-		return desc;
-	}
-	else
-	{
-		Imf::PixelType pixelType = (_pixelType == Imf::UINT ? Imf::UINT : Imf::FLOAT);
+	return ((double)count.QuadPart / (double)frequency.QuadPart);
+#else
+	struct timeval tv;
 	
-		ProEXRbuffer desc = { pixelType, _data, _width, _height, sizeof(float), _rowbytes };
-		
-		return desc;
-	}
+	gettimeofday(&tv, NULL);
+	
+	return ((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+#endif
 }
 
-void
-ProEXRchannel::fill(float val)
+static const char *
+CompressionName(Compression compression)
 {
-	if(_data == NULL)
-		allocateBuffers();
-		
-	char *buf_row = (char *)_data;
-	
-	for(int y=0; y < _height; y++)
+	switch(compression)
 	{
-		float *buf_pix = (float *)buf_row;
-		
-		for(int x=0; x < _width; x++)
-			*buf_pix++ = val;
-		
-		buf_row += _rowbytes;
+		case NO_COMPRESSION:		return "none";
+		case RLE_COMPRESSION:		return "rle";
+		case ZIPS_COMPRESSION:		return "zips";
+		case ZIP_COMPRESSION:		return "zip";
+		case PIZ_COMPRESSION:		return "piz";
+		case PXR24_COMPRESSION:		return "pxr24";
+		case B44_COMPRESSION:		return "b44";
+		case B44A_COMPRESSION:		return "b44a";
+		case DWAA_COMPRESSION:		return "dwaa";
+		case DWAB_COMPRESSION:		return "dwab";
+		default:					return "unknown";
 	}
 }
 
+ProEXRcompressionTrial::ProEXRcompressionTrial(const Header &header, const vector<char> &strip, size_t line_size, Compression compression) :
+	_header(header),
+	_strip(strip),
+	_line_size(line_size),
+	_compression(compression),
+	_compressor(NULL),
+	_block_lines(0),
+	_ok(false),
+	_size(0),
+	_seconds(-1.0)
+{
+
+}
+
+ProEXRcompressionTrial::~ProEXRcompressionTrial()
+{
+	if(_compressor)
+		delete _compressor;
+}
+
 void
-ProEXRchannel::premultiply(ProEXRchannel *alpha, bool force)
+ProEXRcompressionTrial::packStrip(const Header &header, const FrameBuffer &frameBuffer, vector<char> &strip, size_t &line_size)
 {
-	if(_loaded && alpha && alpha->_data && _data)
+	// scanlines in file order: each channel's row, channels sorted by name
+	const Box2i &dw = header.dataWindow();
+	const int width = (dw.max.x - dw.min.x) + 1;
+	const int height = (dw.max.y - dw.min.y) + 1;
+	
+	line_size = 0;
+	
+	for(ChannelList::ConstIterator i = header.channels().begin(); i != header.channels().end(); ++i)
+		line_size += width * pixelTypeSize(i.channel().type);
+	
+	strip.resize(line_size * height);
+	
+	if(strip.empty())
+		return;
+	
+	char *out = &strip[0];
+	
+	for(int y = dw.min.y; y <= dw.max.y; y++)
 	{
-		assert(_width == alpha->_width);
-		assert(_height == alpha->_height);
-		assert(alpha->_pixelType != Imf::UINT);
-		
-		if(_pixelType != Imf::UINT)
+		for(ChannelList::ConstIterator i = header.channels().begin(); i != header.channels().end(); ++i)
 		{
-			if(!_premultiplied || force)
+			const Slice &slice = frameBuffer[ i.name() ];
+			const size_t pix_size = pixelTypeSize(slice.type);
+			
+			const char *pix = slice.base + (y * slice.yStride) + (dw.min.x * slice.xStride);
+			
+			if(slice.xStride == pix_size)
 			{
-				TaskGroup taskGroup;
-				
-				char *buf_row = (char *)_data;
-				char *alpha_row = (char *)alpha->_data;
+				memcpy(out, pix, width * pix_size);
 				
-				for(int y=0; y < _height; y++)
+				out += width * pix_size;
+			}
+			else
+			{
+				for(int x=0; x < width; x++)
 				{
-					ThreadPool::addGlobalTask(new PremultiplyRowTask(&taskGroup,
-																		(float *)buf_row,
-																		(float *)alpha_row,
-																		_width) );
-					buf_row += _rowbytes;
-					alpha_row += alpha->_rowbytes;
+					memcpy(out, pix, pix_size);
+					
+					out += pix_size;
+					pix += slice.xStride;
 				}
-				
-				_premultiplied = true;
 			}
 		}
 	}
 }
 
 void
-ProEXRchannel::unMult(ProEXRchannel *alpha)
+ProEXRcompressionTrial::compress()
 {
-	if(_loaded && alpha && alpha->_data && _data)
+	try
 	{
-		assert(_width == alpha->_width);
-		assert(_height == alpha->_height);
-		assert(alpha->_pixelType != Imf::UINT);
+		const Box2i &dw = _header.dataWindow();
 		
-		if(_pixelType != Imf::UINT)
+		_compressor = newCompressor(_compression, _line_size, _header);
+		
+		// no compressor means the whole strip is one raw block
+		_block_lines = (_compressor ? _compressor->numScanLines() : (dw.max.y - dw.min.y) + 1);
+		
+		_blocks.clear();
+		_size = 0;
+		
+		for(int y = dw.min.y; y <= dw.max.y; y += _block_lines)
 		{
-			if(_premultiplied)
+			const int lines = min(_block_lines, (dw.max.y - y) + 1);
+			const int in_size = lines * _line_size;
+			
+			const char *out = NULL;
+			
+			const int out_size = (_compressor ? _compressor->compress(&_strip[(y - dw.min.y) * _line_size], in_size, y, out) : in_size);
+			
+			// the file stores a block raw when compressing doesn't help
+			if(out_size < in_size)
 			{
-				TaskGroup taskGroup;
+				_blocks.push_back( vector<char>(out, out + out_size) );
 				
-				char *buf_row = (char *)_data;
-				char *alpha_row = (char *)alpha->_data;
-				
-				for(int y=0; y < _height; y++)
-				{
-					ThreadPool::addGlobalTask(new UnMultiplyRowTask(&taskGroup,
-																		(float *)buf_row,
-																		(float *)alpha_row,
-																		_width) );
-					buf_row += _rowbytes;
-					alpha_row += alpha->_rowbytes;
-				}
+				_size += out_size;
+			}
+			else
+			{
+				_blocks.push_back( vector<char>() );
 				
-				_premultiplied = false;
+				_size += in_size;
 			}
 		}
 		
-		queryAbort();
+		_ok = true;
+	}
+	catch(...)
+	{
+		// this one won't get picked
+		_ok = false;
 	}
 }
 
 void
-ProEXRchannel::alphaClip()
+ProEXRcompressionTrial::timeDecode(int runs)
 {
-	assert(channelTag() == CHAN_A);
-
-	if(_loaded && _data)
+	if(!_ok)
+		return;
+	
+	try
 	{
-		if(_pixelType != Imf::UINT)
+		const Box2i &dw = _header.dataWindow();
+		
+		// a raw block still gets copied out of the file's buffer
+		vector<char> raw_copy(_block_lines * _line_size);
+		
+		for(int r=0; r < runs; r++)
 		{
-			TaskGroup taskGroup;
+			const double start = Seconds();
 			
-			char *buf_row = (char *)_data;
+			int b = 0;
 			
-			for(int y=0; y < _height; y++)
+			for(int y = dw.min.y; y <= dw.max.y; y += _block_lines, b++)
 			{
-				ThreadPool::addGlobalTask(new AlphaClipRowTask(&taskGroup,
-																(float *)buf_row,
-																_width) );
-				buf_row += _rowbytes;
+				if( _blocks[b].empty() )
+				{
+					const int lines = min(_block_lines, (dw.max.y - y) + 1);
+					
+					memcpy(&raw_copy[0], &_strip[(y - dw.min.y) * _line_size], lines * _line_size);
+				}
+				else
+				{
+					const char *out = NULL;
+					
+					_compressor->uncompress(&_blocks[b][0], _blocks[b].size(), y, out);
+				}
 			}
+			
+			const double seconds = Seconds() - start;
+			
+			// the fastest run is the one with the least else going on
+			if(r == 0 || seconds < _seconds)
+				_seconds = seconds;
 		}
-		
-		queryAbort();
+	}
+	catch(...)
+	{
+		_ok = false;
 	}
 }
 
-void
-ProEXRchannel::killNaN()
+double
+ProEXRcompressionTrial::score(float speed_weight) const
 {
-	if(_loaded && _data)
+	// size and time both against the raw strip, so every trial gets the same ruler
+	const double raw_size = max<size_t>(_strip.size(), 1);
+	
+	return ((double)_size / raw_size) + (speed_weight * (_seconds * TRIAL_REFERENCE_RATE / raw_size));
+}
+
+// the compressing half of a trial, these run side by side
+class CompressionTrialTask : public Task
+{
+  public:
+	CompressionTrialTask(TaskGroup *group, ProEXRcompressionTrial *trial) : Task(group), _trial(trial) {}
+	virtual ~CompressionTrialTask() {}
+	
+	virtual void execute() { _trial->compress(); }
+
+  private:
+	ProEXRcompressionTrial *_trial;
+};
+
+static int
+ScanlineBlockSize(const HybridInputFile &in)
+{
+	int block_size = 128;
+	
+	if(in.parts() > 1)
 	{
-		TaskGroup taskGroup;
+		// read the whole thing to minimize bouncing around
+		const Box2i &dw = in.dataWindow();
 		
-		char *buf_row = (char *)_data;
+		block_size = dw.max.y - dw.min.y + 1;
+	}
+	else if( isTiled( in.version() ) )
+	{
+		const TileDescriptionAttribute *tiles = in.header(0).findTypedAttribute<TileDescriptionAttribute>("tiles");
 		
-		for(int y=0; y < _height; y++)
+		if(tiles)
 		{
-			ThreadPool::addGlobalTask(new KillNaNRowTask(&taskGroup,
-															(float *)buf_row,
-															_width) );
-			buf_row += _rowbytes;
+			block_size = tiles->value().ySize;
+			
+			const Box2i &dataW = in.dataWindow();
+			const Box2i &dispW = in.displayWindow();
+			
+			if(dataW != dispW)
+				block_size *= 2; // might not be on tile boundries
 		}
-		
-		queryAbort();
 	}
+	
+	return block_size;
 }
 
-void
-ProEXRchannel::queryAbort()
-{
-	if(_doc)
-		_doc->queryAbort();
-}
+#pragma mark-
 
-void
-ProEXRchannel::channelParts(string &layerName, string &channelName) const
+#ifndef WIN32
+// a sparse file would SIGBUS us later when the disk fills up,
+// so get all the blocks now and let the caller fall back to RAM
+static bool
+ReserveScratch(int fd, size_t size)
 {
-	int dot_pos = _name.find_last_of('.');//, _name.size()-1);
+#ifdef __APPLE__
+	fstore_t store;
 	
-	if(dot_pos == string::npos || dot_pos == 0 || dot_pos == _name.size()-1)
+	store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	store.fst_posmode = F_PEOFPOSMODE;
+	store.fst_offset = 0;
+	store.fst_length = size;
+	store.fst_bytesalloc = 0;
+	
+	if(fcntl(fd, F_PREALLOCATE, &store) == -1)
 	{
-		layerName = "";
-		channelName = _name;
-	}
-	else
-	{
-		layerName = _name.substr(0, dot_pos);
-		channelName = _name.substr(dot_pos + 1, _name.size() - dot_pos);
+		store.fst_flags = F_ALLOCATEALL; // contiguous was just a nicety
+		
+		if(fcntl(fd, F_PREALLOCATE, &store) == -1)
+			return false;
 	}
+	
+	return (ftruncate(fd, size) == 0);
+#else
+	return (posix_fallocate(fd, 0, size) == 0); // sets the length too
+#endif
 }
+#endif
 
-void
-ProEXRchannel::incrementText(string &name)
+// scratch files for channels that won't fit in memory
+// returns NULL if the file can't be made or the disk can't hold it, new files come to us zeroed
+static void *
+ScratchAlloc(const string &dir, size_t size)
 {
-	int num_numbers = 0;
+#ifndef WIN32
+	string path = dir + "/ProEXR.XXXXXX";
 	
-	while(string::npos != name.find_last_of("1234567890", name.size() - num_numbers - 1, 1) )
-		num_numbers++;
+	vector<char> path_buf(path.begin(), path.end());
+	path_buf.push_back('\0');
 	
-	if(num_numbers)
-	{
-		string base = name.substr(0, name.size() - num_numbers);
-		string num = name.substr(name.size() - num_numbers, num_numbers);
-		
-		int n = 0;
-		
-		istringstream num_ist( num );
-		num_ist >> n;
-		
-		n++;
-		
-		ostringstream num_ost;
-		num_ost << n;
-		string new_num = num_ost.str();
-		
-		name = base + new_num;
-	}
-	else
-		name += "2";
-}
-
-void
-ProEXRchannel::copyToHalf()
-{
-	if(_data && _half_data)
+	int fd = mkstemp(&path_buf[0]);
+	
+	if(fd < 0)
+		return NULL;
+	
+	unlink(&path_buf[0]); // goes away when we unmap
+	
+	void *ptr = NULL;
+	
+	if(ReserveScratch(fd, size))
 	{
-		if(_width == 0 || _height == 0)
-			throw BaseExc("Image has no size.");
-		
-		TaskGroup taskGroup;
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 		
-		char *float_row = (char *)_data;
-		char *half_row = (char *)_half_data;
-		
-		for(int y=0; y < _height; y++)
-		{
-			ThreadPool::addGlobalTask(new ConvertFloatRowTask(&taskGroup,
-																(float *)float_row,
-																(half *)half_row,
-																_width) );
-			float_row += _rowbytes;
-			half_row += _half_rowbytes;
-		}
+		if(ptr == MAP_FAILED)
+			ptr = NULL;
+		else
+			madvise(ptr, size, MADV_SEQUENTIAL);
 	}
 	
-	queryAbort();
-}
-
-ProEXRchannel_read::ProEXRchannel_read(string name, Imf::PixelType pixelType) :
-	ProEXRchannel(name, pixelType)
-{
-
-}
-
-ProEXRchannel_read::~ProEXRchannel_read()
-{
-
-}
-
-void
-ProEXRchannel_read::loadFromFile()
-{
-	if(doc() == NULL)
-		throw BaseExc("doc() is NULL");
+	close(fd);
 	
-	assert( !loaded() );
+	return ptr;
+#else
+	char path[MAX_PATH];
 	
-	ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
+	if( !GetTempFileNameA(dir.c_str(), "exr", 0, path) )
+		return NULL;
 	
-	ProEXRbuffer buf = getBufferDesc(false);
-			
-	// EXR calls
-	const Box2i &dw = read_doc.file().dataWindow();
+	HANDLE hFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+								FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
 	
-	assert(buf.width == (dw.max.x - dw.min.x) + 1);
-	assert(buf.height == (dw.max.y - dw.min.y) + 1);
+	if(hFile == INVALID_HANDLE_VALUE)
+	{
+		DeleteFileA(path);
+		return NULL;
+	}
 	
-	FrameBuffer frameBuffer;
+	const Int64 size64 = size;
 	
-	if(buf.type == Imf::UINT)
-	{
-		char *exr_buf_origin = (char *)buf.buf - (sizeof(unsigned int) * dw.min.x) - (buf.rowbytes * dw.min.y);
+	// setting EOF on a non-sparse file allocates the clusters, or fails with ERROR_DISK_FULL
+	LARGE_INTEGER eof;
+	eof.QuadPart = size64;
 	
-		frameBuffer.insert(name().c_str(), Slice(Imf::UINT, exr_buf_origin, buf.colbytes, buf.rowbytes, 1, 1, 0.0f));
-	}
-	else
+	if( !SetFilePointerEx(hFile, eof, NULL, FILE_BEGIN) || !SetEndOfFile(hFile) )
 	{
-		float fill_val = (channelTag() == CHAN_A ? 1.0f : 0.0f);
-		
-		char *exr_buf_origin = (char *)buf.buf - (sizeof(float) * dw.min.x) - (buf.rowbytes * dw.min.y);
-	
-		frameBuffer.insert(name().c_str(), Slice(Imf::FLOAT, exr_buf_origin, buf.colbytes, buf.rowbytes, 1, 1, fill_val));
+		CloseHandle(hFile);
+		return NULL;
 	}
-
-	// now read the file, pausing to abort if asked
-	HybridInputFile &in_file = read_doc.file();
 	
-	in_file.setFrameBuffer(frameBuffer);
+	HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE,
+											(DWORD)(size64 >> 32), (DWORD)(size64 & 0xffffffff), NULL);
 	
-	try{
-		int block_size = ScanlineBlockSize( read_doc.file() );
+	void *ptr = NULL;
 	
-		int y = dw.min.y;
+	if(hMapping)
+	{
+		ptr = MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
 		
-		while(y <= dw.max.y)
-		{
-			const int high_scanline = MIN(y + block_size - 1, dw.max.y);
-			
-			in_file.readPixels(y, high_scanline);
-			
-			y = high_scanline + 1;
-			
-			queryAbort();
-		}
+		CloseHandle(hMapping);
 	}
-	catch(Iex::InputExc) {}
-	catch(Iex::IoExc) {}
-	
-	setLoaded(true);
 	
-	killNaN();
+	CloseHandle(hFile); // file gets deleted after the view is unmapped
 	
-	// clip alpha
-	if(channelTag() == CHAN_A && read_doc.getClipAlpha())
-		alphaClip();
+	return ptr;
+#endif
 }
 
-ProEXRlayer::ProEXRlayer(string name) :
-	_name(name),
-	_alpha(NULL),
-	_doc(NULL)
+static void
+ScratchFree(void *ptr, size_t size)
 {
+#ifndef WIN32
+	munmap(ptr, size);
+#else
+	UnmapViewOfFile(ptr);
+#endif
+}
+
+#pragma mark-
 
+ProEXRchannel::ProEXRchannel(string name, Imf::PixelType pixelType) :
+	_name(name),
+	_pixelType(pixelType),
+	_doc(NULL),
+	_loaded(false),
+	_premultiplied(true),
+	_width(0),
+	_height(0),
+	_data(NULL),
+	_half_data(NULL),
+	_data_on_disk(false),
+	_half_on_disk(false),
+	_half_current(false),
+	_rowbytes(0),
+	_half_rowbytes(0)
+{
+	parseName();
 }
 
-ProEXRlayer::~ProEXRlayer()
+ProEXRchannel::~ProEXRchannel()
 {
+	freeBuffers();
+}
 
+const string &
+ProEXRchannel::layerName() const
+{
+	assert( channelType() != CHANNEL_RESERVED);
+	
+	return _layer_name;
 }
 
-string
-ProEXRlayer::name() const
+void
+ProEXRchannel::incrementName()
 {
-	if(_name == "")
+	if( channelType() == CHANNEL_LAYER )
 	{
-		assert( channels().size() );
+		string layerName, channelName;
 		
-		const vector<ProEXRchannel *> &chans = channels();
+		channelParts(layerName, channelName);
 		
-		if(chans[0]->channelType() == CHANNEL_LAYER)
-		{
-			return chans[0]->layerName();
-		}
-		else
-			return ps_name();
+		incrementText(layerName);
+		
+		_name = layerName + "." + channelName;
 	}
-	else
-		return _name;
+	else if( channelType() == CHANNEL_SINGLE )
+	{
+		incrementText(_name);
+	}
+	else // reserved, I guess
+	{
+		_name = "layer1." + _name;
+	}
+	
+	parseName();
 }
 
-static void
-searchReplaceEnd(string &str, const string &search, const string &replace)
+void
+ProEXRchannel::parseName()
 {
-	if(str.size() >= search.size() && str.substr(str.size() - search.size()) == search)
+	// work out everything we'll be asked about the name once, up front
+	string layerName, channelName;
+	
+	channelParts(layerName, channelName);
+	
+	if(	_name == "R" ||	_name == "G" ||	_name == "B" ||	_name == "A" ||
+		_name == "Y" || _name == "RY"||	_name == "BY"||
+		_name == "AR"||	_name == "AG"||	_name == "AB"	)
 	{
-		str.erase(str.size() - search.size());
+		_type = CHANNEL_RESERVED;
 		
-		str.append(replace);
+		_layer_name = _name;
+		_channel_name = _name;
+	}
+	else if(layerName == "")
+	{
+		// this channel not part of a layer
+		_type = CHANNEL_SINGLE;
+		
+		_layer_name = string("[") + _name + string("]");
+		_channel_name = _name;
+	}
+	else
+	{
+		_type = CHANNEL_LAYER;
+		
+		_layer_name = layerName;
+		_channel_name = channelName;
 	}
+	
+	const string &n = _channel_name;
+	
+	     if(n == "R" || n == "r" || n == "RED" || n == "Red" || n == "red") _tag = CHAN_R;
+	else if(n == "G" || n == "g" || n == "GREEN" || n == "Green" || n == "green") _tag = CHAN_G;
+	else if(n == "B" || n == "b" || n == "BLUE" || n == "Blue" || n == "blue") _tag = CHAN_B;
+	else if(n == "A" || n == "a" || n == "ALPHA" || n == "Alpha" || n == "alpha") _tag = CHAN_A;
+	else if(n == "Y") _tag = CHAN_Y;
+	else if(n == "RY") _tag = CHAN_RY;
+	else if(n == "BY") _tag = CHAN_BY;
+	else if(n == "AR") _tag = CHAN_AR;
+	else if(n == "AG") _tag = CHAN_AG;
+	else if(n == "AB") _tag = CHAN_AB;
+	else
+		_tag = CHAN_GENERAL;
 }
 
-string
-ProEXRlayer::ps_name() const
+void
+ProEXRchannel::assignDoc(ProEXRdoc *doc)
 {
-	if(_name == "")
+	_doc = doc;
+	
+	_width = doc->width();
+	_height = doc->height();
+}
+
+void
+ProEXRchannel::allocateBuffers(bool allocate_half)
+{
+	assert(_width && _height);
+	
+	// we always allocate the full-size FLOAT/UINT buffer
+	// only allocate half if we have to (usually for writing half channels only)
+	
+	size_t colbytes, half_colbytes;
+	size_t buf_size, half_buf_size;
+	
+	colbytes = 4;
+	_rowbytes = colbytes * _width;
+	buf_size = _rowbytes * _height;
+	
+	if(allocate_half)
 	{
-		assert( channels().size() );
-		
-		const vector<ProEXRchannel *> &chans = channels();
+		assert(_pixelType == Imf::HALF);
 		
-		if(chans[0]->channelType() == CHANNEL_LAYER)
-		{
-			string ps_name = chans[0]->layerName();
-			
-			ps_name += ".";
-			
-			string channel_text("");
-			
-			for(int i=0; i < chans.size(); i++)
-			{
-				string chan_name = chans[i]->channelName();
-				
-				channel_text += string("[") + chan_name + string("]");
-			}
-			
-			ps_name += channel_text;
-			
-			// in general, multiple channels in a layer will be indicated by
-			// layer.[chan][other][another] at the end
-			// we will only make exceptions for layer.[R][G][B]([A])
-			searchReplaceEnd(ps_name, "[R][G][B][A]", "RGBA");
-			searchReplaceEnd(ps_name, "[R][G][B]", "RGB");
-			
-			return ps_name;
-		}
-		else
-		{
-			string layer_name("");
-			
-			for(vector<ProEXRchannel *>::const_iterator i = chans.begin(); i != chans.end(); ++i)
-			{
-				ProEXRchannel *c = *i;
-				
-				string chan_name = c->channelName();
-				
-				layer_name += "[" + c->name() + "]";
-			}
-			
-			searchReplaceEnd(layer_name, "[R][G][B][A]", "RGBA");
-			searchReplaceEnd(layer_name, "[R][G][B]", "RGB");
-			
-			return layer_name;
-		}
+		half_colbytes = 2;
+		_half_rowbytes = half_colbytes * _width;
+		half_buf_size = _half_rowbytes * _height;
 	}
 	else
-		return _name;
-}
-
-void
-ProEXRlayer::incrementChannels()
-{
-	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
 	{
-		(*i)->incrementName();
+		// leave _half_rowbytes alone, it describes any existing half buffer
+		half_colbytes = 0;
+		half_buf_size = 0;
 	}
+	
+	queryAbort();
+	
+	if(_data == NULL)
+		_data = allocData(buf_size, _data_on_disk);
+	
+	queryAbort();
+	
+	if(half_buf_size && _half_data == NULL)
+		_half_data = allocData(half_buf_size, _half_on_disk);
+	
+	queryAbort();
 }
 
-ProEXRchannel *
-ProEXRlayer::findChannel(string channelName) const
+void
+ProEXRchannel::freeBuffers()
 {
-	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	if(_data)
 	{
-		if( (*i)->name() == channelName )
-			return *i;
+		freeData(_data, _rowbytes * _height, _data_on_disk);
+		_data = NULL;
+		_rowbytes = 0;
 	}
 	
-	return NULL;
-}
-
-void
-ProEXRlayer::addChannel(ProEXRchannel *channel, bool sort)
-{
-	if(channel)
+	if(_half_data)
 	{
-		channels().push_back(channel);
-		
-		if(sort)
-			sortChannels();
+		freeData(_half_data, _half_rowbytes * _height, _half_on_disk);
+		_half_data = NULL;
+		_half_rowbytes = 0;
 	}
+	
+	_half_current = false;
+	_loaded = false;
 }
 
-ProEXRchannel *
-ProEXRlayer::alphaChannel() const
+
+ProEXRbuffer
+ProEXRchannel::getBufferDesc(bool use_half)
 {
-	if(_alpha != NULL)
-		return _alpha;
+	// allocate half if we're getting a float buffer that will
+	// get converted to half for writing
+	assert(_width && _height);
 	
-	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	if(_pixelType == Imf::HALF && use_half && _half_current)
 	{
-		ProEXRchannel *chan = *i;
+		assert(_half_data);
+		assert(_loaded);
 		
-		if(chan->channelTag() == CHAN_A)
-			return chan;
+		ProEXRbuffer desc = { _pixelType, _half_data, _width, _height, sizeof(half), _half_rowbytes };
+		
+		return desc;
 	}
 	
-	return NULL;
-}
-
-void
-ProEXRlayer::assignAlpha(ProEXRchannel *externalAlpha, bool force)
-{
-	if(force) // forced
+	if(_data == NULL || (use_half && _half_data == NULL) )
+		allocateBuffers(use_half && _pixelType == Imf::HALF);
+	
+	assert(_data);
+	
+	if(_pixelType == Imf::HALF && use_half)
 	{
-		_alpha = externalAlpha;
+		assert(_half_data);
+		assert(_loaded);
+		
+		copyToHalf();
+		
+		ProEXRbuffer desc = { _pixelType, _half_data, _width, _height, sizeof(half), _half_rowbytes };
+		
+		return desc;
 	}
-	else if(_alpha == NULL)
+	else
 	{
-		_alpha = alphaChannel(); // from internal layer
+		_half_current = false; // float buffer is the one that counts now
 		
-		if(_alpha == NULL)
-		{
-			_alpha = externalAlpha; // from external source
-		}
+		Imf::PixelType pixelType = (_pixelType == Imf::UINT ? Imf::UINT : Imf::FLOAT);
+	
+		ProEXRbuffer desc = { pixelType, _data, _width, _height, sizeof(float), _rowbytes };
+		
+		return desc;
 	}
 }
 
-vector<ProEXRchannel *>
-ProEXRlayer::getNonAlphaChannels() const
+ProEXRbuffer
+ProEXRchannel::getHalfBufferDesc()
 {
-	vector<ProEXRchannel *> chans;
+	assert(_width && _height);
+	assert(_pixelType == Imf::HALF);
 	
-	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	if(_half_data == NULL)
 	{
-		ProEXRchannel *chan = *i;
+		_half_rowbytes = sizeof(half) * _width;
 		
-		if(chan->channelTag() != CHAN_A)
-			chans.push_back(chan);
+		queryAbort();
+		
+		_half_data = allocData(_half_rowbytes * _height, _half_on_disk);
 	}
 	
-	return chans;
-}
-
-void ProEXRlayer::assignDoc(ProEXRdoc *doc)
-{
-	_doc = doc;
+	_half_current = true;
 	
-	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
-	{
-		(*i)->assignDoc(doc);
-	}
+	ProEXRbuffer desc = { Imf::HALF, _half_data, _width, _height, sizeof(half), _half_rowbytes };
+	
+	return desc;
 }
 
 bool
-ProEXRlayer::loaded() const
+ProEXRchannel::halfExact()
 {
-	bool loaded = true;
-
-	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end() && loaded; ++j)
+	assert(_pixelType == Imf::FLOAT);
+	
+	if(!_loaded || _data == NULL)
+		return false;
+	
+	const char *row = (const char *)_data;
+	
+	for(int y=0; y < _height; y++)
 	{
-		loaded = (*j)->loaded();
+		if( !HalfExactRow((const unsigned int *)row, _width) )
+			return false;
+		
+		row += _rowbytes;
 	}
 	
-	return loaded;
+	return true;
 }
 
 void
-ProEXRlayer::premultiply(ProEXRchannel *shared_alpha)
+ProEXRchannel::demoteToHalf()
 {
-	assert( channels().size() );
-	
-	ProEXRchannel *alpha = alphaChannel();
-	
-	vector<ProEXRchannel *> my_channels = channels(); // working copy
-	
-	// don't act on alphas
-	for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
-	{
-		if( (*i)->channelTag() == CHAN_A )
-		{
-			assert(alpha != NULL); // because we would have found it already
-			my_channels.erase(i); // take out of the working copy
-			break;
-		}
-	}
-	
-	if(alpha == NULL)
-		alpha = shared_alpha;
+	assert(_pixelType == Imf::FLOAT);
+	assert(_half_data == NULL);
 	
-	if(alpha)
-	{
-		for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
-			(*i)->premultiply(alpha);
-	}
+	// float buffer stays as-is, getBufferDesc(true) makes the half copy
+	_pixelType = Imf::HALF;
 }
 
 void
-ProEXRlayer::unMult(ProEXRchannel *shared_alpha)
+ProEXRchannel::fill(float val)
 {
-	assert( channels().size() );
-	
-	ProEXRchannel *alpha = alphaChannel();
-	
-	vector<ProEXRchannel *>my_channels = channels(); // working copy
-	
-	// don't act on alphas
-	for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
-	{
-		if( (*i)->channelTag() == CHAN_A )
-		{
-			assert(alpha != NULL); // because we would have found it already
-			my_channels.erase(i); // take out of the working copy
-			break;
-		}
-	}
+	if(_data == NULL)
+		allocateBuffers();
 	
-	if(alpha == NULL)
-		alpha = shared_alpha;
+	_half_current = false;
+		
+	char *buf_row = (char *)_data;
 	
-	if(alpha)
+	for(int y=0; y < _height; y++)
 	{
-		for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
-			(*i)->unMult(alpha);
+		float *buf_pix = (float *)buf_row;
+		
+		for(int x=0; x < _width; x++)
+			*buf_pix++ = val;
+		
+		buf_row += _rowbytes;
 	}
 }
 
 void
-ProEXRlayer::freeBuffers()
+ProEXRchannel::premultiply(ProEXRchannel *alpha, bool force)
 {
-	for(vector<ProEXRchannel *>::iterator j = channels().begin(); j != channels().end(); ++j)
+	if(_loaded && alpha && alpha->_data && _data)
 	{
-		(*j)->freeBuffers();
+		assert(_width == alpha->_width);
+		assert(_height == alpha->_height);
+		assert(alpha->_pixelType != Imf::UINT);
+		
+		if(_pixelType != Imf::UINT)
+		{
+			if(!_premultiplied || force)
+			{
+				TaskGroup taskGroup;
+				
+				char *buf_row = (char *)_data;
+				char *alpha_row = (char *)alpha->_data;
+				
+				for(int y=0; y < _height; y++)
+				{
+					ThreadPool::addGlobalTask(new PremultiplyRowTask(&taskGroup,
+																		(float *)buf_row,
+																		(float *)alpha_row,
+																		_width) );
+					buf_row += _rowbytes;
+					alpha_row += alpha->_rowbytes;
+				}
+				
+				_premultiplied = true;
+			}
+		}
 	}
 }
 
 void
-ProEXRlayer::sortChannels()
+ProEXRchannel::unMult(ProEXRchannel *alpha)
 {
-	vector<ProEXRchannel *> &chans = channels();
+	if(_loaded && alpha && alpha->_data && _data)
+	{
+		assert(_width == alpha->_width);
+		assert(_height == alpha->_height);
+		assert(alpha->_pixelType != Imf::UINT);
+		
+		if(_pixelType != Imf::UINT)
+		{
+			if(_premultiplied)
+			{
+				TaskGroup taskGroup;
+				
+				char *buf_row = (char *)_data;
+				char *alpha_row = (char *)alpha->_data;
+				
+				for(int y=0; y < _height; y++)
+				{
+					ThreadPool::addGlobalTask(new UnMultiplyRowTask(&taskGroup,
+																		(float *)buf_row,
+																		(float *)alpha_row,
+																		_width) );
+					buf_row += _rowbytes;
+					alpha_row += alpha->_rowbytes;
+				}
+				
+				_premultiplied = false;
+			}
+		}
+		
+		queryAbort();
+	}
+}
 
-	for(int i=0; i < chans.size() - 1; i++)
+void
+ProEXRchannel::alphaClip()
+{
+	assert(channelTag() == CHAN_A);
+
+	if(_loaded && _data)
 	{
-		if( (
-			(chans[i]->channelTag() == CHAN_GENERAL || chans[i+1]->channelTag() == CHAN_GENERAL) && // untagged case
-			(chans[i]->channelName() > chans[i+1]->channelName() )
-			)
-			||
-			(
-			(chans[i]->channelTag() != CHAN_GENERAL && chans[i+1]->channelTag() != CHAN_GENERAL) && // tagged case
-			(chans[i]->channelTag() > chans[i+1]->channelTag() )
-			)
-		)
+		if(_pixelType != Imf::UINT)
 		{
-			// swap
-			ProEXRchannel *temp = chans[i];
+			TaskGroup taskGroup;
 			
-			chans[i] = chans[i+1];
-			chans[i+1] = temp;
+			char *buf_row = (char *)_data;
 			
-			i = -1; // start over
+			for(int y=0; y < _height; y++)
+			{
+				ThreadPool::addGlobalTask(new AlphaClipRowTask(&taskGroup,
+																(float *)buf_row,
+																_width) );
+				buf_row += _rowbytes;
+			}
 		}
+		
+		queryAbort();
 	}
 }
 
 void
-ProEXRlayer::queryAbort()
+ProEXRchannel::killNaN()
+{
+	if(_loaded && _data)
+	{
+		TaskGroup taskGroup;
+		
+		char *buf_row = (char *)_data;
+		
+		for(int y=0; y < _height; y++)
+		{
+			ThreadPool::addGlobalTask(new KillNaNRowTask(&taskGroup,
+															(float *)buf_row,
+															_width) );
+			buf_row += _rowbytes;
+		}
+		
+		queryAbort();
+	}
+}
+
+void
+ProEXRchannel::queryAbort()
 {
 	if(_doc)
 		_doc->queryAbort();
 }
 
+void
+ProEXRchannel::channelParts(string &layerName, string &channelName) const
+{
+	int dot_pos = _name.find_last_of('.');//, _name.size()-1);
+	
+	if(dot_pos == string::npos || dot_pos == 0 || dot_pos == _name.size()-1)
+	{
+		layerName = "";
+		channelName = _name;
+	}
+	else
+	{
+		layerName = _name.substr(0, dot_pos);
+		channelName = _name.substr(dot_pos + 1, _name.size() - dot_pos);
+	}
+}
 
-ProEXRlayer_read::ProEXRlayer_read(string name) :
-	ProEXRlayer(name),
-	_load_as_layer(false)
+void
+ProEXRchannel::incrementText(string &name)
+{
+	int num_numbers = 0;
+	
+	while(string::npos != name.find_last_of("1234567890", name.size() - num_numbers - 1, 1) )
+		num_numbers++;
+	
+	if(num_numbers)
+	{
+		string base = name.substr(0, name.size() - num_numbers);
+		string num = name.substr(name.size() - num_numbers, num_numbers);
+		
+		int n = 0;
+		
+		istringstream num_ist( num );
+		num_ist >> n;
+		
+		n++;
+		
+		ostringstream num_ost;
+		num_ost << n;
+		string new_num = num_ost.str();
+		
+		name = base + new_num;
+	}
+	else
+		name += "2";
+}
+
+void *
+ProEXRchannel::allocData(size_t size, bool &on_disk)
+{
+	void *data = NULL;
+	
+	if(_doc && _doc->spillToDisk())
+		data = ScratchAlloc(_doc->scratchDir(), size); // already zeroed
+	
+	on_disk = (data != NULL);
+	
+	if(data == NULL)
+	{
+		data = malloc(size);
+		
+		if(data == NULL)
+			throw bad_alloc();
+			
+		memset(data, 0, size);
+	}
+	
+	return data;
+}
+
+void
+ProEXRchannel::freeData(void *data, size_t size, bool on_disk)
+{
+	if(on_disk)
+		ScratchFree(data, size);
+	else
+		free(data);
+}
+
+void
+ProEXRchannel::copyToHalf()
+{
+	if(_data && _half_data)
+	{
+		if(_width == 0 || _height == 0)
+			throw BaseExc("Image has no size.");
+		
+		TaskGroup taskGroup;
+		
+		char *float_row = (char *)_data;
+		char *half_row = (char *)_half_data;
+		
+		for(int y=0; y < _height; y++)
+		{
+			ThreadPool::addGlobalTask(new ConvertFloatRowTask(&taskGroup,
+																(float *)float_row,
+																(half *)half_row,
+																_width) );
+			float_row += _rowbytes;
+			half_row += _half_rowbytes;
+		}
+	}
+	
+	queryAbort();
+}
+
+ProEXRchannel_read::ProEXRchannel_read(string name, Imf::PixelType pixelType) :
+	ProEXRchannel(name, pixelType)
+{
+
+}
+
+ProEXRchannel_read::~ProEXRchannel_read()
+{
+
+}
+
+void
+ProEXRchannel_read::loadFromFile()
 {
+	if(doc() == NULL)
+		throw BaseExc("doc() is NULL");
+	
+	assert( !loaded() );
+	
+	ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
+	
+	ProEXRbuffer buf = getBufferDesc(false);
+			
+	// EXR calls
+	const Box2i &dw = read_doc.file().dataWindow();
+	
+	assert(buf.width == (dw.max.x - dw.min.x) + 1);
+	assert(buf.height == (dw.max.y - dw.min.y) + 1);
+	
+	FrameBuffer frameBuffer;
+	
+	if(buf.type == Imf::UINT)
+	{
+		char *exr_buf_origin = (char *)buf.buf - (sizeof(unsigned int) * dw.min.x) - (buf.rowbytes * dw.min.y);
+	
+		frameBuffer.insert(name().c_str(), Slice(Imf::UINT, exr_buf_origin, buf.colbytes, buf.rowbytes, 1, 1, 0.0f));
+	}
+	else
+	{
+		float fill_val = (channelTag() == CHAN_A ? 1.0f : 0.0f);
+		
+		char *exr_buf_origin = (char *)buf.buf - (sizeof(float) * dw.min.x) - (buf.rowbytes * dw.min.y);
+	
+		frameBuffer.insert(name().c_str(), Slice(Imf::FLOAT, exr_buf_origin, buf.colbytes, buf.rowbytes, 1, 1, fill_val));
+	}
+
+	// now read the file, pausing to abort if asked
+	HybridInputFile &in_file = read_doc.file();
+	
+	in_file.setFrameBuffer(frameBuffer);
+	
+	try{
+		int block_size = ScanlineBlockSize( read_doc.file() );
+	
+		int y = dw.min.y;
+		
+		while(y <= dw.max.y)
+		{
+			const int high_scanline = MIN(y + block_size - 1, dw.max.y);
+			
+			in_file.readPixels(y, high_scanline);
+			
+			y = high_scanline + 1;
+			
+			queryAbort();
+		}
+	}
+	catch(Iex::InputExc) {}
+	catch(Iex::IoExc) {}
+	
+	setLoaded(true);
+	
+	killNaN();
+	
+	// clip alpha
+	if(channelTag() == CHAN_A && read_doc.getClipAlpha())
+		alphaClip();
+}
+
+ProEXRlayer::ProEXRlayer(string name) :
+	_name(name),
+	_alpha(NULL),
+	_doc(NULL)
+{
+
+}
+
+ProEXRlayer::~ProEXRlayer()
+{
+
+}
+
+string
+ProEXRlayer::name() const
+{
+	if(_name == "")
+	{
+		assert( channels().size() );
+		
+		const vector<ProEXRchannel *> &chans = channels();
+		
+		if(chans[0]->channelType() == CHANNEL_LAYER)
+		{
+			return chans[0]->layerName();
+		}
+		else
+			return ps_name();
+	}
+	else
+		return _name;
+}
+
+static void
+searchReplaceEnd(string &str, const string &search, const string &replace)
+{
+	if(str.size() >= search.size() && str.substr(str.size() - search.size()) == search)
+	{
+		str.erase(str.size() - search.size());
+		
+		str.append(replace);
+	}
+}
+
+string
+ProEXRlayer::ps_name() const
+{
+	if(_name == "")
+	{
+		assert( channels().size() );
+		
+		const vector<ProEXRchannel *> &chans = channels();
+		
+		if(chans[0]->channelType() == CHANNEL_LAYER)
+		{
+			string ps_name = chans[0]->layerName();
+			
+			ps_name += ".";
+			
+			string channel_text("");
+			
+			for(int i=0; i < chans.size(); i++)
+			{
+				string chan_name = chans[i]->channelName();
+				
+				channel_text += string("[") + chan_name + string("]");
+			}
+			
+			ps_name += channel_text;
+			
+			// in general, multiple channels in a layer will be indicated by
+			// layer.[chan][other][another] at the end
+			// we will only make exceptions for layer.[R][G][B]([A])
+			searchReplaceEnd(ps_name, "[R][G][B][A]", "RGBA");
+			searchReplaceEnd(ps_name, "[R][G][B]", "RGB");
+			
+			return ps_name;
+		}
+		else
+		{
+			string layer_name("");
+			
+			for(vector<ProEXRchannel *>::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			{
+				ProEXRchannel *c = *i;
+				
+				string chan_name = c->channelName();
+				
+				layer_name += "[" + c->name() + "]";
+			}
+			
+			searchReplaceEnd(layer_name, "[R][G][B][A]", "RGBA");
+			searchReplaceEnd(layer_name, "[R][G][B]", "RGB");
+			
+			return layer_name;
+		}
+	}
+	else
+		return _name;
+}
+
+void
+ProEXRlayer::incrementChannels()
+{
+	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		(*i)->incrementName();
+	}
+}
+
+ProEXRchannel *
+ProEXRlayer::findChannel(string channelName) const
+{
+	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		if( (*i)->name() == channelName )
+			return *i;
+	}
+	
+	return NULL;
+}
+
+void
+ProEXRlayer::addChannel(ProEXRchannel *channel, bool sort)
+{
+	if(channel)
+	{
+		channels().push_back(channel);
+		
+		if(sort)
+			sortChannels();
+	}
+}
+
+ProEXRchannel *
+ProEXRlayer::alphaChannel() const
+{
+	if(_alpha != NULL)
+		return _alpha;
+	
+	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		ProEXRchannel *chan = *i;
+		
+		if(chan->channelTag() == CHAN_A)
+			return chan;
+	}
+	
+	return NULL;
+}
+
+void
+ProEXRlayer::assignAlpha(ProEXRchannel *externalAlpha, bool force)
+{
+	if(force) // forced
+	{
+		_alpha = externalAlpha;
+	}
+	else if(_alpha == NULL)
+	{
+		_alpha = alphaChannel(); // from internal layer
+		
+		if(_alpha == NULL)
+		{
+			_alpha = externalAlpha; // from external source
+		}
+	}
+}
+
+vector<ProEXRchannel *>
+ProEXRlayer::getNonAlphaChannels() const
+{
+	vector<ProEXRchannel *> chans;
+	
+	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		ProEXRchannel *chan = *i;
+		
+		if(chan->channelTag() != CHAN_A)
+			chans.push_back(chan);
+	}
+	
+	return chans;
+}
+
+void ProEXRlayer::assignDoc(ProEXRdoc *doc)
+{
+	_doc = doc;
+	
+	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		(*i)->assignDoc(doc);
+	}
+}
+
+bool
+ProEXRlayer::loaded() const
+{
+	bool loaded = true;
+
+	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end() && loaded; ++j)
+	{
+		loaded = (*j)->loaded();
+	}
+	
+	return loaded;
+}
+
+void
+ProEXRlayer::premultiply(ProEXRchannel *shared_alpha)
+{
+	assert( channels().size() );
+	
+	ProEXRchannel *alpha = alphaChannel();
+	
+	vector<ProEXRchannel *> my_channels = channels(); // working copy
+	
+	// don't act on alphas
+	for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
+	{
+		if( (*i)->channelTag() == CHAN_A )
+		{
+			assert(alpha != NULL); // because we would have found it already
+			my_channels.erase(i); // take out of the working copy
+			break;
+		}
+	}
+	
+	if(alpha == NULL)
+		alpha = shared_alpha;
+	
+	if(alpha)
+	{
+		for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
+			(*i)->premultiply(alpha);
+	}
+}
+
+void
+ProEXRlayer::unMult(ProEXRchannel *shared_alpha)
+{
+	assert( channels().size() );
+	
+	ProEXRchannel *alpha = alphaChannel();
+	
+	vector<ProEXRchannel *>my_channels = channels(); // working copy
+	
+	// don't act on alphas
+	for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
+	{
+		if( (*i)->channelTag() == CHAN_A )
+		{
+			assert(alpha != NULL); // because we would have found it already
+			my_channels.erase(i); // take out of the working copy
+			break;
+		}
+	}
+	
+	if(alpha == NULL)
+		alpha = shared_alpha;
+	
+	if(alpha)
+	{
+		for(vector<ProEXRchannel *>::iterator i = my_channels.begin(); i != my_channels.end(); ++i)
+			(*i)->unMult(alpha);
+	}
+}
+
+void
+ProEXRlayer::freeBuffers()
+{
+	for(vector<ProEXRchannel *>::iterator j = channels().begin(); j != channels().end(); ++j)
+	{
+		(*j)->freeBuffers();
+	}
+}
+
+void
+ProEXRlayer::sortChannels()
+{
+	vector<ProEXRchannel *> &chans = channels();
+
+	for(int i=0; i < chans.size() - 1; i++)
+	{
+		if( (
+			(chans[i]->channelTag() == CHAN_GENERAL || chans[i+1]->channelTag() == CHAN_GENERAL) && // untagged case
+			(chans[i]->channelName() > chans[i+1]->channelName() )
+			)
+			||
+			(
+			(chans[i]->channelTag() != CHAN_GENERAL && chans[i+1]->channelTag() != CHAN_GENERAL) && // tagged case
+			(chans[i]->channelTag() > chans[i+1]->channelTag() )
+			)
+		)
+		{
+			// swap
+			ProEXRchannel *temp = chans[i];
+			
+			chans[i] = chans[i+1];
+			chans[i+1] = temp;
+			
+			// everything before i-1 is still in order, so back up one
+			// instead of starting over (ends up in the same place)
+			i = (i > 0 ? i - 2 : -1);
+		}
+	}
+}
+
+void
+ProEXRlayer::queryAbort()
+{
+	if(_doc)
+		_doc->queryAbort();
+}
+
+
+ProEXRlayer_read::ProEXRlayer_read(string name) :
+	ProEXRlayer(name),
+	_load_as_layer(false)
+{
+	
+}
+
+ProEXRlayer_read::~ProEXRlayer_read()
+{
+
+}
+
+void
+ProEXRlayer_read::loadFromFile()
+{
+	if(doc() == NULL)
+		throw BaseExc("doc() is NULL");
+	
+	ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
+	
+	if( loadAsLayer() ) // aka, Y[RY][BY]
+	{
+		loadFromRGBA();
+	}
+	else
+	{
+		HybridInputFile &in_file = read_doc.file();
+		
+		try{
+			vector<ProEXRchannel *> alphas_to_clip;
+		
+			// EXR calls
+			Box2i dw = read_doc.file().dataWindow();
+			
+			FrameBuffer frameBuffer;
+			
+			for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+			{
+				ProEXRchannel *chan = *i;
+				
+				if( chan->loaded() == false )
+				{
+					ProEXRbuffer desc = chan->getBufferDesc(false);
+						
+					char *exr_buf_origin = (char *)desc.buf - (desc.colbytes * dw.min.x) - (desc.rowbytes * dw.min.y);
+
+					float fillValue = (chan->channelTag() == CHAN_A ? 1.f : 0.f);
+
+					frameBuffer.insert(chan->name().c_str(), Slice(desc.type, exr_buf_origin, desc.colbytes, desc.rowbytes, 1, 1, fillValue));
+					
+					chan->setLoaded(true); // yes, I know we haven't actually done it yet
+					
+					if(chan->channelTag() == CHAN_A && read_doc.getClipAlpha())
+						alphas_to_clip.push_back(chan);
+				}
+			}
+
+			if(frameBuffer.begin() != frameBuffer.end()) // i.e. not empty
+			{
+				in_file.setFrameBuffer(frameBuffer);
+						
+				try{
+					const int block_size = ScanlineBlockSize( read_doc.file() );
+				
+					int y = dw.min.y;
+					
+					while(y <= dw.max.y)
+					{
+						int high_scanline = MIN(y + block_size - 1, dw.max.y);
+						
+						in_file.readPixels(y, high_scanline);
+						
+						y = high_scanline + 1;
+						
+						queryAbort();
+					}
+				}
+				catch(Iex::InputExc) {}
+				catch(Iex::IoExc) {}
+			}
+			
+			// kill NaN
+			for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+			{
+				ProEXRchannel *chan = *i;
+				
+				chan->killNaN();
+			}
+			
+			// clip alpha
+			for(vector<ProEXRchannel *>::iterator i = alphas_to_clip.begin(); i != alphas_to_clip.end(); ++i)
+			{
+				ProEXRchannel *chan = *i;
+				
+				chan->alphaClip();
+			}
+		}
+		catch(bad_alloc)
+		{
+			// we ran out of memory, unload everything
+			freeBuffers();
+		}
+	}
+}
+
+void
+ProEXRlayer_read::loadFromRGBA()
+{
+	try{
+		if(doc() == NULL)
+			throw BaseExc("doc() is NULL.");
+	
+		ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
+		
+		vector<ProEXRchannel *> &chans = channels();
+		
+		sortChannels();
+		
+		assert(chans.size() >= 3);
+		assert(chans[0]->name() == "Y");
+		assert(chans[1]->name() == "RY");
+		assert(chans[2]->name() == "BY");
+		
+		bool have_a = (chans.size() >= 4 && chans[3]->name() == "A");
+		
+		ProEXRbuffer r_desc = chans[0]->getBufferDesc(); // should also allocate float buffer
+		ProEXRbuffer g_desc = chans[1]->getBufferDesc();
+		ProEXRbuffer b_desc = chans[2]->getBufferDesc();
+		
+		ProEXRbuffer a_desc = {Imf::HALF, NULL, 0, 0, 0, 0};
+		
+		if(have_a)
+			a_desc = chans[3]->getBufferDesc();
+			
+		int buf_width = r_desc.width;
+		int buf_height = r_desc.height;
+		
+		assert(r_desc.width == g_desc.width && g_desc.width == b_desc.width);
+		assert(r_desc.height == g_desc.height && g_desc.height == b_desc.height);
+		
+		// now use the Rgba interface
+		Imf::IStream &file_in = read_doc.stream();
+		file_in.seekg(0); // expected to be at the beginning, apparently
+		
+		RgbaInputFile inputFile( file_in );
+		
+		Box2i dw = inputFile.dataWindow();
+		int width = (dw.max.x - dw.min.x) + 1;
+		int height = (dw.max.y - dw.min.y) + 1;
+		
+		Array2D<Rgba> half_buffer(height, width);
+		
+		inputFile.setFrameBuffer(&half_buffer[-dw.min.y][-dw.min.x], 1, width);
+		
+		try{
+			int y = dw.min.y;
+			
+			while(y <= dw.max.y)
+			{
+				int high_scanline = MIN(y + 127, dw.max.y);
+				
+				inputFile.readPixels(y, high_scanline);
+				
+				y = high_scanline + 1;
+				
+				queryAbort();
+			}
+		}
+		catch(Iex::InputExc) {}
+		catch(Iex::IoExc) {}
+		
+		// copy from big half buffer to our channel buffers
+		char *r_row = (char *)r_desc.buf;
+		char *g_row = (char *)g_desc.buf;
+		char *b_row = (char *)b_desc.buf;
+		char *a_row = (char *)a_desc.buf;
+		
+		for(int y=0; y < buf_height; y++)
+		{
+			float *r_pix = (float *)r_row;
+			float *g_pix = (float *)g_row;
+			float *b_pix = (float *)b_row;
+			float *a_pix = (float *)a_row;
+			
+			for(int x=0; x < buf_width; x++)
+			{
+				*r_pix++ = half_buffer[y][x].r;
+				*g_pix++ = half_buffer[y][x].g;
+				*b_pix++ = half_buffer[y][x].b;
+				
+				if(have_a)
+					*a_pix++ = half_buffer[y][x].a;
+			}
+			
+			r_row += r_desc.rowbytes;
+			g_row += g_desc.rowbytes;
+			b_row += b_desc.rowbytes;
+			a_row += a_desc.rowbytes;
+		}
+		
+		// mark as loaded
+		chans[0]->setLoaded(true);
+		chans[1]->setLoaded(true);
+		chans[2]->setLoaded(true);
+		
+		if(have_a)
+			chans[3]->setLoaded(true);
+		
+		// kill NaN
+		chans[0]->killNaN();
+		chans[1]->killNaN();
+		chans[2]->killNaN();
+		
+		if(have_a)
+			chans[3]->killNaN();
+		
+		// clip alpha
+		if(have_a && read_doc.getClipAlpha())
+			chans[3]->alphaClip();
+		
+		queryAbort();
+	}
+	catch(bad_alloc)
+	{
+		// we ran out of memory, unload everything
+		freeBuffers();
+	}
+}
+
+ProEXRdoc::ProEXRdoc() :
+	_black_channel(NULL),
+	_white_channel(NULL),
+	_spill_to_disk(false)
+{
+
+}
+
+ProEXRdoc::~ProEXRdoc()
+{
+	if(_black_channel) delete _black_channel;
+	if(_white_channel) delete _white_channel;
+	
+	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+	{
+		if(*i)
+		{
+			delete *i;
+			*i = NULL;
+		}
+	}
+
+	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		if(*i)
+		{
+			delete *i;
+			*i = NULL;
+		}
+	}
+}
+
+ProEXRchannel *
+ProEXRdoc::getAlphaChannel() const
+{
+	return findChannel("A");
+}
+
+ProEXRchannel *
+ProEXRdoc::findChannel(string channelName) const
+{
+	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	{
+		if( (*i)->name() == channelName )
+			return *i;
+	}
+	
+	return NULL;
+}
+
+ProEXRlayer *
+ProEXRdoc::findLayer(string layerName) const
+{
+	for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
+	{
+		if( (*i)->name() == layerName )
+			return *i;
+	}
+	
+	return NULL;
+}
+
+ProEXRlayer *
+ProEXRdoc::findMainLayer(bool be_flexible, bool force) const
+{
+	assert( layers().size() );
+	
+	if( findLayer("RGB") )				return findLayer("RGB");
+	if( findLayer("RGBA") )				return findLayer("RGBA");
+	if( findLayer("Y") )				return findLayer("Y");
+	if( findLayer("[Y]") )				return findLayer("[Y]");
+	if( findLayer("YA") )				return findLayer("YA");
+	if( findLayer("[Y][A]") )			return findLayer("[Y][A]");
+	if( findLayer("[Y][RY][BY]") )		return findLayer("[Y][RY][BY]");
+	if( findLayer("[Y][RY][BY][A]") )	return findLayer("[Y][RY][BY][A]");
+	
+	
+	if(be_flexible)
+	{
+		// ok, then we'll look for a layer that has at least one standard channel
+		vector<string> standard_channels;
+		
+		standard_channels.push_back("R");
+		standard_channels.push_back("G");
+		standard_channels.push_back("B");
+		standard_channels.push_back("A");
+		
+		for(vector<string>::const_iterator j = standard_channels.begin(); j != standard_channels.end(); ++j)
+		{
+			for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
+			{
+				if( (*i)->findChannel( *j ) != NULL )
+					return *i;
+			}
+		}
+	}
+	
+	// ummm, ok, forced to come up with a layer of some kind?
+	if(force && layers().size())
+		return layers().at(0);
+	else
+		return NULL;
+}
+
+bool
+ProEXRdoc::loaded() const
+{
+	bool loaded = true;
+
+	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end() && loaded; ++j)
+	{
+		if( !(*j)->loaded() )
+			loaded = false;
+	}
+	
+	return loaded;
+}
+
+Int64
+ProEXRdoc::memorySize() const
+{
+	return ( (Int64)sizeof(float) * (Int64)width() * (Int64)height() * (Int64)channels().size() );
+}
+
+void
+ProEXRdoc::freeBuffers() const
+{
+	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end(); ++j)
+	{
+		(*j)->freeBuffers();
+	}
+}
+
+string
+ProEXRdoc::scratchDir() const
+{
+	if( !_scratch_dir.empty() )
+		return _scratch_dir;
+	
+	// lets users point scratch files at a big disk without touching TMPDIR for everything else
+	const char *scratch_env = getenv("PROEXR_SCRATCH_DIR");
+	
+	if(scratch_env && *scratch_env)
+		return string(scratch_env);
+	
+#ifndef WIN32
+	const char *tmp = getenv("TMPDIR");
+	
+	return (tmp ? string(tmp) : string("/tmp"));
+#else
+	char path[MAX_PATH + 1];
+	
+	DWORD len = GetTempPathA(MAX_PATH + 1, path);
+	
+	return ((len > 0 && len <= MAX_PATH) ? string(path) : string("."));
+#endif
+}
+
+void
+ProEXRdoc::premultiply()
+{
+	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		(*i)->premultiply( getAlphaChannel() );
+}
+
+void
+ProEXRdoc::unMult()
+{
+	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		(*i)->unMult( getAlphaChannel() );
+}
+
+ProEXRdoc_read::ProEXRdoc_read(Imf::IStream &is, bool clip_alpha, bool renameFirstPart, bool set_up) :
+	_in_stream(is),
+	_in_file(is, renameFirstPart),
+	_clipAlpha(clip_alpha)
+{
+	if(set_up)
+		setupDoc();
+}
+
+ProEXRdoc_read::~ProEXRdoc_read()
+{
+
+}
+
+int
+ProEXRdoc_read::width() const
+{
+	const Box2i &dw = file().dataWindow();
+			
+	return ((dw.max.x - dw.min.x) + 1);
+}
+
+int
+ProEXRdoc_read::height() const
+{
+	const Box2i &dw = file().dataWindow();
+	
+	return ((dw.max.y - dw.min.y) + 1);
+}
+
+void
+ProEXRdoc_read::loadFromFile()
+{
+	try{
+		vector<ProEXRchannel *> alphas_to_clip;
+		
+		// EXR calls
+		const Box2i &dw = file().dataWindow();
+		
+		FrameBuffer frameBuffer;
+
+		vector<ProEXRlayer_read *> layers_to_load;
+
+		for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		{
+			ProEXRlayer_read &read_layer = dynamic_cast<ProEXRlayer_read &>( **i );
+			
+			if( read_layer.loadAsLayer() )
+			{
+				layers_to_load.push_back(&read_layer);
+			}
+			else
+			{
+				vector<ProEXRchannel *> &chans = read_layer.channels();
+			
+				for(vector<ProEXRchannel *>::iterator j = chans.begin(); j != chans.end(); ++j)
+				{
+					ProEXRchannel *chan = *j;
+					
+					if( chan->loaded() == false )
+					{
+						const bool this_is_alpha = (chan->channelTag() == CHAN_A);
+					
+						ProEXRbuffer desc = chan->getBufferDesc(false);
+							
+						char *exr_buf_origin = (char *)desc.buf - (desc.colbytes * dw.min.x) - (desc.rowbytes * dw.min.y);
+
+						float fillValue = (this_is_alpha ? 1.0f : 0.0f);
+
+						frameBuffer.insert(chan->name().c_str(), Slice(desc.type, exr_buf_origin, desc.colbytes, desc.rowbytes, 1, 1, fillValue));
+						
+						chan->setLoaded(true); // yes, I know we haven't actually done it yet
+						
+						if(this_is_alpha && getClipAlpha())
+							alphas_to_clip.push_back(chan);
+					}
+				}
+			}
+		}
+
+		if(frameBuffer.begin() != frameBuffer.end()) // i.e. not empty
+		{
+			file().setFrameBuffer(frameBuffer);
+					
+			try{
+				const int block_size = ScanlineBlockSize( file() );
+				
+				int y = dw.min.y;
+				
+				while(y <= dw.max.y)
+				{
+					int high_scanline = MIN(y + block_size - 1, dw.max.y);
+					
+					file().readPixels(y, high_scanline);
+					
+					y = high_scanline + 1;
+					
+					queryAbort();
+				}
+			}
+			catch(Iex::InputExc) {}
+			catch(Iex::IoExc) {}
+		}
+		
+		// kill NaN
+		for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		{
+			ProEXRlayer_read &read_layer = dynamic_cast<ProEXRlayer_read &>( **i );
+			
+			vector<ProEXRchannel *> &chans = read_layer.channels();
+		
+			for(vector<ProEXRchannel *>::iterator j = chans.begin(); j != chans.end(); ++j)
+			{
+				ProEXRchannel *chan = *j;
+				
+				chan->killNaN();
+			}
+		}
+		
+		// clip alpha
+		for(vector<ProEXRchannel *>::iterator i = alphas_to_clip.begin(); i != alphas_to_clip.end(); ++i)
+		{
+			ProEXRchannel *chan = *i;
+			
+			chan->alphaClip();
+		}
+		
+		// any layers to load all together?
+		if( layers_to_load.size() )
+		{
+			for(vector<ProEXRlayer_read *>::iterator i = layers_to_load.begin(); i != layers_to_load.end(); ++i)
+			{
+				(*i)->loadFromFile();
+			}
+		}
+	}
+	catch(bad_alloc)
+	{
+		// we ran out of memory, unload everything
+		freeBuffers();
+	}
+}
+
+void
+ProEXRdoc_read::setupDoc()
+{
+	initChannels<ProEXRchannel_read>();
+	
+	buildLayers<ProEXRlayer_read>();
+}
+
+ProEXRdoc_write_base::ProEXRdoc_write_base(OStream &os, Header &header) :
+	_out_stream(os),
+	_header(header),
+	_demote_types(false),
+	_auto_compression(false),
+	_speed_weight(0.25f),
+	_write_stats(false),
+	_write_preview(false)
+{
+
+}
+
+ProEXRdoc_write_base::~ProEXRdoc_write_base()
+{
+
+}
+
+int
+ProEXRdoc_write_base::width() const
+{
+	const Box2i &dw = header().dataWindow();
+	
+	return ((dw.max.x - dw.min.x) + 1);
+}
+
+int
+ProEXRdoc_write_base::height() const
+{
+	const Box2i &dw = header().dataWindow();
+	
+	return ((dw.max.y - dw.min.y) + 1);
+}
+
+void
+ProEXRdoc_write_base::addChannel(ProEXRchannel *channel)
+{
+	// don't want a duplicate channel
+	while( findChannel( channel->name() ) )
+		channel->incrementName();
+	
+	if( channel->doc() == NULL )
+		channel->assignDoc(this);
+	else
+		assert(channel->doc() == this);
+	
+	channels().push_back(channel);
+}
+
+void
+ProEXRdoc_write_base::addLayer(ProEXRlayer *layer)
+{
+	assert(layer->doc() == NULL);
+	
+	// make sure we're not duplicating any channels
+	bool found_no_duplicates = false;
+	
+	while(!found_no_duplicates)
+	{
+		bool must_increment = false;
+		
+		for(vector<ProEXRchannel *>::iterator i = layer->channels().begin(); i != layer->channels().end(); ++i)
+		{
+			assert( (*i)->doc() == NULL ); // channels should be unattached
+			
+			if( findChannel( (*i)->name() ) )
+				must_increment = true;
+		}
+		
+		if(must_increment)
+			layer->incrementChannels();
+		else
+			found_no_duplicates = true;
+	}
 	
-}
-
-ProEXRlayer_read::~ProEXRlayer_read()
-{
-
+	// now that we know all channels are unique
+	for(vector<ProEXRchannel *>::iterator i = layer->channels().begin(); i != layer->channels().end(); ++i)
+		addChannel( *i );
+	
+	// add that layer
+	layer->assignDoc(this);
+	
+	layers().push_back(layer);
 }
 
 void
-ProEXRlayer_read::loadFromFile()
+ProEXRdoc_write_base::demoteChannels()
 {
-	if(doc() == NULL)
-		throw BaseExc("doc() is NULL");
+	_demoted_channels.clear();
 	
-	ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
+	if(!_demote_types)
+		return;
 	
-	if( loadAsLayer() ) // aka, Y[RY][BY]
+	vector<ProEXRchannel *> candidates;
+	
+	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
 	{
-		loadFromRGBA();
+		if( (*i)->loaded() && (*i)->pixelType() == Imf::FLOAT )
+			candidates.push_back(*i);
 	}
-	else
+	
+	if( candidates.empty() )
+		return;
+	
+	// Task results can't be bools in a vector<bool>
+	vector<char> exact(candidates.size(), 0);
+	
+	if(true) // making a scope for the TaskGroup
 	{
-		HybridInputFile &in_file = read_doc.file();
-		
-		try{
-			vector<ProEXRchannel *> alphas_to_clip;
+		TaskGroup taskGroup;
 		
-			// EXR calls
-			Box2i dw = read_doc.file().dataWindow();
-			
-			FrameBuffer frameBuffer;
-			
-			for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
-			{
-				ProEXRchannel *chan = *i;
-				
-				if( chan->loaded() == false )
-				{
-					ProEXRbuffer desc = chan->getBufferDesc(false);
-						
-					char *exr_buf_origin = (char *)desc.buf - (desc.colbytes * dw.min.x) - (desc.rowbytes * dw.min.y);
-
-					float fillValue = (chan->channelTag() == CHAN_A ? 1.f : 0.f);
-
-					frameBuffer.insert(chan->name().c_str(), Slice(desc.type, exr_buf_origin, desc.colbytes, desc.rowbytes, 1, 1, fillValue));
-					
-					chan->setLoaded(true); // yes, I know we haven't actually done it yet
-					
-					if(chan->channelTag() == CHAN_A && read_doc.getClipAlpha())
-						alphas_to_clip.push_back(chan);
-				}
-			}
-
-			if(frameBuffer.begin() != frameBuffer.end()) // i.e. not empty
-			{
-				in_file.setFrameBuffer(frameBuffer);
-						
-				try{
-					const int block_size = ScanlineBlockSize( read_doc.file() );
-				
-					int y = dw.min.y;
-					
-					while(y <= dw.max.y)
-					{
-						int high_scanline = MIN(y + block_size - 1, dw.max.y);
-						
-						in_file.readPixels(y, high_scanline);
-						
-						y = high_scanline + 1;
-						
-						queryAbort();
-					}
-				}
-				catch(Iex::InputExc) {}
-				catch(Iex::IoExc) {}
-			}
-			
-			// kill NaN
-			for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
-			{
-				ProEXRchannel *chan = *i;
-				
-				chan->killNaN();
-			}
-			
-			// clip alpha
-			for(vector<ProEXRchannel *>::iterator i = alphas_to_clip.begin(); i != alphas_to_clip.end(); ++i)
-			{
-				ProEXRchannel *chan = *i;
-				
-				chan->alphaClip();
-			}
+		for(int i=0; i < candidates.size(); i++)
+		{
+			ThreadPool::addGlobalTask(new HalfExactTask(&taskGroup, candidates[i], exact[i]) );
 		}
-		catch(bad_alloc)
+	}
+	
+	queryAbort();
+	
+	for(int i=0; i < candidates.size(); i++)
+	{
+		if( exact[i] )
 		{
-			// we ran out of memory, unload everything
-			freeBuffers();
+			candidates[i]->demoteToHalf();
+			
+			_demoted_channels.push_back( candidates[i]->name() );
 		}
 	}
 }
 
 void
-ProEXRlayer_read::loadFromRGBA()
+ProEXRdoc_write_base::chooseCompressions(vector<Header> &part_headers, const vector<FrameBuffer> &part_buffers)
 {
-	try{
-		if(doc() == NULL)
-			throw BaseExc("doc() is NULL.");
+	_chosen_compressions.clear();
 	
-		ProEXRdoc_read &read_doc = dynamic_cast<ProEXRdoc_read &>( *doc() );
-		
-		vector<ProEXRchannel *> &chans = channels();
-		
-		sortChannels();
-		
-		assert(chans.size() >= 3);
-		assert(chans[0]->name() == "Y");
-		assert(chans[1]->name() == "RY");
-		assert(chans[2]->name() == "BY");
-		
-		bool have_a = (chans.size() >= 4 && chans[3]->name() == "A");
-		
-		ProEXRbuffer r_desc = chans[0]->getBufferDesc(); // should also allocate float buffer
-		ProEXRbuffer g_desc = chans[1]->getBufferDesc();
-		ProEXRbuffer b_desc = chans[2]->getBufferDesc();
-		
-		ProEXRbuffer a_desc = {Imf::HALF, NULL, 0, 0, 0, 0};
-		
-		if(have_a)
-			a_desc = chans[3]->getBufferDesc();
-			
-		int buf_width = r_desc.width;
-		int buf_height = r_desc.height;
+	if(!_auto_compression)
+		return;
+	
+	// the lossless ones, plus whatever was asked for, so none or a lossy
+	// one only gets tried when the user picked it
+	vector<Compression> candidates;
+	
+	candidates.push_back(RLE_COMPRESSION);
+	candidates.push_back(ZIPS_COMPRESSION);
+	candidates.push_back(ZIP_COMPRESSION);
+	candidates.push_back(PIZ_COMPRESSION);
+	
+	if(find(candidates.begin(), candidates.end(), header().compression()) == candidates.end())
+		candidates.push_back( header().compression() );
+	
+	for(int n=0; n < part_headers.size(); n++)
+	{
+		// a strip out of the middle of the part
+		Header trial_head = part_headers[n];
 		
-		assert(r_desc.width == g_desc.width && g_desc.width == b_desc.width);
-		assert(r_desc.height == g_desc.height && g_desc.height == b_desc.height);
+		Box2i &dw = trial_head.dataWindow();
+		const int height = (dw.max.y - dw.min.y) + 1;
 		
-		// now use the Rgba interface
-		Imf::IStream &file_in = read_doc.stream();
-		file_in.seekg(0); // expected to be at the beginning, apparently
+		if(height > TRIAL_SCANLINES)
+		{
+			dw.min.y += (height - TRIAL_SCANLINES) / 2;
+			dw.max.y = dw.min.y + TRIAL_SCANLINES - 1;
+		}
 		
-		RgbaInputFile inputFile( file_in );
+		vector<char> strip;
+		size_t line_size = 0;
 		
-		Box2i dw = inputFile.dataWindow();
-		int width = (dw.max.x - dw.min.x) + 1;
-		int height = (dw.max.y - dw.min.y) + 1;
+		ProEXRcompressionTrial::packStrip(trial_head, part_buffers[n], strip, line_size);
 		
-		Array2D<Rgba> half_buffer(height, width);
+		vector<ProEXRcompressionTrial *> trials;
 		
-		inputFile.setFrameBuffer(&half_buffer[-dw.min.y][-dw.min.x], 1, width);
+		for(int c=0; c < candidates.size(); c++)
+			trials.push_back( new ProEXRcompressionTrial(trial_head, strip, line_size, candidates[c]) );
 		
-		try{
-			int y = dw.min.y;
+		if(true) // making a scope for the TaskGroup
+		{
+			TaskGroup taskGroup;
 			
-			while(y <= dw.max.y)
-			{
-				int high_scanline = MIN(y + 127, dw.max.y);
-				
-				inputFile.readPixels(y, high_scanline);
-				
-				y = high_scanline + 1;
-				
-				queryAbort();
-			}
+			for(int c=0; c < trials.size(); c++)
+				ThreadPool::addGlobalTask(new CompressionTrialTask(&taskGroup, trials[c]) );
 		}
-		catch(Iex::InputExc) {}
-		catch(Iex::IoExc) {}
 		
-		// copy from big half buffer to our channel buffers
-		char *r_row = (char *)r_desc.buf;
-		char *g_row = (char *)g_desc.buf;
-		char *b_row = (char *)b_desc.buf;
-		char *a_row = (char *)a_desc.buf;
+		// timed one at a time, side by side they'd only be timing each other
+		int best = -1;
+		double best_score = 0.0;
 		
-		for(int y=0; y < buf_height; y++)
+		for(int c=0; c < trials.size(); c++)
 		{
-			float *r_pix = (float *)r_row;
-			float *g_pix = (float *)g_row;
-			float *b_pix = (float *)b_row;
-			float *a_pix = (float *)a_row;
+			trials[c]->timeDecode(TRIAL_DECODE_RUNS);
 			
-			for(int x=0; x < buf_width; x++)
+			if( trials[c]->ok() )
 			{
-				*r_pix++ = half_buffer[y][x].r;
-				*g_pix++ = half_buffer[y][x].g;
-				*b_pix++ = half_buffer[y][x].b;
+				const double score = trials[c]->score(_speed_weight);
 				
-				if(have_a)
-					*a_pix++ = half_buffer[y][x].a;
+				if(best < 0 || score < best_score)
+				{
+					best = c;
+					best_score = score;
+				}
 			}
-			
-			r_row += r_desc.rowbytes;
-			g_row += g_desc.rowbytes;
-			b_row += b_desc.rowbytes;
-			a_row += a_desc.rowbytes;
 		}
 		
-		// mark as loaded
-		chans[0]->setLoaded(true);
-		chans[1]->setLoaded(true);
-		chans[2]->setLoaded(true);
-		
-		if(have_a)
-			chans[3]->setLoaded(true);
+		if(best >= 0)
+			part_headers[n].compression() = candidates[best];
 		
-		// kill NaN
-		chans[0]->killNaN();
-		chans[1]->killNaN();
-		chans[2]->killNaN();
+		for(int c=0; c < trials.size(); c++)
+			delete trials[c];
 		
-		if(have_a)
-			chans[3]->killNaN();
+		queryAbort();
 		
-		// clip alpha
-		if(have_a && read_doc.getClipAlpha())
-			chans[3]->alphaClip();
+		const string chosen = CompressionName( part_headers[n].compression() );
 		
-		queryAbort();
-	}
-	catch(bad_alloc)
-	{
-		// we ran out of memory, unload everything
-		freeBuffers();
+		_chosen_compressions.push_back( part_headers[n].hasName() ? (part_headers[n].name() + ": " + chosen) : chosen );
 	}
 }
 
-ProEXRdoc::ProEXRdoc() :
-	_black_channel(NULL),
-	_white_channel(NULL)
-{
-
-}
-
-ProEXRdoc::~ProEXRdoc()
+void
+ProEXRdoc_write_base::addStats(Header &head, const vector<string> &names, const vector<ProEXRbuffer> &buffers)
 {
-	if(_black_channel) delete _black_channel;
-	if(_white_channel) delete _white_channel;
+	if(!_write_stats)
+		return;
+	
+	const Box2i &dw = header().dataWindow();
+	
+	// first pass gets everything but the histogram, in bands of rows
+	vector< vector<StatsBand> > bands( buffers.size() );
+	
+	if(true) // making a scope for the TaskGroup
+	{
+		TaskGroup taskGroup;
+		
+		for(int c=0; c < buffers.size(); c++)
+		{
+			const int height = buffers[c].height;
+			
+			bands[c].resize( (height + STATS_BAND_ROWS - 1) / STATS_BAND_ROWS );
+			
+			for(int b=0; b < bands[c].size(); b++)
+			{
+				ThreadPool::addGlobalTask(new ChannelStatsTask(&taskGroup, buffers[c], b * STATS_BAND_ROWS,
+																MIN((b + 1) * STATS_BAND_ROWS, height), bands[c][b]) );
+			}
+		}
+	}
+	
+	queryAbort();
+	
+	vector<ChannelStats> stats( buffers.size() );
+	vector<int> finite( buffers.size(), 0 );
+	
+	for(int c=0; c < buffers.size(); c++)
+	{
+		ChannelStats &st = stats[c];
+		
+		st.min = st.max = st.mean = 0.f;
+		st.nan_count = st.inf_count = 0;
+		
+		double sum = 0.0;
+		
+		for(int b=0; b < bands[c].size(); b++)
+		{
+			const StatsBand &band = bands[c][b];
+			
+			if(band.finite > 0)
+			{
+				if(finite[c] == 0)
+				{
+					st.min = band.min;
+					st.max = band.max;
+				}
+				else
+				{
+					st.min = MIN(st.min, band.min);
+					st.max = MAX(st.max, band.max);
+				}
+			}
+			
+			sum += band.sum;
+			finite[c] += band.finite;
+			st.nan_count += band.nan_count;
+			st.inf_count += band.inf_count;
+			
+			if( !band.bounds.isEmpty() )
+				st.bounds.extendBy(band.bounds);
+		}
+		
+		if(finite[c] > 0)
+			st.mean = sum / (double)finite[c];
+		
+		if( !st.bounds.isEmpty() )
+			st.bounds = Box2i(st.bounds.min + dw.min, st.bounds.max + dw.min);
+	}
 	
-	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+	// now that we have the ranges, the histograms
+	if(true) // making a scope for the TaskGroup
 	{
-		if(*i)
+		TaskGroup taskGroup;
+		
+		for(int c=0; c < buffers.size(); c++)
 		{
-			delete *i;
-			*i = NULL;
+			const int height = buffers[c].height;
+			
+			for(int b=0; b < bands[c].size(); b++)
+			{
+				ThreadPool::addGlobalTask(new ChannelHistogramTask(&taskGroup, buffers[c], b * STATS_BAND_ROWS,
+																	MIN((b + 1) * STATS_BAND_ROWS, height),
+																	stats[c].min, stats[c].max, bands[c][b].histogram) );
+			}
 		}
 	}
-
-	for(vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
+	
+	queryAbort();
+	
+	for(int c=0; c < buffers.size(); c++)
 	{
-		if(*i)
+		ChannelStats &st = stats[c];
+		
+		vector<double> counts(CHANNEL_STATS_BINS, 0.0);
+		
+		for(int b=0; b < bands[c].size(); b++)
 		{
-			delete *i;
-			*i = NULL;
+			for(int i=0; i < CHANNEL_STATS_BINS; i++)
+				counts[i] += bands[c][b].histogram[i];
 		}
+		
+		st.histogram.resize(CHANNEL_STATS_BINS);
+		
+		for(int i=0; i < CHANNEL_STATS_BINS; i++)
+			st.histogram[i] = (finite[c] > 0 ? counts[i] / (double)finite[c] : 0.0);
+		
+		addChannelStats(head, names[c], st);
 	}
 }
 
-ProEXRchannel *
-ProEXRdoc::getAlphaChannel() const
-{
-	return findChannel("A");
-}
-
-ProEXRchannel *
-ProEXRdoc::findChannel(string channelName) const
+void
+ProEXRdoc_write_base::addPreview(Header &head, const vector<string> &names, const vector<ProEXRbuffer> &buffers)
 {
-	for(vector<ProEXRchannel *>::const_iterator i = channels().begin(); i != channels().end(); ++i)
+	if(!_write_preview)
+		return;
+	
+	// the buffers the part is being written from, so nothing gets converted again
+	static const char * rgba_names[4] = { "R", "G", "B", "A" };
+	
+	const ProEXRbuffer *rgba[4] = { NULL, NULL, NULL, NULL };
+	const ProEXRbuffer *y_buf = NULL;
+	
+	for(int i=0; i < names.size(); i++)
 	{
-		if( (*i)->name() == channelName )
-			return *i;
+		if(buffers[i].buf == NULL)
+			continue;
+		
+		for(int c=0; c < 4; c++)
+		{
+			if(names[i] == rgba_names[c])
+				rgba[c] = &buffers[i];
+		}
+		
+		if(names[i] == "Y")
+			y_buf = &buffers[i];
 	}
 	
-	return NULL;
-}
-
-ProEXRlayer *
-ProEXRdoc::findLayer(string layerName) const
-{
-	for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
+	// gray if all we have is Y
+	if(rgba[0] == NULL || rgba[1] == NULL || rgba[2] == NULL)
 	{
-		if( (*i)->name() == layerName )
-			return *i;
+		if(y_buf == NULL)
+			return;
+		
+		rgba[0] = rgba[1] = rgba[2] = y_buf;
 	}
 	
-	return NULL;
-}
-
-ProEXRlayer *
-ProEXRdoc::findMainLayer(bool be_flexible, bool force) const
-{
-	assert( layers().size() );
+	const int width = rgba[0]->width;
+	const int height = rgba[0]->height;
 	
-	if( findLayer("RGB") )				return findLayer("RGB");
-	if( findLayer("RGBA") )				return findLayer("RGBA");
-	if( findLayer("Y") )				return findLayer("Y");
-	if( findLayer("[Y]") )				return findLayer("[Y]");
-	if( findLayer("YA") )				return findLayer("YA");
-	if( findLayer("[Y][A]") )			return findLayer("[Y][A]");
-	if( findLayer("[Y][RY][BY]") )		return findLayer("[Y][RY][BY]");
-	if( findLayer("[Y][RY][BY][A]") )	return findLayer("[Y][RY][BY][A]");
+	// fit in PREVIEW_SIZE x PREVIEW_SIZE, never bigger than the image
+	int preview_width = MIN(width, PREVIEW_SIZE);
+	int preview_height = MIN(height, PREVIEW_SIZE);
 	
+	if(width > height)
+		preview_height = MAX(1, (height * preview_width) / width);
+	else
+		preview_width = MAX(1, (width * preview_height) / height);
 	
-	if(be_flexible)
+	PreviewImage preview(preview_width, preview_height);
+	
+	if(true) // making a scope for the TaskGroup
 	{
-		// ok, then we'll look for a layer that has at least one standard channel
-		vector<string> standard_channels;
-		
-		standard_channels.push_back("R");
-		standard_channels.push_back("G");
-		standard_channels.push_back("B");
-		standard_channels.push_back("A");
+		TaskGroup taskGroup;
 		
-		for(vector<string>::const_iterator j = standard_channels.begin(); j != standard_channels.end(); ++j)
+		for(int y=0; y < preview_height; y++)
 		{
-			for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
-			{
-				if( (*i)->findChannel( *j ) != NULL )
-					return *i;
-			}
+			ThreadPool::addGlobalTask(new PreviewRowTask(&taskGroup, rgba, preview, y) );
 		}
 	}
 	
-	// ummm, ok, forced to come up with a layer of some kind?
-	if(force && layers().size())
-		return layers().at(0);
-	else
-		return NULL;
-}
-
-bool
-ProEXRdoc::loaded() const
-{
-	bool loaded = true;
-
-	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end() && loaded; ++j)
-	{
-		if( !(*j)->loaded() )
-			loaded = false;
-	}
+	queryAbort();
 	
-	return loaded;
-}
-
-Int64
-ProEXRdoc::memorySize() const
-{
-	return ( (Int64)sizeof(float) * (Int64)width() * (Int64)height() * (Int64)channels().size() );
-}
-
-void
-ProEXRdoc::freeBuffers() const
-{
-	for(vector<ProEXRchannel *>::const_iterator j = channels().begin(); j != channels().end(); ++j)
-	{
-		(*j)->freeBuffers();
-	}
-}
-
-void
-ProEXRdoc::premultiply()
-{
-	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
-		(*i)->premultiply( getAlphaChannel() );
+	head.setPreviewImage(preview);
 }
 
 void
-ProEXRdoc::unMult()
-{
-	for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
-		(*i)->unMult( getAlphaChannel() );
-}
-
-ProEXRdoc_read::ProEXRdoc_read(Imf::IStream &is, bool clip_alpha, bool renameFirstPart, bool set_up) :
-	_in_stream(is),
-	_in_file(is, renameFirstPart),
-	_clipAlpha(clip_alpha)
-{
-	if(set_up)
-		setupDoc();
-}
-
-ProEXRdoc_read::~ProEXRdoc_read()
+ProEXRdoc_write_base::writeParts(bool crop_layers)
 {
-
-}
-
-int
-ProEXRdoc_read::width() const
-{
-	const Box2i &dw = file().dataWindow();
-			
-	return ((dw.max.x - dw.min.x) + 1);
-}
-
-int
-ProEXRdoc_read::height() const
-{
-	const Box2i &dw = file().dataWindow();
+	Header &head = header();
+	vector<ProEXRchannel *> &chans = channels();
 	
-	return ((dw.max.y - dw.min.y) + 1);
-}
-
-void
-ProEXRdoc_read::loadFromFile()
-{
-	try{
-		vector<ProEXRchannel *> alphas_to_clip;
-		
-		// EXR calls
-		const Box2i &dw = file().dataWindow();
+	assert( head.channels().begin() == head.channels().end() ); // i.e., there are no channels in the header now
+	
+	demoteChannels();
+	
+	Box2i dw = head.dataWindow();
+	
+	// the first part holds the channels that aren't in a layer,
+	// keeping their full names so a single-part reader still finds R, G, B, A
+	const string first_part_name = "rgba";
+	
+	vector<string> part_names;
+	vector<Header> part_headers;
+	vector<FrameBuffer> part_buffers;
+	vector< vector<ProEXRbuffer> > part_descs; // for finding the bounds
+	vector< vector<string> > part_chans;
+	
+	part_names.push_back(first_part_name);
+	part_headers.push_back(head);
+	part_buffers.push_back( FrameBuffer() );
+	part_descs.push_back( vector<ProEXRbuffer>() );
+	part_chans.push_back( vector<string>() );
+	
+	for(int i=0; i < chans.size(); i++)
+	{
+		ProEXRchannel *chan = chans[i];
 		
-		FrameBuffer frameBuffer;
-
-		vector<ProEXRlayer_read *> layers_to_load;
-
-		for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		if( chan->loaded() )
 		{
-			ProEXRlayer_read &read_layer = dynamic_cast<ProEXRlayer_read &>( **i );
+			const bool in_layer = (chan->channelType() == CHANNEL_LAYER);
 			
-			if( read_layer.loadAsLayer() )
+			// inside a layer's part, channels go by their short names and
+			// the part name supplies the layer, the way HybridInputFile reads them back
+			const string &part_name = (in_layer ? chan->layerName() : first_part_name);
+			const string &chan_name = (in_layer ? chan->channelName() : chan->name());
+			
+			int part = 0;
+			
+			while(part < part_names.size() && part_names[part] != part_name)
+				part++;
+			
+			if(part == part_names.size())
 			{
-				layers_to_load.push_back(&read_layer);
+				part_names.push_back(part_name);
+				part_headers.push_back(head);
+				part_buffers.push_back( FrameBuffer() );
+				part_descs.push_back( vector<ProEXRbuffer>() );
+				part_chans.push_back( vector<string>() );
 			}
-			else
-			{
-				vector<ProEXRchannel *> &chans = read_layer.channels();
 			
-				for(vector<ProEXRchannel *>::iterator j = chans.begin(); j != chans.end(); ++j)
-				{
-					ProEXRchannel *chan = *j;
-					
-					if( chan->loaded() == false )
-					{
-						const bool this_is_alpha = (chan->channelTag() == CHAN_A);
-					
-						ProEXRbuffer desc = chan->getBufferDesc(false);
-							
-						char *exr_buf_origin = (char *)desc.buf - (desc.colbytes * dw.min.x) - (desc.rowbytes * dw.min.y);
-
-						float fillValue = (this_is_alpha ? 1.0f : 0.0f);
-
-						frameBuffer.insert(chan->name().c_str(), Slice(desc.type, exr_buf_origin, desc.colbytes, desc.rowbytes, 1, 1, fillValue));
-						
-						chan->setLoaded(true); // yes, I know we haven't actually done it yet
-						
-						if(this_is_alpha && getClipAlpha())
-							alphas_to_clip.push_back(chan);
-					}
-				}
-			}
-		}
-
-		if(frameBuffer.begin() != frameBuffer.end()) // i.e. not empty
-		{
-			file().setFrameBuffer(frameBuffer);
-					
-			try{
-				const int block_size = ScanlineBlockSize( file() );
-				
-				int y = dw.min.y;
-				
-				while(y <= dw.max.y)
-				{
-					int high_scanline = MIN(y + block_size - 1, dw.max.y);
-					
-					file().readPixels(y, high_scanline);
-					
-					y = high_scanline + 1;
-					
-					queryAbort();
-				}
-			}
-			catch(Iex::InputExc) {}
-			catch(Iex::IoExc) {}
+			part_headers[part].channels().insert(chan_name.c_str(), chan->pixelType() );
+			
+			ProEXRbuffer buffer = chan->getBufferDesc(chan->pixelType() == Imf::HALF);
+			
+			if(buffer.buf == NULL)
+				throw BaseExc("buffer.buf is NULL.");
+			
+			char *exr_origin = (char *)buffer.buf - (dw.min.y * buffer.rowbytes) - (dw.min.x * buffer.colbytes);
+			
+			part_buffers[part].insert(chan_name.c_str(),
+						Slice(chan->pixelType(), exr_origin, buffer.colbytes, buffer.rowbytes) );
+			
+			part_descs[part].push_back(buffer);
+			part_chans[part].push_back(chan_name);
 		}
+	}
+	
+	// drop the first part if nothing went in it
+	if(part_headers[0].channels().begin() == part_headers[0].channels().end() && part_headers.size() > 1)
+	{
+		part_names.erase( part_names.begin() );
+		part_headers.erase( part_headers.begin() );
+		part_buffers.erase( part_buffers.begin() );
+		part_descs.erase( part_descs.begin() );
+		part_chans.erase( part_chans.begin() );
+	}
+	
+	
+	// shrink each layer's data window down to where it has pixels,
+	// leaving the first part alone so the file keeps its full data window
+	if(crop_layers)
+	{
+		vector< vector<Box2i> > part_bounds( part_descs.size() );
 		
-		// kill NaN
-		for(vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
+		if(true) // making a scope for the TaskGroup
 		{
-			ProEXRlayer_read &read_layer = dynamic_cast<ProEXRlayer_read &>( **i );
+			TaskGroup taskGroup;
 			
-			vector<ProEXRchannel *> &chans = read_layer.channels();
-		
-			for(vector<ProEXRchannel *>::iterator j = chans.begin(); j != chans.end(); ++j)
+			for(int n=0; n < part_descs.size(); n++)
 			{
-				ProEXRchannel *chan = *j;
-				
-				chan->killNaN();
+				if(n > 0)
+				{
+					part_bounds[n].resize( part_descs[n].size() );
+					
+					for(int c=0; c < part_descs[n].size(); c++)
+					{
+						ThreadPool::addGlobalTask(new ChannelBoundsTask(&taskGroup, part_descs[n][c], part_bounds[n][c]) );
+					}
+				}
 			}
 		}
 		
-		// clip alpha
-		for(vector<ProEXRchannel *>::iterator i = alphas_to_clip.begin(); i != alphas_to_clip.end(); ++i)
-		{
-			ProEXRchannel *chan = *i;
-			
-			chan->alphaClip();
-		}
+		queryAbort();
 		
-		// any layers to load all together?
-		if( layers_to_load.size() )
+		for(int n=0; n < part_bounds.size(); n++)
 		{
-			for(vector<ProEXRlayer_read *>::iterator i = layers_to_load.begin(); i != layers_to_load.end(); ++i)
+			if(n > 0)
 			{
-				(*i)->loadFromFile();
+				Box2i bounds;
+				
+				for(int c=0; c < part_bounds[n].size(); c++)
+				{
+					if( !part_bounds[n][c].isEmpty() )
+					{
+						bounds.extendBy( part_bounds[n][c] );
+					}
+				}
+				
+				if( bounds.isEmpty() )
+				{
+					// an empty layer still needs a pixel
+					bounds = Box2i(V2i(0, 0), V2i(0, 0));
+				}
+				
+				part_headers[n].dataWindow() = Box2i(bounds.min + dw.min, bounds.max + dw.min);
 			}
 		}
 	}
-	catch(bad_alloc)
+	
+	for(int n=0; n < part_headers.size(); n++)
 	{
-		// we ran out of memory, unload everything
-		freeBuffers();
+		part_headers[n].setName( part_names[n] );
+		part_headers[n].setType(SCANLINEIMAGE);
 	}
-}
-
-void
-ProEXRdoc_read::setupDoc()
-{
-	initChannels<ProEXRchannel_read>();
 	
-	buildLayers<ProEXRlayer_read>();
-}
-
-ProEXRdoc_write_base::ProEXRdoc_write_base(OStream &os, Header &header) :
-	_out_stream(os),
-	_header(header)
-{
-
+	for(int n=0; n < part_headers.size(); n++)
+		addStats(part_headers[n], part_chans[n], part_descs[n]);
+	
+	// the preview goes with R, G, B, A, so only if the first part survived
+	if(part_names[0] == first_part_name)
+		addPreview(part_headers[0], part_chans[0], part_descs[0]);
+	
+	chooseCompressions(part_headers, part_buffers);
+	
+	queryAbort();
+	
+	MultiPartOutputFile file(stream(), &part_headers[0], part_headers.size());
+	
+	for(int n=0; n < part_headers.size(); n++)
+	{
+		OutputPart part(file, n);
+		
+		const Box2i &part_dw = part_headers[n].dataWindow();
+		
+		part.setFrameBuffer( part_buffers[n] );
+		
+		part.writePixels( (part_dw.max.y - part_dw.min.y) + 1 );
+		
+		queryAbort();
+	}
 }
 
-ProEXRdoc_write_base::~ProEXRdoc_write_base()
+ProEXRdoc_write::ProEXRdoc_write(OStream &os, Header &header) :
+	ProEXRdoc_write_base(os, header),
+	_layer_parts(false),
+	_tiled(false),
+	_level_mode(MIPMAP_LEVELS),
+	_tile_size(64)
 {
 
 }
 
-int
-ProEXRdoc_write_base::width() const
+ProEXRdoc_write::~ProEXRdoc_write()
 {
-	const Box2i &dw = header().dataWindow();
 	
-	return ((dw.max.x - dw.min.x) + 1);
 }
 
-int
-ProEXRdoc_write_base::height() const
+void
+ProEXRdoc_write::setLayerParts(bool layer_parts)
 {
-	const Box2i &dw = header().dataWindow();
+	if(layer_parts && _tiled)
+		throw ArgExc("Layer parts can't be written as tiles.");
 	
-	return ((dw.max.y - dw.min.y) + 1);
+	_layer_parts = layer_parts;
 }
 
 void
-ProEXRdoc_write_base::addChannel(ProEXRchannel *channel)
+ProEXRdoc_write::setTiles(bool tiled, LevelMode level_mode, int tile_size)
 {
-	// don't want a duplicate channel
-	while( findChannel( channel->name() ) )
-		channel->incrementName();
-	
-	if( channel->doc() == NULL )
-		channel->assignDoc(this);
-	else
-		assert(channel->doc() == this);
+	if(tiled && _layer_parts)
+		throw ArgExc("Layer parts can't be written as tiles.");
 	
-	channels().push_back(channel);
+	_tiled = tiled;
+	_level_mode = level_mode;
+	_tile_size = tile_size;
 }
 
 void
-ProEXRdoc_write_base::addLayer(ProEXRlayer *layer)
+ProEXRdoc_write::writeFile()
 {
-	assert(layer->doc() == NULL);
-	
-	// make sure we're not duplicating any channels
-	bool found_no_duplicates = false;
-	
-	while(!found_no_duplicates)
+	if(_layer_parts)
 	{
-		bool must_increment = false;
-		
-		for(vector<ProEXRchannel *>::iterator i = layer->channels().begin(); i != layer->channels().end(); ++i)
-		{
-			assert( (*i)->doc() == NULL ); // channels should be unattached
-			
-			if( findChannel( (*i)->name() ) )
-				must_increment = true;
-		}
+		writeParts(true);
 		
-		if(must_increment)
-			layer->incrementChannels();
-		else
-			found_no_duplicates = true;
+		return;
 	}
 	
-	// now that we know all channels are unique
-	for(vector<ProEXRchannel *>::iterator i = layer->channels().begin(); i != layer->channels().end(); ++i)
-		addChannel( *i );
-	
-	// add that layer
-	layer->assignDoc(this);
-	
-	layers().push_back(layer);
-}
-
-ProEXRdoc_write::ProEXRdoc_write(OStream &os, Header &header) :
-	ProEXRdoc_write_base(os, header)
-{
-
-}
-
-ProEXRdoc_write::~ProEXRdoc_write()
-{
-	
-}
-
-void
-ProEXRdoc_write::writeFile()
-{
 	Header &head = header();
 	vector<ProEXRchannel *> &chans = channels();
 	
 	assert( head.channels().begin() == head.channels().end() ); // i.e., there are no channels in the header now
 	
+	demoteChannels();
+	
 	Box2i dw = head.dataWindow();
 	int dw_height = (dw.max.y - dw.min.y) + 1;
 	
 	FrameBuffer frameBuffer;
 	
+	vector<string> names;
+	vector<ProEXRbuffer> descs;
+	
 	for(int i=0; i < chans.size(); i++)
 	{
 		ProEXRchannel *chan = chans[i];
@@ -1763,9 +3355,33 @@ ProEXRdoc_write::writeFile()
 			
 			frameBuffer.insert(chan->name().c_str(),
 						Slice(chan->pixelType(), exr_origin, buffer.colbytes, buffer.rowbytes) );
+			
+			names.push_back( chan->name() );
+			descs.push_back(buffer);
 		}
 	}
 	
+	addStats(head, names, descs);
+	
+	addPreview(head, names, descs);
+	
+	if( autoCompression() )
+	{
+		vector<Header> part_headers(1, head);
+		vector<FrameBuffer> part_buffers(1, frameBuffer);
+		
+		chooseCompressions(part_headers, part_buffers);
+		
+		head.compression() = part_headers[0].compression();
+	}
+	
+	if(_tiled)
+	{
+		writeTiledFile(names, descs);
+		
+		return;
+	}
+	
 	OutputFile file(stream(), head);
 	
 	file.setFrameBuffer(frameBuffer);
@@ -1773,6 +3389,136 @@ ProEXRdoc_write::writeFile()
 	file.writePixels(dw_height);
 }
 
+void
+ProEXRdoc_write::writeTiledFile(const vector<string> &names, const vector<ProEXRbuffer> &buffers)
+{
+	Header &head = header();
+	
+	head.setTileDescription( TileDescription(_tile_size, _tile_size, _level_mode, ROUND_DOWN) );
+	
+	TiledOutputFile file(stream(), head);
+	
+	const Box2i &dw = head.dataWindow();
+	
+	// each level is made from the one before it and then let go,
+	// so we never hold more than about one extra frame
+	LevelBuffers level_0(buffers);
+	
+	level_0.write(file, names, dw, 0, 0);
+	
+	queryAbort();
+	
+	if(_level_mode == MIPMAP_LEVELS)
+	{
+		const LevelBuffers *previous = &level_0;
+		
+		try
+		{
+			for(int l=1; l < file.numLevels(); l++)
+			{
+				const LevelBuffers *level = new LevelBuffers(*previous, file.levelWidth(l), file.levelHeight(l));
+				
+				if(previous != &level_0)
+					delete previous;
+				
+				previous = level;
+				
+				level->write(file, names, dw, l, l);
+				
+				queryAbort();
+			}
+		}
+		catch(...)
+		{
+			if(previous != &level_0)
+				delete previous;
+			
+			throw;
+		}
+		
+		if(previous != &level_0)
+			delete previous;
+	}
+	else if(_level_mode == RIPMAP_LEVELS)
+	{
+		// going down a column of Y levels, with a row of X levels off each one
+		const LevelBuffers *column = &level_0;
+		const LevelBuffers *row = NULL;
+		
+		try
+		{
+			for(int ly=0; ly < file.numYLevels(); ly++)
+			{
+				if(ly > 0)
+				{
+					const LevelBuffers *level = new LevelBuffers(*column, file.levelWidth(0), file.levelHeight(ly));
+					
+					if(column != &level_0)
+						delete column;
+					
+					column = level;
+					
+					column->write(file, names, dw, 0, ly);
+					
+					queryAbort();
+				}
+				
+				const LevelBuffers *previous = column;
+				
+				for(int lx=1; lx < file.numXLevels(); lx++)
+				{
+					row = new LevelBuffers(*previous, file.levelWidth(lx), file.levelHeight(ly));
+					
+					if(previous != column)
+						delete previous;
+					
+					previous = row;
+					
+					row->write(file, names, dw, lx, ly);
+					
+					queryAbort();
+				}
+				
+				if(previous != column)
+					delete previous;
+				
+				row = NULL;
+			}
+		}
+		catch(...)
+		{
+			if(row != NULL)
+				delete row;
+			
+			if(column != &level_0)
+				delete column;
+			
+			throw;
+		}
+		
+		if(column != &level_0)
+			delete column;
+	}
+}
+
+
+ProEXRdoc_writeMultiPart::ProEXRdoc_writeMultiPart(OStream &os, Header &header) :
+	ProEXRdoc_write_base(os, header)
+{
+
+}
+
+ProEXRdoc_writeMultiPart::~ProEXRdoc_writeMultiPart()
+{
+
+}
+
+void
+ProEXRdoc_writeMultiPart::writeFile()
+{
+	writeParts(false);
+}
+
 
 ProEXRdoc_writeRGBA::ProEXRdoc_writeRGBA(OStream &os, Header &header, RgbaChannels mode) :
 	ProEXRdoc_write_base(os, header),
@@ -1991,3 +3737,78 @@ void KillNaN(float &in)
 		in = 0.f;
 	}
 }
+
+// keys go by the channel's place in the header, "stats3.histogram" and so on,
+// since a channel name in the key could go past 31 characters and set the
+// long names flag that OpenEXR 1.x can't read, the name itself is a value
+static bool
+StatsAttrPrefix(const Header &header, const string &channel, string &prefix)
+{
+	int index = 0;
+	
+	for(ChannelList::ConstIterator i = header.channels().begin(); i != header.channels().end(); ++i, index++)
+	{
+		if(channel == i.name())
+		{
+			ostringstream prefix_ost;
+			
+			prefix_ost << "stats" << index << ".";
+			
+			prefix = prefix_ost.str();
+			
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void addChannelStats(Header &header, const string &channel, const ChannelStats &stats)
+{
+	string prefix;
+	
+	if( !StatsAttrPrefix(header, channel, prefix) )
+		throw BaseExc("Channel " + channel + " is not in the header.");
+	
+	header.insert(prefix + "channel", StringAttribute(channel) );
+	header.insert(prefix + "range", V2fAttribute( V2f(stats.min, stats.max) ) );
+	header.insert(prefix + "mean", FloatAttribute(stats.mean) );
+	header.insert(prefix + "nanInf", V2iAttribute( V2i(stats.nan_count, stats.inf_count) ) );
+	header.insert(prefix + "bounds", Box2iAttribute(stats.bounds) );
+	header.insert(prefix + "histogram", FloatVectorAttribute(stats.histogram) );
+}
+
+bool getChannelStats(const Header &header, const string &channel, ChannelStats &stats)
+{
+	string prefix;
+	
+	if( !StatsAttrPrefix(header, channel, prefix) )
+		return false;
+	
+	// the channel list has to be the one the stats were made with
+	const StringAttribute *name = header.findTypedAttribute<StringAttribute>(prefix + "channel");
+	
+	if(name == NULL || name->value() != channel)
+		return false;
+	
+	const V2fAttribute *range = header.findTypedAttribute<V2fAttribute>(prefix + "range");
+	const FloatAttribute *mean = header.findTypedAttribute<FloatAttribute>(prefix + "mean");
+	const V2iAttribute *nan_inf = header.findTypedAttribute<V2iAttribute>(prefix + "nanInf");
+	const Box2iAttribute *bounds = header.findTypedAttribute<Box2iAttribute>(prefix + "bounds");
+	const FloatVectorAttribute *histogram = header.findTypedAttribute<FloatVectorAttribute>(prefix + "histogram");
+	
+	if(range && mean && nan_inf && bounds && histogram)
+	{
+		stats.min = range->value().x;
+		stats.max = range->value().y;
+		stats.mean = mean->value();
+		stats.nan_count = nan_inf->value().x;
+		stats.inf_count = nan_inf->value().y;
+		stats.bounds = bounds->value();
+		stats.histogram = histogram->value();
+		
+		return true;
+	}
+	else
+		return false;
+}
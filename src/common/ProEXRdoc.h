@@ -25,11 +25,17 @@
 #define __ProEXRdoc_H__
 
 #include <vector>
+#include <map>
 
 #include <ImfRgbaFile.h>
 #include "ImfHybridInputFile.h"
 #include <ImfOutputFile.h>
+#include <ImfMultiPartOutputFile.h>
+#include <ImfTiledOutputFile.h>
 #include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfPreviewImage.h>
+#include <ImfCompressor.h>
 
 #include <IexBaseExc.h>
 
@@ -80,14 +86,14 @@ class ProEXRchannel
 	ProEXRchannel(std::string name, Imf::PixelType pixelType=Imf::HALF);
 	virtual ~ProEXRchannel();
 	
-	std::string name() const { return _name; } // R, Transparency, layer.R, 
-	std::string layerName() const; // (invalid-reserved), [Transparency], layer
-	std::string channelName() const; // R, Transparency, R
+	const std::string & name() const { return _name; } // R, Transparency, layer.R, 
+	const std::string & layerName() const; // (invalid-reserved), [Transparency], layer
+	const std::string & channelName() const { return _channel_name; } // R, Transparency, R
 	void incrementName();
-	ChanTag channelTag() const;
+	ChanTag channelTag() const { return _tag; }
 	
 	const Imf::PixelType pixelType() const { return _pixelType; }
-	ChannelType channelType() const;
+	ChannelType channelType() const { return _type; }
 	
 	void assignDoc(ProEXRdoc *doc);
 	ProEXRdoc *doc() const { return _doc; }
@@ -99,6 +105,10 @@ class ProEXRchannel
 	std::vector<ChannelType *> getUintRGBchannels(); // the recipient is responsible for deleting these channels
 	
 	ProEXRbuffer getBufferDesc(bool use_half=false);
+	ProEXRbuffer getHalfBufferDesc(); // fill the half buffer directly, no float buffer is kept
+	
+	bool halfExact(); // every loaded FLOAT value survives a trip through half
+	void demoteToHalf(); // FLOAT to HALF, before writing
 	
 	bool loaded() const { return _loaded; }
 	void setLoaded(bool loaded, bool premultiplied=true) { _loaded = loaded; _premultiplied = premultiplied; }
@@ -115,12 +125,22 @@ class ProEXRchannel
   private:
 	void channelParts(std::string &layerName, std::string &channelName) const;
 	void incrementText(std::string &name);
+	void parseName();
 	
 	void copyToHalf();
 	
+	void *allocData(size_t size, bool &on_disk);
+	void freeData(void *data, size_t size, bool on_disk);
+	
 	std::string _name;
 	Imf::PixelType _pixelType;
 	
+	// parsed from _name, redone whenever it changes
+	std::string _layer_name;
+	std::string _channel_name;
+	ChanTag _tag;
+	ChannelType _type;
+	
 	ProEXRdoc *_doc;
 
 	bool _loaded;
@@ -131,6 +151,10 @@ class ProEXRchannel
 	void *_data;
 	void *_half_data;
 	
+	bool _data_on_disk, _half_on_disk; // buffer is a mapped scratch file
+	
+	bool _half_current; // half buffer was filled directly, nothing to convert
+	
 	size_t _rowbytes, _half_rowbytes;
 };
 
@@ -238,6 +262,13 @@ class ProEXRdoc
 	Imath::Int64 memorySize() const; // the amount this would take up if it were fully loaded
 	void freeBuffers() const;
 	
+	// when set, new channel buffers are memory-mapped scratch files instead of RAM
+	void setSpillToDisk(bool spill) { _spill_to_disk = spill; }
+	bool spillToDisk() const { return _spill_to_disk; }
+	
+	void setScratchDir(const std::string &dir) { _scratch_dir = dir; }
+	std::string scratchDir() const; // PROEXR_SCRATCH_DIR or the system temp directory unless set
+	
   protected:
 	void premultiply();
 	void unMult();
@@ -257,6 +288,9 @@ class ProEXRdoc
   
 	ProEXRchannel *_black_channel;
 	ProEXRchannel *_white_channel;
+	
+	bool _spill_to_disk;
+	std::string _scratch_dir;
 };
 
 class ProEXRdoc_read : public ProEXRdoc
@@ -279,6 +313,10 @@ class ProEXRdoc_read : public ProEXRdoc
 	
 	bool getClipAlpha() const { return _clipAlpha; }
 	
+	// the embedded preview, for thumbnails without reading any pixels (use set_up=false)
+	bool hasPreview() const { return header().hasPreviewImage(); }
+	const Imf::PreviewImage & preview() const { return header().previewImage(); }
+	
 	void loadFromFile();
 	
 	virtual void queryAbort() {}
@@ -299,6 +337,44 @@ class ProEXRdoc_read : public ProEXRdoc
 	Imf::HybridInputFile _in_file;
 };
 
+// one compression tried on a strip of scanlines laid out the way the file has them,
+// compress() can run beside other trials but timeDecode() should run on its own
+class ProEXRcompressionTrial
+{
+  public:
+	ProEXRcompressionTrial(const Imf::Header &header, const std::vector<char> &strip, size_t line_size, Imf::Compression compression);
+	~ProEXRcompressionTrial();
+	
+	static void packStrip(const Imf::Header &header, const Imf::FrameBuffer &frameBuffer, std::vector<char> &strip, size_t &line_size);
+	
+	void compress();
+	void timeDecode(int runs); // keeps the fastest
+	
+	bool ok() const { return _ok; }
+	Imf::Compression compression() const { return _compression; }
+	size_t size() const { return _size; } // what the blocks take up in the file
+	double seconds() const { return _seconds; }
+	
+	double score(float speed_weight) const; // lowest wins
+	
+  private:
+	const Imf::Header &_header;
+	const std::vector<char> &_strip;
+	const size_t _line_size;
+	const Imf::Compression _compression;
+	
+	Imf::Compressor *_compressor;
+	int _block_lines;
+	std::vector< std::vector<char> > _blocks; // empty when the file would store it raw
+	
+	bool _ok;
+	size_t _size;
+	double _seconds;
+	
+	ProEXRcompressionTrial(const ProEXRcompressionTrial &); // not copyable
+	ProEXRcompressionTrial & operator = (const ProEXRcompressionTrial &);
+};
+
 class ProEXRdoc_write_base : public ProEXRdoc
 {
   public:
@@ -319,11 +395,56 @@ class ProEXRdoc_write_base : public ProEXRdoc
 	
 	virtual void queryAbort() {}
 	
+	// write FLOAT channels as HALF when nothing would be lost
+	void setDemoteTypes(bool demote) { _demote_types = demote; }
+	bool demoteTypes() const { return _demote_types; }
+	
+	const std::vector<std::string> & demotedChannels() const { return _demoted_channels; } // after writeFile()
+	
+	// try some compressions on a strip of each part and keep the best trade
+	// of size for decode speed, speed_weight of 0 caring only about size
+	void setAutoCompression(bool auto_compression, float speed_weight = 0.25f) { _auto_compression = auto_compression; _speed_weight = speed_weight; }
+	bool autoCompression() const { return _auto_compression; }
+	float speedWeight() const { return _speed_weight; }
+	
+	const std::vector<std::string> & chosenCompressions() const { return _chosen_compressions; } // after writeFile()
+	
+	// put min, max, mean, NaN/Inf counts, bounds and a histogram in the header for each channel
+	void setWriteStats(bool write_stats) { _write_stats = write_stats; }
+	bool writeStats() const { return _write_stats; }
+	
+	// embed a small 8-bit preview made from R, G, B, A (or Y)
+	void setWritePreview(bool write_preview) { _write_preview = write_preview; }
+	bool writePreview() const { return _write_preview; }
+	
   protected:
+	// each layer in its own part, optionally cropped to where the layer isn't empty
+	void writeParts(bool crop_layers);
+	
+	void demoteChannels(); // writers call this before building headers
+	
+	// sets the compression in each header, if we're doing that
+	void chooseCompressions(std::vector<Imf::Header> &part_headers, const std::vector<Imf::FrameBuffer> &part_buffers);
+	
+	// adds the stats attributes, if we're doing that
+	void addStats(Imf::Header &header, const std::vector<std::string> &names, const std::vector<ProEXRbuffer> &buffers);
+	
+	// adds the preview, if we're doing that, from the buffers the part is written from
+	void addPreview(Imf::Header &header, const std::vector<std::string> &names, const std::vector<ProEXRbuffer> &buffers);
   
   private:
 	Imf::OStream &_out_stream;
 	Imf::Header &_header;
+	
+	bool _demote_types;
+	std::vector<std::string> _demoted_channels;
+	
+	bool _auto_compression;
+	float _speed_weight;
+	std::vector<std::string> _chosen_compressions;
+	
+	bool _write_stats;
+	bool _write_preview;
 };
 
 class ProEXRdoc_write : public ProEXRdoc_write_base
@@ -336,6 +457,40 @@ class ProEXRdoc_write : public ProEXRdoc_write_base
 	
 	virtual void queryAbort() {}
 	
+	// write each layer as a cropped part instead of everything in one part
+	// (parts are always scanlines, so this throws if tiles are on)
+	void setLayerParts(bool layer_parts);
+	bool layerParts() const { return _layer_parts; }
+	
+	// write tiles instead of scanlines, with reduced levels for MIPMAP_LEVELS
+	// and RIPMAP_LEVELS (throws if layer parts are on)
+	void setTiles(bool tiled, Imf::LevelMode level_mode = Imf::MIPMAP_LEVELS, int tile_size = 64);
+	bool tiled() const { return _tiled; }
+	
+  protected:
+  
+  private:
+	void writeTiledFile(const std::vector<std::string> &names, const std::vector<ProEXRbuffer> &buffers);
+	
+	bool _layer_parts;
+	
+	bool _tiled;
+	Imf::LevelMode _level_mode;
+	int _tile_size;
+};
+
+// each layer gets its own part, named after the layer
+// reserved and single channels stay together in the first part
+class ProEXRdoc_writeMultiPart : public ProEXRdoc_write_base
+{
+  public:
+	ProEXRdoc_writeMultiPart(Imf::OStream &os, Imf::Header &header);
+	virtual ~ProEXRdoc_writeMultiPart();
+  
+	virtual void writeFile();
+	
+	virtual void queryAbort() {}
+	
   protected:
   
   private:
@@ -363,6 +518,22 @@ class ProEXRdoc_writeRGBA : public ProEXRdoc_write_base
 void writeRGBAfile(Imf::OStream &os, Imf::Header &header, Imf::RgbaChannels mode,
 					ProEXRchannel *r_chan, ProEXRchannel *g_chan, ProEXRchannel *b_chan, ProEXRchannel *a_chan);
 
+// statistics that can ride along in the header, so nobody has to read the pixels to get them
+#define CHANNEL_STATS_BINS	(16)
+
+typedef struct ChannelStats {
+	float min; // finite pixels only
+	float max;
+	float mean;
+	int nan_count;
+	int inf_count;
+	Imath::Box2i bounds; // where the channel isn't zero, empty if it all is
+	std::vector<float> histogram; // fraction of the finite pixels in each bin from min to max
+} ChannelStats;
+
+void addChannelStats(Imf::Header &header, const std::string &channel, const ChannelStats &stats); // channel has to be in the header already
+bool getChannelStats(const Imf::Header &header, const std::string &channel, ChannelStats &stats); // false if not there
+
 
 #ifndef MAX
 	#define MAX(A,B)	((A) > (B) ? (A) : (B))
@@ -480,99 +651,99 @@ template <class NewLayerType>
 void
 ProEXRdoc::seperateAlphas()
 {
-	bool start_over = true;
+	// one pass, building a new layer list as we go
+	// alpha layers go in front of the layer they came from
+	std::vector<ProEXRlayer *> new_layers;
 	
-	// keep running until we don't find any alphas to split
-	while(start_over)
+	new_layers.reserve( layers().size() );
+	
+	for(std::vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
 	{
-		start_over = false;
+		ProEXRlayer *layer = *i;
 		
-		for(std::vector<ProEXRlayer *>::iterator i = layers().begin(); !start_over && i != layers().end(); ++i)
-		{
-			ProEXRlayer *layer = *i;
+		std::vector<ProEXRchannel *> &chans = layer->channels();
 		
-			if( layer->channels().size() > 1 )
+		for(size_t j = 0; j < chans.size() && chans.size() > 1; )
+		{
+			ProEXRchannel *chan = chans[j];
+			
+			if(chan->channelTag() == CHAN_A)
 			{
-				for(std::vector<ProEXRchannel *>::iterator j = layer->channels().begin(); !start_over && j != layer->channels().end(); ++j)
-				{
-					ProEXRchannel *chan = *j;
-					
-					std::string ch_name = chan->name();
-					
-					if(chan->channelTag() == CHAN_A)
-					{
-						// remove the alpha from this layer
-						layer->channels().erase(j);
-						
-						// but remember the alpha in case we have to UnMult
-						layer->assignAlpha(chan);
-						
-						// make a new layer with the alpha, and insert it
-						NewLayerType *new_layer = new NewLayerType;
-						
-						new_layer->assignDoc(this);
-						
-						new_layer->addChannel(chan);
-						
-						layers().insert(i, new_layer);
-						
-						start_over = true;
-						break;
-					}
-				}
+				// remove the alpha from this layer
+				chans.erase(chans.begin() + j);
+				
+				// but remember the alpha in case we have to UnMult
+				layer->assignAlpha(chan);
+				
+				// make a new layer with the alpha
+				NewLayerType *new_layer = new NewLayerType;
+				
+				new_layer->assignDoc(this);
+				
+				new_layer->addChannel(chan);
+				
+				new_layers.push_back(new_layer);
 			}
-			
-			if(start_over)
-				break;
+			else
+				j++;
 		}
+		
+		new_layers.push_back(layer);
 	}
+	
+	layers().swap(new_layers);
 }
 
 template <class NewLayerType>
 void
 ProEXRdoc::overflowChannels()
 {
-	bool start_over = true;
+	// one pass, building a new layer list as we go
+	// overflow layers go in front of the layer they came from
+	std::vector<ProEXRlayer *> new_layers;
+	
+	new_layers.reserve( layers().size() );
 	
-	// keep running until we don't find any layers to overflow
-	while(start_over)
+	for(std::vector<ProEXRlayer *>::iterator i = layers().begin(); i != layers().end(); ++i)
 	{
-		start_over = false;
+		ProEXRlayer *layer = *i;
 		
-		for(std::vector<ProEXRlayer *>::iterator i = layers().begin(); !start_over && i != layers().end(); ++i)
-		{
-			ProEXRlayer *layer = *i;
+		size_t non_alpha = layer->getNonAlphaChannels().size();
 		
-			if( layer->getNonAlphaChannels().size() > 3 )
+		if(non_alpha > 3)
+		{
+			std::vector<ProEXRchannel *> &chans = layer->channels();
+			
+			std::vector<ProEXRchannel *> kept_chans;
+			
+			for(std::vector<ProEXRchannel *>::iterator j = chans.begin(); j != chans.end(); ++j)
 			{
-				for(std::vector<ProEXRchannel *>::iterator j = layer->channels().begin(); !start_over && j != layer->channels().end(); ++j)
+				ProEXRchannel *chan = *j;
+				
+				if(non_alpha > 3 && chan->channelTag() == CHAN_GENERAL)
 				{
-					ProEXRchannel *chan = *j;
+					// make a new layer with the channel
+					NewLayerType *new_layer = new NewLayerType;
+					
+					new_layer->assignDoc(this);
 					
-					if(chan->channelTag() == CHAN_GENERAL)
-					{
-						// remove the channel from this layer
-						layer->channels().erase(j);
-												
-						// make a new layer with the channel, and insert it
-						NewLayerType *new_layer = new NewLayerType;
-						
-						new_layer->assignDoc(this);
-						
-						new_layer->addChannel(chan);
-						
-						layers().insert(i, new_layer);
-						
-						start_over = true;
-						break;
-					}
+					new_layer->addChannel(chan);
+					
+					new_layers.push_back(new_layer);
+					
+					non_alpha--;
 				}
+				else
+					kept_chans.push_back(chan);
 			}
 			
-			if(start_over)
-				break;
+			chans.swap(kept_chans);
 		}
+		
+		new_layers.push_back(layer);
 	}
+	
+	layers().swap(new_layers);
 }
 
 template <class ChannelType>
@@ -624,6 +795,15 @@ ProEXRdoc_read::buildLayers(bool split_alpha)
 	bool have_AG = false;
 	bool have_AB = false;
 	
+	// layers by name, so we don't have to search for them
+	// if two layers share a name, this points to the first one, like findLayer()
+	typedef std::map<std::string, ProEXRlayer *> LayerMap;
+	
+	LayerMap layer_map;
+	
+	for(std::vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
+		layer_map.insert( LayerMap::value_type((*i)->name(), *i) );
+	
 	// make the regular layers
 	for(std::vector<ProEXRchannel *>::iterator i = channels().begin(); i != channels().end(); ++i)
 	{
@@ -645,11 +825,30 @@ ProEXRdoc_read::buildLayers(bool split_alpha)
 		}
 		else
 		{
-			ProEXRlayer *layer = findLayer( chan->layerName() );
+			const std::string layer_name = chan->layerName();
+			
+			LayerMap::iterator found = layer_map.find(layer_name);
+			
+			ProEXRlayer *layer = (found != layer_map.end() ? found->second : NULL);
 			
 			if(layer && chan->pixelType() != Imf::UINT)
 			{
 				layer->addChannel( chan );
+				
+				// adding a channel can change a layer's name in odd cases
+				const std::string new_name = layer->name();
+				
+				if(new_name != layer_name)
+				{
+					layer_map.erase(found);
+					
+					ProEXRlayer *other = findLayer(layer_name);
+					
+					if(other)
+						layer_map.insert( LayerMap::value_type(layer_name, other) );
+					
+					layer_map.insert( LayerMap::value_type(new_name, layer) );
+				}
 			}
 			else
 			{
@@ -665,6 +864,8 @@ ProEXRdoc_read::buildLayers(bool split_alpha)
 				l->assignDoc(this);
 				
 				layers().push_back(l);
+				
+				layer_map.insert( LayerMap::value_type(l->name(), l) );
 			}
 		}
 	}
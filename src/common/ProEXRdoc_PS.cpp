@@ -2024,13 +2024,14 @@ ProEXRdoc_readPS::ps_res() const
 void
 ProEXRdoc_readPS::loadFromFile(bool force)
 {
-	if(SafeAvailableMemory(true) > (memorySize() * 2) || force)
-	{
-		ProEXRdoc_read::loadFromFile();
-		
-		if(_unMult)
-			unMult(); // won't do anything if the file failed to load
-	}
+	// if it won't fit in memory, spill to disk so we only have to decode once
+	if( !force && !(SafeAvailableMemory(true) > (memorySize() * 2)) )
+		setSpillToDisk(true);
+	
+	ProEXRdoc_read::loadFromFile();
+	
+	if(_unMult)
+		unMult(); // won't do anything if the file failed to load
 }
 
 void
@@ -2274,24 +2275,25 @@ ProEXRdoc_writePS::addMainLayer(ReadChannelDesc *channel_list, ReadChannelDesc *
 }
 
 void
-ProEXRdoc_writePS::loadFromPhotoshop(bool force) const
+ProEXRdoc_writePS::loadFromPhotoshop(bool force)
 {
-	if(SafeAvailableMemory(true) > (memorySize() * 2) || force)
-	{
-		try{
-			for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
-			{
-				ProEXRlayer_writePS &the_layer = dynamic_cast<ProEXRlayer_writePS &>( **i );
-				
-				the_layer.loadFromPhotoshop();
-			}
-		}
-		catch(bad_alloc)
+	// if it won't fit in memory, spill to disk so we only query Photoshop once
+	if( !force && !(SafeAvailableMemory(true) > (memorySize() * 2)) )
+		setSpillToDisk(true);
+	
+	try{
+		for(vector<ProEXRlayer *>::const_iterator i = layers().begin(); i != layers().end(); ++i)
 		{
-			// we ran out of memory, unload everything
-			freeBuffers();
+			ProEXRlayer_writePS &the_layer = dynamic_cast<ProEXRlayer_writePS &>( **i );
+			
+			the_layer.loadFromPhotoshop();
 		}
 	}
+	catch(bad_alloc)
+	{
+		// we ran out of memory, unload everything
+		freeBuffers();
+	}
 }
 
 void
@@ -2494,15 +2496,16 @@ ProEXRdoc_writePS_RGBA::loadFromPhotoshop(bool force)
 	
 	ProEXRlayer_writePS &the_layer = dynamic_cast<ProEXRlayer_writePS &>( *layers().at(0) );
 	
-	if(SafeAvailableMemory(true) > (memorySize() * 2) || force)
+	// if it won't fit in memory, spill to disk so we only query Photoshop once
+	if( !force && !(SafeAvailableMemory(true) > (memorySize() * 2)) )
+		setSpillToDisk(true);
+	
+	try{
+		the_layer.loadFromPhotoshop();
+	}
+	catch(bad_alloc)
 	{
-		try{
-			the_layer.loadFromPhotoshop();
-		}
-		catch(bad_alloc)
-		{
-			the_layer.freeBuffers();
-		}
+		the_layer.freeBuffers();
 	}
 }
 
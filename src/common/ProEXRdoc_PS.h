@@ -273,7 +273,7 @@ class ProEXRdoc_writePS : public ProEXRdoc_write, public ProEXRdoc_writePS_base
 	
 	bool hasRGBAlayer() const { return (findMainLayer(false, false) != NULL); }
 
-	void loadFromPhotoshop(bool force=false) const;
+	void loadFromPhotoshop(bool force=false);
 	
 	virtual void writeFile();
 	
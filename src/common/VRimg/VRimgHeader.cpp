@@ -87,13 +87,13 @@ Header::readFrom(Imf::IStream &is)
 	Xdr::read<Imf::StreamIO>(is, res2);
 	
 	
-	// get required tags
-	// not using the RIT_INDEX (brute_force = true) because these tags are
-	// usually near the beginning and RIT_CHAN_INFO not listed in index for some reason
-	if( !parseTag(is, RIT_RESOLUTION, true) )
+	// find where everything is in one go, then get required tags
+	locateTags(is);
+	
+	if( !parseTag(is, RIT_RESOLUTION) )
 		throw Iex::InputExc("Resolution not found.");
 	
-	if( !parseTag(is, RIT_CHAN_INFO, true) )
+	if( !parseTag(is, RIT_CHAN_INFO) )
 		throw Iex::InputExc("Channel list not found.");
 		
 	
@@ -116,120 +116,152 @@ Header::findLayer(string name) const
 }
 
 
+Imf::Int64
+Header::tagPosition(RIF_TAG_ID tag) const
+{
+	TagPositions::const_iterator found = _tags.find(tag);
+	
+	return (found == _tags.end() ? 0 : found->second);
+}
+
+
+static void
+ReadTag(Imf::IStream &is, RIF_TAG &tag)
+{
+	Xdr::read<Imf::StreamIO>(is, tag.tag);
+	Xdr::read<Imf::StreamIO>(is, tag.tagsize);
+	Xdr::read<Imf::StreamIO>(is, tag.p0);
+	Xdr::read<Imf::StreamIO>(is, tag.p1);
+	Xdr::read<Imf::StreamIO>(is, tag.p2);
+	Xdr::read<Imf::StreamIO>(is, tag.p3);
+	Xdr::read<Imf::StreamIO>(is, tag.p4);
+	Xdr::read<Imf::StreamIO>(is, tag.p5);
+	Xdr::read<Imf::StreamIO>(is, tag.p6);
+	Xdr::read<Imf::StreamIO>(is, tag.p7);
+}
+
+
+static inline bool
+IsBucket(unsigned int tag_id)
+{
+	return (tag_id == RIT_CHAN3F || tag_id == RIT_CHAN2F || tag_id == RIT_CHANI || tag_id == RIT_CHANF);
+}
+
+
+void
+Header::locateTags(Imf::IStream &is)
+{
+	// Resolution and channel info are usually the first tags in the file, so we
+	// walk the tags starting right after the file header.  If we hit pixel data
+	// before finding them, we try the RIT_INDEX table (which has been known to
+	// leave out RIT_CHAN_INFO) and then keep walking from where we were.
+	// No tag gets read twice and we never start over from the beginning.
+	_tags.clear();
+	
+	bool tried_index = false;
+	
+	// we just keep going until an exception is thrown by seekg or read
+	try{
+		while( !haveRequiredTags() )
+		{
+			const Imf::Int64 start_pos = is.tellg();
+			
+			RIF_TAG file_tag;
+			
+			ReadTag(is, file_tag);
+			
+			if(file_tag.tagsize < sizeof(RIF_TAG))
+				break; // would never get anywhere
+			
+			if( IsBucket(file_tag.tag) )
+			{
+				if(!tried_index)
+				{
+					tried_index = true;
+					
+					if( readIndexTags(is) && haveRequiredTags() )
+						break;
+				}
+			}
+			else if(_tags.find(file_tag.tag) == _tags.end())
+			{
+				_tags[file_tag.tag] = start_pos;
+			}
+			
+			is.seekg(start_pos + file_tag.tagsize);
+		}
+	}
+	catch(Iex::IoExc &e) {}
+}
+
+
 bool
-Header::moveToTag(Imf::IStream &is, RIF_TAG_ID tag, bool brute_force)
+Header::readIndexTags(Imf::IStream &is)
 {
-	if(_indexPos != 0 && !brute_force)
-	{
+	if(_indexPos == 0)
+		return false;
+	
+	try{
 		is.seekg(_indexPos);
 		
 		RIF_TAG index;
 		
-		Xdr::read<Imf::StreamIO>(is, index.tag);
-		Xdr::read<Imf::StreamIO>(is, index.tagsize);
-		Xdr::read<Imf::StreamIO>(is, index.p0);
-		Xdr::read<Imf::StreamIO>(is, index.p1);
-		Xdr::read<Imf::StreamIO>(is, index.p2);
-		Xdr::read<Imf::StreamIO>(is, index.p3);
-		Xdr::read<Imf::StreamIO>(is, index.p4);
-		Xdr::read<Imf::StreamIO>(is, index.p5);
-		Xdr::read<Imf::StreamIO>(is, index.p6);
-		Xdr::read<Imf::StreamIO>(is, index.p7);
+		ReadTag(is, index);
 		
 		if(index.tag != RIT_INDEX)
-			throw Iex::InputExc ("Bogus index tag entry.");
+			return false;
 		
-		int num_tags = index.p0;
+		unsigned int num_tags = index.p0;
 		
 		while(num_tags--)
 		{
 			RIF_TAG index_tag;
 			
-			Xdr::read<Imf::StreamIO>(is, index_tag.tag);
-			Xdr::read<Imf::StreamIO>(is, index_tag.tagsize);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p0);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p1);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p2);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p3);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p4);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p5);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p6);
-			Xdr::read<Imf::StreamIO>(is, index_tag.p7);
+			ReadTag(is, index_tag);
 			
 			Imf::Int64 file_offset;
 			
 			Xdr::read<Imf::StreamIO>(is, file_offset);
 			
-			
-			if(index_tag.tag == tag)
-			{
-				is.seekg(file_offset);
-				
-				return true;
-			}
+			if( !IsBucket(index_tag.tag) && _tags.find(index_tag.tag) == _tags.end() )
+				_tags[index_tag.tag] = file_offset;
 		}
-		
-		// Guess we'll have to try brute_force after all
-		return moveToTag(is, tag, true);
 	}
-	else
+	catch(Iex::IoExc &e)
 	{
-		is.seekg(0);
-		
-		// cruise through header
-		unsigned int magic, versionmajor, versionminor, indexPosLS, indexPosMS, flags, res1, res2;
-		
-		Xdr::read<Imf::StreamIO>(is, magic);
-		Xdr::read<Imf::StreamIO>(is, versionmajor);
-		Xdr::read<Imf::StreamIO>(is, versionminor);
-		Xdr::read<Imf::StreamIO>(is, indexPosLS);
-		Xdr::read<Imf::StreamIO>(is, indexPosMS);
-		Xdr::read<Imf::StreamIO>(is, flags);
-		Xdr::read<Imf::StreamIO>(is, res1);
-		Xdr::read<Imf::StreamIO>(is, res2);
-		
-		// we just keep going until an exception is thrown by seekg or read
-		try{
-			do{
-				Imf::Int64 start_pos = is.tellg();
-
-				RIF_TAG file_tag;
-				
-				Xdr::read<Imf::StreamIO>(is, file_tag.tag);
-				Xdr::read<Imf::StreamIO>(is, file_tag.tagsize);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p0);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p1);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p2);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p3);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p4);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p5);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p6);
-				Xdr::read<Imf::StreamIO>(is, file_tag.p7);
-				
-				if(file_tag.tag == tag)
-				{
-					is.seekg(start_pos);
-					
-					return true;
-				}
-				else
-				{
-					is.seekg(start_pos + file_tag.tagsize);
-				}
-				
-			}while(1);
-		}
-		catch(Iex::IoExc &e) {}
-		
 		return false;
 	}
+	
+	return true;
 }
 
 
 bool
-Header::parseTag(Imf::IStream &is, RIF_TAG_ID tag, bool brute_force)
+Header::haveRequiredTags() const
 {
-	if( moveToTag(is, tag, brute_force) )
+	return (_tags.find(RIT_RESOLUTION) != _tags.end() &&
+			_tags.find(RIT_CHAN_INFO) != _tags.end());
+}
+
+
+bool
+Header::moveToTag(Imf::IStream &is, RIF_TAG_ID tag)
+{
+	TagPositions::const_iterator found = _tags.find(tag);
+	
+	if(found == _tags.end())
+		return false;
+	
+	is.seekg(found->second);
+	
+	return true;
+}
+
+
+bool
+Header::parseTag(Imf::IStream &is, RIF_TAG_ID tag)
+{
+	if( moveToTag(is, tag) )
 	{
 		parseTag(is, false);
 		
@@ -247,16 +279,7 @@ Header::parseTag(Imf::IStream &is, bool skip_ahead)
 
 	RIF_TAG tag;
 	
-	Xdr::read<Imf::StreamIO>(is, tag.tag);
-	Xdr::read<Imf::StreamIO>(is, tag.tagsize);
-	Xdr::read<Imf::StreamIO>(is, tag.p0);
-	Xdr::read<Imf::StreamIO>(is, tag.p1);
-	Xdr::read<Imf::StreamIO>(is, tag.p2);
-	Xdr::read<Imf::StreamIO>(is, tag.p3);
-	Xdr::read<Imf::StreamIO>(is, tag.p4);
-	Xdr::read<Imf::StreamIO>(is, tag.p5);
-	Xdr::read<Imf::StreamIO>(is, tag.p6);
-	Xdr::read<Imf::StreamIO>(is, tag.p7);
+	ReadTag(is, tag);
 	
 	switch(tag.tag)
 	{
@@ -100,6 +100,11 @@ class Header
 	
 	bool isCompressed() const { return (_flags & RIF_FLAG_COMPRESSION); }
 	
+	Imf::Int64 indexPosition() const { return _indexPos; }
+	
+	// where the first tag of this kind starts, 0 if we didn't see one
+	Imf::Int64 tagPosition(RIF_TAG_ID tag) const;
+	
 	void readFrom(Imf::IStream &is);
 	
 	
@@ -112,11 +117,18 @@ class Header
 	
   private:
   
-	bool moveToTag(Imf::IStream &is, RIF_TAG_ID tag, bool brute_force);
-	bool parseTag(Imf::IStream &is, RIF_TAG_ID tag, bool brute_force = false);
+	void locateTags(Imf::IStream &is);
+	bool readIndexTags(Imf::IStream &is);
+	bool haveRequiredTags() const;
+	
+	bool moveToTag(Imf::IStream &is, RIF_TAG_ID tag);
+	bool parseTag(Imf::IStream &is, RIF_TAG_ID tag);
   
 	void parseTag(Imf::IStream &is, bool skip_ahead = true);
 	
+	typedef std::map<unsigned int, Imf::Int64> TagPositions;
+	TagPositions _tags; // not counting pixel buckets
+	
 	Imf::Int64 _indexPos;
 	unsigned int _flags;
 	
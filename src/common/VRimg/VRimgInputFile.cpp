@@ -33,16 +33,21 @@
 
 #ifdef USE_ILMTHREAD
 #include <IlmThreadPool.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
 using namespace IlmThread;
 #endif
 
 
 using namespace std;
+using IMATH_NAMESPACE::Box2i;
+using IMATH_NAMESPACE::V2i;
 
 namespace VRimg {
 
 
 InputFile::InputFile(Imf::IStream &is) :
+	_indexed(false),
 	_is(is)
 {
 	_is.seekg(0);
@@ -94,147 +99,361 @@ static inline float Platform(float in)
 }
 
 
-#ifdef USE_ILMTHREAD
-class ReadTagTask : public Task
+// magic, version, index position, flags, reserved
+#define VRIMG_FILE_HEADER_SIZE	(8 * sizeof(unsigned int))
+
+static void
+ReadTag(Imf::IStream &is, RIF_TAG &tag)
 {
-  public:
-	ReadTagTask(TaskGroup *group,
-					Imf::IStream &is, const Header &head, const Layer &layer, const RIF_TAG &tag,
-					void *out_buf, size_t rowbytes);
-	virtual ~ReadTagTask();
+	Xdr::read<Imf::StreamIO>(is, tag.tag);
+	Xdr::read<Imf::StreamIO>(is, tag.tagsize);
+	Xdr::read<Imf::StreamIO>(is, tag.p0);
+	Xdr::read<Imf::StreamIO>(is, tag.p1);
+	Xdr::read<Imf::StreamIO>(is, tag.p2);
+	Xdr::read<Imf::StreamIO>(is, tag.p3);
+	Xdr::read<Imf::StreamIO>(is, tag.p4);
+	Xdr::read<Imf::StreamIO>(is, tag.p5);
+	Xdr::read<Imf::StreamIO>(is, tag.p6);
+	Xdr::read<Imf::StreamIO>(is, tag.p7);
+}
+
+static inline bool
+IsBucket(unsigned int tag_id)
+{
+	return (tag_id == RIT_CHAN3F || tag_id == RIT_CHAN2F || tag_id == RIT_CHANI || tag_id == RIT_CHANF);
+}
+
+
+// size of the decoded bucket
+static inline size_t
+BucketSize(const RIF_TAG &tag, int dimensions)
+{
+	const size_t bytes_per_channel = (tag.tag == RIT_CHANI ? sizeof(int) : sizeof(float));
 	
-	virtual void execute();
+	return (bytes_per_channel * dimensions * tag.p3 * tag.p4);
+}
+
+
+// seek to a bucket and read its data, making sure it's the tag we were expecting
+static bool
+ReadBucketData(Imf::IStream &is, const RIF_TAG &tag, Imf::Int64 offset, void *data, size_t data_size)
+{
+	is.seekg(offset);
 	
+	RIF_TAG file_tag;
 	
-  private:
-	const int _dimensions;
-	const unsigned int _tag_id;
-	void *_out_buf;
-	const size_t _rowbytes;
+	ReadTag(is, file_tag);
 	
-	const unsigned int _x_pos;
-	const unsigned int _y_pos;
-	const unsigned int _tile_width;
-	const unsigned int _tile_height;
+	if(file_tag.tag != tag.tag || file_tag.tagsize != tag.tagsize || file_tag.p7 != tag.p7)
+		return false;
 	
-	void *_uncompressed_buf;
-	void *_compressed_buf;
-	size_t _compressed_size;
-};
+	return is.read((char *)data, data_size);
+}
 
 
-ReadTagTask::ReadTagTask(TaskGroup *group,
-					Imf::IStream &is, const Header &head, const Layer &layer, const RIF_TAG &tag,
-					void *out_buf, size_t rowbytes) :
-	Task(group),
-	_dimensions(layer.dimensions),
-	_tag_id(tag.tag),
-	_out_buf(out_buf),
-	_rowbytes(rowbytes),
-	_x_pos(tag.p1),
-	_y_pos(tag.p2),
-	_tile_width(tag.p3),
-	_tile_height(tag.p4),
-	_uncompressed_buf(NULL),
-	_compressed_buf(NULL),
-	_compressed_size(0)
+// first position at or after pos that lands on the subsample grid
+static inline int
+SnapToGrid(int pos, int origin, int subsample)
 {
-	const size_t bytes_per_channel = (_tag_id == RIT_CHANI ? sizeof(int) : sizeof(float));
+	return origin + (((pos - origin) + subsample - 1) / subsample) * subsample;
+}
 
-	const size_t tile_rowbytes = bytes_per_channel * _dimensions * _tile_width;
 
-	const size_t full_size = tile_rowbytes * _tile_height;
+// the pixels of a bucket that we'll actually be sampling, returns false if there are none
+static bool
+SampledArea(const RIF_TAG &tag, const Box2i &region, int subsample, Box2i &area)
+{
+	const int x_pos = tag.p1;
+	const int y_pos = tag.p2;
+	
+	const int tile_width = tag.p3;
+	const int tile_height = tag.p4;
+	
+	area.min.x = SnapToGrid(max<int>(x_pos, region.min.x), region.min.x, subsample);
+	area.min.y = SnapToGrid(max<int>(y_pos, region.min.y), region.min.y, subsample);
+	
+	area.max.x = min<int>(x_pos + tile_width - 1, region.max.x);
+	area.max.y = min<int>(y_pos + tile_height - 1, region.max.y);
+	
+	return (area.min.x <= area.max.x && area.min.y <= area.max.y);
+}
 
-	_uncompressed_buf = malloc(full_size);
 
-	if(_uncompressed_buf)
+// inflate (if necessary) and copy the part of a bucket we want into the layer buffer,
+// the first channels of each pixel go colbytes apart in out_buf
+static void
+DecodeBucket(const RIF_TAG &tag, int dimensions,
+				const void *compressed_buf, size_t compressed_size, void *uncompressed_buf,
+				void *out_buf, size_t colbytes, size_t rowbytes, int channels,
+				const Box2i &region, int subsample)
+{
+	Box2i area;
+	
+	if( !SampledArea(tag, region, subsample, area) )
+		return;
+	
+	const int x_pos = tag.p1;
+	const int y_pos = tag.p2;
+	
+	const int tile_width = tag.p3;
+	const int tile_height = tag.p4;
+	
+	const size_t bytes_per_channel = (tag.tag == RIT_CHANI ? sizeof(int) : sizeof(float));
+	
+	const size_t pix_size = bytes_per_channel * dimensions;
+	
+	const size_t tile_rowbytes = pix_size * tile_width;
+	
+	if(compressed_buf)
+	{
+		uLongf the_full_size = tile_rowbytes * tile_height;
+		
+		int z_result = uncompress((Bytef *)uncompressed_buf, &the_full_size, (Bytef *)compressed_buf, compressed_size);
+		
+		if(z_result != Z_OK)
+			return;
+	}
+	
+	
+	const int out_width = ((area.max.x - area.min.x) / subsample) + 1;
+	
+	char *source_row = (char *)uncompressed_buf + (tile_rowbytes * (area.min.y - y_pos)) + (pix_size * (area.min.x - x_pos));
+	char *dest_row = (char *)out_buf + (rowbytes * ((area.min.y - region.min.y) / subsample)) + (colbytes * ((area.min.x - region.min.x) / subsample));
+	
+	const int source_step = subsample * dimensions;
+	
+	for(int y = area.min.y; y <= area.max.y; y += subsample)
 	{
-		if( head.isCompressed() )
+		if(tag.tag == RIT_CHANI)
 		{
-			_compressed_size = tag.tagsize - sizeof(tag);
+			const int *source_pix = (int *)source_row;
+			char *dest_pix = dest_row;
 			
-			_compressed_buf = malloc(_compressed_size);
-			
-			if(_compressed_buf)
+			for(int x=0; x < out_width; x++)
 			{
-				bool did_read = is.read((char *)_compressed_buf, _compressed_size);
+				for(int c=0; c < channels; c++)
+					((int *)dest_pix)[c] = Platform( source_pix[c] );
+				
+				source_pix += source_step;
+				dest_pix += colbytes;
 			}
 		}
 		else
 		{
-			const size_t uncompressed_size = tag.tagsize - sizeof(tag);
+			const float *source_pix = (float *)source_row;
+			char *dest_pix = dest_row;
 			
-			if(uncompressed_size <= full_size)
+			for(int x=0; x < out_width; x++)
 			{
-				bool did_read = is.read((char *)_uncompressed_buf, uncompressed_size);
+				for(int c=0; c < channels; c++)
+					((float *)dest_pix)[c] = Platform( source_pix[c] );
+				
+				source_pix += source_step;
+				dest_pix += colbytes;
 			}
 		}
+		
+		source_row += tile_rowbytes * subsample;
+		dest_row += rowbytes;
 	}
 }
 
 
-ReadTagTask::~ReadTagTask()
+#ifdef USE_ILMTHREAD
+
+// buckets in flight are limited by how much memory they're holding
+#define READ_BUDGET_SIZE	(64 * 1024 * 1024)
+
+class ReadBudget
 {
-	if(_uncompressed_buf)
-		free(_uncompressed_buf);
+  public:
+	ReadBudget(size_t budget);
+	~ReadBudget();
+	
+	void acquire(size_t bytes); // blocks until there's room
+	void release(size_t bytes);
+	
+  private:
+	const size_t _budget;
+	size_t _in_flight;
+	bool _waiting;
 	
-	if(_compressed_buf)
-		free(_compressed_buf);
+	Mutex _mutex;
+	Semaphore _freed;
+};
+
+
+ReadBudget::ReadBudget(size_t budget) :
+	_budget(budget),
+	_in_flight(0),
+	_waiting(false),
+	_freed(0)
+{
+
 }
 
 
-void
-ReadTagTask::execute()
+ReadBudget::~ReadBudget()
 {
-	if(!_uncompressed_buf)
-		return;
 
-	const size_t bytes_per_channel = (_tag_id == RIT_CHANI ? sizeof(int) : sizeof(float));
+}
 
-	const size_t tile_rowbytes = bytes_per_channel * _dimensions * _tile_width;
 
-	if(_compressed_buf)
+void
+ReadBudget::acquire(size_t bytes)
+{
+	while(1)
 	{
-		const size_t full_size = tile_rowbytes * _tile_height;
+		{
+			Lock lock(_mutex);
+			
+			// always let one through, even if it's bigger than the budget
+			if(_in_flight == 0 || (_in_flight + bytes) <= _budget)
+			{
+				_in_flight += bytes;
+				
+				return;
+			}
+			
+			_waiting = true;
+		}
 		
-		uLongf the_full_size = full_size;
+		_freed.wait();
+	}
+}
+
+
+void
+ReadBudget::release(size_t bytes)
+{
+	Lock lock(_mutex);
+	
+	_in_flight -= bytes;
+	
+	if(_waiting)
+	{
+		_waiting = false;
 		
-		int z_result = uncompress((Bytef *)_uncompressed_buf, &the_full_size, (Bytef *)_compressed_buf, _compressed_size);
+		_freed.post();
 	}
+}
+
+
+class ReadTagTask : public Task
+{
+  public:
+	ReadTagTask(TaskGroup *group,
+					Imf::IStream &is, const Mutex &is_mutex, ReadBudget &budget, size_t budget_size,
+					const Header &head, const Layer &layer, const RIF_TAG &tag, Imf::Int64 offset,
+					void *out_buf, size_t colbytes, size_t rowbytes, int channels,
+					const Box2i &region, int subsample);
+	virtual ~ReadTagTask();
+	
+	virtual void execute();
+	
+	// memory the task will be holding while it runs
+	static size_t budgetSize(const Header &head, const Layer &layer, const RIF_TAG &tag);
+	
+  private:
+	Imf::IStream &_is;
+	const Mutex &_is_mutex;
+	
+	ReadBudget &_budget;
+	const size_t _budget_size;
+	
+	const bool _compressed;
+	const int _dimensions;
+	const RIF_TAG _tag;
+	const Imf::Int64 _offset;
+	
+	void *_out_buf;
+	const size_t _colbytes;
+	const size_t _rowbytes;
+	const int _channels;
+	const Box2i _region;
+	const int _subsample;
+};
+
+
+ReadTagTask::ReadTagTask(TaskGroup *group,
+					Imf::IStream &is, const Mutex &is_mutex, ReadBudget &budget, size_t budget_size,
+					const Header &head, const Layer &layer, const RIF_TAG &tag, Imf::Int64 offset,
+					void *out_buf, size_t colbytes, size_t rowbytes, int channels,
+					const Box2i &region, int subsample) :
+	Task(group),
+	_is(is),
+	_is_mutex(is_mutex),
+	_budget(budget),
+	_budget_size(budget_size),
+	_compressed(head.isCompressed()),
+	_dimensions(layer.dimensions),
+	_tag(tag),
+	_offset(offset),
+	_out_buf(out_buf),
+	_colbytes(colbytes),
+	_rowbytes(rowbytes),
+	_channels(channels),
+	_region(region),
+	_subsample(subsample)
+{
+
+}
+
+
+ReadTagTask::~ReadTagTask()
+{
+	_budget.release(_budget_size);
+}
+
+
+size_t
+ReadTagTask::budgetSize(const Header &head, const Layer &layer, const RIF_TAG &tag)
+{
+	const size_t data_size = tag.tagsize - sizeof(RIF_TAG);
+	const size_t full_size = BucketSize(tag, layer.dimensions);
+	
+	return (head.isCompressed() ? data_size + full_size : full_size);
+}
+
+
+void
+ReadTagTask::execute()
+{
+	const size_t data_size = _tag.tagsize - sizeof(RIF_TAG);
+	const size_t full_size = BucketSize(_tag, _dimensions);
 	
+	if(!_compressed && data_size > full_size)
+		return;
 	
-	char *source_row = (char *)_uncompressed_buf;
-	char *dest_row = (char *)_out_buf + (_rowbytes * _y_pos) + (_dimensions * bytes_per_channel * _x_pos);
+	void *uncompressed_buf = malloc(full_size);
+	void *compressed_buf = (_compressed ? malloc(data_size) : NULL);
 	
-	for(int y=0; y < _tile_height; y++)
+	if(uncompressed_buf && (compressed_buf || !_compressed))
 	{
-		if(_tag_id == RIT_CHANI)
+		bool did_read = false;
+		
+		try
 		{
-			int *source_pix = (int *)source_row;
-			int *dest_pix = (int *)dest_row;
-			
-			for(int x=0; x < (_tile_width * _dimensions); x++)
-			{
-				*dest_pix++ = Platform( *source_pix++ );
-			}
+			Lock lock(_is_mutex);
 			
-			source_row += tile_rowbytes;
-			dest_row += _rowbytes;
+			did_read = ReadBucketData(_is, _tag, _offset,
+										(_compressed ? compressed_buf : uncompressed_buf), data_size);
 		}
-		else
+		catch(...) {}
+		
+		if(did_read)
 		{
-			float *source_pix = (float *)source_row;
-			float *dest_pix = (float *)dest_row;
-			
-			for(int x=0; x < (_tile_width * _dimensions); x++)
-			{
-				*dest_pix++ = Platform( *source_pix++ );
-			}
-			
-			source_row += tile_rowbytes;
-			dest_row += _rowbytes;
+			DecodeBucket(_tag, _dimensions,
+							compressed_buf, data_size, uncompressed_buf,
+							_out_buf, _colbytes, _rowbytes, _channels, _region, _subsample);
 		}
 	}
+	
+	if(uncompressed_buf)
+		free(uncompressed_buf);
+	
+	if(compressed_buf)
+		free(compressed_buf);
 }
 
 #endif // USE_ILMTHREAD
@@ -251,21 +470,24 @@ InputFile::loadFromFile(BufferMap *buf_map)
 		const int height = head.height();
 		
 		
-		map<unsigned int, string>index_map;
+		LayerDestList dests;
 		
-		// allocate buffers and fill in indices
+		// allocate buffers
 		for(Header::LayerMap::const_iterator i = layer_map.begin(); i != layer_map.end(); ++i)
 		{
 			const string &name = i->first;
 			const Layer &layer = i->second;
 			
+			const size_t colbytes = sizeof(float) * layer.dimensions;
+			const size_t rowbytes = colbytes * width;
+			
+			void *buf = NULL;
+			
 			if(buf_map == NULL)
 			{
-				const size_t colbytes = sizeof(float) * layer.dimensions;
-				const size_t rowbytes = colbytes * width;
 				const size_t buf_size = rowbytes * height;
 				
-				void *buf = malloc(buf_size);
+				buf = malloc(buf_size);
 				
 				if(buf == NULL)
 					throw bad_alloc();
@@ -276,15 +498,17 @@ InputFile::loadFromFile(BufferMap *buf_map)
 			{
 				if(buf_map->find(name) == buf_map->end())
 					throw Iex::LogicExc("buf_map missing layers");
+				
+				buf = (*buf_map)[name];
+				
+				if(buf == NULL)
+					throw Iex::LogicExc("Problem with layer buffer.");
 			}
 			
-			index_map[layer.index] = name;
+			dests.push_back( LayerDest(&layer, buf, colbytes, rowbytes, layer.dimensions, Box2i(V2i(0, 0), V2i(width - 1, height - 1))) );
 		}
 		
 		
-		BufferMap &BufMap = (buf_map == NULL ? _map : *buf_map);
-		
-		
 		// build a description while we're loading the file
 		Rope newline("&#xA;");
 		Rope xmp;
@@ -317,9 +541,12 @@ InputFile::loadFromFile(BufferMap *buf_map)
 		xmp += Rope("Compressed: ") + Rope((flags & RIF_FLAG_COMPRESSION) ? "true" : "false") + newline;
 		
 		
-	#ifdef USE_ILMTHREAD
-		TaskGroup group;
-	#endif
+		// pick up the bucket locations while we're passing by,
+		// then read them all in at the end
+		const bool build_index = !_indexed;
+		
+		if(build_index)
+			_index.clear();
 	
 		// read through each tag
 		try{
@@ -340,105 +567,13 @@ InputFile::loadFromFile(BufferMap *buf_map)
 				Xdr::read<Imf::StreamIO>(_is, tag.p6);
 				Xdr::read<Imf::StreamIO>(_is, tag.p7);
 				
-				if(tag.tag == RIT_CHAN3F || tag.tag == RIT_CHAN2F || tag.tag == RIT_CHANI || tag.tag == RIT_CHANF)
+				if(tag.tagsize < sizeof(RIF_TAG))
+					break; // would never get anywhere
+				
+				if( IsBucket(tag.tag) )
 				{
-					const string &layer_name = index_map[tag.p7];
-					void *buf = BufMap[layer_name];
-					
-					const Layer *the_layer = head.findLayer(layer_name);
-					
-					if(the_layer == NULL || buf == NULL)
-						throw Iex::LogicExc("Problem with layer index.");
-					
-					const int dimensions = the_layer->dimensions;
-					
-					const size_t bytes_per_channel = (tag.tag == RIT_CHANI ? sizeof(int) : sizeof(float));
-					
-					const size_t rowbytes = bytes_per_channel * dimensions * width;
-					
-				#ifdef USE_ILMTHREAD
-					ThreadPool::addGlobalTask(new ReadTagTask(&group,
-															_is, head, *the_layer, tag,
-															buf, rowbytes) );
-				#else
-					const int x_pos = tag.p1;
-					const int y_pos = tag.p2;
-					
-					const int tile_width = tag.p3;
-					const int tile_height = tag.p4;
-					
-					const size_t tile_rowbytes = bytes_per_channel * dimensions * tile_width;
-					
-					const size_t full_size = tile_rowbytes * tile_height;
-					
-					void *uncompressed_buf = malloc(full_size);
-					
-					if(uncompressed_buf)
-					{
-						if( head.isCompressed() )
-						{
-							size_t compressed_size = tag.tagsize - sizeof(tag);
-							
-							void *compressed_buf = malloc(compressed_size);
-							
-							if(compressed_buf)
-							{
-								bool did_read = _is.read((char *)compressed_buf, compressed_size);
-								
-								uLongf the_full_size = full_size;
-								
-								int z_result = uncompress((Bytef *)uncompressed_buf, &the_full_size, (Bytef *)compressed_buf, compressed_size);
-								
-								free(compressed_buf);
-							}
-						}
-						else
-						{
-							size_t uncompressed_size = tag.tagsize - sizeof(tag);
-							
-							if(uncompressed_size <= full_size)
-							{
-								bool did_read = _is.read((char *)uncompressed_buf, uncompressed_size);
-							}
-						}
-						
-						
-						char *source_row = (char *)uncompressed_buf;
-						char *dest_row = (char *)buf + (rowbytes * y_pos) + (dimensions * bytes_per_channel * x_pos);
-						
-						for(int y=0; y < tile_height; y++)
-						{
-							if(tag.tag == RIT_CHANI)
-							{
-								int *source_pix = (int *)source_row;
-								int *dest_pix = (int *)dest_row;
-								
-								for(int x=0; x < (tile_width * dimensions); x++)
-								{
-									*dest_pix++ = Platform( *source_pix++ );
-								}
-								
-								source_row += tile_rowbytes;
-								dest_row += rowbytes;
-							}
-							else
-							{
-								float *source_pix = (float *)source_row;
-								float *dest_pix = (float *)dest_row;
-								
-								for(int x=0; x < (tile_width * dimensions); x++)
-								{
-									*dest_pix++ = Platform( *source_pix++ );
-								}
-								
-								source_row += tile_rowbytes;
-								dest_row += rowbytes;
-							}
-						}
-						
-						free(uncompressed_buf);
-					}
-				#endif
+					if(build_index)
+						addToIndex(tag, start_pos);
 				}
 				else
 				{
@@ -452,6 +587,12 @@ InputFile::loadFromFile(BufferMap *buf_map)
 		}
 		catch(Iex::IoExc &e) {}
 		
+		if(build_index)
+			_indexed = true;
+		
+		
+		readLayers(dests);
+		
 		
 		// channel info
 		xmp += newline + Rope("=Channels=") + newline;
@@ -490,179 +631,366 @@ InputFile::loadFromFile(BufferMap *buf_map)
 void
 InputFile::copyLayerToBuffer(const std::string &name, void *buf, size_t rowbytes)
 {
-	if(buf == NULL)
-		throw Iex::NullExc("buf is NULL");
-		
+	const Header &head = header();
+	
+	const Box2i region(V2i(0, 0), V2i(head.width() - 1, head.height() - 1));
+	
+	copyLayerToBuffer(name, buf, rowbytes, region, 1);
+}
+
+
+void
+InputFile::copyLayerToBuffer(const std::string &name, void *buf, size_t rowbytes,
+								const Box2i &region, int subsample)
+{
 	const Layer *the_layer = header().findLayer(name);
 	
 	if(the_layer == NULL)
 		return;
+	
+	LayerSliceList slices;
+	
+	slices.push_back( LayerSlice(name, buf, sizeof(float) * the_layer->dimensions, rowbytes) );
+	
+	copyLayersToBuffer(slices, region, subsample);
+}
+
 
-	if( !_map.empty() && (_map.find(name) != _map.end()) && (_map[name] != NULL) )
+// copy from a layer that's already been loaded into memory
+static void
+CopyLoadedLayer(const void *layer_buf, int width, int dimensions,
+				void *buf, size_t colbytes, size_t rowbytes, int channels,
+				const Box2i &region, int subsample)
+{
+	const size_t pix_size = sizeof(float) * dimensions;
+	const size_t layer_rowbytes = pix_size * width;
+	
+	const int out_width = ((region.max.x - region.min.x) / subsample) + 1;
+	const int out_height = ((region.max.y - region.min.y) / subsample) + 1;
+	
+	const bool packed = (colbytes == pix_size && channels == dimensions);
+	
+	if(packed && layer_rowbytes == rowbytes && subsample == 1 && region.min.x == 0 && region.max.x == width - 1)
 	{
-		// layer has already been loaded into memory
-		const Header &head = header();
-		
-		int width = head.width();
-		int height = head.height();
+		size_t mem_size = layer_rowbytes * out_height;
 		
-		const void *layer_buf = _map[name];
-		size_t layer_rowbytes = sizeof(float) * the_layer->dimensions * width;
-		
-		if(layer_rowbytes == rowbytes)
+		memcpy(buf, (char *)layer_buf + (region.min.y * layer_rowbytes), mem_size);
+	}
+	else
+	{
+		for(int y=0; y < out_height; y++)
 		{
-			size_t mem_size = layer_rowbytes * height;
+			const char *layer_row = (char *)layer_buf + ((region.min.y + (y * subsample)) * layer_rowbytes) + (region.min.x * pix_size);
+			char *output_row = (char *)buf + (y * rowbytes);
 			
-			memcpy(buf, layer_buf, mem_size);
-		}
-		else
-		{
-			for(int y=0; y < height; y++)
+			if(packed && subsample == 1)
+			{
+				memcpy(output_row, layer_row, pix_size * out_width);
+			}
+			else
 			{
-				const void *layer_row = (char *)layer_buf + (y * layer_rowbytes);
-				void *output_row = (char *)buf + (y * rowbytes);
+				// bits are bits, doesn't matter if it's float or int
+				const unsigned int *layer_pix = (const unsigned int *)layer_row;
 				
-				memcpy(output_row, layer_row, layer_rowbytes);
+				for(int x=0; x < out_width; x++)
+				{
+					for(int c=0; c < channels; c++)
+						((unsigned int *)output_row)[c] = layer_pix[c];
+					
+					layer_pix += dimensions * subsample;
+					output_row += colbytes;
+				}
 			}
 		}
 	}
-	else
+}
+
+
+void
+InputFile::copyLayersToBuffer(const LayerSliceList &slices,
+								const Box2i &requested_region, int subsample)
+{
+	if(subsample < 1)
+		throw Iex::ArgExc("subsample must be at least 1");
+	
+	const Header &head = header();
+	
+	const int width = head.width();
+	const int height = head.height();
+	
+	Box2i region = requested_region;
+	
+	region.min.x = max<int>(region.min.x, 0);
+	region.min.y = max<int>(region.min.y, 0);
+	region.max.x = min<int>(region.max.x, width - 1);
+	region.max.y = min<int>(region.max.y, height - 1);
+	
+	if(region.min != requested_region.min)
+		throw Iex::ArgExc("region must start inside the image");
+	
+	if(region.isEmpty())
+		return;
+	
+	
+	// layers that aren't in memory get read together, so
+	// their buckets are all decoded in the same parallel pass
+	LayerDestList dests;
+	
+	for(LayerSliceList::const_iterator i = slices.begin(); i != slices.end(); ++i)
 	{
-		_is.seekg(0);
+		if(i->buf == NULL)
+			throw Iex::NullExc("buf is NULL");
 		
-		// cruise through header
-		unsigned int magic, versionmajor, versionminor, indexPosLS, indexPosMS, flags, res1, res2;
+		const Layer *the_layer = head.findLayer(i->name);
 		
-		Xdr::read<Imf::StreamIO>(_is, magic);
-		Xdr::read<Imf::StreamIO>(_is, versionmajor);
-		Xdr::read<Imf::StreamIO>(_is, versionminor);
-		Xdr::read<Imf::StreamIO>(_is, indexPosLS);
-		Xdr::read<Imf::StreamIO>(_is, indexPosMS);
-		Xdr::read<Imf::StreamIO>(_is, flags);
-		Xdr::read<Imf::StreamIO>(_is, res1);
-		Xdr::read<Imf::StreamIO>(_is, res2);
+		if(the_layer == NULL)
+			continue;
 		
-	#ifdef USE_ILMTHREAD
-		TaskGroup group;
-	#endif
+		const int channels = ((i->channels > 0 && i->channels < the_layer->dimensions) ? i->channels : the_layer->dimensions);
+		
+		BufferMap::const_iterator loaded = _map.find(i->name);
+		
+		if(loaded != _map.end() && loaded->second != NULL)
+		{
+			CopyLoadedLayer(loaded->second, width, the_layer->dimensions,
+							i->buf, i->colbytes, i->rowbytes, channels,
+							region, subsample);
+		}
+		else
+			dests.push_back( LayerDest(the_layer, i->buf, i->colbytes, i->rowbytes, channels, region, subsample) );
+	}
 	
-		try{
-			while(1)
+	if( !dests.empty() )
+		readLayers(dests);
+}
+
+
+void
+InputFile::readLayers(const LayerDestList &dests)
+{
+	buildIndex();
+	
+	const Header &head = header();
+	
+#ifdef USE_ILMTHREAD
+	// workers do their own reads, taking turns with the stream
+	Mutex is_mutex;
+	ReadBudget budget(READ_BUDGET_SIZE);
+	
+	TaskGroup group;
+#endif
+
+	for(LayerDestList::const_iterator d = dests.begin(); d != dests.end(); ++d)
+	{
+		const Layer &layer = *d->layer;
+		
+		BucketIndex::const_iterator layer_buckets = _index.find(layer.index);
+		
+		if(layer_buckets == _index.end())
+			continue;
+		
+		const BucketList &buckets = layer_buckets->second;
+		
+		for(BucketList::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
+		{
+			const RIF_TAG &tag = b->tag;
+			
+			if(tag.tagsize < sizeof(RIF_TAG))
+				continue;
+			
+			Box2i area;
+			
+			if( !SampledArea(tag, d->region, d->subsample, area) )
+				continue; // don't even read it
+			
+		#ifdef USE_ILMTHREAD
+			const size_t budget_size = ReadTagTask::budgetSize(head, layer, tag);
+			
+			budget.acquire(budget_size);
+			
+			ThreadPool::addGlobalTask(new ReadTagTask(&group,
+													_is, is_mutex, budget, budget_size,
+													head, layer, tag, b->offset,
+													d->buf, d->colbytes, d->rowbytes, d->channels,
+													d->region, d->subsample) );
+		#else
+			const size_t data_size = tag.tagsize - sizeof(RIF_TAG);
+			const size_t full_size = BucketSize(tag, layer.dimensions);
+			
+			if(!head.isCompressed() && data_size > full_size)
+				continue;
+			
+			void *uncompressed_buf = malloc(full_size);
+			void *compressed_buf = (head.isCompressed() ? malloc(data_size) : NULL);
+			
+			if(uncompressed_buf && (compressed_buf || !head.isCompressed()))
 			{
-				Imf::Int64 start_pos = _is.tellg();
-				
-				RIF_TAG tag;
-				
-				Xdr::read<Imf::StreamIO>(_is, tag.tag);
-				Xdr::read<Imf::StreamIO>(_is, tag.tagsize);
-				Xdr::read<Imf::StreamIO>(_is, tag.p0);
-				Xdr::read<Imf::StreamIO>(_is, tag.p1);
-				Xdr::read<Imf::StreamIO>(_is, tag.p2);
-				Xdr::read<Imf::StreamIO>(_is, tag.p3);
-				Xdr::read<Imf::StreamIO>(_is, tag.p4);
-				Xdr::read<Imf::StreamIO>(_is, tag.p5);
-				Xdr::read<Imf::StreamIO>(_is, tag.p6);
-				Xdr::read<Imf::StreamIO>(_is, tag.p7);
-				
-				if( (tag.tag == RIT_CHAN3F || tag.tag == RIT_CHAN2F || tag.tag == RIT_CHANI || tag.tag == RIT_CHANF) &&
-					(tag.p7 == the_layer->index) )
+				if( ReadBucketData(_is, tag, b->offset, (compressed_buf ? compressed_buf : uncompressed_buf), data_size) )
 				{
-				#ifdef USE_ILMTHREAD
-					ThreadPool::addGlobalTask(new ReadTagTask(&group,
-															_is, header(), *the_layer, tag,
-															buf, rowbytes) );
-				#else
-					int dimensions = the_layer->dimensions;
-					
-					int x_pos = tag.p1;
-					int y_pos = tag.p2;
-					
-					int tile_width = tag.p3;
-					int tile_height = tag.p4;
-					
-					size_t bytes_per_channel = (tag.tag == RIT_CHANI ? sizeof(int) : sizeof(float));
-					
-					size_t tile_rowbytes = bytes_per_channel * dimensions * tile_width;
-					
-					size_t full_size = tile_rowbytes * tile_height;
-					
-					void *uncompressed_buf = malloc(full_size);
-					
-					if(uncompressed_buf)
-					{
-						if( header().isCompressed() )
-						{
-							size_t compressed_size = tag.tagsize - sizeof(tag);
-							
-							void *compressed_buf = malloc(compressed_size);
-							
-							if(compressed_buf)
-							{
-								bool did_read = _is.read((char *)compressed_buf, compressed_size);
-								
-								uLongf the_full_size = full_size;
-								
-								int z_result = uncompress((Bytef *)uncompressed_buf, &the_full_size, (Bytef *)compressed_buf, compressed_size);
-								
-								free(compressed_buf);
-							}
-						}
-						else
-						{
-							size_t uncompressed_size = tag.tagsize - sizeof(tag);
-							
-							if(uncompressed_size <= full_size)
-							{
-								bool did_read = _is.read((char *)uncompressed_buf, uncompressed_size);
-							}
-						}
-						
-						
-						char *source_row = (char *)uncompressed_buf;
-						char *dest_row = (char *)buf + (rowbytes * y_pos) + (dimensions * bytes_per_channel * x_pos);
-						
-						for(int y=0; y < tile_height; y++)
-						{
-							if(tag.tag == RIT_CHANI)
-							{
-								int *source_pix = (int *)source_row;
-								int *dest_pix = (int *)dest_row;
-								
-								for(int x=0; x < (tile_width * dimensions); x++)
-								{
-									*dest_pix++ = Platform( *source_pix++ );
-								}
-								
-								source_row += tile_rowbytes;
-								dest_row += rowbytes;
-							}
-							else
-							{
-								float *source_pix = (float *)source_row;
-								float *dest_pix = (float *)dest_row;
-								
-								for(int x=0; x < (tile_width * dimensions); x++)
-								{
-									*dest_pix++ = Platform( *source_pix++ );
-								}
-								
-								source_row += tile_rowbytes;
-								dest_row += rowbytes;
-							}
-						}
-						
-						free(uncompressed_buf);
-					}
-				#endif
+					DecodeBucket(tag, layer.dimensions,
+									compressed_buf, data_size, uncompressed_buf,
+									d->buf, d->colbytes, d->rowbytes, d->channels,
+									d->region, d->subsample);
 				}
-				
-				_is.seekg(start_pos + tag.tagsize);
 			}
+			
+			if(uncompressed_buf)
+				free(uncompressed_buf);
+			
+			if(compressed_buf)
+				free(compressed_buf);
+		#endif
 		}
-		catch(Iex::IoExc &e) {}
 	}
 }
 
+
+void
+InputFile::buildIndex()
+{
+	if(_indexed)
+		return;
+	
+	// V-Ray usually writes a tag table at the end of the file,
+	// otherwise we'll make one pass through the tag headers
+	if( !readIndexTable() )
+		scanForBuckets();
+	
+	_indexed = true;
+}
+
+
+bool
+InputFile::readIndexTable()
+{
+	const Imf::Int64 index_pos = header().indexPosition();
+	
+	if(index_pos == 0)
+		return false;
+	
+	_index.clear();
+	
+	try{
+		_is.seekg(index_pos);
+		
+		RIF_TAG index;
+		
+		ReadTag(_is, index);
+		
+		if(index.tag != RIT_INDEX)
+			return false;
+		
+		unsigned int num_tags = index.p0;
+		
+		while(num_tags--)
+		{
+			RIF_TAG index_tag;
+			
+			ReadTag(_is, index_tag);
+			
+			Imf::Int64 file_offset;
+			
+			Xdr::read<Imf::StreamIO>(_is, file_offset);
+			
+			if( IsBucket(index_tag.tag) )
+				addToIndex(index_tag, file_offset);
+		}
+	}
+	catch(Iex::IoExc &e)
+	{
+		_index.clear();
+		
+		return false;
+	}
+	
+	// the table has been known to leave things out,
+	// so only trust it if every layer's buckets cover the whole image
+	const Header::LayerMap &layers = header().layers();
+	
+	const Imf::Int64 image_area = (Imf::Int64)header().width() * (Imf::Int64)header().height();
+	
+	for(Header::LayerMap::const_iterator i = layers.begin(); i != layers.end(); ++i)
+	{
+		BucketIndex::const_iterator layer_buckets = _index.find(i->second.index);
+		
+		if(layer_buckets == _index.end() || bucketArea(layer_buckets->second) < image_area)
+		{
+			_index.clear();
+			
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+
+// pixels the buckets cover inside the image, a bucket written twice counts twice
+Imf::Int64
+InputFile::bucketArea(const BucketList &buckets) const
+{
+	const int width = header().width();
+	const int height = header().height();
+	
+	Imf::Int64 area = 0;
+	
+	for(BucketList::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
+	{
+		const RIF_TAG &tag = b->tag;
+		
+		const int x_pos = tag.p1;
+		const int y_pos = tag.p2;
+		
+		const int tile_width = tag.p3;
+		const int tile_height = tag.p4;
+		
+		const Imf::Int64 w = min<Imf::Int64>((Imf::Int64)x_pos + tile_width, width) - max<Imf::Int64>(x_pos, 0);
+		const Imf::Int64 h = min<Imf::Int64>((Imf::Int64)y_pos + tile_height, height) - max<Imf::Int64>(y_pos, 0);
+		
+		if(w > 0 && h > 0)
+			area += w * h;
+	}
+	
+	return area;
+}
+
+
+void
+InputFile::scanForBuckets()
+{
+	_index.clear();
+	
+	_is.seekg(VRIMG_FILE_HEADER_SIZE);
+	
+	// keep going until read or seekg throws
+	try{
+		while(1)
+		{
+			const Imf::Int64 start_pos = _is.tellg();
+			
+			RIF_TAG tag;
+			
+			ReadTag(_is, tag);
+			
+			if(tag.tagsize < sizeof(RIF_TAG))
+				break; // would never get anywhere
+			
+			if( IsBucket(tag.tag) )
+				addToIndex(tag, start_pos);
+			
+			_is.seekg(start_pos + tag.tagsize);
+		}
+	}
+	catch(Iex::IoExc &e) {}
+}
+
+
+void
+InputFile::addToIndex(const RIF_TAG &tag, Imf::Int64 offset)
+{
+	_index[tag.p7].push_back( BucketEntry(tag, offset) );
+}
+
 Rope
 InputFile::getXMPdescription() const
 {
@@ -992,6 +1320,24 @@ InputFile::DescribeTag(Rope &xmp) const
 }
 
 
+void
+InputFile::adoptLayer(const string &name, void *buf)
+{
+	if(buf == NULL)
+		throw Iex::NullExc("Adopted layer buffer is NULL.");
+	
+	if(_header.findLayer(name) == NULL)
+		throw Iex::ArgExc("No such layer to adopt.");
+	
+	BufferMap::iterator i = _map.find(name);
+	
+	if(i != _map.end() && i->second != NULL)
+		free(i->second);
+	
+	_map[name] = buf;
+}
+
+
 void
 InputFile::freeBuffers()
 {
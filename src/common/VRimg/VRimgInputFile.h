@@ -26,6 +26,10 @@
 
 #include "VRimgHeader.h"
 
+#include <ImathBox.h>
+
+#include <vector>
+
 #ifdef __APPLE__
 #include <ext/rope>
 typedef __gnu_cxx::crope Rope;
@@ -49,13 +53,81 @@ class InputFile
 	
 	void loadFromFile(BufferMap *buf_map=NULL);
 	
+	// take a whole layer that was already decoded somewhere else,
+	// buf must come from malloc() and is ours to free
+	void adoptLayer(const std::string &name, void *buf);
+	
 	void copyLayerToBuffer(const std::string &name, void *buf, size_t rowbytes);
 	
+	// read just part of the layer, taking every subsample-th pixel starting from region.min
+	// buf gets the pixel at region.min in its upper left corner
+	void copyLayerToBuffer(const std::string &name, void *buf, size_t rowbytes,
+							const IMATH_NAMESPACE::Box2i &region, int subsample = 1);
+	
+	// where one layer goes when several are read into the same buffer,
+	// buf points to the first channel of the pixel at region.min
+	typedef struct LayerSlice
+	{
+		std::string name;
+		void *buf;
+		size_t colbytes; // from one pixel to the next
+		size_t rowbytes;
+		int channels; // how many of the layer's channels to copy, 0 for all of them
+		
+		LayerSlice(const std::string &n, void *b, size_t c, size_t r, int ch = 0) : name(n), buf(b), colbytes(c), rowbytes(r), channels(ch) {}
+	} LayerSlice;
+	
+	typedef std::vector<LayerSlice> LayerSliceList;
+	
+	// reads all the layers in one pass, each going straight into its slice,
+	// so something like RGB and Alpha can be interleaved without a temp buffer
+	void copyLayersToBuffer(const LayerSliceList &slices,
+							const IMATH_NAMESPACE::Box2i &region, int subsample = 1);
+	
 	Rope getXMPdescription() const;
 	
   private:
 	void AddDescription(Rope &xmp) const;
 	void DescribeTag(Rope &xmp) const;
+	
+	// where each bucket lives in the file, so reading a layer
+	// doesn't have to walk every tag
+	typedef struct BucketEntry
+	{
+		RIF_TAG tag;
+		Imf::Int64 offset; // start of the tag
+		
+		BucketEntry(const RIF_TAG &t, Imf::Int64 o) : tag(t), offset(o) {}
+	} BucketEntry;
+	
+	typedef std::vector<BucketEntry> BucketList;
+	typedef std::map<int, BucketList> BucketIndex; // by Layer::index
+	
+	typedef struct LayerDest
+	{
+		const Layer *layer;
+		void *buf;
+		size_t colbytes;
+		size_t rowbytes;
+		int channels;
+		IMATH_NAMESPACE::Box2i region;
+		int subsample;
+		
+		LayerDest(const Layer *l, void *b, size_t c, size_t r, int ch, const IMATH_NAMESPACE::Box2i &g, int s=1) : layer(l), buf(b), colbytes(c), rowbytes(r), channels(ch), region(g), subsample(s) {}
+	} LayerDest;
+	
+	typedef std::vector<LayerDest> LayerDestList;
+	
+	void readLayers(const LayerDestList &dests);
+	
+	void buildIndex();
+	bool readIndexTable();
+	Imf::Int64 bucketArea(const BucketList &buckets) const;
+	void scanForBuckets();
+	void addToIndex(const RIF_TAG &tag, Imf::Int64 offset);
+	
+	bool _indexed;
+	BucketIndex _index;
   
 	Header _header;
 
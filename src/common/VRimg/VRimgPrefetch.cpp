@@ -0,0 +1,464 @@
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+
+#include "VRimgPrefetch.h"
+
+#include <IlmThread.h>
+#include <Iex.h>
+
+#include <stdlib.h>
+
+using namespace IlmThread;
+using namespace std;
+
+
+namespace VRimg {
+
+class PrefetchThread : public Thread
+{
+  public:
+	PrefetchThread(Prefetcher &prefetcher) : _prefetcher(prefetcher), _finished(0) { start(); }
+	virtual ~PrefetchThread() { _finished.wait(); } // ~Thread joins too late, our members are gone by then
+	
+	virtual void run() { _prefetcher.run(); _finished.post(); }
+	
+  private:
+	Prefetcher &_prefetcher;
+	Semaphore _finished;
+};
+
+
+Prefetcher::Prefetcher(FrameSource *source, int window, size_t max_bytes) :
+	_source(source),
+	_thread(NULL),
+	_window(window),
+	_max_bytes(max_bytes),
+	_bytes(0),
+	_last_frame(0),
+	_direction(1),
+	_started(false),
+	_busy(false),
+	_busy_frame(0),
+	_abort(false),
+	_quit(false),
+	_waiters(0),
+	_work(0),
+	_done(0)
+{
+	if(_source == NULL)
+		throw Iex::NullExc("Prefetcher needs a frame source.");
+	
+	if(supportsThreads() && _window > 0 && _max_bytes > 0)
+		_thread = new PrefetchThread(*this);
+}
+
+
+Prefetcher::~Prefetcher()
+{
+	if(_thread)
+	{
+		if(true) // making a scope for the Lock
+		{
+			Lock lock(_mutex);
+			
+			_queue.clear();
+			_abort = true;
+			_quit = true;
+		}
+		
+		_work.post();
+		
+		delete _thread;
+	}
+	
+	cancel();
+	
+	delete _source;
+}
+
+
+void
+Prefetcher::frameRequested(int frame, const vector<string> &layers)
+{
+	if(_thread == NULL)
+		return;
+	
+	Lock lock(_mutex);
+	
+	for(vector<string>::const_iterator i = layers.begin(); i != layers.end(); ++i)
+		_layers.insert(*i);
+	
+	if(_started)
+	{
+		const int step = frame - _last_frame;
+		
+		if(step > _window || step < -_window)
+			_direction = 1; // jumped somewhere, assume we'll play forward from here
+		else if(step != 0)
+			_direction = (step > 0 ? 1 : -1);
+	}
+	
+	_last_frame = frame;
+	_started = true;
+	
+	
+	// anything that isn't ahead of us anymore goes
+	trimFrames();
+	
+	if(_busy && !inWindow(_busy_frame))
+		_abort = true;
+	
+	
+	_queue.clear();
+	
+	for(int i=1; i <= _window; i++)
+	{
+		const int next_frame = frame + (i * _direction);
+		
+		if(next_frame >= 0 &&
+			_frames.find(next_frame) == _frames.end() &&
+			!(_busy && !_abort && _busy_frame == next_frame))
+		{
+			_queue.push_back(next_frame);
+		}
+	}
+	
+	if(!_queue.empty())
+		_work.post();
+}
+
+
+int
+Prefetcher::adoptLayers(int frame, InputFile &in, const FrameStamp &stamp, const vector<string> &layers)
+{
+	Lock lock(_mutex);
+	
+	while(_busy && !_abort && _busy_frame == frame)
+	{
+		_waiters++;
+		
+		lock.release();
+		
+		_done.wait();
+		
+		lock.acquire();
+	}
+	
+	
+	FrameMap::iterator f = _frames.find(frame);
+	
+	if(f == _frames.end())
+		return 0;
+	
+	Frame &fetched = f->second;
+	
+	const Header &head = in.header();
+	
+	// make sure this is the same file we decoded, not one rendered over it since
+	if(fetched.stamp != stamp || fetched.width != head.width() || fetched.height != head.height())
+	{
+		freeFrame(fetched);
+		
+		_frames.erase(f);
+		
+		return 0;
+	}
+	
+	
+	int adopted = 0;
+	
+	for(vector<string>::const_iterator i = layers.begin(); i != layers.end(); ++i)
+	{
+		InputFile::BufferMap::iterator l = fetched.layers.find(*i);
+		
+		const Layer *layer = head.findLayer(*i);
+		
+		if(l != fetched.layers.end() && layer != NULL)
+		{
+			const size_t layer_size = sizeof(float) * layer->dimensions * head.width() * head.height();
+			const size_t size = (layer_size < fetched.size ? layer_size : fetched.size);
+			
+			try
+			{
+				in.adoptLayer(l->first, l->second);
+				
+				adopted++;
+			}
+			catch(...)
+			{
+				free(l->second);
+			}
+			
+			fetched.layers.erase(l);
+			
+			fetched.size -= size;
+			_bytes -= size;
+		}
+	}
+	
+	if(fetched.layers.empty())
+	{
+		freeFrame(fetched);
+		
+		_frames.erase(f);
+	}
+	
+	return adopted;
+}
+
+
+void
+Prefetcher::cancel()
+{
+	Lock lock(_mutex);
+	
+	_queue.clear();
+	
+	if(_busy)
+		_abort = true;
+	
+	for(FrameMap::iterator i = _frames.begin(); i != _frames.end(); ++i)
+		freeFrame(i->second);
+	
+	_frames.clear();
+	
+	_started = false;
+}
+
+
+size_t
+Prefetcher::bytes() const
+{
+	Lock lock(_mutex);
+	
+	return _bytes;
+}
+
+
+void
+Prefetcher::run()
+{
+	while(true)
+	{
+		_work.wait();
+		
+		Lock lock(_mutex);
+		
+		if(_quit)
+			break;
+		
+		while(!_queue.empty() && !_quit)
+		{
+			const int frame = _queue.front();
+			
+			_queue.pop_front();
+			
+			if(_frames.find(frame) != _frames.end())
+				continue;
+			
+			const set<string> layers = _layers;
+			
+			_busy = true;
+			_busy_frame = frame;
+			_abort = false;
+			
+			lock.release();
+			
+			
+			Frame fetched;
+			
+			const bool success = fetchFrame(frame, layers, fetched);
+			
+			
+			lock.acquire();
+			
+			if(success && !_abort && inWindow(frame) && _frames.find(frame) == _frames.end())
+			{
+				_frames[frame] = fetched;
+			}
+			else
+				freeFrame(fetched);
+			
+			_busy = false;
+			
+			while(_waiters > 0)
+			{
+				_done.post();
+				
+				_waiters--;
+			}
+		}
+	}
+}
+
+
+bool
+Prefetcher::fetchFrame(int frame, const set<string> &layers, Frame &fetched)
+{
+	Imf::IStream *stream = NULL;
+	
+	bool success = false;
+	
+	try
+	{
+		FrameStamp stamp;
+		
+		stream = _source->openFrame(frame, stamp);
+		
+		if(stream != NULL)
+		{
+			InputFile input(*stream);
+			
+			const Header &head = input.header();
+			
+			const size_t pixels = (size_t)head.width() * (size_t)head.height();
+			
+			vector<string> names;
+			size_t size = 0;
+			
+			for(set<string>::const_iterator i = layers.begin(); i != layers.end(); ++i)
+			{
+				const Layer *layer = head.findLayer(*i);
+				
+				if(layer != NULL)
+				{
+					names.push_back(*i);
+					
+					size += sizeof(float) * layer->dimensions * pixels;
+				}
+			}
+			
+			
+			bool go = !names.empty();
+			
+			if(go)
+			{
+				Lock lock(_mutex);
+				
+				if(_abort || _quit)
+				{
+					go = false;
+				}
+				else if(_bytes + size > _max_bytes)
+				{
+					// frames further out won't fit either
+					_queue.clear();
+					
+					go = false;
+				}
+				else
+				{
+					_bytes += size;
+					
+					fetched.size = size;
+					fetched.width = head.width();
+					fetched.height = head.height();
+					fetched.stamp = stamp;
+				}
+			}
+			
+			
+			for(vector<string>::const_iterator i = names.begin(); i != names.end() && go; ++i)
+			{
+				const Layer *layer = head.findLayer(*i);
+				
+				const size_t rowbytes = sizeof(float) * layer->dimensions * head.width();
+				
+				void *buf = malloc(rowbytes * head.height());
+				
+				if(buf == NULL)
+					throw bad_alloc();
+				
+				fetched.layers[*i] = buf;
+				
+				input.copyLayerToBuffer(*i, buf, rowbytes);
+				
+				Lock lock(_mutex);
+				
+				if(_abort || _quit)
+					go = false;
+			}
+			
+			success = go;
+		}
+	}
+	catch(...)
+	{
+		// half-written frames get read by whoever asks for them
+		success = false;
+	}
+	
+	if(stream != NULL)
+		delete stream;
+	
+	return success;
+}
+
+
+bool
+Prefetcher::inWindow(int frame) const
+{
+	const int distance = (frame - _last_frame) * _direction;
+	
+	return (distance >= 0 && distance <= _window);
+}
+
+
+void
+Prefetcher::freeFrame(Frame &frame)
+{
+	for(InputFile::BufferMap::iterator i = frame.layers.begin(); i != frame.layers.end(); ++i)
+	{
+		if(i->second != NULL)
+			free(i->second);
+	}
+	
+	frame.layers.clear();
+	
+	_bytes -= frame.size;
+	
+	frame.size = 0;
+}
+
+
+void
+Prefetcher::trimFrames()
+{
+	FrameMap::iterator i = _frames.begin();
+	
+	while(i != _frames.end())
+	{
+		if(inWindow(i->first))
+		{
+			++i;
+		}
+		else
+		{
+			freeFrame(i->second);
+			
+			_frames.erase(i++);
+		}
+	}
+}
+
+} // namespace VRimg
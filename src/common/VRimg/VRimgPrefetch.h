@@ -0,0 +1,140 @@
+/* ---------------------------------------------------------------------
+// 
+// ProEXR - OpenEXR plug-ins for Photoshop and After Effects
+// Copyright (c) 2007-2017,  Brendan Bolles, http://www.fnordware.com
+// 
+// This file is part of ProEXR.
+//
+// ProEXR is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// 
+// -------------------------------------------------------------------*/
+
+
+#ifndef VRIMG_PREFETCH_H
+#define VRIMG_PREFETCH_H
+
+#include "VRimgInputFile.h"
+
+#include <IlmThreadMutex.h>
+#include <IlmThreadSemaphore.h>
+
+#include <list>
+#include <set>
+
+
+namespace VRimg {
+
+// enough to tell a frame that's been rendered again from the one we decoded
+typedef struct FrameStamp {
+	Imf::Int64	modtime; // in whatever units the platform uses
+	Imf::Int64	size;
+	
+	FrameStamp(Imf::Int64 m=0, Imf::Int64 s=0) : modtime(m), size(s) {}
+	
+	bool operator == (const FrameStamp &other) const { return (modtime == other.modtime && size == other.size); }
+	bool operator != (const FrameStamp &other) const { return !(*this == other); }
+} FrameStamp;
+
+
+// knows where the other frames of a sequence live
+class FrameSource
+{
+  public:
+	virtual ~FrameSource() {}
+	
+	// NULL if there's no such frame, caller deletes the stream,
+	// stamp is filled in for the file that was opened
+	virtual Imf::IStream *openFrame(int frame, FrameStamp &stamp) = 0;
+};
+
+
+class PrefetchThread;
+
+// decodes the frames ahead of the one being looked at on a background thread
+// so they're already in memory when they get asked for
+class Prefetcher
+{
+  public:
+	// we own the source from now on
+	Prefetcher(FrameSource *source, int window, size_t max_bytes);
+	~Prefetcher();
+	
+	// call every time a frame is read, queues up the next few frames in the
+	// direction we're moving, jumping somewhere else throws out the old work
+	void frameRequested(int frame, const std::vector<std::string> &layers);
+	
+	// give these layers to the InputFile if we've decoded them, waiting if the
+	// frame is being decoded right now, returns the number of layers handed over,
+	// stamp is for the file the InputFile is reading
+	int adoptLayers(int frame, InputFile &in, const FrameStamp &stamp, const std::vector<std::string> &layers);
+	
+	// drop everything queued or decoded
+	void cancel();
+	
+	size_t bytes() const; // decoded and waiting
+	
+  private:
+	typedef struct Frame {
+		InputFile::BufferMap	layers;
+		size_t					size;
+		unsigned int			width;
+		unsigned int			height;
+		FrameStamp				stamp;
+		
+		Frame() : size(0), width(0), height(0) {}
+	} Frame;
+	
+	typedef std::map<int, Frame> FrameMap;
+	
+	void run(); // the thread's loop
+	bool fetchFrame(int frame, const std::set<std::string> &layers, Frame &fetched);
+	
+	bool inWindow(int frame) const;
+	void freeFrame(Frame &frame);
+	void trimFrames();
+	
+	friend class PrefetchThread;
+	
+  private:
+	FrameSource *_source;
+	PrefetchThread *_thread;
+	
+	int _window;
+	size_t _max_bytes;
+	size_t _bytes; // decoded plus what the frame in progress will need
+	
+	int _last_frame;
+	int _direction;
+	bool _started;
+	
+	std::set<std::string> _layers;
+	
+	std::list<int> _queue;
+	FrameMap _frames;
+	
+	bool _busy;
+	int _busy_frame;
+	bool _abort;
+	bool _quit;
+	
+	int _waiters;
+	
+	mutable IlmThread::Mutex _mutex;
+	IlmThread::Semaphore _work;
+	IlmThread::Semaphore _done;
+};
+
+} // namespace VRimg
+
+#endif // VRIMG_PREFETCH_H
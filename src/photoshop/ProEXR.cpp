@@ -36,7 +36,6 @@
 // any kind of metadata I'm missing
 // tiles
 // mip mapping
-// preview image
 //
 //
 // known issues:
@@ -201,6 +200,7 @@ static void InitGlobals(Ptr globalPtr)
 	gOptions.luminance_chroma		= FALSE;
 	gOptions.layer_composite		= TRUE;
 	gOptions.hidden_layers			= FALSE;
+	gOptions.layer_parts			= FALSE;
 
 	gInOptions.alpha_mode           = ALPHA_TRANSPARENCY;
 	gInOptions.unmult               = FALSE;
@@ -209,6 +209,7 @@ static void InitGlobals(Ptr globalPtr)
 		
 	globals->ps_in = NULL;
 	globals->doc_in = NULL;
+	globals->reading_preview = false;
 	globals->total_layers = 0;
 }
 
@@ -467,9 +468,124 @@ static void DoReadPrepare(GPtr globals)
 }
 
 
+// for the Open dialog's thumbnail, an embedded preview saves us the
+// import dialog and reading any pixels, false if there isn't one
+static bool ReadPreviewStart(GPtr globals)
+{
+	globals->ps_in = new IStreamPS(gStuff->dataFork, "Photoshop Input");
+	
+	globals->doc_in = new ProEXRdoc_readPS( *(globals->ps_in), NULL, false, true, false, false, false, true, false);
+	
+	if( !globals->doc_in->hasPreview() )
+	{
+		delete globals->doc_in;
+		globals->doc_in = NULL;
+		
+		delete globals->ps_in;
+		globals->ps_in = NULL;
+		
+		return false;
+	}
+	
+	const PreviewImage &preview = globals->doc_in->preview();
+	
+	gStuff->PluginUsing32BitCoordinates = TRUE;
+	gStuff->imageSize.h = gStuff->imageSize32.h = preview.width();
+	gStuff->imageSize.v = gStuff->imageSize32.v = preview.height();
+	
+	gStuff->imageMode = plugInModeRGBColor;
+	gStuff->depth = 8;
+	gStuff->planes = 3;
+	
+	gStuff->layerData = 0;
+	
+	globals->reading_preview = true;
+	
+	gStuff->data = (void *)1; // just to keep it going
+	
+	return true;
+}
+
+
+static void ReadPreviewContinue(GPtr globals)
+{
+	const PreviewImage &preview = globals->doc_in->preview();
+	
+	const int width = preview.width();
+	const int height = preview.height();
+	
+	vector<unsigned char> rgb(width * height * 3);
+	
+	for(int y=0; y < height; y++)
+	{
+		unsigned char *pix = &rgb[y * width * 3];
+		
+		for(int x=0; x < width; x++)
+		{
+			const PreviewRgba &p = preview.pixel(x, y);
+			
+			*pix++ = p.r;
+			*pix++ = p.g;
+			*pix++ = p.b;
+		}
+	}
+	
+	gStuff->data = &rgb[0];
+	
+	gStuff->planeBytes = 1;
+	gStuff->colBytes = 3;
+	gStuff->rowBytes = width * 3;
+	
+	gStuff->loPlane = 0;
+	gStuff->hiPlane = 2;
+	
+	gStuff->theRect.left = gStuff->theRect32.left = 0;
+	gStuff->theRect.right = gStuff->theRect32.right = width;
+	gStuff->theRect.top = gStuff->theRect32.top = 0;
+	gStuff->theRect.bottom = gStuff->theRect32.bottom = height;
+	
+	gResult = gStuff->advanceState();
+	
+	gStuff->data = NULL;
+}
+
+
 static void DoReadStart(GPtr globals)
 {	
 	GlobalSetup();
+	
+	globals->reading_preview = false;
+	
+	if(gStuff->openForPreview)
+	{
+		// no dialog and no full read for a thumbnail, only the embedded preview will do
+		try{
+		
+		if( ReadPreviewStart(globals) )
+			return;
+		
+		}
+		catch(...)
+		{
+			if(globals->doc_in)
+			{
+				delete globals->doc_in;
+				globals->doc_in = NULL;
+			}
+			
+			if(globals->ps_in)
+			{
+				delete globals->ps_in;
+				globals->ps_in = NULL;
+			}
+			
+			globals->reading_preview = false;
+		}
+		
+		gResult = formatCannotRead;
+		
+		return;
+	}
 
 	// Photoshop scripting is messing things up on import
 	// it wants to remember the previous setting and force the dialog to come up
@@ -560,6 +676,12 @@ static void DoReadContinue(GPtr globals)
 		return;
 	}
 	
+	if(globals->reading_preview)
+	{
+		ReadPreviewContinue(globals);
+		return;
+	}
+	
 	ProEXRdoc_readPS *exr = globals->doc_in;
 	
 	PS_callbacks ps_calls = { globals->result, gStuff->channelPortProcs,
@@ -621,6 +743,8 @@ static void DoReadFinish(GPtr globals)
 	}
 	
 	g_layer_names.clear();
+	
+	globals->reading_preview = false;
 		
 	}catch(...) {}
 }
@@ -648,7 +772,7 @@ static bool hasRGBAlayer(GPtr globals)
 						NO_COMPRESSION);
 
 	// fake output file
-	OStreamPS fake_out(0, "Dummy Output File");
+	OStreamPS fake_out(0, "Dummy Output File", false);
 	
 	ProEXRdoc_writePS fake_file(fake_out, fake_header, Imf::HALF, true, true,
 									NULL, gStuff->documentInfo, NULL);
@@ -850,6 +974,8 @@ static void DoWriteContinue(GPtr globals)
 		output_file.writeFile();
 	}
 	
+	ps_out.flush();
+	
 	}
 	catch(AbortExc)
 	{
@@ -1069,6 +1195,8 @@ static void DoWriteLayerContinue(GPtr globals)
 		ProEXRdoc_writePS output_file(ps_out, header, pixelType, true, gOptions.hidden_layers,
 										&ps_calls, gStuff->documentInfo, NULL);
 		
+		output_file.setLayerParts(gOptions.layer_parts);
+		
 		if(gOptions.layer_composite)
 			output_file.addMainLayer(gStuff->documentInfo->mergedCompositeChannels,
 										gStuff->documentInfo->mergedTransparency,
@@ -1078,6 +1206,8 @@ static void DoWriteLayerContinue(GPtr globals)
 		output_file.loadFromPhotoshop(); // won't load if insufficient memory
 		
 		output_file.writeFile();
+		
+		ps_out.flush();
 			
 		}
 		catch(AbortExc)
@@ -64,7 +64,8 @@ typedef struct ProEXR_outData
 	A_Boolean	luminance_chroma;
 	A_Boolean	layer_composite;
 	A_Boolean	hidden_layers;
-	char		reserved[59]; // total of 64 bytes
+	A_Boolean	layer_parts;
+	char		reserved[58]; // total of 64 bytes
 } ProEXR_outData;
 
 
@@ -79,6 +80,7 @@ typedef struct Globals
 	
 	IStreamPS			*ps_in;
 	ProEXRdoc_readPS	*doc_in;
+	bool				reading_preview; // doc_in is only there for its preview image
 	
 	int					total_layers; // for progress when writing
 
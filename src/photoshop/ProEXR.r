@@ -127,7 +127,7 @@ resource 'PiPL' (ResourceID, plugInName " PiPL", purgeable)
 					  fmtCanWrite, 
 					  fmtCanWriteIfRead, 
 					  fmtCanWriteTransparency,
-					  fmtCannotCreateThumbnail },
+					  fmtCanCreateThumbnail },
 		PlugInMaxSize { 2147483647, 2147483647 }, // Photoshop 8
 		FormatMaxSize { { 32767, 32767 } },
 		FormatMaxChannels { {   0, 0, 0, 4, 0, 0, 
@@ -200,6 +200,12 @@ resource 'aete' (ResourceID, plugInName " dictionary", purgeable)
 				"Include hidden layers",
 				flagsSingleProperty,
 
+				"Layer Parts",
+				keyEXRparts,
+				typeBoolean,
+				"Write each layer as its own part, cropped to its contents",
+				flagsSingleProperty,
+
 				"Alpha Mode",
                 keyEXRalphamode,
                 typeEnumerated,
@@ -666,6 +666,8 @@ static void DoWriteContinue (GPtr globals)
 
 	output_file.writeFile();
 	
+	ps_out.flush();
+	
 	}
 	catch(AbortExc)
 	{
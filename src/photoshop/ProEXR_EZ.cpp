@@ -749,6 +749,8 @@ static void DoWriteContinue (GPtr globals)
 		output_file.writeFile();
 	}
 	
+	ps_out.flush();
+	
 	}
 	catch(AbortExc)
 	{
@@ -234,7 +234,7 @@ static void DoStart(ExGPtr globals)
 			if(gOptions.layer_composite)
 				out_stream.reset( new StdOFStream(file_path) );
 			else
-				out_stream.reset( new OStreamPS(0, "Bogus File") ); // make sure you don't try to write the actual doc!
+				out_stream.reset( new OStreamPS(0, "Bogus File", false) ); // make sure you don't try to write the actual doc!
 				
 
 			PS_callbacks ps_calls = { globals->result, gStuff->channelPortProcs,
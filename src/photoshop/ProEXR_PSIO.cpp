@@ -25,10 +25,38 @@
 
 #include <IexBaseExc.h>
 
+#include <IlmThread.h>
+#include <IlmThreadSemaphore.h>
+
 #include <assert.h>
+#include <new>
+
+#ifdef __APPLE__
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
 
 using namespace Imf;
 using namespace Iex;
+using namespace IlmThread;
+using namespace std;
+
+
+#ifndef MIN
+#define MIN(A,B)			( (A) < (B) ? (A) : (B))
+#endif
+
+
+// bytes to read at a time when we're not memory mapped
+#define READ_AHEAD_SIZE		(1024 * 1024)
+
+// size of each output buffer
+#define WRITE_BEHIND_SIZE	(4 * 1024 * 1024)
 
 
 bool
@@ -53,7 +81,7 @@ IStreamPS::read(char c[/*n*/], int n)
 		return success;
 	}
 	else
-		return read_file(c, n);
+		return read_ahead(c, n);
 }
 
 char *
@@ -83,7 +111,7 @@ IStreamPS::tellg()
 		return _voffset;
 	}
 	else
-		return tellg_file();
+		return _rpos;
 }
 
 
@@ -98,7 +126,7 @@ IStreamPS::seekg(Int64 pos)
 		_voffset = pos;
 	}
 	else
-		seekg_file(pos);
+		_rpos = pos; // actual file seek happens when we need more data
 }
 
 
@@ -109,22 +137,37 @@ IStreamPS::memoryMap()
 	
 	if( !isMemoryMapped() )
 	{
-		_vsize = file_size();
-		
-		_vfile = malloc(_vsize);
+		_voffset = _rpos;
 		
-		if(_vfile)
+		if( map_file() )
 		{
-			_voffset = tellg_file();
-			
-			seekg_file(0);
+			_mapped = true;
+		}
+		else
+		{
+			// couldn't map, so read the whole file into a buffer
+			_vsize = file_size();
 			
-			bool result = read_file((char *)_vfile, _vsize);
+			_vfile = malloc(_vsize);
 			
-			if(!result)
-				unMemoryMap();
+			if(_vfile)
+			{
+				seekg_file(0);
+				
+				bool result = read_file((char *)_vfile, _vsize);
+				
+				if(!result)
+					unMemoryMap();
+			}
+		}
+		
+		if( isMemoryMapped() && _rbuf )
+		{
+			// won't be needing this
+			free(_rbuf);
 			
-			seekg_file(_voffset);
+			_rbuf = NULL;
+			_rbuf_len = 0;
 		}
 	}
 }
@@ -135,11 +178,337 @@ IStreamPS::unMemoryMap()
 {
 	if( isMemoryMapped() )
 	{
-		//seekg_file(_voffset); // use if you want to still access the file
-		
-		free(_vfile);
+		if(_mapped)
+			unmap_file();
+		else
+			free(_vfile);
 		
 		_vfile = NULL;
+		_mapped = false;
+		
+		_rpos = _voffset; // pick up where we left off
+	}
+}
+
+
+bool
+IStreamPS::read_ahead(char c[/*n*/], int n)
+{
+	while(n > 0)
+	{
+		if(_rbuf && _rpos >= _rbuf_pos && _rpos < _rbuf_pos + _rbuf_len)
+		{
+			// copy what we already have
+			const int offset = _rpos - _rbuf_pos;
+			const int count = MIN(n, _rbuf_len - offset);
+			
+			memcpy(c, _rbuf + offset, count);
+			
+			c += count;
+			n -= count;
+			_rpos += count;
+		}
+		else if(n >= READ_AHEAD_SIZE)
+		{
+			// big reads go straight into the caller's buffer
+			seekg_file(_rpos);
+			
+			if( !read_file(c, n) )
+				return false;
+			
+			_rpos += n;
+			
+			return true;
+		}
+		else
+		{
+			// fill the buffer
+			if(_rbuf == NULL)
+			{
+				_rbuf = (char *)malloc(READ_AHEAD_SIZE);
+				
+				if(_rbuf == NULL)
+					throw bad_alloc();
+			}
+			
+			const Int64 remaining = file_size() - _rpos;
+			
+			_rbuf_len = 0;
+			
+			if(remaining < n)
+				return false;
+			
+			const int count = MIN(remaining, READ_AHEAD_SIZE);
+			
+			seekg_file(_rpos);
+			
+			if( !read_file(_rbuf, count) )
+				return false;
+			
+			_rbuf_pos = _rpos;
+			_rbuf_len = count;
+		}
+	}
+	
+	return true;
+}
+
+
+#pragma mark-
+
+// writes full buffers to disk while OpenEXR keeps filling the other one
+class OStreamPS_Writer : public Thread
+{
+  public:
+	OStreamPS_Writer(OStreamPS &stream, char *spare);
+	virtual ~OStreamPS_Writer();
+	
+	// hand over a full buffer, get back an empty one
+	char *submit(char *buf, int n);
+	
+	// wait for the current write to finish
+	void wait();
+	
+	virtual void run();
+	
+  private:
+	OStreamPS &_stream;
+	char *_buf;
+	int _len;
+	bool _quit;
+	bool _failed;
+	string _error;
+	Semaphore _work;
+	Semaphore _idle;
+	Semaphore _finished;
+};
+
+
+OStreamPS_Writer::OStreamPS_Writer(OStreamPS &stream, char *spare) :
+	_stream(stream),
+	_buf(spare),
+	_len(0),
+	_quit(false),
+	_failed(false),
+	_work(0),
+	_idle(1),
+	_finished(0)
+{
+	start();
+}
+
+
+OStreamPS_Writer::~OStreamPS_Writer()
+{
+	_idle.wait();
+	
+	_quit = true;
+	
+	_work.post();
+	
+	// ~Thread joins too late, our semaphores are gone by then
+	_finished.wait();
+	
+	free(_buf);
+}
+
+
+char *
+OStreamPS_Writer::submit(char *buf, int n)
+{
+	_idle.wait();
+	
+	if(_failed)
+	{
+		_idle.post();
+		
+		throw IoExc(_error);
+	}
+	
+	char *spare = _buf;
+	
+	_buf = buf;
+	_len = n;
+	
+	_work.post();
+	
+	return spare;
+}
+
+
+void
+OStreamPS_Writer::wait()
+{
+	_idle.wait();
+	_idle.post();
+	
+	if(_failed)
+		throw IoExc(_error);
+}
+
+
+void
+OStreamPS_Writer::run()
+{
+	while(true)
+	{
+		_work.wait();
+		
+		if(_quit)
+			break;
+		
+		try{
+			_stream.write_file(_buf, _len);
+		}
+		catch(exception &e)
+		{
+			_error = e.what();
+			_failed = true;
+		}
+		catch(...)
+		{
+			_error = "Not able to write.";
+			_failed = true;
+		}
+		
+		_idle.post();
+	}
+	
+	_finished.post();
+}
+
+
+OStreamPS::OStreamPS(int refNum, const char fileName[], bool write_behind) :
+	OStream(fileName),
+	_buf(NULL),
+	_buf_len(0),
+	_buf_pos(0),
+	_pos_known(false),
+	_writer(NULL)
+{
+#ifdef __APPLE__
+	_refNum = refNum;
+#else
+	_hFile = (HANDLE)refNum;
+#endif
+
+	// without write-behind it goes straight to the file, no buffers and no thread
+	if(write_behind)
+		_buf = (char *)malloc(WRITE_BEHIND_SIZE);
+	
+	if(_buf && supportsThreads())
+	{
+		char *spare = (char *)malloc(WRITE_BEHIND_SIZE);
+		
+		if(spare)
+		{
+			try{
+				_writer = new OStreamPS_Writer(*this, spare);
+			}
+			catch(...)
+			{
+				free(spare);
+			}
+		}
+	}
+}
+
+
+OStreamPS::~OStreamPS()
+{
+	try{
+		flush();
+	}catch(...) {} // call flush() yourself if you want to know
+	
+	if(_writer)
+		delete _writer;
+	
+	if(_buf)
+		free(_buf);
+}
+
+
+void
+OStreamPS::write(const char c[/*n*/], int n)
+{
+	if(!_pos_known)
+	{
+		_buf_pos = tellp_file();
+		_pos_known = true;
+	}
+	
+	if(_buf == NULL)
+	{
+		write_file(c, n);
+		
+		_buf_pos += n;
+	}
+	else
+	{
+		while(n > 0)
+		{
+			const int count = MIN(n, WRITE_BEHIND_SIZE - _buf_len);
+			
+			memcpy(_buf + _buf_len, c, count);
+			
+			_buf_len += count;
+			c += count;
+			n -= count;
+			
+			if(_buf_len == WRITE_BEHIND_SIZE)
+				flush_buffer();
+		}
+	}
+}
+
+
+Int64
+OStreamPS::tellp()
+{
+	if(!_pos_known)
+	{
+		_buf_pos = tellp_file();
+		_pos_known = true;
+	}
+	
+	return _buf_pos + _buf_len;
+}
+
+
+void
+OStreamPS::seekp(Int64 pos)
+{
+	flush();
+	
+	seekp_file(pos);
+	
+	_buf_pos = pos;
+	_pos_known = true;
+}
+
+
+void
+OStreamPS::flush()
+{
+	flush_buffer();
+	
+	if(_writer)
+		_writer->wait();
+}
+
+
+void
+OStreamPS::flush_buffer()
+{
+	if(_buf_len > 0)
+	{
+		if(_writer)
+			_buf = _writer->submit(_buf, _buf_len);
+		else
+			write_file(_buf, _buf_len);
+		
+		_buf_pos += _buf_len;
+		_buf_len = 0;
 	}
 }
 
@@ -148,7 +517,14 @@ IStreamPS::unMemoryMap()
 
 IStreamPS::IStreamPS(int refNum, const char fileName[]):
 	IStream(fileName),
-	_vfile(NULL)
+	_vfile(NULL),
+	_voffset(0),
+	_vsize(0),
+	_mapped(false),
+	_rbuf(NULL),
+	_rbuf_pos(0),
+	_rbuf_len(0),
+	_rpos(0)
 {
 	_refNum = refNum;
 	
@@ -160,10 +536,81 @@ IStreamPS::~IStreamPS()
 {
 	unMemoryMap();
 	
+	if(_rbuf)
+		free(_rbuf);
+	
 	seekg_file(0); // back to the beginning
 }
 
 
+static bool
+IsLocalVolume(const char *path)
+{
+	// mapping a file on a network volume turns a dropped connection
+	// or a file that gets truncated under us into SIGBUS
+	struct statfs sfs;
+	
+	if(statfs(path, &sfs) != 0)
+		return false;
+	
+	return ((sfs.f_flags & MNT_LOCAL) != 0);
+}
+
+
+bool
+IStreamPS::map_file()
+{
+	// Photoshop gives us a fork, we need a path to mmap
+	FSRef fsRef;
+	
+	OSErr result = FSGetForkCBInfo(_refNum, 0, NULL, NULL, NULL, &fsRef, NULL);
+	
+	if(result != noErr)
+		return false;
+	
+	UInt8 path[PATH_MAX + 1];
+	
+	result = FSRefMakePath(&fsRef, path, PATH_MAX);
+	
+	if(result != noErr)
+		return false;
+	
+	if( !IsLocalVolume((const char *)path) )
+		return false;
+	
+	const Int64 size = file_size();
+	
+	if(size <= 0 || size != (Int64)(size_t)size)
+		return false;
+	
+	int fd = open((const char *)path, O_RDONLY);
+	
+	if(fd < 0)
+		return false;
+	
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	
+	close(fd); // the mapping holds its own reference
+	
+	if(addr == MAP_FAILED)
+		return false;
+	
+	madvise(addr, size, MADV_SEQUENTIAL);
+	
+	_vfile = addr;
+	_vsize = size;
+	
+	return true;
+}
+
+
+void
+IStreamPS::unmap_file()
+{
+	munmap(_vfile, _vsize);
+}
+
+
 Int64
 IStreamPS::file_size()
 {
@@ -216,14 +663,8 @@ IStreamPS::seekg_file(Int64 pos)
 }
 
 
-OStreamPS::OStreamPS(int refNum, const char fileName[]) :
-	OStream(fileName)
-{
-	_refNum = refNum;
-}
-
 void
-OStreamPS::write(const char c[/*n*/], int n)
+OStreamPS::write_file(const char c[/*n*/], int n)
 {
 	ByteCount count = n;
 
@@ -235,7 +676,7 @@ OStreamPS::write(const char c[/*n*/], int n)
 
 
 Int64
-OStreamPS::tellp()
+OStreamPS::tellp_file()
 {
 	Int64 pos;
 	SInt64 lpos;
@@ -252,7 +693,7 @@ OStreamPS::tellp()
 
 
 void
-OStreamPS::seekp(Int64 pos)
+OStreamPS::seekp_file(Int64 pos)
 {
 	OSErr result = FSSetForkPosition(_refNum, fsFromStart, pos);
 
@@ -267,7 +708,14 @@ OStreamPS::seekp(Int64 pos)
 
 IStreamPS::IStreamPS(int refNum, const char fileName[]):
 	IStream(fileName),
-	_vfile(NULL)
+	_vfile(NULL),
+	_voffset(0),
+	_vsize(0),
+	_mapped(false),
+	_rbuf(NULL),
+	_rbuf_pos(0),
+	_rbuf_len(0),
+	_rpos(0)
 {
 	_hFile = (HANDLE)refNum;
 	
@@ -279,14 +727,108 @@ IStreamPS::~IStreamPS()
 {
 	unMemoryMap();
 	
+	if(_rbuf)
+		free(_rbuf);
+	
 	seekg_file(0); // back to the beginning
 }
 
 
+static bool
+IsLocalVolume(HANDLE hFile)
+{
+	// mapping a file on a network share turns a dropped connection
+	// or a file that gets truncated under us into an access violation,
+	// so only map files on fixed drives
+	typedef DWORD (WINAPI *GetFinalPathNameByHandleProc)(HANDLE, LPWSTR, DWORD, DWORD);
+	
+	// Vista and later, XP just doesn't get mapping
+	GetFinalPathNameByHandleProc getFinalPathNameByHandle = (GetFinalPathNameByHandleProc)
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "GetFinalPathNameByHandleW");
+	
+	if(getFinalPathNameByHandle == NULL)
+		return false;
+	
+	// a long path just tells us how big a buffer it wants
+	const DWORD len = getFinalPathNameByHandle(hFile, NULL, 0, 0); // VOLUME_NAME_DOS
+	
+	if(len == 0)
+		return false;
+	
+	WCHAR *path = (WCHAR *)malloc((len + 1) * sizeof(WCHAR));
+	
+	if(path == NULL)
+		return false;
+	
+	UINT type = DRIVE_UNKNOWN;
+	
+	if( getFinalPathNameByHandle(hFile, path, len + 1, 0) != 0 )
+	{
+		// local files come back as \\?\C:\..., network files as \\?\UNC\...
+		const WCHAR *drive = (wcsncmp(path, L"\\\\?\\", 4) == 0 ? path + 4 : path);
+		
+		if(drive[0] != L'\0' && drive[1] == L':')
+		{
+			const WCHAR root[4] = { drive[0], L':', L'\\', L'\0' };
+			
+			type = GetDriveTypeW(root);
+		}
+	}
+	
+	free(path);
+	
+	return (type == DRIVE_FIXED || type == DRIVE_RAMDISK);
+}
+
+
+bool
+IStreamPS::map_file()
+{
+	if( !IsLocalVolume(_hFile) )
+		return false;
+	
+	const Int64 size = file_size();
+	
+	if(size <= 0 || size != (Int64)(SIZE_T)size)
+		return false;
+	
+	HANDLE hMapping = CreateFileMapping(_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	
+	if(hMapping == NULL)
+		return false;
+	
+	LPVOID addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	
+	CloseHandle(hMapping); // the view holds its own reference
+	
+	if(addr == NULL)
+		return false;
+	
+	_vfile = addr;
+	_vsize = size;
+	
+	return true;
+}
+
+
+void
+IStreamPS::unmap_file()
+{
+	UnmapViewOfFile(_vfile);
+}
+
+
 Int64
 IStreamPS::file_size()
 {
-	return GetFileSize(_hFile, NULL);
+	LARGE_INTEGER size;
+	
+	BOOL result = GetFileSizeEx(_hFile, &size);
+	
+	if(!result)
+		throw IoExc("Error calling GetFileSizeEx().");
+	
+	return size.QuadPart;
 }
 
 
@@ -333,16 +875,10 @@ IStreamPS::seekg_file(Int64 pos)
 		throw IoExc("Error calling SetFilePointerEx().");
 }
 
-	
-OStreamPS::OStreamPS(int refNum, const char fileName[]) :
-	OStream(fileName)
-{
-	_hFile = (HANDLE)refNum;
-}
 
 
 void
-OStreamPS::write(const char c[/*n*/], int n)
+OStreamPS::write_file(const char c[/*n*/], int n)
 {
 	DWORD count = n, out = 0;
 	
@@ -354,7 +890,7 @@ OStreamPS::write(const char c[/*n*/], int n)
 
 
 Int64
-OStreamPS::tellp()
+OStreamPS::tellp_file()
 {
 	Int64 pos;
 	LARGE_INTEGER lpos, zero;
@@ -373,7 +909,7 @@ OStreamPS::tellp()
 
 
 void
-OStreamPS::seekp(Int64 pos)
+OStreamPS::seekp_file(Int64 pos)
 {
 	LARGE_INTEGER lpos;
 
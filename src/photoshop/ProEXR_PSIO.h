@@ -57,11 +57,16 @@ class IStreamPS : public Imf::IStream
 	virtual Imf::Int64 tellg();
 	virtual void seekg(Imf::Int64 pos);
 	
-	// function to load the file into a buffer and start memory mapping
+	// map the file into memory (or load it into a buffer if that fails)
 	void memoryMap();
 	void unMemoryMap();
 	
   private:
+	bool read_ahead(char c[/*n*/], int n);
+	
+	bool map_file();
+	void unmap_file();
+	
 	Imf::Int64 file_size();
 	bool read_file(char c[/*n*/], int n);
 	Imf::Int64 tellg_file();
@@ -72,6 +77,13 @@ class IStreamPS : public Imf::IStream
 	void *_vfile;
 	Imf::Int64 _voffset;
 	Imf::Int64 _vsize;
+	bool _mapped;
+	
+	// read-ahead buffer for when we're not memory mapped
+	char *_rbuf;
+	Imf::Int64 _rbuf_pos;
+	int _rbuf_len;
+	Imf::Int64 _rpos;
   
 #ifdef __APPLE__
 	FSIORefNum _refNum;
@@ -83,18 +95,39 @@ class IStreamPS : public Imf::IStream
 };
 
 
+class OStreamPS_Writer;
+
 class OStreamPS : public Imf::OStream
 {
   public:
   
-	OStreamPS(int refNum, const char fileName[]);
-	virtual ~OStreamPS() {}
+	OStreamPS(int refNum, const char fileName[], bool write_behind=true); // write_behind=false for dummy streams, no buffers or thread
+	virtual ~OStreamPS();
 	
 	virtual void write(const char c[/*n*/], int n);
 	virtual Imf::Int64 tellp();
 	virtual void seekp(Imf::Int64 pos);
+	
+	// write out everything buffered, throws if there was a problem
+	void flush();
 
   private:
+	void flush_buffer();
+	
+	void write_file(const char c[/*n*/], int n);
+	Imf::Int64 tellp_file();
+	void seekp_file(Imf::Int64 pos);
+	
+	friend class OStreamPS_Writer;
+
+  private:
+	char *_buf;
+	int _buf_len;
+	Imf::Int64 _buf_pos;
+	bool _pos_known;
+	
+	OStreamPS_Writer *_writer; // background thread, if we have one
+	
 #ifdef __APPLE__
 	FSIORefNum _refNum;
 #endif
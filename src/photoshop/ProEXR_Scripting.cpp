@@ -210,6 +210,11 @@ Boolean ReadScriptParamsOnWrite (GPtr globals)
 							PIGetBool(token, &boolStoreValue);
 							gOptions.hidden_layers = boolStoreValue;
 							break;
+
+					case keyEXRparts:
+							PIGetBool(token, &boolStoreValue);
+							gOptions.layer_parts = boolStoreValue;
+							break;
 				}
 			}
 
@@ -266,6 +271,7 @@ OSErr WriteScriptParamsOnWrite (GPtr globals)
 			PIPutBool(token, keyEXRlumichrom, gOptions.luminance_chroma);
 			PIPutBool(token, keyEXRcomposite, gOptions.layer_composite);
 			PIPutBool(token, keyEXRhidden, gOptions.hidden_layers);
+			PIPutBool(token, keyEXRparts, gOptions.layer_parts);
 			gotErr = CloseWriter(&token); // closes and sets dialog optional
 			// done.  Now pass handle on to Photoshop
 		}
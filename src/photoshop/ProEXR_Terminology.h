@@ -34,6 +34,7 @@
 #define keyEXRlumichrom			'exrY'
 #define keyEXRcomposite			'exrT'
 #define keyEXRhidden			'exrH'
+#define keyEXRparts				'exrP'
 #define keyEXRalpha				'exrL'
 
 // compression enum